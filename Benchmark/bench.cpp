@@ -0,0 +1,238 @@
+#include "bench.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <random>
+
+using namespace std;
+
+#ifndef FORMULA_BENCH_BUILD_TYPE
+#define FORMULA_BENCH_BUILD_TYPE ""
+#endif
+
+namespace bench
+{
+	static vector<pair<string, Function> >& registry()
+	{
+		static vector<pair<string, Function> > v;
+		return v;
+	}
+
+	void add(const string& name, const Function& f)
+	{
+		registry().emplace_back(name, f);
+	}
+
+	vector<double> values(size_t n, double low, double high, unsigned seed)
+	{
+		mt19937_64 engine(seed);
+		uniform_real_distribution<double> distribution(low, high);
+
+		vector<double> v(n);
+		for(double& x : v)
+		{
+			x = distribution(engine);
+		}
+		return v;
+	}
+
+	State::State(const string& name, const Options& options):
+	m_options(options)
+	{
+		m_result.name = name;
+	}
+
+	void State::bytes(double n)
+	{
+		m_result.bytes_per_op = n;
+	}
+
+	void State::counter(const string& name, double value)
+	{
+		m_result.counters[name] = value;
+	}
+
+	const Result& State::result()const
+	{
+		return m_result;
+	}
+
+	void State::record(size_t iterations, vector<double>& samples)
+	{
+		sort(samples.begin(), samples.end());
+		m_result.iterations = iterations;
+		m_result.ns_per_op = samples[samples.size() / 2];
+		m_result.ns_min = samples.front();
+		m_result.ns_max = samples.back();
+	}
+}
+
+static string compiler()
+{
+#if defined(__clang__)
+	return string("clang ") + __clang_version__;
+#elif defined(__GNUC__)
+	return string("gcc ") + __VERSION__;
+#elif defined(_MSC_VER)
+	return "msvc " + to_string(_MSC_VER);
+#else
+	return "unknown";
+#endif
+}
+
+static string jsonEscape(const string& str)
+{
+	string escaped;
+	for(char ch : str)
+	{
+		if(ch == '"' || ch == '\\')
+		{
+			escaped.push_back('\\');
+		}
+		escaped.push_back(ch);
+	}
+	return escaped;
+}
+
+static void writeJson(ostream& out, const vector<bench::Result>& results, const bench::Options& options)
+{
+	out.precision(17);
+	out << "{\n";
+	out << "  \"context\": {\n";
+	out << "    \"compiler\": \"" << jsonEscape(compiler()) << "\",\n";
+	out << "    \"build_type\": \"" << FORMULA_BENCH_BUILD_TYPE << "\",\n";
+	out << "    \"min_time_ms\": " << options.min_time_ms << ",\n";
+	out << "    \"repetitions\": " << options.repetitions << "\n";
+	out << "  },\n";
+	out << "  \"benchmarks\": [";
+	for(size_t i = 0; i < results.size(); i++)
+	{
+		const bench::Result& r = results[i];
+		out << (i ? ",\n" : "\n");
+		out << "    {\"name\": \"" << jsonEscape(r.name) << "\""
+			<< ", \"iterations\": " << r.iterations
+			<< ", \"ns_per_op\": " << r.ns_per_op
+			<< ", \"ns_min\": " << r.ns_min
+			<< ", \"ns_max\": " << r.ns_max
+			<< ", \"bytes_per_second\": " << (r.bytes_per_op > 0 ? r.bytes_per_op * 1E9 / r.ns_per_op : 0.0)
+			<< ", \"counters\": {";
+		bool first = true;
+		for(const auto& counter : r.counters)
+		{
+			out << (first ? "" : ", ") << "\"" << jsonEscape(counter.first) << "\": " << counter.second;
+			first = false;
+		}
+		out << "}}";
+	}
+	out << "\n  ]\n}\n";
+}
+
+static void writeCsv(ostream& out, const vector<bench::Result>& results)
+{
+	out.precision(17);
+	out << "name,iterations,ns_per_op,ns_min,ns_max,bytes_per_second,counters\n";
+	for(const bench::Result& r : results)
+	{
+		out << r.name << ","
+			<< r.iterations << ","
+			<< r.ns_per_op << ","
+			<< r.ns_min << ","
+			<< r.ns_max << ","
+			<< (r.bytes_per_op > 0 ? r.bytes_per_op * 1E9 / r.ns_per_op : 0.0) << ",";
+		bool first = true;
+		for(const auto& counter : r.counters)
+		{
+			out << (first ? "" : ";") << counter.first << "=" << counter.second;
+			first = false;
+		}
+		out << "\n";
+	}
+}
+
+static void writeConsole(const bench::Result& r)
+{
+	char line[256];
+	snprintf(line, sizeof(line), "%-44s %14.2f ns %14.2f ns %14.2f ns", r.name.c_str(), r.ns_per_op, r.ns_min, r.ns_max);
+	cout << line;
+	if(r.bytes_per_op > 0)
+	{
+		snprintf(line, sizeof(line), " %10.2f MB/s", r.bytes_per_op * 1E3 / r.ns_per_op);
+		cout << line;
+	}
+	for(const auto& counter : r.counters)
+	{
+		cout << " " << counter.first << "=" << counter.second;
+	}
+	cout << endl;
+}
+
+static bool option(const char* arg, const char* name, string& value)
+{
+	size_t n = strlen(name);
+	if(strncmp(arg, name, n) == 0 && arg[n] == '=')
+	{
+		value = arg + n + 1;
+		return true;
+	}
+	return false;
+}
+
+int main(int argc, char* argv[])
+{
+	bench::Options options;
+	string filter, json_file, csv_file, value;
+	bool list = false;
+
+	for(int i = 1; i < argc; i++)
+	{
+		if(option(argv[i], "--filter", value)) filter = value;
+		else if(option(argv[i], "--json", value)) json_file = value;
+		else if(option(argv[i], "--csv", value)) csv_file = value;
+		else if(option(argv[i], "--min-time", value)) options.min_time_ms = stod(value);
+		else if(option(argv[i], "--repetitions", value)) options.repetitions = max(1, stoi(value));
+		else if(strcmp(argv[i], "--list") == 0) list = true;
+		else
+		{
+			cerr << "usage: " << argv[0] << " [--filter=<substring>] [--min-time=<ms>] [--repetitions=<n>]"
+				 << " [--json=<file>] [--csv=<file>] [--list]" << endl;
+			return 2;
+		}
+	}
+
+	vector<bench::Result> results;
+	for(const auto& entry : bench::registry())
+	{
+		if(!filter.empty() && entry.first.find(filter) == string::npos)
+		{
+			continue;
+		}
+
+		if(list)
+		{
+			cout << entry.first << endl;
+			continue;
+		}
+
+		bench::State state(entry.first, options);
+		entry.second(state);
+		writeConsole(state.result());
+		results.push_back(state.result());
+	}
+
+	if(!json_file.empty())
+	{
+		ofstream out(json_file);
+		writeJson(out, results, options);
+	}
+
+	if(!csv_file.empty())
+	{
+		ofstream out(csv_file);
+		writeCsv(out, results);
+	}
+
+	return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef FORMULA_BENCH_H
+#define FORMULA_BENCH_H
+
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace bench
+{
+	struct Options
+	{
+		double min_time_ms = 20.0;
+		int repetitions = 5;
+	};
+
+	struct Result
+	{
+		std::string name;
+		std::size_t iterations = 0;
+		double ns_per_op = 0.0;
+		double ns_min = 0.0;
+		double ns_max = 0.0;
+		double bytes_per_op = 0.0;
+		std::map<std::string, double> counters;
+	};
+
+	class State
+	{
+	public:
+		State(const std::string& name, const Options& options);
+
+		// Times body() until the samples are stable enough and records the
+		// median, fastest and slowest ns per call.
+		template<typename Body>
+		void measure(Body body);
+
+		// Bytes processed by one body() call, reported as throughput.
+		void bytes(double n);
+		void counter(const std::string& name, double value);
+
+		const Result& result()const;
+
+	private:
+		template<typename Body>
+		double sample(Body& body, std::size_t iterations);
+		void record(std::size_t iterations, std::vector<double>& samples);
+
+	private:
+		Options m_options;
+		Result m_result;
+	};
+
+	using Function = std::function<void(State&)>;
+
+	void add(const std::string& name, const Function& f);
+
+	// Uniform values in [low, high) from a fixed seed, so every run of the
+	// suite sees the same inputs.
+	std::vector<double> values(std::size_t n, double low, double high, unsigned seed = 42);
+
+	struct Registrar
+	{
+		Registrar(const std::string& name, const Function& f)
+		{
+			add(name, f);
+		}
+	};
+
+	template<typename T>
+	inline void doNotOptimize(const T& value)
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		__asm__ __volatile__("" : : "r,m"(value) : "memory");
+#else
+		static volatile const T* sink;
+		sink = &value;
+#endif
+	}
+
+	template<typename Body>
+	double State::sample(Body& body, std::size_t iterations)
+	{
+		auto start = std::chrono::steady_clock::now();
+		for(std::size_t i = 0; i < iterations; i++)
+		{
+			body();
+		}
+		auto stop = std::chrono::steady_clock::now();
+		return std::chrono::duration<double, std::nano>(stop - start).count();
+	}
+
+	template<typename Body>
+	void State::measure(Body body)
+	{
+		std::size_t iterations = 1;
+		while(true)
+		{
+			double ns = sample(body, iterations);
+			if(ns >= m_options.min_time_ms * 1E6 || iterations >= (std::size_t(1) << 40))
+			{
+				break;
+			}
+
+			double scale = ns > 0 ? 1.4 * m_options.min_time_ms * 1E6 / ns : 10.0;
+			iterations = (std::size_t)(iterations * (scale > 10.0 ? 10.0 : (scale < 2.0 ? 2.0 : scale)));
+		}
+
+		std::vector<double> samples;
+		for(int r = 0; r < m_options.repetitions; r++)
+		{
+			samples.push_back(sample(body, iterations) / iterations);
+		}
+		record(iterations, samples);
+	}
+}
+
+#define BENCH_CONCAT_IMPL(a, b) a##b
+#define BENCH_CONCAT(a, b) BENCH_CONCAT_IMPL(a, b)
+#define BENCH(name, function) static bench::Registrar BENCH_CONCAT(s_bench_registrar_, __LINE__)(name, function)
+
+#endif // FORMULA_BENCH_H
@@ -0,0 +1,69 @@
+#!/usr/bin/env python3
+"""Compare two formula_bench runs and flag regressions.
+
+Usage: compare.py <baseline.json|csv> <candidate.json|csv> [--threshold=PERCENT]
+                  [--metric=ns_per_op|ns_min]
+
+Both files are outputs of `formula_bench --json=...` or `--csv=...`. A
+benchmark regresses when its median ns per operation (or fastest sample with
+--metric=ns_min, which is less sensitive to a noisy machine) grows by more
+than the threshold (5% by default). The exit status is 1 if any benchmark
+regressed.
+"""
+
+import csv
+import json
+import sys
+
+
+def load(path, metric):
+    with open(path, newline="") as f:
+        if path.endswith(".csv"):
+            return {row["name"]: float(row[metric]) for row in csv.DictReader(f)}
+        return {b["name"]: float(b[metric]) for b in json.load(f)["benchmarks"]}
+
+
+def main(argv):
+    threshold = 5.0
+    metric = "ns_per_op"
+    paths = []
+    for arg in argv[1:]:
+        if arg.startswith("--threshold="):
+            threshold = float(arg.split("=", 1)[1])
+        elif arg.startswith("--metric="):
+            metric = arg.split("=", 1)[1]
+        else:
+            paths.append(arg)
+
+    if len(paths) != 2 or metric not in ("ns_per_op", "ns_min"):
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+
+    baseline, candidate = load(paths[0], metric), load(paths[1], metric)
+    regressions = 0
+
+    print("%-44s %14s %14s %9s" % ("benchmark", "baseline ns", "candidate ns", "change"))
+    for name in sorted(set(baseline) | set(candidate)):
+        if name not in baseline or name not in candidate:
+            side = "candidate" if name not in candidate else "baseline"
+            print("%-44s missing in %s" % (name, side))
+            continue
+
+        old, new = baseline[name], candidate[name]
+        change = (new - old) / old * 100.0 if old > 0 else 0.0
+        flag = ""
+        if change > threshold:
+            flag = "  REGRESSION"
+            regressions += 1
+        elif change < -threshold:
+            flag = "  improved"
+        print("%-44s %14.2f %14.2f %+8.1f%%%s" % (name, old, new, change, flag))
+
+    if regressions:
+        print("\n%d benchmark(s) regressed by more than %.1f%%" % (regressions, threshold))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv))
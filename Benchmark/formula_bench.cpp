@@ -0,0 +1,1181 @@
+#include "bench.hpp"
+
+#include <formula.hpp>
+#include <formula_context.hpp>
+#include <formula_graph.hpp>
+#include <formula_handle.hpp>
+#include <formula_loader.hpp>
+#include <formula_memo.hpp>
+#include <formula_pipeline.hpp>
+
+#ifdef FORMULA_BENCH_GENERATED
+#include <curves.hpp>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <exception>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+static const string s_short_expression = "x*y + 2.5*x - y/3";
+
+static string longExpression()
+{
+	string str;
+	for(int i = 1; i <= 48; i++)
+	{
+		if(i > 1)
+		{
+			str += " + ";
+		}
+		str += "(x*" + to_string(i) + ".25 + y/(z+" + to_string(i) + "))^2";
+		if(i % 8 == 0)
+		{
+			str += " - sin(x*" + to_string(i) + ")*cos(y)";
+		}
+	}
+	return str;
+}
+
+static const string s_long_expression = longExpression();
+
+// Nested to depth 64, so every operand but the innermost is a temporary.
+static string deepExpression()
+{
+	string str = "x";
+	for(int i = 1; i <= 64; i++)
+	{
+		str = "(" + str + (i % 2 ? ")*y + " : ")/z - ") + to_string(i);
+	}
+	return str;
+}
+
+static const string s_deep_expression = deepExpression();
+
+// Multiply-adds and small powers, as fitted models tend to look.
+static const string s_poly_expression = "0.5*x^3 + 1.5*x^2*y - 2*x*y + y^2 + 3*z - 1 + (x*y + z)^0.5";
+
+static const size_t s_inputs = 1024;
+
+static void benchParse(bench::State& state, const string& expression)
+{
+	state.measure([&]()
+	{
+		Formula f(expression);
+		bench::doNotOptimize(f);
+	});
+	state.bytes(expression.size());
+}
+
+static void benchEvalMap(bench::State& state, const string& expression)
+{
+	Formula f(expression);
+	vector<double> x = bench::values(s_inputs, -2, 2, 1);
+	vector<double> y = bench::values(s_inputs, -2, 2, 2);
+	vector<double> z = bench::values(s_inputs, 1, 2, 3);
+
+	size_t i = 0;
+	unordered_map<string, double> variables;
+	state.measure([&]()
+	{
+		variables["x"] = x[i];
+		variables["y"] = y[i];
+		variables["z"] = z[i];
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+}
+
+static void benchEvalVector(bench::State& state, const string& expression)
+{
+	Formula f(expression);
+	vector<double> x = bench::values(s_inputs, -2, 2, 1);
+	vector<double> y = bench::values(s_inputs, -2, 2, 2);
+	vector<double> z = bench::values(s_inputs, 1, 2, 3);
+
+	size_t i = 0;
+	vector<double> variables(3);
+	state.measure([&]()
+	{
+		variables[0] = x[i];
+		variables[1] = y[i];
+		variables[2] = z[i];
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+}
+
+static void benchEvalVariadic(bench::State& state, const string& expression)
+{
+	Formula f(expression);
+	vector<double> x = bench::values(s_inputs, -2, 2, 1);
+	vector<double> y = bench::values(s_inputs, -2, 2, 2);
+	vector<double> z = bench::values(s_inputs, 1, 2, 3);
+
+	size_t i = 0;
+	state.measure([&]()
+	{
+		bench::doNotOptimize(f.eval(x[i], y[i], z[i]));
+		i = (i + 1) % s_inputs;
+	});
+}
+
+static void benchEngine(bench::State& state, const string& expression, Formula::Engine engine)
+{
+	Formula f(expression);
+	f.setEngine(engine);
+	vector<double> x = bench::values(s_inputs, -2, 2, 1);
+	vector<double> y = bench::values(s_inputs, -2, 2, 2);
+	vector<double> z = bench::values(s_inputs, 1, 2, 3);
+
+	size_t i = 0;
+	vector<double> variables(3);
+	state.measure([&]()
+	{
+		variables[0] = x[i];
+		variables[1] = y[i];
+		variables[2] = z[i];
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+
+	FormulaStats stats = f.stats();
+	state.counter("dispatches", engine == Formula::StackMachine ? stats.stack_dispatches : stats.fused_dispatches);
+	state.counter("unfused", stats.register_dispatches);
+}
+
+static void benchEvalBatch(bench::State& state, const string& expression)
+{
+	Formula f(expression);
+	vector<double> x = bench::values(s_inputs, -2, 2, 1);
+	vector<double> y = bench::values(s_inputs, -2, 2, 2);
+	vector<double> z = bench::values(s_inputs, 1, 2, 3);
+
+	vector<const double*> columns = {x.data(), y.data(), z.data()};
+	vector<double> results(s_inputs);
+	state.measure([&]()
+	{
+		f.evalBatch(columns, s_inputs, results.data());
+		bench::doNotOptimize(results);
+	});
+	state.counter("rows_per_op", s_inputs);
+}
+
+static void benchFunction(bench::State& state, const string& expression, Formula f)
+{
+	vector<double> x = bench::values(s_inputs, 0.1, 0.9, 4);
+
+	size_t i = 0;
+	vector<double> variables(1);
+	state.measure([&]()
+	{
+		variables[0] = x[i];
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+	state.counter("calls_per_op", expression == "x" ? 0 : 1);
+}
+
+BENCH("parse/short", [](bench::State& state) { benchParse(state, s_short_expression); });
+BENCH("parse/long", [](bench::State& state) { benchParse(state, s_long_expression); });
+
+BENCH("eval/map/short", [](bench::State& state) { benchEvalMap(state, s_short_expression + " + z"); });
+BENCH("eval/map/long", [](bench::State& state) { benchEvalMap(state, s_long_expression); });
+BENCH("eval/vector/short", [](bench::State& state) { benchEvalVector(state, s_short_expression + " + z"); });
+BENCH("eval/vector/long", [](bench::State& state) { benchEvalVector(state, s_long_expression); });
+BENCH("eval/variadic/short", [](bench::State& state) { benchEvalVariadic(state, s_short_expression + " + z"); });
+BENCH("eval/variadic/long", [](bench::State& state) { benchEvalVariadic(state, s_long_expression); });
+BENCH("engine/stack/short", [](bench::State& state) { benchEngine(state, s_short_expression + " + z", Formula::StackMachine); });
+BENCH("engine/register/short", [](bench::State& state) { benchEngine(state, s_short_expression + " + z", Formula::RegisterMachine); });
+BENCH("engine/stack/long", [](bench::State& state) { benchEngine(state, s_long_expression, Formula::StackMachine); });
+BENCH("engine/register/long", [](bench::State& state) { benchEngine(state, s_long_expression, Formula::RegisterMachine); });
+BENCH("engine/stack/deep", [](bench::State& state) { benchEngine(state, s_deep_expression, Formula::StackMachine); });
+BENCH("engine/register/deep", [](bench::State& state) { benchEngine(state, s_deep_expression, Formula::RegisterMachine); });
+BENCH("engine/stack/poly", [](bench::State& state) { benchEngine(state, s_poly_expression, Formula::StackMachine); });
+BENCH("engine/register/poly", [](bench::State& state) { benchEngine(state, s_poly_expression, Formula::RegisterMachine); });
+BENCH("eval/batch/short", [](bench::State& state) { benchEvalBatch(state, s_short_expression + " + z"); });
+BENCH("eval/batch/long", [](bench::State& state) { benchEvalBatch(state, s_long_expression); });
+
+// Sum and extrema of a formula over many rows: evalBatch then a pass over the
+// results, against reduce() folding each block as it is computed.
+static const size_t s_reduce_rows = 1 << 20;
+
+static void benchReduce(bench::State& state, const string& expression, bool fused, size_t bins)
+{
+	Formula f(expression);
+	vector<double> x = bench::values(s_reduce_rows, -2, 2, 1);
+	vector<double> y = bench::values(s_reduce_rows, -2, 2, 2);
+	vector<double> z = bench::values(s_reduce_rows, 1, 2, 3);
+	vector<const double*> columns = {x.data(), y.data(), z.data()};
+
+	FormulaReduction::Options options;
+	options.bins = bins;
+	options.low = -10;
+	options.high = 10;
+	vector<double> results(s_reduce_rows);
+	state.measure([&]()
+	{
+		if(fused)
+		{
+			bench::doNotOptimize(f.reduce(columns, s_reduce_rows, options));
+			return;
+		}
+		f.evalBatch(columns, s_reduce_rows, results.data());
+		double sum = 0.0;
+		double low = results[0];
+		double high = results[0];
+		for(double result : results)
+		{
+			sum += result;
+			low = min(low, result);
+			high = max(high, result);
+		}
+		bench::doNotOptimize(sum + low + high);
+	});
+	state.counter("rows_per_op", s_reduce_rows);
+}
+
+BENCH("reduce/batch_then_sum/short", [](bench::State& state) { benchReduce(state, s_short_expression + " + z", false, 0); });
+BENCH("reduce/sum/short", [](bench::State& state) { benchReduce(state, s_short_expression + " + z", true, 0); });
+BENCH("reduce/histogram/short", [](bench::State& state) { benchReduce(state, s_short_expression + " + z", true, 64); });
+
+// A 1024 x 1024 grid: the meshgrid built as columns for evalBatch, against
+// evalGrid making the coordinates as it goes.
+static void benchGrid(bench::State& state, bool generated)
+{
+	Formula f("sin(x)*cos(y) + 0.5*x*y");
+	vector<FormulaAxis> axes = {FormulaAxis::linspace(-3, 3, 1024), FormulaAxis::linspace(-3, 3, 1024)};
+	size_t n_rows = axes[0].count * axes[1].count;
+	vector<double> results(n_rows);
+	state.measure([&]()
+	{
+		if(generated)
+		{
+			f.evalGrid(axes, results.data());
+		}
+		else
+		{
+			vector<double> x(n_rows);
+			vector<double> y(n_rows);
+			for(size_t row = 0; row < n_rows; row++)
+			{
+				x[row] = axes[0].start + row / axes[1].count * axes[0].step;
+				y[row] = axes[1].start + row % axes[1].count * axes[1].step;
+			}
+			f.evalBatch({x.data(), y.data()}, n_rows, results.data());
+		}
+		bench::doNotOptimize(results);
+	});
+	state.counter("rows_per_op", n_rows);
+	state.counter("input_bytes", generated ? 0 : 2 * n_rows * sizeof(double));
+}
+
+BENCH("grid/meshgrid/1024x1024", [](bench::State& state) { benchGrid(state, false); });
+BENCH("grid/generated/1024x1024", [](bench::State& state) { benchGrid(state, true); });
+
+// Bounds of a formula over a box: one evalInterval, against evalBatch over a
+// 32 x 32 sample of it, which only estimates them.
+static const string s_interval_expression = "sin(x)*cos(y) + 0.5*x*y - exp(-x^2)";
+
+static void benchInterval(bench::State& state, bool sample)
+{
+	Formula f(s_interval_expression);
+	vector<FormulaInterval> box = {FormulaInterval(-0.5, 0.25), FormulaInterval(1.0, 1.5)};
+	vector<FormulaAxis> axes = {FormulaAxis::linspace(-0.5, 0.25, 32), FormulaAxis::linspace(1.0, 1.5, 32)};
+	vector<double> results(32 * 32);
+	state.measure([&]()
+	{
+		if(sample)
+		{
+			f.evalGrid(axes, results.data());
+			bench::doNotOptimize(*min_element(results.begin(), results.end()));
+			bench::doNotOptimize(*max_element(results.begin(), results.end()));
+		}
+		else
+		{
+			bench::doNotOptimize(f.evalInterval(box));
+		}
+	});
+}
+
+BENCH("interval/evalInterval", [](bench::State& state) { benchInterval(state, false); });
+BENCH("interval/sample/1024", [](bench::State& state) { benchInterval(state, true); });
+
+// Records of 12 doubles with x, y and z at offsets 8, 40 and 72 bytes:
+// transposed into columns for evalBatch on every call, against read in
+// place as records, and the columns alone once transposed.
+static const size_t s_record_rows = 1 << 16;
+static const size_t s_record_fields = 12;
+
+static void benchRecords(bench::State& state, int mode)
+{
+	Formula f(s_short_expression + " + z");
+	vector<double> records(s_record_rows * s_record_fields);
+	vector<double> x = bench::values(s_record_rows, -2, 2, 1);
+	vector<double> y = bench::values(s_record_rows, -2, 2, 2);
+	vector<double> z = bench::values(s_record_rows, 1, 2, 3);
+	for(size_t row = 0; row < s_record_rows; row++)
+	{
+		records[row * s_record_fields + 1] = x[row];
+		records[row * s_record_fields + 5] = y[row];
+		records[row * s_record_fields + 9] = z[row];
+	}
+	FormulaRecords layout(records.data(), s_record_fields * sizeof(double),
+		{{"x", 1 * sizeof(double)}, {"y", 5 * sizeof(double)}, {"z", 9 * sizeof(double)}});
+
+	vector<double> results(s_record_rows);
+	state.measure([&]()
+	{
+		if(mode == 0)
+		{
+			vector<double> columns(3 * s_record_rows);
+			for(size_t row = 0; row < s_record_rows; row++)
+			{
+				columns[row] = records[row * s_record_fields + 1];
+				columns[s_record_rows + row] = records[row * s_record_fields + 5];
+				columns[2 * s_record_rows + row] = records[row * s_record_fields + 9];
+			}
+			f.evalBatch({&columns[0], &columns[s_record_rows], &columns[2 * s_record_rows]}, s_record_rows, results.data());
+		}
+		else if(mode == 1)
+		{
+			f.evalBatch(layout, s_record_rows, results.data());
+		}
+		else
+		{
+			f.evalBatch({x.data(), y.data(), z.data()}, s_record_rows, results.data());
+		}
+		bench::doNotOptimize(results);
+	});
+	state.counter("rows_per_op", s_record_rows);
+}
+
+BENCH("records/transpose/short", [](bench::State& state) { benchRecords(state, 0); });
+BENCH("records/strided/short", [](bench::State& state) { benchRecords(state, 1); });
+BENCH("records/columns/short", [](bench::State& state) { benchRecords(state, 2); });
+
+// A formula calling a user function, over 65536 points of its range: the
+// formula through evalBatch, against the proxy approximate fits to 1E-9, and
+// the fit itself.
+static const size_t s_approx_rows = 1 << 16;
+
+static void benchApproximation(bench::State& state, int mode)
+{
+	Formula f("atan(g(x)) * exp(-x/4) + log(1 + x^2) / (2 + sin(3*x))");
+	f.define("g", function<double(double)>([](double x) { return tgamma(1 + x / 4); }));
+	vector<FormulaInterval> range = {FormulaInterval(0.0, 8.0)};
+	FormulaApproximation proxy = f.approximate(range, 1E-9);
+	vector<double> x(s_approx_rows);
+	for(size_t row = 0; row < s_approx_rows; row++)
+	{
+		x[row] = 8.0 * row / s_approx_rows;
+	}
+	vector<double> results(s_approx_rows);
+	state.measure([&]()
+	{
+		if(mode == 0)
+		{
+			f.evalBatch({x.data()}, s_approx_rows, results.data());
+			bench::doNotOptimize(results);
+		}
+		else if(mode == 1)
+		{
+			proxy.evalBatch({x.data()}, s_approx_rows, results.data());
+			bench::doNotOptimize(results);
+		}
+		else
+		{
+			bench::doNotOptimize(f.approximate(range, 1E-9).pieces());
+		}
+	});
+	if(mode != 2)
+	{
+		state.counter("rows_per_op", s_approx_rows);
+	}
+	state.counter("pieces", proxy.pieces());
+}
+
+BENCH("approx/evalBatch/user", [](bench::State& state) { benchApproximation(state, 0); });
+BENCH("approx/proxy/user", [](bench::State& state) { benchApproximation(state, 1); });
+BENCH("approx/fit/user", [](bench::State& state) { benchApproximation(state, 2); });
+
+// Fitted curves as they are usually written, a power per term: degree 8 in
+// one variable, and a cubic surface in two.
+static const string s_curve_expression =
+	"0.31 - 1.7*x + 2.25*x^2 + 0.6*x^3 - 1.35*x^4 + 0.42*x^5 + 0.18*x^6 - 0.07*x^7 + 0.009*x^8";
+static const string s_surface_expression =
+	"1.2 + 0.5*x - 0.8*y + 0.3*x^2 - 0.45*x*y + 0.25*y^2 + 0.11*x^3 - 0.06*x^2*y + 0.04*x*y^2 - 0.02*y^3";
+
+// The stack engine runs a polynomial as written, the register engine and
+// evalBatch in Horner form; the error is the largest difference between the
+// two, relative to the value, over the inputs.
+static void benchPolynomial(bench::State& state, const string& expression, Formula::Engine engine, bool batch)
+{
+	Formula f(expression);
+	f.setEngine(engine);
+	Formula written(expression);
+	written.setEngine(Formula::StackMachine);
+	vector<double> x = bench::values(s_inputs, -2, 2, 1);
+	vector<double> y = bench::values(s_inputs, -2, 2, 2);
+	vector<const double*> columns = {x.data(), y.data()};
+	columns.resize(f.arguments().size());
+
+	vector<double> results(s_inputs);
+	size_t i = 0;
+	vector<double> variables(columns.size());
+	state.measure([&]()
+	{
+		if(batch)
+		{
+			f.evalBatch(columns, s_inputs, results.data());
+			bench::doNotOptimize(results);
+			return;
+		}
+		for(size_t k = 0; k < variables.size(); k++)
+		{
+			variables[k] = columns[k][i];
+		}
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+
+	if(!batch)
+	{
+		for(i = 0; i < s_inputs; i++)
+		{
+			for(size_t k = 0; k < variables.size(); k++)
+			{
+				variables[k] = columns[k][i];
+			}
+			results[i] = f.eval(variables);
+		}
+	}
+	double max_rel = 0.0;
+	for(i = 0; i < s_inputs; i++)
+	{
+		for(size_t k = 0; k < variables.size(); k++)
+		{
+			variables[k] = columns[k][i];
+		}
+		double expected = written.eval(variables);
+		max_rel = max(max_rel, fabs(results[i] - expected) / max(1.0, fabs(expected)));
+	}
+	if(batch)
+	{
+		state.counter("rows_per_op", s_inputs);
+	}
+	else
+	{
+		state.counter("dispatches", engine == Formula::StackMachine ? f.stats().stack_dispatches : f.stats().fused_dispatches);
+	}
+	state.counter("max_rel_error", max_rel);
+}
+
+BENCH("poly/stack/curve", [](bench::State& state) { benchPolynomial(state, s_curve_expression, Formula::StackMachine, false); });
+BENCH("poly/register/curve", [](bench::State& state) { benchPolynomial(state, s_curve_expression, Formula::RegisterMachine, false); });
+BENCH("poly/batch/curve", [](bench::State& state) { benchPolynomial(state, s_curve_expression, Formula::RegisterMachine, true); });
+BENCH("poly/stack/surface", [](bench::State& state) { benchPolynomial(state, s_surface_expression, Formula::StackMachine, false); });
+BENCH("poly/register/surface", [](bench::State& state) { benchPolynomial(state, s_surface_expression, Formula::RegisterMachine, false); });
+BENCH("poly/batch/surface", [](bench::State& state) { benchPolynomial(state, s_surface_expression, Formula::RegisterMachine, true); });
+
+#ifdef FORMULA_BENCH_GENERATED
+// The functions generated from curves.txt at build time against eval of the
+// same expressions: called directly, through the table, or over all the
+// rows in a loop the compiler can vectorize. The error is the largest
+// difference from eval, relative to the value.
+enum CodegenMode
+{
+	Interpreted,
+	Generated,
+	Table,
+	Array
+};
+
+template<typename Function>
+static void benchCodegen(bench::State& state, const string& name, CodegenMode mode, Function function)
+{
+	const FormulaFunction* entry = curves::find(name);
+	size_t arity = entry->arity;
+
+	// Generated code folds the constants pi and e; here they are defined,
+	// so that the arguments are the same.
+	Formula f(entry->expression);
+	for(const string& variable : f.variables())
+	{
+		if(find(entry->arguments, entry->arguments + arity, variable) == entry->arguments + arity)
+		{
+			f.define(variable, Formula(variable).eval());
+		}
+	}
+	vector<double> rows = bench::values(s_inputs * arity, -2, 2, 1);
+	vector<double> results(s_inputs);
+
+	size_t i = 0;
+	vector<double> variables(arity);
+	state.measure([&]()
+	{
+		switch(mode)
+		{
+			case Interpreted:
+			{
+				copy(&rows[i * arity], &rows[i * arity] + arity, variables.begin());
+				bench::doNotOptimize(f.eval(variables));
+				break;
+			}
+			case Generated:
+			{
+				bench::doNotOptimize(function(&rows[i * arity]));
+				break;
+			}
+			case Table:
+			{
+				bench::doNotOptimize(entry->eval(&rows[i * arity]));
+				break;
+			}
+			case Array:
+			{
+				for(size_t j = 0; j < s_inputs; j++)
+				{
+					results[j] = function(&rows[j * arity]);
+				}
+				bench::doNotOptimize(results);
+				break;
+			}
+		}
+		i = (i + 1) % s_inputs;
+	});
+
+	double max_rel = 0.0;
+	for(i = 0; i < s_inputs; i++)
+	{
+		copy(&rows[i * arity], &rows[i * arity] + arity, variables.begin());
+		double expected = f.eval(variables);
+		max_rel = max(max_rel, fabs(function(&rows[i * arity]) - expected) / max(1.0, fabs(expected)));
+	}
+	if(mode == Array)
+	{
+		state.counter("rows_per_op", s_inputs);
+	}
+	state.counter("max_rel_error", max_rel);
+}
+
+// Lambdas, unlike function pointers, are inlined into the benchmark loops.
+static const auto s_generated_curve = [](const double* x) { return curves::curve(x[0]); };
+static const auto s_generated_damped = [](const double* x) { return curves::damped(x[0]); };
+
+BENCH("codegen/interpreted/curve", [](bench::State& state) { benchCodegen(state, "curve", Interpreted, s_generated_curve); });
+BENCH("codegen/generated/curve", [](bench::State& state) { benchCodegen(state, "curve", Generated, s_generated_curve); });
+BENCH("codegen/table/curve", [](bench::State& state) { benchCodegen(state, "curve", Table, s_generated_curve); });
+BENCH("codegen/array/curve", [](bench::State& state) { benchCodegen(state, "curve", Array, s_generated_curve); });
+BENCH("codegen/interpreted/damped", [](bench::State& state) { benchCodegen(state, "damped", Interpreted, s_generated_damped); });
+BENCH("codegen/generated/damped", [](bench::State& state) { benchCodegen(state, "damped", Generated, s_generated_damped); });
+BENCH("codegen/array/damped", [](bench::State& state) { benchCodegen(state, "damped", Array, s_generated_damped); });
+#endif
+
+BENCH("function/none", [](bench::State& state) { benchFunction(state, "x", Formula("x")); });
+BENCH("function/sin", [](bench::State& state) { benchFunction(state, "sin(x)", Formula("sin(x)")); });
+BENCH("function/exp", [](bench::State& state) { benchFunction(state, "exp(x)", Formula("exp(x)")); });
+BENCH("function/log", [](bench::State& state) { benchFunction(state, "log(x)", Formula("log(x)")); });
+BENCH("function/sqrt", [](bench::State& state) { benchFunction(state, "sqrt(x)", Formula("sqrt(x)")); });
+BENCH("function/asin", [](bench::State& state) { benchFunction(state, "asin(x)", Formula("asin(x)")); });
+BENCH("function/user", [](bench::State& state)
+{
+	Formula f("g(x)");
+	f.define("g", [](double x) { return x * x + 1; });
+	benchFunction(state, "g(x)", f);
+});
+
+static void benchFunctionBatch(bench::State& state, const Formula& f)
+{
+	vector<double> x = bench::values(s_inputs, 0.1, 0.9, 4);
+	vector<double> results(s_inputs);
+	state.measure([&]()
+	{
+		f.evalBatch({x.data()}, s_inputs, results.data());
+		bench::doNotOptimize(results);
+	});
+	state.counter("rows_per_op", s_inputs);
+}
+
+BENCH("function/user/batch/scalar", [](bench::State& state)
+{
+	Formula f("g(x)");
+	f.define("g", [](double x) { return x * x + 1; });
+	benchFunctionBatch(state, f);
+});
+BENCH("function/user/batch/kernel", [](bench::State& state)
+{
+	Formula f("g(x)");
+	f.define("g", [](const double* x, double* y, size_t n)
+	{
+		for(size_t i = 0; i < n; i++)
+		{
+			y[i] = x[i] * x[i] + 1;
+		}
+	});
+	benchFunctionBatch(state, f);
+});
+
+// A costly user function: the real root of t^3 + t = x by Newton's method.
+static double cubicRoot(double x)
+{
+	double t = x;
+	for(int i = 0; i < 32; i++)
+	{
+		t -= (t * t * t + t - x) / (3 * t * t + 1);
+	}
+	return t;
+}
+
+// Arguments repeat, as values read from a coarse table do: 64 distinct ones.
+static void benchMemo(bench::State& state, const Formula& f)
+{
+	vector<double> x = bench::values(s_inputs, 0, 64, 4);
+	for(double& v : x)
+	{
+		v = floor(v) / 8;
+	}
+
+	size_t i = 0;
+	vector<double> variables(1);
+	state.measure([&]()
+	{
+		variables[0] = x[i];
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+}
+
+BENCH("function/memo/none", [](bench::State& state)
+{
+	Formula f("g(x)");
+	f.define("g", cubicRoot);
+	benchMemo(state, f);
+});
+BENCH("function/memo/cached", [](bench::State& state)
+{
+	FormulaMemo g(cubicRoot);
+	Formula f("g(x)");
+	f.define("g", g);
+	benchMemo(state, f);
+	state.counter("hit_rate", g.stats().hitRate());
+});
+
+static const string s_context_expression = "g*mass*h + 0.5*mass*v^2*scale - sin(phase)*x";
+
+static void benchContext(bench::State& state, const Formula& f)
+{
+	vector<double> x = bench::values(s_inputs, -100, 100, 6);
+
+	size_t i = 0;
+	vector<double> variables(1);
+	state.measure([&]()
+	{
+		variables[0] = x[i];
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+	state.counter("fused_dispatches", f.stats().fused_dispatches);
+}
+
+static void defineConstants(const std::function<void(const string&, double)>& define)
+{
+	define("g", 9.81);
+	define("mass", 3.5);
+	define("h", 12.0);
+	define("v", 4.25);
+	define("scale", 0.75);
+	define("phase", 0.3);
+}
+
+BENCH("context/eval/defined", [](bench::State& state)
+{
+	Formula f(s_context_expression);
+	defineConstants([&](const string& name, double value) { f.define(name, value); });
+	benchContext(state, f);
+});
+BENCH("context/eval/bound", [](bench::State& state)
+{
+	FormulaContext context;
+	defineConstants([&](const string& name, double value) { context.define(name, value); });
+	Formula f(s_context_expression, context);
+	benchContext(state, f);
+});
+
+// Redefining a constant refolds the formulas using it: 100 of the 1000.
+BENCH("context/update/1000", [](bench::State& state)
+{
+	FormulaContext context;
+	defineConstants([&](const string& name, double value) { context.define(name, value); });
+	context.define("rate", 1.0);
+
+	vector<Formula> formulas;
+	for(int i = 0; i < 1000; i++)
+	{
+		formulas.emplace_back(i % 10 == 0 ? s_context_expression + " + rate" : s_context_expression, context);
+	}
+
+	FormulaContext::Stats before = context.stats();
+	double rate = 1.0;
+	state.measure([&]()
+	{
+		context.define("rate", rate);
+		rate += 1.0;
+	});
+	FormulaContext::Stats after = context.stats();
+	state.counter("refolds_per_update", (double)(after.refolds - before.refolds) / (after.updates - before.updates));
+});
+
+// eval through a FormulaHandle against the same formula evaluated directly,
+// alone and while another thread reassigns the expression every 100 us.
+static void benchHandle(bench::State& state, bool handle, bool swapping)
+{
+	const string expression = s_short_expression + " + z";
+	Formula f(expression);
+	FormulaHandle h(f);
+	vector<double> x = bench::values(s_inputs, -2, 2, 1);
+	vector<double> y = bench::values(s_inputs, -2, 2, 2);
+	vector<double> z = bench::values(s_inputs, 1, 2, 3);
+
+	atomic<bool> stop(false);
+	thread writer;
+	if(swapping)
+	{
+		writer = thread([&]()
+		{
+			for(unsigned n = 0; !stop.load(); n++)
+			{
+				h.assign(n % 2 ? expression : expression + " + 1");
+				this_thread::sleep_for(chrono::microseconds(100));
+			}
+		});
+	}
+
+	size_t i = 0;
+	vector<double> variables(3);
+	state.measure([&]()
+	{
+		variables[0] = x[i];
+		variables[1] = y[i];
+		variables[2] = z[i];
+		bench::doNotOptimize(handle ? h.eval(variables) : f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+
+	stop.store(true);
+	if(writer.joinable())
+	{
+		writer.join();
+	}
+	state.counter("swaps", h.version());
+}
+
+BENCH("handle/eval/direct", [](bench::State& state) { benchHandle(state, false, false); });
+BENCH("handle/eval/handle", [](bench::State& state) { benchHandle(state, true, false); });
+BENCH("handle/eval/swapping", [](bench::State& state) { benchHandle(state, true, true); });
+
+// A burst of messages, each with its own vector of arguments, handled one
+// eval at a time or pushed through a pipeline. Latency is from the start of
+// the burst to the completion of a message.
+static void benchStream(bench::State& state, const string& expression, bool pipelined)
+{
+	Formula f(expression);
+	vector<double> x = bench::values(s_inputs, -100, 100, 7);
+	vector<double> y = bench::values(s_inputs, 1, 100, 8);
+	vector<double> z = bench::values(s_inputs, 1, 100, 9);
+	unique_ptr<FormulaPipeline> pipeline(pipelined ? new FormulaPipeline(f) : nullptr);
+
+	vector<double> latency(s_inputs);
+	state.measure([&]()
+	{
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		auto completed = [&](size_t i)
+		{
+			latency[i] = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+		};
+
+		for(size_t i = 0; i < s_inputs; i++)
+		{
+			vector<double> row = {x[i], y[i], z[i]};
+			if(pipelined)
+			{
+				pipeline->push(std::move(row), [&completed, i](double value, exception_ptr)
+				{
+					bench::doNotOptimize(value);
+					completed(i);
+				});
+				continue;
+			}
+			bench::doNotOptimize(f.eval(row));
+			completed(i);
+		}
+		if(pipelined)
+		{
+			pipeline->drain();
+		}
+	});
+
+	sort(latency.begin(), latency.end());
+	state.counter("messages_per_op", s_inputs);
+	state.counter("p50_us", latency[s_inputs / 2]);
+	state.counter("p99_us", latency[s_inputs * 99 / 100]);
+	if(pipelined)
+	{
+		state.counter("mean_batch", pipeline->stats().meanBatch());
+	}
+}
+
+BENCH("stream/eval/short", [](bench::State& state) { benchStream(state, s_short_expression + " + z", false); });
+BENCH("stream/pipeline/short", [](bench::State& state) { benchStream(state, s_short_expression + " + z", true); });
+BENCH("stream/eval/long", [](bench::State& state) { benchStream(state, s_long_expression, false); });
+BENCH("stream/pipeline/long", [](bench::State& state) { benchStream(state, s_long_expression, true); });
+
+// Inputs spanning the domain of a function, log-uniform for the logarithms.
+static vector<double> domainValues(const string& function, size_t n)
+{
+	if(function.compare(0, 3, "log") == 0)
+	{
+		vector<double> x = bench::values(n, -300, 300, 5);
+		for(double& v : x)
+		{
+			v = pow(10.0, v);
+		}
+		return x;
+	}
+	if(function == "exp")
+	{
+		return bench::values(n, -700, 700, 5);
+	}
+	if(function == "tan")
+	{
+		return bench::values(n, -1.5, 1.5, 5);
+	}
+	return bench::values(n, -100, 100, 5);
+}
+
+// Speed of one function at a precision, one row at a time or in batches,
+// with the largest error of the fast version against the exact one over a
+// sweep of its domain.
+static void benchPrecision(bench::State& state, const string& function, Formula::Precision precision, bool batch)
+{
+	Formula f(function + "(x)");
+	f.setPrecision(precision);
+	vector<double> x = domainValues(function, s_inputs);
+	vector<double> results(s_inputs);
+	vector<const double*> columns = {x.data()};
+
+	size_t i = 0;
+	vector<double> variables(1);
+	state.measure([&]()
+	{
+		if(batch)
+		{
+			f.evalBatch(columns, s_inputs, results.data());
+			bench::doNotOptimize(results);
+			return;
+		}
+		variables[0] = x[i];
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+	if(batch)
+	{
+		state.counter("rows_per_op", s_inputs);
+	}
+
+	if(precision == Formula::Fast)
+	{
+		Formula exact(function + "(x)");
+		vector<double> sweep = domainValues(function, 100000);
+		vector<double> approximate = f.evalBatch({sweep});
+		vector<double> reference = exact.evalBatch({sweep});
+
+		double max_abs = 0.0;
+		double max_rel = 0.0;
+		for(size_t k = 0; k < sweep.size(); k++)
+		{
+			double error = fabs(approximate[k] - reference[k]);
+			max_abs = max(max_abs, error);
+			if(fabs(reference[k]) > 1E-6)
+			{
+				max_rel = max(max_rel, error / fabs(reference[k]));
+			}
+		}
+		state.counter("max_abs_error", max_abs);
+		state.counter("max_rel_error", max_rel);
+	}
+}
+
+static bool registerPrecision()
+{
+	for(const char* function : {"sin", "cos", "tan", "exp", "log", "log2", "log10"})
+	{
+		string name = string("precision/") + function;
+		bench::add(name + "/exact", [=](bench::State& state) { benchPrecision(state, function, Formula::Exact, false); });
+		bench::add(name + "/fast", [=](bench::State& state) { benchPrecision(state, function, Formula::Fast, false); });
+		bench::add(name + "/batch/exact", [=](bench::State& state) { benchPrecision(state, function, Formula::Exact, true); });
+		bench::add(name + "/batch/fast", [=](bench::State& state) { benchPrecision(state, function, Formula::Fast, true); });
+	}
+	return true;
+}
+
+static const bool s_precision_registered = registerPrecision();
+
+static vector<string> manyExpressions(size_t n)
+{
+	vector<string> expressions;
+	for(size_t i = 0; i < n; i++)
+	{
+		expressions.push_back("x*" + to_string(i) + " + sin(y)^2 - rate/3");
+	}
+	return expressions;
+}
+
+BENCH("memory/heap/1000", [](bench::State& state)
+{
+	vector<string> expressions = manyExpressions(1000);
+	state.measure([&]()
+	{
+		vector<Formula> formulas;
+		formulas.reserve(expressions.size());
+		for(const string& expression : expressions)
+		{
+			formulas.emplace_back(expression);
+		}
+		bench::doNotOptimize(formulas);
+	});
+
+	Formula f(expressions[0]);
+	state.counter("bytes_per_formula", f.memoryUsage().total());
+	state.counter("heap_blocks_per_formula", f.memoryUsage().heap_blocks);
+});
+
+BENCH("memory/arena/1000", [](bench::State& state)
+{
+	vector<string> expressions = manyExpressions(1000);
+	state.measure([&]()
+	{
+		FormulaArena arena;
+		vector<Formula> formulas;
+		formulas.reserve(expressions.size());
+		for(const string& expression : expressions)
+		{
+			formulas.emplace_back(expression, arena);
+		}
+		bench::doNotOptimize(formulas);
+	});
+
+	FormulaArena arena;
+	for(const string& expression : expressions)
+	{
+		Formula f(expression, arena);
+	}
+	FormulaArena::Usage usage = arena.usage();
+	state.counter("bytes_per_formula", sizeof(Formula) + (double)usage.used / expressions.size());
+	state.counter("heap_blocks_per_formula", (double)usage.chunks / expressions.size());
+});
+
+// Constructing 1000 formulas fully compiled, against with tiering, which
+// leaves them to be interpreted; then eval of a formula with tiering before
+// and after it has been optimized.
+static void benchTieringConstruct(bench::State& state, bool tiered)
+{
+	vector<string> expressions = manyExpressions(1000);
+	state.measure([&]()
+	{
+		vector<Formula> formulas;
+		formulas.reserve(expressions.size());
+		for(const string& expression : expressions)
+		{
+			if(tiered)
+			{
+				formulas.emplace_back(expression, FormulaTiering());
+			}
+			else
+			{
+				formulas.emplace_back(expression);
+			}
+		}
+		bench::doNotOptimize(formulas);
+	});
+}
+
+static void benchTieringEval(bench::State& state, const string& expression, bool hot)
+{
+	FormulaTiering tiering;
+	tiering.threshold = hot ? 1 : 0;
+	Formula f(expression, tiering);
+	vector<double> variables = {0.5, 1.5, 1.25};
+	f.eval(variables);
+	while(f.tier() != (hot ? Formula::Optimized : Formula::Interpreted))
+	{
+		this_thread::yield();
+	}
+
+	vector<double> x = bench::values(s_inputs, -2, 2, 1);
+	size_t i = 0;
+	state.measure([&]()
+	{
+		variables[0] = x[i];
+		bench::doNotOptimize(f.eval(variables));
+		i = (i + 1) % s_inputs;
+	});
+}
+
+BENCH("tiering/construct/eager/1000", [](bench::State& state) { benchTieringConstruct(state, false); });
+BENCH("tiering/construct/tiered/1000", [](bench::State& state) { benchTieringConstruct(state, true); });
+BENCH("tiering/eval/interpreted/long", [](bench::State& state) { benchTieringEval(state, s_long_expression, false); });
+BENCH("tiering/eval/optimized/long", [](bench::State& state) { benchTieringEval(state, s_long_expression, true); });
+
+// 1000 formulas over 10 inputs, 100 using each, and 100 totals of ten
+// formulas each. One input changes per call.
+static void benchGraph(bench::State& state, bool all)
+{
+	FormulaGraph graph;
+	for(int i = 0; i < 10; i++)
+	{
+		graph.set("x" + to_string(i), i);
+	}
+	for(int i = 0; i < 1000; i++)
+	{
+		graph.define("a" + to_string(i), Formula("x" + to_string(i % 10) + "*" + to_string(i) + " + sin(x" + to_string(i % 10) + ")"));
+	}
+	for(int i = 0; i < 100; i++)
+	{
+		string total = "a" + to_string(i * 10);
+		for(int k = 1; k < 10; k++)
+		{
+			total += " + a" + to_string(i * 10 + k);
+		}
+		graph.define("total" + to_string(i), Formula(total));
+	}
+	graph.evaluate();
+	graph.resetCounters();
+
+	double x = 0.0;
+	unsigned long long calls = 0;
+	state.measure([&]()
+	{
+		graph.set("x3", x);
+		x += 1.0;
+		if(all)
+		{
+			graph.evaluate();
+		}
+		else
+		{
+			bench::doNotOptimize(graph.value("total0"));
+		}
+		calls++;
+	});
+	state.counter("evaluated_per_op", (double)graph.evaluated() / calls);
+}
+
+BENCH("graph/value/1100", [](bench::State& state) { benchGraph(state, false); });
+BENCH("graph/evaluate/1100", [](bench::State& state) { benchGraph(state, true); });
+
+// A rules file where every expression appears twice, loaded by the
+// constructor one line at a time or by the loader.
+typedef vector<pair<string, string> > Rules;
+
+static Rules manyRules(size_t n)
+{
+	vector<string> expressions = manyExpressions(n / 2);
+	Rules rules;
+	for(size_t i = 0; i < n; i++)
+	{
+		rules.emplace_back("rule" + to_string(i), expressions[i % expressions.size()]);
+	}
+	return rules;
+}
+
+BENCH("load/serial/4000", [](bench::State& state)
+{
+	Rules rules = manyRules(4000);
+	state.measure([&]()
+	{
+		unordered_map<string, Formula> formulas;
+		for(const auto& rule : rules)
+		{
+			Formula f(rule.second);
+			f.check();
+			formulas.emplace(rule.first, f);
+		}
+		bench::doNotOptimize(formulas);
+	});
+});
+
+BENCH("load/loader/4000", [](bench::State& state)
+{
+	Rules rules = manyRules(4000);
+	FormulaLoader loader;
+	state.measure([&]()
+	{
+		bench::doNotOptimize(loader.compile(rules));
+	});
+	state.counter("threads", thread::hardware_concurrency());
+});
+
+static Formula definedFormula()
+{
+	Formula f(s_long_expression);
+	for(int i = 0; i < 40; i++)
+	{
+		f.define("k" + to_string(i), i);
+	}
+	f.define("g", [](double x) { return x; });
+	return f;
+}
+
+BENCH("copy/formula/long", [](bench::State& state)
+{
+	Formula f = definedFormula();
+	state.measure([&]()
+	{
+		Formula copy(f);
+		bench::doNotOptimize(copy);
+	});
+});
+
+BENCH("copy/move/long", [](bench::State& state)
+{
+	Formula f = definedFormula();
+	state.measure([&]()
+	{
+		Formula moved(std::move(f));
+		f = std::move(moved);
+		bench::doNotOptimize(f);
+	});
+});
+
+// What a copy costs when the program has to be rebuilt from its string.
+BENCH("copy/reparse/long", [](bench::State& state)
+{
+	state.measure([&]()
+	{
+		Formula copy(s_long_expression);
+		bench::doNotOptimize(copy);
+	});
+});
+
+BENCH("copy/vector_growth/1000", [](bench::State& state)
+{
+	Formula f = definedFormula();
+	state.measure([&]()
+	{
+		vector<Formula> formulas;
+		for(int i = 0; i < 1000; i++)
+		{
+			formulas.push_back(f);
+		}
+		bench::doNotOptimize(formulas);
+	});
+});
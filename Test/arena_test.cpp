@@ -0,0 +1,78 @@
+#include "check.hpp"
+#include "formula.hpp"
+#include "formula_arena.hpp"
+#include "formula_handle.hpp"
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Formulas reassigned over and over reuse the blocks of their old programs,
+// so the arena stops growing after the first round.
+static void testReassignedFormulasReuseBlocks()
+{
+	FormulaArena arena;
+	vector<Formula> formulas;
+	for(int i = 0; i < 100; i++)
+	{
+		formulas.emplace_back("x*" + to_string(i) + " + 1", arena);
+	}
+
+	size_t reserved = 0;
+	for(int round = 0; round < 1000; round++)
+	{
+		for(size_t i = 0; i < formulas.size(); i++)
+		{
+			formulas[i] = "x*" + to_string(round) + " - y/" + to_string(i + 1);
+		}
+		if(round == 1)
+		{
+			reserved = arena.usage().reserved;
+		}
+	}
+
+	FormulaArena::Usage usage = arena.usage();
+	CHECK(usage.reserved == reserved);
+	CHECK(usage.programs == formulas.size());
+	CHECK_NEAR(formulas[9].eval(2.0, 5.0), 2.0 * 999 - 0.5, 1e-12);
+}
+
+// A handle keeps readers' programs alive; once replaced, their blocks are
+// reused too.
+static void testHandleSwapsReuseBlocks()
+{
+	FormulaArena arena;
+	FormulaHandle handle(Formula("x + 1", arena));
+	size_t reserved = 0;
+	for(int i = 0; i < 100000; i++)
+	{
+		handle.assign("x + " + to_string(i % 1000));
+		if(i == 1000)
+		{
+			reserved = arena.usage().reserved;
+		}
+	}
+	CHECK(arena.usage().reserved <= reserved + 64 * 1024);
+	CHECK_NEAR(handle.eval(1.0), 1000.0, 1e-12);
+}
+
+static void testProgramsOutliveTheirArena()
+{
+	Formula f;
+	{
+		FormulaArena arena;
+		f = Formula("sin(x) + 2", arena);
+	}
+	Formula g = f;
+	f = "x";
+	CHECK_NEAR(g.eval(0.0), 2.0, 1e-12);
+}
+
+int main()
+{
+	testReassignedFormulasReuseBlocks();
+	testHandleSwapsReuseBlocks();
+	testProgramsOutliveTheirArena();
+	return check::result();
+}
@@ -0,0 +1,195 @@
+#include "check.hpp"
+#include "formula.hpp"
+#include "formula_context.hpp"
+#include "formula_exeption.hpp"
+#include "formula_reduction.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static vector<double> linear(double from, double to, size_t n)
+{
+	vector<double> x(n);
+	for(size_t i = 0; i < n; i++)
+	{
+		x[i] = from + (to - from) * i / (n - 1);
+	}
+	return x;
+}
+
+// Clears out before reading in, so it is only right when the two do not
+// overlap, as the kernel contract states.
+static void twice(const double* in, double* out, size_t n)
+{
+	fill(out, out + n, 0.0);
+	for(size_t i = 0; i < n; i++)
+	{
+		out[i] += 2.0 * in[i];
+	}
+}
+
+static void testKernelBuffers()
+{
+	// 1000 rows span several blocks; the argument of twice is computed into
+	// a block buffer, the one the kernel would otherwise write over.
+	vector<double> x = linear(-3.0, 5.0, 1000);
+	vector<double> y = linear(1.0, 2.0, 1000);
+	for(const char* expression : {"twice(x*y) + 1", "twice(x) - twice(y*2)", "twice(twice(x + 1))", "3 + twice(x)^2"})
+	{
+		Formula f(expression);
+		f.define("twice", twice);
+
+		vector<double> batch = f.evalBatch({x, y});
+		for(size_t i = 0; i < x.size(); i++)
+		{
+			double expected = f.eval(x[i], y[i]);
+			CHECK_NEAR(batch[i], expected, fabs(expected) * 1e-15);
+		}
+	}
+
+	FormulaContext context;
+	context.define("twice", twice);
+	Formula f("twice(x*2)", context);
+	vector<double> batch = f.evalBatch({x});
+	for(size_t i = 0; i < x.size(); i++)
+	{
+		CHECK_NEAR(batch[i], 4.0 * x[i], 1e-12);
+	}
+}
+
+static void testScalarFunctions()
+{
+	vector<double> x = linear(0.1, 10.0, 777);
+	Formula f("sqrt(x) * log(x + 1) - sin(x)^2 / (1 + x)");
+	vector<double> batch = f.evalBatch({x});
+	for(size_t i = 0; i < x.size(); i++)
+	{
+		double expected = f.eval(x[i]);
+		CHECK_NEAR(batch[i], expected, fabs(expected) * 1e-14 + 1e-15);
+	}
+}
+
+static double positive(double x)
+{
+	if(x < 0.0)
+	{
+		throw runtime_error(to_string((int)x));
+	}
+	return x;
+}
+
+// In postfix order positive(x) runs first over the block and fails at row
+// 7, but positive(y) fails at row 3, whose error reduce must throw.
+static void testReduceFirstFailingRow()
+{
+	vector<double> x = linear(1.0, 2.0, 5000);
+	vector<double> y = linear(1.0, 2.0, 5000);
+	x[4007] = -7.0;
+	y[4003] = -3.0;
+
+	Formula f("positive(x) * positive(y)");
+	f.define("positive", positive);
+	for(unsigned threads : {1u, 4u})
+	{
+		FormulaReduction::Options options;
+		options.threads = threads;
+		string error;
+		try
+		{
+			f.reduce({x, y}, options);
+		}
+		catch(const runtime_error& e)
+		{
+			error = e.what();
+		}
+		CHECK(error == "-3");
+	}
+}
+
+// No row, or only NaN results, leave argmin and argmax at NONE rather than
+// pointing at a row.
+static void testReduceWithoutExtremum()
+{
+	Formula f("x * 2 + 1");
+	vector<double> none;
+	vector<double> nans(3000, numeric_limits<double>::quiet_NaN());
+	for(unsigned threads : {1u, 4u})
+	{
+		FormulaReduction::Options options;
+		options.threads = threads;
+
+		FormulaReduction empty = f.reduce({none}, options);
+		CHECK(empty.count == 0);
+		CHECK(empty.argmin == FormulaReduction::NONE);
+		CHECK(empty.argmax == FormulaReduction::NONE);
+
+		FormulaReduction all_nan = f.reduce({nans}, options);
+		CHECK(all_nan.count == nans.size());
+		CHECK(all_nan.argmin == FormulaReduction::NONE);
+		CHECK(all_nan.argmax == FormulaReduction::NONE);
+
+		vector<double> one = nans;
+		one[2500] = 4.0;
+		FormulaReduction single = f.reduce({one}, options);
+		CHECK(single.argmin == 2500);
+		CHECK(single.argmax == 2500);
+		CHECK_NEAR(single.min, 9.0, 1e-12);
+	}
+}
+
+static bool sameBits(double a, double b)
+{
+	return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+// eval runs constant powers by square-and-multiply, and evalBatch must do
+// the same to give the same bits; a context folds 0-3 to a constant.
+static void testPowersMatchEvalBits()
+{
+	mt19937 random(42);
+	uniform_real_distribution<double> value(0.5, 3.0);
+	vector<double> x(2000), y(2000);
+	for(size_t i = 0; i < x.size(); i++)
+	{
+		x[i] = value(random);
+		y[i] = value(random);
+	}
+
+	FormulaContext context;
+	context.define("k", 3.0);
+	vector<Formula> formulas;
+	for(const char* expression : {"x^3 - y^4", "sin(x)^2 + x^12", "(x + y)^0.5", "1/x^2", "x^4*y^3 + x^(0-1)", "exp(x)^3"})
+	{
+		formulas.emplace_back(expression);
+	}
+	formulas.emplace_back("x^(0-k) + y^k + x^(k+1)", context);
+
+	for(const Formula& f : formulas)
+	{
+		vector<double> batch = f.evalBatch({x, y});
+		size_t differing = 0;
+		for(size_t i = 0; i < x.size(); i++)
+		{
+			differing += !sameBits(batch[i], f.eval(x[i], y[i]));
+		}
+		CHECK(differing == 0);
+	}
+}
+
+int main()
+{
+	testKernelBuffers();
+	testScalarFunctions();
+	testReduceFirstFailingRow();
+	testReduceWithoutExtremum();
+	testPowersMatchEvalBits();
+	return check::result();
+}
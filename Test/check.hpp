@@ -0,0 +1,73 @@
+#ifndef FORMULA_TEST_CHECK_H
+#define FORMULA_TEST_CHECK_H
+
+#include <cmath>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+// Minimal checks: a failing one is printed and the test keeps going, so a
+// run reports every failure; main returns check::result().
+namespace check
+{
+	inline int& failures()
+	{
+		static int s_failures = 0;
+		return s_failures;
+	}
+
+	inline void fail(const char* file, int line, const std::string& what)
+	{
+		std::cerr << file << ":" << line << ": " << what << std::endl;
+		failures()++;
+	}
+
+	inline int result()
+	{
+		if(failures() != 0)
+		{
+			std::cerr << failures() << " check(s) failed" << std::endl;
+			return 1;
+		}
+		return 0;
+	}
+}
+
+#define CHECK(condition) \
+	((condition) ? (void)0 : check::fail(__FILE__, __LINE__, "CHECK(" #condition ")"))
+
+// Checks that |actual - expected| <= bound, printing both values otherwise.
+#define CHECK_NEAR(actual, expected, bound) \
+	do \
+	{ \
+		double check_actual = (actual); \
+		double check_expected = (expected); \
+		if(!(std::fabs(check_actual - check_expected) <= (bound))) \
+		{ \
+			std::ostringstream check_message; \
+			check_message.precision(17); \
+			check_message << #actual << " = " << check_actual << ", expected " << check_expected << " within " << (bound); \
+			check::fail(__FILE__, __LINE__, check_message.str()); \
+		} \
+	} while(false)
+
+// Checks that statement throws exception_type.
+#define CHECK_THROWS(statement, exception_type) \
+	do \
+	{ \
+		bool check_thrown = false; \
+		try \
+		{ \
+			statement; \
+		} \
+		catch(const exception_type&) \
+		{ \
+			check_thrown = true; \
+		} \
+		if(!check_thrown) \
+		{ \
+			check::fail(__FILE__, __LINE__, "CHECK_THROWS(" #statement ", " #exception_type ")"); \
+		} \
+	} while(false)
+
+#endif // FORMULA_TEST_CHECK_H
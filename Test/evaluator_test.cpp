@@ -0,0 +1,64 @@
+#include "check.hpp"
+#include "formula.hpp"
+#include "formula_evaluator.hpp"
+
+#include <cstring>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+static bool sameBits(double a, double b)
+{
+	return memcmp(&a, &b, sizeof(double)) == 0;
+}
+
+// value() and eval() run the same functions and power shortcuts, so they give
+// the same bits whatever the precision, also after set() changed one variable.
+static void testValueMatchesEval(Formula::Precision precision)
+{
+	const char* expressions[] =
+	{
+		"sin(x)/exp(y) - log(x + y)^3",
+		"tan(y)^2/cos(x) + (x - y)^(0 - 2)",
+		"sqrt(x)^0.5 - exp(0 - y)^4 + x^y",
+		"log10(x + 1)/sin(y)^(0 - 3) - (x + 2)^0.5"
+	};
+
+	mt19937 generator(7);
+	uniform_real_distribution<double> values(0.1, 20.0);
+	for(const char* expression : expressions)
+	{
+		Formula f(expression);
+		f.setPrecision(precision);
+		FormulaEvaluator evaluator(f);
+
+		double y = 0.0;
+		int mismatches = 0;
+		for(int i = 0; i < 2000; i++)
+		{
+			double x = values(generator);
+			evaluator.set("x", x);
+			if(i % 2 == 0)
+			{
+				y = values(generator);
+				evaluator.set("y", y);
+			}
+
+			unordered_map<string, double> variables = {{"x", x}, {"y", y}};
+			if(!sameBits(evaluator.value(), f.eval(variables)))
+			{
+				mismatches++;
+			}
+		}
+		CHECK(mismatches == 0);
+	}
+}
+
+int main()
+{
+	testValueMatchesEval(Formula::Exact);
+	testValueMatchesEval(Formula::Fast);
+	return check::result();
+}
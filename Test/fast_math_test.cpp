@@ -0,0 +1,202 @@
+#include "check.hpp"
+#include "fast_math.hpp"
+#include "formula.hpp"
+#include "formula_exeption.hpp"
+
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Bounds stated in fast_math.hpp and the README.
+static const double TRIG_ABSOLUTE = 3e-14;
+static const double TAN_RELATIVE = 4e-14;
+static const double EXP_RELATIVE = 1e-11;
+static const double LOG_RELATIVE = 4e-14;
+
+static vector<double> linear(double from, double to, size_t n)
+{
+	vector<double> x(n);
+	for(size_t i = 0; i < n; i++)
+	{
+		x[i] = from + (to - from) * i / (n - 1);
+	}
+	return x;
+}
+
+static vector<double> logarithmic(double from, double to, size_t n)
+{
+	vector<double> x(n);
+	for(size_t i = 0; i < n; i++)
+	{
+		x[i] = from * pow(to / from, (double)i / (n - 1));
+	}
+	return x;
+}
+
+static double error(double approximate, double reference, bool relative)
+{
+	double difference = fabs(approximate - reference);
+	return relative ? difference / fabs(reference) : difference;
+}
+
+// Sweeps the scalar form, the array form into another buffer and the array
+// form in place over x, each against reference.
+static void sweep(const string& name, const function<double(double)>& reference, const vector<double>& x,
+	double bound, bool relative)
+{
+	const FastMath::Function& fast = *FastMath::function(name);
+
+	vector<double> out(x.size());
+	fast.vector(x.data(), out.data(), x.size());
+	vector<double> in_place = x;
+	fast.vector(in_place.data(), in_place.data(), in_place.size());
+
+	double scalar_error = 0.0;
+	double array_error = 0.0;
+	double in_place_error = 0.0;
+	for(size_t i = 0; i < x.size(); i++)
+	{
+		double expected = reference(x[i]);
+		scalar_error = max(scalar_error, error(fast.scalar(x[i]), expected, relative));
+		array_error = max(array_error, error(out[i], expected, relative));
+		in_place_error = max(in_place_error, error(in_place[i], expected, relative));
+	}
+
+	CHECK_NEAR(scalar_error, 0.0, bound);
+	CHECK_NEAR(array_error, 0.0, bound);
+	CHECK_NEAR(in_place_error, 0.0, bound);
+}
+
+static double sinReference(double x) { return sin(x); }
+static double cosReference(double x) { return cos(x); }
+static double tanReference(double x) { return tan(x); }
+static double expReference(double x) { return exp(x); }
+static double logReference(double x) { return log(x); }
+static double log2Reference(double x) { return log2(x); }
+static double log10Reference(double x) { return log10(x); }
+
+static void testTrigonometric()
+{
+	vector<double> x = linear(-1e5, 1e5, 200001);
+	vector<double> small = linear(-10.0, 10.0, 20001);
+	x.insert(x.end(), small.begin(), small.end());
+
+	// Beyond TRIG_LIMIT the exact functions are used, so the error is 0.
+	vector<double> large = {1e5 + 0.5, -1e5 - 0.5, 1e6, 1e15, -1e15, 1e300, -1e300};
+	vector<double> mixed = x;
+	mixed.insert(mixed.begin() + 1000, large.begin(), large.end());
+
+	sweep("sin", sinReference, mixed, TRIG_ABSOLUTE, false);
+	sweep("cos", cosReference, mixed, TRIG_ABSOLUTE, false);
+	sweep("sin", sinReference, large, 0.0, false);
+	sweep("cos", cosReference, large, 0.0, false);
+
+	// Away from the poles, where tan is well conditioned.
+	vector<double> tan_x;
+	for(double value : mixed)
+	{
+		if(fabs(cos(value)) > 1e-2)
+		{
+			tan_x.push_back(value);
+		}
+	}
+	sweep("tan", tanReference, tan_x, TAN_RELATIVE, true);
+}
+
+static void testTanPoles()
+{
+	const FastMath::Function& tan_fast = *FastMath::function("tan");
+
+	for(double pole : {1.5707963, 1.5707963267948966, -1.5707963267948966, 4.71238898038469, 1e5 * 3.141592653589793 + 1.5707963267948966})
+	{
+		CHECK_THROWS(tan_fast.scalar(pole), FormulaException);
+
+		vector<double> x = linear(-1.0, 1.0, 300);
+		x[200] = pole;
+		vector<double> out(x.size());
+		CHECK_THROWS(tan_fast.vector(x.data(), out.data(), x.size()), FormulaException);
+		CHECK_THROWS(tan_fast.vector(x.data(), x.data(), x.size()), FormulaException);
+	}
+
+	// Close to a pole but outside the error margin: the array form matches
+	// the scalar one, also in place.
+	vector<double> near = linear(1.5707, 1.57079, 300);
+	vector<double> out(near.size());
+	tan_fast.vector(near.data(), out.data(), near.size());
+	vector<double> in_place = near;
+	tan_fast.vector(in_place.data(), in_place.data(), in_place.size());
+	for(size_t i = 0; i < near.size(); i++)
+	{
+		double expected = tan_fast.scalar(near[i]);
+		CHECK_NEAR(out[i], expected, fabs(expected) * 1e-15);
+		CHECK_NEAR(in_place[i], expected, fabs(expected) * 1e-15);
+	}
+}
+
+static void testExponent()
+{
+	sweep("exp", expReference, linear(-708.0, 709.7, 200001), EXP_RELATIVE, true);
+
+	const FastMath::Function& exp_fast = *FastMath::function("exp");
+	CHECK(exp_fast.scalar(-709.0) == 0.0);
+	CHECK(exp_fast.scalar(-1e300) == 0.0);
+	CHECK(std::isinf(exp_fast.scalar(710.0)));
+}
+
+static void testLogarithms()
+{
+	vector<double> x = logarithmic(1e-310, 1e308, 200001);
+	vector<double> unit = linear(0.5, 2.0, 20001);
+	x.insert(x.end(), unit.begin(), unit.end());
+
+	sweep("log", logReference, x, LOG_RELATIVE, true);
+	sweep("log2", log2Reference, x, LOG_RELATIVE, true);
+	sweep("log10", log10Reference, x, LOG_RELATIVE, true);
+
+	for(const char* name : {"log", "log2", "log10"})
+	{
+		const FastMath::Function& fast = *FastMath::function(name);
+		CHECK_THROWS(fast.scalar(0.0), FormulaException);
+		CHECK_THROWS(fast.scalar(-1.0), FormulaException);
+
+		vector<double> domain = {1.0, 2.0, -1.0, 3.0};
+		CHECK_THROWS(fast.vector(domain.data(), domain.data(), domain.size()), FormulaException);
+	}
+}
+
+// A batch calls the kernels in place on its block buffers, so it must give
+// what eval gives, also where the scalar fallback is taken.
+static void testBatchMatchesEval()
+{
+	vector<double> x = {1.0, -3.5, 1e5 + 0.5, 1e15, 1e300, 2.0};
+	for(const char* expression : {"sin(x*1)", "cos(x*1)", "tan(x*1)"})
+	{
+		Formula f(expression);
+		f.setPrecision(Formula::Fast);
+
+		vector<double> batch = f.evalBatch({x});
+		for(size_t i = 0; i < x.size(); i++)
+		{
+			double expected = f.eval(x[i]);
+			CHECK_NEAR(batch[i], expected, fabs(expected) * 1e-15);
+		}
+	}
+
+	Formula f("tan(x*1)");
+	f.setPrecision(Formula::Fast);
+	CHECK_THROWS(f.eval(1.5707963), FormulaException);
+	CHECK_THROWS(f.evalBatch({{0.5, 1.5707963, 1.0}}), FormulaException);
+}
+
+int main()
+{
+	testTrigonometric();
+	testTanPoles();
+	testExponent();
+	testLogarithms();
+	testBatchMatchesEval();
+	return check::result();
+}
@@ -0,0 +1,123 @@
+#include "check.hpp"
+#include "formula.hpp"
+#include "formula_exeption.hpp"
+#include "formula_graph.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A formula using itself, directly or through others, is refused and leaves
+// the graph as it was.
+static void testCyclesThrow()
+{
+	FormulaGraph graph;
+	CHECK_THROWS(graph.define("a", Formula("a + 1")), FormulaException);
+
+	graph.define("a", Formula("b + 1"));
+	graph.define("b", Formula("c * 2"));
+	graph.set("c", 3.0);
+	CHECK_THROWS(graph.define("c", Formula("a - 1")), FormulaException);
+	CHECK_THROWS(graph.define("b", Formula("a * 2")), FormulaException);
+
+	CHECK_NEAR(graph.value("a"), 7.0, 1e-12);
+	graph.set("c", 4.0);
+	CHECK_NEAR(graph.value("a"), 9.0, 1e-12);
+}
+
+static unsigned s_calls = 0;
+
+static double counted(double x)
+{
+	s_calls++;
+	return x;
+}
+
+// top uses base through both branches of a diamond; base is computed once
+// for each change of its input.
+static void testDiamondComputedOnce()
+{
+	Formula base("counted(x) * 3");
+	base.define("counted", counted);
+
+	FormulaGraph graph(1);
+	graph.define("base", base);
+	graph.define("left", Formula("base * 2"));
+	graph.define("right", Formula("base + 1"));
+	graph.define("top", Formula("left + right"));
+
+	graph.set("x", 2.0);
+	CHECK_NEAR(graph.value("top"), 12.0 + 7.0, 1e-12);
+	CHECK(s_calls == 1);
+	CHECK(graph.evaluated() == 4);
+
+	graph.resetCounters();
+	CHECK_NEAR(graph.value("top"), 19.0, 1e-12);
+	CHECK(graph.evaluated() == 0);
+
+	graph.set("x", 1.0);
+	graph.evaluate();
+	CHECK_NEAR(graph.value("top"), 6.0 + 4.0, 1e-12);
+	CHECK(s_calls == 2);
+	CHECK(graph.evaluated() == 4);
+}
+
+// Layers of formulas each using two of the layer before, enough of them to
+// be recomputed on several threads, give the bits of a serial update.
+static void testParallelMatchesSerial()
+{
+	const int layers = 40;
+	const int width = 10;
+	FormulaGraph parallel(4);
+	FormulaGraph serial(1);
+	for(int l = 0; l < layers; l++)
+	{
+		for(int k = 0; k < width; k++)
+		{
+			string name = "n" + to_string(l) + "x" + to_string(k);
+			Formula f(l == 0 ? "sin(in" + to_string(k) + ") + 2" :
+				"(n" + to_string(l - 1) + "x" + to_string(k) + " + n" + to_string(l - 1) + "x" + to_string((k + 1) % width) + ")/2 + cos(n"
+				+ to_string(l - 1) + "x" + to_string((k + 3) % width) + ")/10");
+			parallel.define(name, f);
+			serial.define(name, f);
+		}
+	}
+
+	vector<string> order = serial.order();
+	CHECK(order.size() == (size_t)(layers * width));
+	for(int round = 0; round < 3; round++)
+	{
+		for(int k = 0; k < width; k++)
+		{
+			double input = 0.37 * (k + 1) + round;
+			parallel.set("in" + to_string(k), input);
+			serial.set("in" + to_string(k), input);
+		}
+
+		parallel.resetCounters();
+		parallel.evaluate();
+		CHECK(parallel.evaluated() == (unsigned long long)(layers * width));
+
+		int mismatches = 0;
+		for(const string& name : order)
+		{
+			double x = parallel.value(name);
+			double y = serial.value(name);
+			if(memcmp(&x, &y, sizeof(double)) != 0)
+			{
+				mismatches++;
+			}
+		}
+		CHECK(mismatches == 0);
+	}
+}
+
+int main()
+{
+	testCyclesThrow();
+	testDiamondComputedOnce();
+	testParallelMatchesSerial();
+	return check::result();
+}
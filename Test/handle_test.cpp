@@ -0,0 +1,131 @@
+#include "check.hpp"
+#include "formula.hpp"
+#include "formula_exeption.hpp"
+#include "formula_handle.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Every formula published is "x*k + k" for an integer k >= 1, so a result at
+// x gives k back, and the rows of one evalBatch must all give the same k.
+static bool published(double value, double x, double& k)
+{
+	k = value / (x + 1.0);
+	return k >= 1.0 && k == floor(k);
+}
+
+// Writers assign and update while readers evaluate; readers only ever see
+// whole formulas, versions never go back, and each publication counts once;
+// an expression that does not compile publishes nothing.
+static void testConcurrentAssignAndEval()
+{
+	const int n_writes = 20000;
+	FormulaHandle handle(Formula("x*1 + 1"));
+	unsigned long long start = handle.version();
+
+	atomic<bool> writing(true);
+	atomic<int> torn(0);
+	atomic<int> backwards(0);
+	atomic<long long> reads(0);
+	atomic<int> rejected(0);
+
+	vector<thread> readers;
+	for(int r = 0; r < 4; r++)
+	{
+		readers.emplace_back([&, r]()
+		{
+			vector<double> x(300);
+			for(size_t i = 0; i < x.size(); i++)
+			{
+				x[i] = 0.5 * i + r;
+			}
+			vector<double> y(x.size());
+			unsigned long long seen = 0;
+			while(writing)
+			{
+				unsigned long long version = handle.version();
+				if(version < seen)
+				{
+					backwards++;
+				}
+				seen = version;
+
+				double k;
+				if(!published(handle.eval(x[1]), x[1], k))
+				{
+					torn++;
+				}
+
+				handle.evalBatch({x.data()}, x.size(), y.data());
+				double first;
+				if(!published(y[0], x[0], first))
+				{
+					torn++;
+				}
+				for(size_t i = 1; i < x.size(); i++)
+				{
+					if(!published(y[i], x[i], k) || k != first)
+					{
+						torn++;
+						break;
+					}
+				}
+				reads++;
+			}
+		});
+	}
+
+	thread assigner([&]()
+	{
+		for(int i = 0; i < n_writes; i++)
+		{
+			handle.assign("x*" + to_string(i % 50 + 1) + " + " + to_string(i % 50 + 1));
+			if(i % 100 == 0)
+			{
+				try
+				{
+					handle.assign("x*(");
+				}
+				catch(const FormulaException&)
+				{
+					rejected++;
+				}
+			}
+		}
+	});
+	thread updater([&]()
+	{
+		for(int i = 0; i < n_writes; i++)
+		{
+			handle.update([i](Formula& f)
+			{
+				f = "x*" + to_string(i % 70 + 1) + " + " + to_string(i % 70 + 1);
+			});
+		}
+	});
+
+	assigner.join();
+	updater.join();
+	writing = false;
+	for(thread& reader : readers)
+	{
+		reader.join();
+	}
+
+	CHECK(torn == 0);
+	CHECK(backwards == 0);
+	CHECK(reads > 0);
+	CHECK(rejected == n_writes / 100);
+	CHECK(handle.version() == start + 2 * n_writes);
+}
+
+int main()
+{
+	testConcurrentAssignAndEval();
+	return check::result();
+}
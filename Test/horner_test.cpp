@@ -0,0 +1,131 @@
+#include "check.hpp"
+#include "formula.hpp"
+#include "formula_stats.hpp"
+
+#include <cmath>
+#include <limits>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const double EPSILON = numeric_limits<double>::epsilon();
+
+// c * x^i * y^j
+struct Term
+{
+	double c;
+	unsigned i;
+	unsigned j;
+};
+
+static string expression(const vector<Term>& terms)
+{
+	ostringstream out;
+	out.precision(17);
+	for(size_t k = 0; k < terms.size(); k++)
+	{
+		const Term& term = terms[k];
+		out << (k == 0 ? "" : " + ") << "(" << term.c << ")";
+		if(term.i > 0)
+		{
+			out << "*x" << (term.i > 1 ? "^" + to_string(term.i) : "");
+		}
+		if(term.j > 0)
+		{
+			out << "*y" << (term.j > 1 ? "^" + to_string(term.j) : "");
+		}
+	}
+	return out.str();
+}
+
+// Both forms round at most a few times per degree and per term, each by a
+// relative EPSILON of a partial sum bounded by the sum of the terms'
+// magnitudes, so that sum scales the error bound.
+static void checkPolynomial(const vector<Term>& terms, unsigned degree, mt19937& random)
+{
+	string source = expression(terms);
+	Formula original(source);
+	original.setEngine(Formula::StackMachine);
+	Formula horner(source);
+
+	// The rewrite is done: the register form runs fewer operations than
+	// the postfix code has operators.
+	FormulaStats stats = horner.stats();
+	CHECK(stats.fused_dispatches < stats.register_dispatches);
+
+	const double bound = 4.0 * (degree + terms.size()) * EPSILON;
+	uniform_real_distribution<double> point(-2.0, 2.0);
+	vector<double> xs(64), ys(64);
+	for(size_t k = 0; k < xs.size(); k++)
+	{
+		xs[k] = point(random);
+		ys[k] = point(random);
+	}
+	vector<double> batch = horner.evalBatch({xs, ys});
+
+	for(size_t k = 0; k < xs.size(); k++)
+	{
+		long double exact = 0.0L;
+		long double magnitude = 0.0L;
+		for(const Term& term : terms)
+		{
+			long double value = term.c * powl(xs[k], term.i) * powl(ys[k], term.j);
+			exact += value;
+			magnitude += fabsl(value);
+		}
+
+		// Results within 1e-6 of 0 are rounded to 0 by eval.
+		if(fabsl(exact) < 1e-5L)
+		{
+			continue;
+		}
+
+		double scale = (double)magnitude;
+		CHECK_NEAR(original.eval(xs[k], ys[k]), (double)exact, bound * scale);
+		CHECK_NEAR(horner.eval(xs[k], ys[k]), (double)exact, bound * scale);
+		CHECK_NEAR(batch[k], (double)exact, bound * scale);
+	}
+}
+
+int main()
+{
+	mt19937 random(20260419);
+	uniform_real_distribution<double> coefficient(-10.0, 10.0);
+	uniform_int_distribution<unsigned> degrees(2, 9);
+
+	// Dense polynomials in x, one term per power.
+	for(int n = 0; n < 200; n++)
+	{
+		unsigned degree = degrees(random);
+		vector<Term> terms;
+		for(unsigned i = 0; i <= degree; i++)
+		{
+			terms.push_back(Term{coefficient(random), i, 0});
+		}
+		checkPolynomial(terms, degree, random);
+	}
+
+	// Sparse polynomials in x and y.
+	uniform_int_distribution<unsigned> powers(0, 4);
+	for(int n = 0; n < 200; n++)
+	{
+		vector<Term> terms;
+		unsigned degree = 0;
+		for(int k = 0; k < 6; k++)
+		{
+			Term term{coefficient(random), powers(random), powers(random)};
+			degree = max(degree, term.i + term.j);
+			terms.push_back(term);
+		}
+		if(degree < 2)
+		{
+			continue;
+		}
+		checkPolynomial(terms, degree, random);
+	}
+
+	return check::result();
+}
@@ -0,0 +1,92 @@
+#include "check.hpp"
+#include "formula.hpp"
+#include "formula_exeption.hpp"
+#include "formula_interval.hpp"
+
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+// Every value eval gives at a point of a box lies in the bounds evalInterval
+// gives for it. Boxes range from wide to a few ulps, where the outward
+// rounding of the bounds is all that covers the errors of eval; points are
+// drawn inside them and at their corners.
+static void testBoundsHoldEvalValues(Formula::Precision precision)
+{
+	const char* expressions[] =
+	{
+		"x^2 + y^3",
+		"x^4 - y^2",
+		"x^(0 - 2) + y^(0 - 3)",
+		"(x - y)^(0 - 4)",
+		"x^5 + y^0.5",
+		"sin(x) + cos(y)",
+		"tan(x) - y",
+		"exp(x) * exp(y)",
+		"log(x) + log2(y)",
+		"log10(x * y) - ln(y)",
+		"sqrt(x) / y + x^y",
+		"sin(x*y)^2 + exp(x - y)^3"
+	};
+
+	mt19937 generator(2024);
+	uniform_real_distribution<double> unit(0.0, 1.0);
+	uniform_real_distribution<double> center(-40.0, 40.0);
+	uniform_int_distribution<int> scale(-15, 1);
+
+	size_t checked = 0;
+	for(const char* expression : expressions)
+	{
+		Formula f(expression);
+		f.setPrecision(precision);
+		int misses = 0;
+		for(int box = 0; box < 300; box++)
+		{
+			vector<FormulaInterval> intervals;
+			for(int k = 0; k < 2; k++)
+			{
+				double c = center(generator);
+				double half = fabs(c) * pow(10.0, scale(generator)) * unit(generator);
+				intervals.push_back(FormulaInterval(c - half, c + half));
+			}
+			FormulaInterval bounds = f.evalInterval(intervals);
+
+			for(int i = 0; i < 1250; i++)
+			{
+				double x = i < 4 ? (i & 1 ? intervals[0].upper : intervals[0].lower) :
+					intervals[0].lower + unit(generator) * (intervals[0].upper - intervals[0].lower);
+				double y = i < 4 ? (i & 2 ? intervals[1].upper : intervals[1].lower) :
+					intervals[1].lower + unit(generator) * (intervals[1].upper - intervals[1].lower);
+				double value;
+				try
+				{
+					value = f.eval(x, y);
+				}
+				catch(const FormulaException&)
+				{
+					continue;
+				}
+				checked++;
+				if(value == value && !bounds.contains(value))
+				{
+					if(misses++ == 0)
+					{
+						printf("%s at (%.17g, %.17g) = %.17g outside [%.17g, %.17g]\n", expression, x, y, value, bounds.lower, bounds.upper);
+					}
+				}
+			}
+		}
+		CHECK(misses == 0);
+	}
+	CHECK(checked > 1000000);
+}
+
+int main()
+{
+	testBoundsHoldEvalValues(Formula::Exact);
+	testBoundsHoldEvalValues(Formula::Fast);
+	return check::result();
+}
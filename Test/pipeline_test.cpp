@@ -0,0 +1,190 @@
+#include "check.hpp"
+#include "formula.hpp"
+#include "formula_exeption.hpp"
+#include "formula_pipeline.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <future>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// Throws a std::runtime_error, not a FormulaException, for negative x.
+// The first row sleeps, so the rows pushed meanwhile queue up and are taken
+// in batches.
+static double checked(double x)
+{
+	if(x == 0.0)
+	{
+		this_thread::sleep_for(chrono::milliseconds(50));
+	}
+	if(x < 0.0)
+	{
+		throw runtime_error("negative argument");
+	}
+	return x + 1.0;
+}
+
+static void testForeignExceptions()
+{
+	Formula f("checked(x) * 2");
+	f.define("checked", checked);
+
+	const size_t n = 1000;
+	vector<future<double> > results;
+	{
+		FormulaPipeline pipeline(f, 1);
+		for(size_t i = 0; i < n; i++)
+		{
+			double x = (i % 7 == 3) ? -1.0 : (double)i;
+			results.push_back(pipeline.push(vector<double>{x}));
+		}
+		pipeline.drain();
+
+		FormulaPipeline::Stats stats = pipeline.stats();
+		CHECK(stats.rows == n);
+		CHECK(stats.failed == (n + 3) / 7);
+		CHECK(stats.batches < n);
+	}
+
+	for(size_t i = 0; i < n; i++)
+	{
+		if(i % 7 == 3)
+		{
+			CHECK_THROWS(results[i].get(), runtime_error);
+		}
+		else
+		{
+			CHECK_NEAR(results[i].get(), 2.0 * (i + 1.0), 1e-12);
+		}
+	}
+}
+
+static void testFormulaExceptions()
+{
+	Formula f("1 / x");
+
+	vector<future<double> > results;
+	{
+		FormulaPipeline pipeline(f, 2);
+		for(int i = -50; i <= 50; i++)
+		{
+			results.push_back(pipeline.push(vector<double>{(double)i}));
+		}
+		pipeline.drain();
+		CHECK(pipeline.stats().failed == 1);
+	}
+
+	for(int i = -50; i <= 50; i++)
+	{
+		if(i == 0)
+		{
+			CHECK_THROWS(results[i + 50].get(), FormulaException);
+		}
+		else
+		{
+			CHECK_NEAR(results[i + 50].get(), 1.0 / i, 1e-15);
+		}
+	}
+}
+
+// Rows give the bits evalBatch gives, alone, in a batch or in a batch run
+// again row by row because one of its rows failed.
+static void testResultsMatchEvalBatch()
+{
+	Formula f("(x^3 - 2*x)/(y - 1) + exp(x)^0.5 - sin(y)^2");
+	f.setPrecision(Formula::Fast);
+
+	mt19937 generator(11);
+	uniform_real_distribution<double> values(-3.0, 3.0);
+	const size_t n = 5000;
+	vector<double> xs, ys;
+	vector<future<double> > results;
+	{
+		FormulaPipeline pipeline(f, 2, 4096, 64);
+		for(size_t i = 0; i < n; i++)
+		{
+			xs.push_back(values(generator));
+			ys.push_back(i % 97 == 5 ? 1.0 : values(generator));
+			results.push_back(pipeline.push(vector<double>{xs[i], ys[i]}));
+			if(i % 500 == 0)
+			{
+				pipeline.drain();
+			}
+		}
+	}
+
+	vector<double> xs_valid, ys_valid;
+	for(size_t i = 0; i < n; i++)
+	{
+		if(ys[i] != 1.0)
+		{
+			xs_valid.push_back(xs[i]);
+			ys_valid.push_back(ys[i]);
+		}
+	}
+	vector<double> expected(xs_valid.size());
+	f.evalBatch(vector<const double*>{xs_valid.data(), ys_valid.data()}, expected.size(), expected.data());
+
+	size_t mismatches = 0;
+	for(size_t i = 0, j = 0; i < n; i++)
+	{
+		if(ys[i] == 1.0)
+		{
+			CHECK_THROWS(results[i].get(), FormulaException);
+			continue;
+		}
+		double value = results[i].get();
+		if(memcmp(&value, &expected[j++], sizeof(double)) != 0)
+		{
+			mismatches++;
+		}
+	}
+	CHECK(mismatches == 0);
+}
+
+static atomic<unsigned> s_calls(0);
+
+static double counted(double x)
+{
+	if(s_calls++ == 0)
+	{
+		this_thread::sleep_for(chrono::milliseconds(50));
+	}
+	return x;
+}
+
+// A failing row does not make the pipeline call user functions again for
+// the other rows of its batch.
+static void testUserFunctionsCalledOnce()
+{
+	Formula f("1 / counted(x)");
+	f.define("counted", counted);
+
+	const size_t n = 1000;
+	{
+		FormulaPipeline pipeline(f, 1);
+		for(size_t i = 0; i < n; i++)
+		{
+			pipeline.push(vector<double>{i % 10 == 3 ? 0.0 : 1.0 + i}, [](double, exception_ptr) {});
+		}
+		pipeline.drain();
+		CHECK(pipeline.stats().failed == n / 10);
+		CHECK(pipeline.stats().batches < n);
+	}
+	CHECK(s_calls == n);
+}
+
+int main()
+{
+	testForeignExceptions();
+	testFormulaExceptions();
+	testResultsMatchEvalBatch();
+	testUserFunctionsCalledOnce();
+	return check::result();
+}
@@ -0,0 +1,1255 @@
+// formula_eval: evaluates formulas over every row of a CSV or raw binary
+// column file and streams the results out as CSV or binary.
+//
+// One thread reads the input in blocks of whole rows, a pool of workers
+// parses, evaluates and formats the blocks, and the main thread writes the
+// results back in input order. At most a few blocks per worker are in flight,
+// so memory stays bounded however large the input is.
+
+#include <formula.hpp>
+#include <formula_exeption.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define FORMULA_EVAL_MMAP
+#endif
+
+using namespace std;
+
+static const char* s_usage =
+	"Usage: formula_eval [options] -e EXPRESSION [-e EXPRESSION ...] INPUT\n"
+	"\n"
+	"Evaluates every expression for each row of INPUT, binding variables to the\n"
+	"input columns of the same name. INPUT \"-\" reads the standard input.\n"
+	"\n"
+	"  -e, --expr [NAME=]EXPRESSION  expression to evaluate, may be repeated;\n"
+	"                                NAME is its output column name\n"
+	"  -d, --define NAME=VALUE       pre-define a variable in every expression\n"
+	"  -f, --format csv|binary       input format (default: binary for .bin and\n"
+	"                                .f64 files, csv otherwise)\n"
+	"  -c, --columns A,B,...         column names of a binary input\n"
+	"  -l, --layout columns|rows     binary input stores one column after the\n"
+	"                                other (default) or interleaved records\n"
+	"  -o, --output FILE             output file (default: standard output)\n"
+	"      --output-format csv|binary\n"
+	"                                binary writes interleaved little-endian\n"
+	"                                doubles, one per expression and row\n"
+	"      --delimiter CHAR          CSV field delimiter (default: ',')\n"
+	"      --chunk BYTES             input bytes per block (default: 1048576)\n"
+	"  -t, --threads N               evaluation threads (default: all cores)\n"
+	"      --on-error nan|fail       rows that fail to evaluate become NaN\n"
+	"                                (default) or stop the run\n"
+	"  -v, --verbose                 report throughput on standard error\n"
+	"  -h, --help                    show this help\n"
+	"\n"
+	"Binary input and output are little-endian IEEE 754 doubles.\n";
+
+struct Options
+{
+	vector<string> names;
+	vector<string> expressions;
+	vector<pair<string, double> > definitions;
+	string input;
+	string output;
+	string format;
+	string output_format = "csv";
+	vector<string> columns;
+	bool rows_layout = false;
+	char delimiter = ',';
+	size_t chunk = 1 << 20;
+	unsigned threads = 0;
+	bool fail_on_error = false;
+	bool verbose = false;
+};
+
+static bool littleEndian()
+{
+	const uint16_t one = 1;
+	unsigned char first;
+	memcpy(&first, &one, 1);
+	return first == 1;
+}
+
+static double decode(const char* p, bool swap)
+{
+	char bytes[8];
+	memcpy(bytes, p, 8);
+	if(swap)
+	{
+		reverse(bytes, bytes + 8);
+	}
+
+	double value;
+	memcpy(&value, bytes, 8);
+	return value;
+}
+
+static void encode(double value, char* p, bool swap)
+{
+	memcpy(p, &value, 8);
+	if(swap)
+	{
+		reverse(p, p + 8);
+	}
+}
+
+static vector<string> split(const string& str, char delimiter)
+{
+	vector<string> fields;
+	size_t begin = 0;
+	while(true)
+	{
+		size_t end = str.find(delimiter, begin);
+		fields.push_back(str.substr(begin, end - begin));
+		if(end == string::npos)
+		{
+			return fields;
+		}
+		begin = end + 1;
+	}
+}
+
+// Strips blanks, a carriage return and surrounding quotes from a CSV field.
+static void trim(const char*& begin, const char*& end)
+{
+	while(begin < end && (*begin == ' ' || *begin == '\t'))
+	{
+		begin++;
+	}
+	while(end > begin && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+	{
+		end--;
+	}
+	if(end - begin >= 2 && *begin == '"' && end[-1] == '"')
+	{
+		begin++;
+		end--;
+	}
+}
+
+static bool parseNumber(const char* begin, const char* end, double& value)
+{
+	trim(begin, end);
+	if(begin == end)
+	{
+		value = numeric_limits<double>::quiet_NaN();
+		return true;
+	}
+
+	if(*begin == '+')
+	{
+		begin++;
+	}
+	from_chars_result result = from_chars(begin, end, value);
+	return result.ec == errc() && result.ptr == end;
+}
+
+static size_t parseSize(const string& option, const string& value)
+{
+	size_t n = 0;
+	from_chars_result result = from_chars(value.data(), value.data() + value.size(), n);
+	if(result.ec != errc() || result.ptr != value.data() + value.size() || n == 0)
+	{
+		throw runtime_error("invalid value for " + option + ": " + value);
+	}
+	return n;
+}
+
+static Options parseOptions(int argc, char** argv)
+{
+	Options options;
+	for(int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		string value;
+		bool has_value = false;
+		if(arg.compare(0, 2, "--") == 0 && arg.find('=') != string::npos)
+		{
+			value = arg.substr(arg.find('=') + 1);
+			arg = arg.substr(0, arg.find('='));
+			has_value = true;
+		}
+
+		auto next = [&]() -> string
+		{
+			if(has_value)
+			{
+				return value;
+			}
+			if(i + 1 >= argc)
+			{
+				throw runtime_error("missing value for " + arg);
+			}
+			return argv[++i];
+		};
+
+		if(arg == "-h" || arg == "--help")
+		{
+			fputs(s_usage, stdout);
+			exit(0);
+		}
+		else if(arg == "-e" || arg == "--expr")
+		{
+			// '=' is not a formula character, so it can only separate a name.
+			string expression = next();
+			size_t equal = expression.find('=');
+			options.names.push_back(equal == string::npos ? expression : expression.substr(0, equal));
+			options.expressions.push_back(equal == string::npos ? expression : expression.substr(equal + 1));
+		}
+		else if(arg == "-d" || arg == "--define")
+		{
+			string definition = next();
+			size_t equal = definition.find('=');
+			double number = 0.0;
+			if(equal == string::npos || !parseNumber(definition.data() + equal + 1, definition.data() + definition.size(), number))
+			{
+				throw runtime_error("invalid definition: " + definition);
+			}
+			options.definitions.emplace_back(definition.substr(0, equal), number);
+		}
+		else if(arg == "-f" || arg == "--format")
+		{
+			options.format = next();
+		}
+		else if(arg == "-c" || arg == "--columns")
+		{
+			options.columns = split(next(), ',');
+		}
+		else if(arg == "-l" || arg == "--layout")
+		{
+			string layout = next();
+			if(layout != "rows" && layout != "columns")
+			{
+				throw runtime_error("unknown layout: " + layout);
+			}
+			options.rows_layout = (layout == "rows");
+		}
+		else if(arg == "-o" || arg == "--output")
+		{
+			options.output = next();
+		}
+		else if(arg == "--output-format")
+		{
+			options.output_format = next();
+		}
+		else if(arg == "--delimiter")
+		{
+			string delimiter = next();
+			if(delimiter.size() != 1)
+			{
+				throw runtime_error("delimiter must be a single character");
+			}
+			options.delimiter = delimiter[0];
+		}
+		else if(arg == "--chunk")
+		{
+			options.chunk = parseSize(arg, next());
+		}
+		else if(arg == "-t" || arg == "--threads")
+		{
+			options.threads = parseSize(arg, next());
+		}
+		else if(arg == "--on-error")
+		{
+			string mode = next();
+			if(mode != "nan" && mode != "fail")
+			{
+				throw runtime_error("unknown error mode: " + mode);
+			}
+			options.fail_on_error = (mode == "fail");
+		}
+		else if(arg == "-v" || arg == "--verbose")
+		{
+			options.verbose = true;
+		}
+		else if(arg.size() > 1 && arg[0] == '-')
+		{
+			throw runtime_error("unknown option: " + arg);
+		}
+		else if(options.input.empty())
+		{
+			options.input = arg;
+		}
+		else
+		{
+			throw runtime_error("more than one input file");
+		}
+	}
+
+	if(options.input.empty() || options.expressions.empty())
+	{
+		throw runtime_error("an input file and at least one expression are required");
+	}
+
+	if(options.format.empty())
+	{
+		size_t dot = options.input.rfind('.');
+		string extension = dot == string::npos ? "" : options.input.substr(dot);
+		options.format = (extension == ".bin" || extension == ".f64") ? "binary" : "csv";
+	}
+	if(options.format != "csv" && options.format != "binary")
+	{
+		throw runtime_error("unknown input format: " + options.format);
+	}
+	if(options.output_format != "csv" && options.output_format != "binary")
+	{
+		throw runtime_error("unknown output format: " + options.output_format);
+	}
+	if(options.format == "binary" && options.columns.empty())
+	{
+		throw runtime_error("binary input needs its column names, see --columns");
+	}
+	if(options.threads == 0)
+	{
+		options.threads = max(1u, thread::hardware_concurrency());
+	}
+	return options;
+}
+
+// Input file mapped in memory when possible, read through stdio otherwise.
+class InputFile
+{
+public:
+	explicit InputFile(const string& path):
+	m_file(nullptr),
+	m_data(nullptr),
+	m_size(0),
+	m_known_size(false)
+	{
+		if(path == "-")
+		{
+			m_file = stdin;
+			return;
+		}
+
+#ifdef FORMULA_EVAL_MMAP
+		int fd = open(path.c_str(), O_RDONLY);
+		struct stat info;
+		if(fd >= 0 && fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0)
+		{
+			void* data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if(data != MAP_FAILED)
+			{
+				madvise(data, info.st_size, MADV_SEQUENTIAL);
+				m_data = (const char*)data;
+				m_size = info.st_size;
+				m_known_size = true;
+			}
+		}
+		if(fd >= 0)
+		{
+			close(fd);
+		}
+		if(m_data)
+		{
+			return;
+		}
+#endif
+
+		m_file = fopen(path.c_str(), "rb");
+		if(!m_file)
+		{
+			throw runtime_error("cannot open " + path);
+		}
+		if(fseek(m_file, 0, SEEK_END) == 0)
+		{
+			long size = ftell(m_file);
+			if(size >= 0)
+			{
+				m_size = size;
+				m_known_size = true;
+			}
+			fseek(m_file, 0, SEEK_SET);
+		}
+	}
+
+	~InputFile()
+	{
+#ifdef FORMULA_EVAL_MMAP
+		if(m_data)
+		{
+			munmap((void*)m_data, m_size);
+		}
+#endif
+		if(m_file && m_file != stdin)
+		{
+			fclose(m_file);
+		}
+	}
+
+	InputFile(const InputFile&) = delete;
+	InputFile& operator =(const InputFile&) = delete;
+
+	// The whole file, or nullptr when it is not mapped.
+	const char* data()const
+	{
+		return m_data;
+	}
+
+	size_t size()const
+	{
+		return m_size;
+	}
+
+	bool knownSize()const
+	{
+		return m_known_size;
+	}
+
+	size_t read(char* buffer, size_t n)
+	{
+		size_t total = 0;
+		while(total < n)
+		{
+			size_t got = fread(buffer + total, 1, n - total, m_file);
+			if(got == 0)
+			{
+				if(ferror(m_file))
+				{
+					throw runtime_error("read error");
+				}
+				break;
+			}
+			total += got;
+		}
+		return total;
+	}
+
+	void readAt(size_t offset, char* buffer, size_t n)
+	{
+		if(fseek(m_file, offset, SEEK_SET) != 0 || read(buffer, n) != n)
+		{
+			throw runtime_error("read error");
+		}
+	}
+
+private:
+	FILE* m_file;
+	const char* m_data;
+	size_t m_size;
+	bool m_known_size;
+};
+
+template<typename T>
+class Queue
+{
+public:
+	void push(T item)
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_items.push_back(std::move(item));
+		m_ready.notify_one();
+	}
+
+	// Waits for an item; false once the queue is closed and drained.
+	bool pop(T& item)
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_ready.wait(lock, [&]() { return !m_items.empty() || m_closed; });
+		if(m_items.empty())
+		{
+			return false;
+		}
+		item = std::move(m_items.front());
+		m_items.pop_front();
+		return true;
+	}
+
+	void close()
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_closed = true;
+		m_ready.notify_all();
+	}
+
+private:
+	mutex m_mutex;
+	condition_variable m_ready;
+	deque<T> m_items;
+	bool m_closed = false;
+};
+
+// Limits the blocks between the reader and the writer, so a fast reader
+// waits for a slow writer instead of filling the memory.
+class Window
+{
+public:
+	explicit Window(size_t size):
+	m_free(size) {}
+
+	bool acquire()
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_changed.wait(lock, [&]() { return m_free > 0 || m_cancelled; });
+		if(m_cancelled)
+		{
+			return false;
+		}
+		m_free--;
+		return true;
+	}
+
+	void release()
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_free++;
+		m_changed.notify_one();
+	}
+
+	void cancel()
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_cancelled = true;
+		m_changed.notify_all();
+	}
+
+private:
+	mutex m_mutex;
+	condition_variable m_changed;
+	size_t m_free;
+	bool m_cancelled = false;
+};
+
+struct Block
+{
+	size_t index = 0;
+
+	// CSV: whole lines of text, the first of them being line first_line.
+	const char* text = nullptr;
+	size_t text_size = 0;
+	size_t first_line = 0;
+
+	// Binary: value of column k in row r is at
+	// data + k * column_stride + r * row_stride.
+	const char* data = nullptr;
+	size_t rows = 0;
+	size_t first_row = 0;
+	size_t column_stride = 0;
+	size_t row_stride = 0;
+
+	// Holds the data of the block unless it points into the mapped file.
+	string storage;
+};
+
+struct Output
+{
+	size_t index = 0;
+	string bytes;
+};
+
+class Pipeline
+{
+public:
+	Pipeline(const Options& options, InputFile& input, FILE* output):
+	m_options(options),
+	m_input(input),
+	m_output(output),
+	m_window(4 * options.threads + 2),
+	m_swap(!littleEndian()),
+	m_failed(false),
+	m_rows(0),
+	m_errors(0),
+	m_bytes_in(0),
+	m_bytes_out(0),
+	m_active(0) {}
+
+	void run()
+	{
+		if(m_options.format == "csv")
+		{
+			readCsvHeader();
+		}
+		else
+		{
+			m_columns = m_options.columns;
+		}
+		prepareFormulas();
+		writeHeader();
+
+		m_active = m_options.threads;
+		thread reader(&Pipeline::read, this);
+		vector<thread> workers;
+		for(unsigned i = 0; i < m_options.threads; i++)
+		{
+			workers.emplace_back(&Pipeline::work, this);
+		}
+
+		write();
+
+		reader.join();
+		for(thread& worker : workers)
+		{
+			worker.join();
+		}
+
+		if(m_failed)
+		{
+			throw runtime_error(m_error);
+		}
+	}
+
+	size_t rows()const
+	{
+		return m_rows;
+	}
+
+	size_t errors()const
+	{
+		return m_errors;
+	}
+
+	size_t bytesIn()const
+	{
+		return m_bytes_in;
+	}
+
+	size_t bytesOut()const
+	{
+		return m_bytes_out;
+	}
+
+private:
+	void fail(const string& message)
+	{
+		{
+			lock_guard<mutex> lock(m_error_mutex);
+			if(m_failed)
+			{
+				return;
+			}
+			m_error = message;
+			m_failed = true;
+		}
+		m_window.cancel();
+		m_blocks.close();
+		m_outputs.close();
+	}
+
+	void readCsvHeader()
+	{
+		string line;
+		if(m_input.data())
+		{
+			const char* end = (const char*)memchr(m_input.data(), '\n', m_input.size());
+			size_t length = end ? end - m_input.data() : m_input.size();
+			line.assign(m_input.data(), length);
+			m_offset = end ? length + 1 : length;
+		}
+		else
+		{
+			char ch;
+			while(m_input.read(&ch, 1) == 1 && ch != '\n')
+			{
+				line.push_back(ch);
+			}
+			m_offset = line.size() + 1;
+		}
+
+		for(const string& field : split(line, m_options.delimiter))
+		{
+			const char* begin = field.data();
+			const char* end = field.data() + field.size();
+			trim(begin, end);
+			m_columns.emplace_back(begin, end);
+		}
+		m_bytes_in = m_offset;
+	}
+
+	// Binds each argument of each formula to an input column. Variables that
+	// are no column must be built-in constants and are defined as such, so the
+	// remaining arguments are exactly the columns.
+	void prepareFormulas()
+	{
+		for(size_t i = 0; i < m_options.expressions.size(); i++)
+		{
+			Formula formula(m_options.expressions[i]);
+			for(const pair<string, double>& definition : m_options.definitions)
+			{
+				formula.define(definition.first, definition.second);
+			}
+			formula.check();
+
+			for(const string& name : formula.arguments())
+			{
+				if(find(m_columns.begin(), m_columns.end(), name) == m_columns.end())
+				{
+					formula.define(name, Formula(name).eval());
+				}
+			}
+
+			vector<size_t> slots;
+			for(const string& name : formula.arguments())
+			{
+				size_t column = find(m_columns.begin(), m_columns.end(), name) - m_columns.begin();
+				auto used = find(m_used.begin(), m_used.end(), column);
+				slots.push_back(used - m_used.begin());
+				if(used == m_used.end())
+				{
+					m_used.push_back(column);
+				}
+			}
+
+			m_formulas.push_back(formula);
+			m_slots.push_back(slots);
+		}
+
+		// Slot of each input column, or -1 for columns no formula reads.
+		m_column_slot.assign(m_columns.size(), -1);
+		for(size_t slot = 0; slot < m_used.size(); slot++)
+		{
+			m_column_slot[m_used[slot]] = slot;
+		}
+	}
+
+	void writeHeader()
+	{
+		if(m_options.output_format != "csv")
+		{
+			return;
+		}
+
+		string header;
+		for(size_t i = 0; i < m_options.names.size(); i++)
+		{
+			if(i > 0)
+			{
+				header += m_options.delimiter;
+			}
+			header += m_options.names[i];
+		}
+		header += '\n';
+		writeBytes(header);
+	}
+
+	void writeBytes(const string& bytes)
+	{
+		if(fwrite(bytes.data(), 1, bytes.size(), m_output) != bytes.size())
+		{
+			throw runtime_error("write error");
+		}
+		m_bytes_out += bytes.size();
+	}
+
+	void read()
+	{
+		try
+		{
+			if(m_options.format == "csv")
+			{
+				readCsv();
+			}
+			else
+			{
+				readBinary();
+			}
+		}
+		catch(const exception& e)
+		{
+			fail(e.what());
+		}
+		m_blocks.close();
+	}
+
+	void readCsv()
+	{
+		size_t index = 0;
+		size_t line = 2;
+		string carry;
+		while(true)
+		{
+			if(!m_window.acquire())
+			{
+				return;
+			}
+
+			Block block;
+			block.index = index++;
+			block.first_line = line;
+
+			if(m_input.data())
+			{
+				// Cut the mapped text after the first line break past the chunk.
+				if(m_offset >= m_input.size())
+				{
+					m_window.release();
+					return;
+				}
+				size_t end = min(m_offset + m_options.chunk, m_input.size());
+				const char* newline = (const char*)memchr(m_input.data() + end, '\n', m_input.size() - end);
+				end = newline ? newline - m_input.data() + 1 : m_input.size();
+
+				block.text = m_input.data() + m_offset;
+				block.text_size = end - m_offset;
+				m_offset = end;
+			}
+			else
+			{
+				// Whole lines of what has been read go out, the rest is carried.
+				block.storage.swap(carry);
+				size_t carried = block.storage.size();
+				block.storage.resize(carried + m_options.chunk);
+				size_t got = m_input.read(&block.storage[carried], m_options.chunk);
+				block.storage.resize(carried + got);
+				if(block.storage.empty())
+				{
+					m_window.release();
+					return;
+				}
+
+				if(got == m_options.chunk)
+				{
+					size_t newline = block.storage.rfind('\n');
+					if(newline == string::npos)
+					{
+						carry.swap(block.storage);
+						m_window.release();
+						index--;
+						continue;
+					}
+					carry.assign(block.storage, newline + 1, string::npos);
+					block.storage.resize(newline + 1);
+				}
+				block.text = block.storage.data();
+				block.text_size = block.storage.size();
+			}
+
+			line += count(block.text, block.text + block.text_size, '\n');
+			m_bytes_in += block.text_size;
+			m_blocks.push(std::move(block));
+		}
+	}
+
+	void readBinary()
+	{
+		size_t n_columns = m_columns.size();
+		size_t record = 8 * n_columns;
+		size_t rows_per_block = max<size_t>(1, m_options.chunk / record);
+
+		if(!m_options.rows_layout && !m_input.knownSize())
+		{
+			throw runtime_error("a binary input of unknown size must use the rows layout");
+		}
+
+		size_t total_rows = m_input.knownSize() ? m_input.size() / record : 0;
+		if(m_input.knownSize() && m_input.size() % record != 0)
+		{
+			throw runtime_error("binary input size is not a multiple of " + to_string(n_columns) + " doubles");
+		}
+
+		size_t index = 0;
+		for(size_t row = 0; !m_input.knownSize() || row < total_rows; row += rows_per_block)
+		{
+			if(!m_window.acquire())
+			{
+				return;
+			}
+
+			Block block;
+			block.index = index++;
+			block.first_row = row;
+			block.rows = m_input.knownSize() ? min(rows_per_block, total_rows - row) : rows_per_block;
+
+			if(m_options.rows_layout)
+			{
+				block.column_stride = 8;
+				block.row_stride = record;
+				if(m_input.data())
+				{
+					block.data = m_input.data() + row * record;
+				}
+				else
+				{
+					block.storage.resize(block.rows * record);
+					size_t got = m_input.read(&block.storage[0], block.storage.size());
+					if(got % record != 0)
+					{
+						throw runtime_error("binary input ends within a record");
+					}
+					block.rows = got / record;
+					block.data = block.storage.data();
+				}
+			}
+			else
+			{
+				block.row_stride = 8;
+				if(m_input.data())
+				{
+					block.data = m_input.data() + row * 8;
+					block.column_stride = total_rows * 8;
+				}
+				else
+				{
+					// Columns of the block are read one after the other.
+					block.column_stride = block.rows * 8;
+					block.storage.resize(block.rows * record);
+					for(size_t k = 0; k < n_columns; k++)
+					{
+						m_input.readAt((k * total_rows + row) * 8, &block.storage[k * block.column_stride], block.column_stride);
+					}
+					block.data = block.storage.data();
+				}
+			}
+
+			if(block.rows == 0)
+			{
+				m_window.release();
+				return;
+			}
+
+			m_bytes_in += block.rows * record;
+			m_blocks.push(std::move(block));
+		}
+	}
+
+	void work()
+	{
+		vector<vector<double> > columns(m_used.size());
+		vector<const double*> pointers(m_used.size());
+		vector<size_t> lines;
+
+		Block block;
+		while(m_blocks.pop(block))
+		{
+			try
+			{
+				size_t n_rows = 0;
+				if(m_options.format == "csv")
+				{
+					n_rows = parseCsv(block, columns, lines);
+					for(size_t slot = 0; slot < m_used.size(); slot++)
+					{
+						pointers[slot] = columns[slot].data();
+					}
+				}
+				else
+				{
+					n_rows = block.rows;
+					decodeBinary(block, columns, pointers);
+				}
+
+				Output output;
+				output.index = block.index;
+				output.bytes = evaluate(block, n_rows, pointers, lines);
+				m_outputs.push(std::move(output));
+			}
+			catch(const exception& e)
+			{
+				fail(e.what());
+			}
+		}
+
+		if(--m_active == 0)
+		{
+			m_outputs.close();
+		}
+	}
+
+	size_t parseCsv(const Block& block, vector<vector<double> >& columns, vector<size_t>& lines)
+	{
+		for(vector<double>& column : columns)
+		{
+			column.clear();
+		}
+		lines.clear();
+
+		const char* p = block.text;
+		const char* end = block.text + block.text_size;
+		size_t line = block.first_line;
+		for(; p < end; line++)
+		{
+			const char* eol = (const char*)memchr(p, '\n', end - p);
+			if(!eol)
+			{
+				eol = end;
+			}
+
+			const char* begin = p;
+			const char* last = eol;
+			trim(begin, last);
+			if(begin == last)
+			{
+				p = eol + 1;
+				continue;
+			}
+
+			size_t field = 0;
+			const char* q = p;
+			while(true)
+			{
+				const char* next = (const char*)memchr(q, m_options.delimiter, eol - q);
+				const char* field_end = next ? next : eol;
+				if(field < m_column_slot.size() && m_column_slot[field] >= 0)
+				{
+					double value;
+					if(!parseNumber(q, field_end, value))
+					{
+						throw runtime_error("line " + to_string(line) + ": cannot parse '" + string(q, field_end) +
+							"' in column " + m_columns[field]);
+					}
+					columns[m_column_slot[field]].push_back(value);
+				}
+				field++;
+				if(!next)
+				{
+					break;
+				}
+				q = next + 1;
+			}
+
+			if(field < m_columns.size())
+			{
+				throw runtime_error("line " + to_string(line) + ": expected " + to_string(m_columns.size()) +
+					" fields, found " + to_string(field));
+			}
+			lines.push_back(line);
+			p = eol + 1;
+		}
+		return lines.size();
+	}
+
+	void decodeBinary(const Block& block, vector<vector<double> >& columns, vector<const double*>& pointers)
+	{
+		for(size_t slot = 0; slot < m_used.size(); slot++)
+		{
+			const char* column = block.data + m_used[slot] * block.column_stride;
+
+			// Contiguous native doubles are read in place.
+			if(!m_swap && block.row_stride == 8 && (uintptr_t)column % alignof(double) == 0)
+			{
+				pointers[slot] = (const double*)column;
+				continue;
+			}
+
+			columns[slot].resize(block.rows);
+			for(size_t r = 0; r < block.rows; r++)
+			{
+				columns[slot][r] = decode(column + r * block.row_stride, m_swap);
+			}
+			pointers[slot] = columns[slot].data();
+		}
+	}
+
+	string evaluate(const Block& block, size_t n_rows, const vector<const double*>& pointers, const vector<size_t>& lines)
+	{
+		size_t n_formulas = m_formulas.size();
+		vector<double> results(n_formulas * n_rows);
+		size_t errors = 0;
+
+		vector<const double*> columns;
+		for(size_t i = 0; i < n_formulas; i++)
+		{
+			columns.clear();
+			for(size_t slot : m_slots[i])
+			{
+				columns.push_back(pointers[slot]);
+			}
+
+			double* result = &results[i * n_rows];
+			try
+			{
+				m_formulas[i].evalBatch(columns, n_rows, result);
+			}
+			catch(const FormulaException&)
+			{
+				// Some row failed: evaluate the block row by row to find which.
+				// Each row still goes through evalBatch, so the results are
+				// those the whole block would have given.
+				vector<const double*> row(columns.size());
+				for(size_t r = 0; r < n_rows; r++)
+				{
+					for(size_t k = 0; k < columns.size(); k++)
+					{
+						row[k] = columns[k] + r;
+					}
+
+					try
+					{
+						m_formulas[i].evalBatch(row, 1, &result[r]);
+					}
+					catch(const FormulaException& e)
+					{
+						if(m_options.fail_on_error)
+						{
+							string where = lines.empty() ? "row " + to_string(block.first_row + r + 1) : "line " + to_string(lines[r]);
+							throw runtime_error(where + ": " + m_options.names[i] + ": " + e.what());
+						}
+						result[r] = numeric_limits<double>::quiet_NaN();
+						errors++;
+					}
+				}
+			}
+		}
+
+		m_rows += n_rows;
+		m_errors += errors;
+		return format(results, n_rows);
+	}
+
+	string format(const vector<double>& results, size_t n_rows)const
+	{
+		size_t n_formulas = m_formulas.size();
+
+		string bytes;
+		if(m_options.output_format == "binary")
+		{
+			bytes.resize(8 * n_formulas * n_rows);
+			for(size_t r = 0; r < n_rows; r++)
+			{
+				for(size_t i = 0; i < n_formulas; i++)
+				{
+					encode(results[i * n_rows + r], &bytes[8 * (r * n_formulas + i)], m_swap);
+				}
+			}
+			return bytes;
+		}
+
+		bytes.reserve(n_rows * n_formulas * 12);
+		char buffer[64];
+		for(size_t r = 0; r < n_rows; r++)
+		{
+			for(size_t i = 0; i < n_formulas; i++)
+			{
+				if(i > 0)
+				{
+					bytes += m_options.delimiter;
+				}
+				to_chars_result printed = to_chars(buffer, buffer + sizeof(buffer), results[i * n_rows + r]);
+				bytes.append(buffer, printed.ptr);
+			}
+			bytes += '\n';
+		}
+		return bytes;
+	}
+
+	// Blocks finish in any order; they are held back until their turn comes.
+	void write()
+	{
+		map<size_t, string> pending;
+		size_t next = 0;
+
+		Output output;
+		while(m_outputs.pop(output))
+		{
+			pending.emplace(output.index, std::move(output.bytes));
+			for(auto it = pending.begin(); it != pending.end() && it->first == next; it = pending.erase(it), next++)
+			{
+				try
+				{
+					if(!m_failed)
+					{
+						writeBytes(it->second);
+					}
+				}
+				catch(const exception& e)
+				{
+					fail(e.what());
+				}
+				m_window.release();
+			}
+		}
+
+		if(fflush(m_output) != 0)
+		{
+			fail("write error");
+		}
+	}
+
+private:
+	const Options& m_options;
+	InputFile& m_input;
+	FILE* m_output;
+	size_t m_offset = 0;
+
+	vector<string> m_columns;
+	vector<Formula> m_formulas;
+
+	// Input columns read by any formula, and for each formula the slots of
+	// its arguments in that list.
+	vector<size_t> m_used;
+	vector<vector<size_t> > m_slots;
+	vector<int> m_column_slot;
+
+	Queue<Block> m_blocks;
+	Queue<Output> m_outputs;
+	Window m_window;
+	bool m_swap;
+
+	mutex m_error_mutex;
+	string m_error;
+	atomic<bool> m_failed;
+
+	atomic<size_t> m_rows;
+	atomic<size_t> m_errors;
+	atomic<size_t> m_bytes_in;
+	size_t m_bytes_out;
+	atomic<unsigned> m_active;
+};
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		Options options = parseOptions(argc, argv);
+
+		InputFile input(options.input);
+		FILE* output = stdout;
+		if(!options.output.empty())
+		{
+			output = fopen(options.output.c_str(), "wb");
+			if(!output)
+			{
+				throw runtime_error("cannot open " + options.output);
+			}
+		}
+		setvbuf(output, nullptr, _IOFBF, 1 << 20);
+
+		auto start = chrono::steady_clock::now();
+		Pipeline pipeline(options, input, output);
+		pipeline.run();
+		double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+		if(output != stdout && fclose(output) != 0)
+		{
+			throw runtime_error("write error");
+		}
+
+		if(options.verbose)
+		{
+			fprintf(stderr, "%zu rows, %zu failed, %.3f s, %.1f MB/s in, %.1f MB/s out, %.1f Mrows/s\n",
+				pipeline.rows(), pipeline.errors(), seconds,
+				pipeline.bytesIn() / seconds / 1e6, pipeline.bytesOut() / seconds / 1e6, pipeline.rows() / seconds / 1e6);
+		}
+		else if(pipeline.errors() > 0)
+		{
+			fprintf(stderr, "formula_eval: %zu evaluations failed and were written as NaN\n", pipeline.errors());
+		}
+		return 0;
+	}
+	catch(const exception& e)
+	{
+		fprintf(stderr, "formula_eval: %s\n", e.what());
+		return 1;
+	}
+}
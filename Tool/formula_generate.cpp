@@ -0,0 +1,195 @@
+// formula_generate: turns a rules file of named formulas into a C++ header
+// with one inline function per formula and a source file with a table of
+// them by name. Used at build time through formula_generate() in CMake.
+
+#include <formula.hpp>
+#include <formula_codegen.hpp>
+#include <formula_context.hpp>
+#include <formula_exeption.hpp>
+#include <formula_loader.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static const char* s_usage =
+	"Usage: formula_generate [options] RULES HEADER SOURCE\n"
+	"\n"
+	"Reads RULES, one \"name = expression\" per line, and writes HEADER with\n"
+	"an inline C++ function per formula and SOURCE with a table of them.\n"
+	"\n"
+	"  -n, --namespace NAME       namespace of the generated code\n"
+	"                             (default: the name of RULES)\n"
+	"  -d, --define NAME=VALUE    constant folded into every formula\n"
+	"  -h, --help                 show this help\n";
+
+struct Options
+{
+	string name_space;
+	vector<pair<string, double> > definitions;
+	string rules;
+	string header;
+	string source;
+};
+
+static string baseName(const string& path)
+{
+	size_t slash = path.find_last_of("/\\");
+	return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+static Options parseOptions(int argc, char** argv)
+{
+	Options options;
+	vector<string> files;
+	for(int i = 1; i < argc; i++)
+	{
+		string arg = argv[i];
+		auto next = [&]() -> string
+		{
+			if(i + 1 >= argc)
+			{
+				throw runtime_error("missing value for " + arg);
+			}
+			return argv[++i];
+		};
+
+		if(arg == "-h" || arg == "--help")
+		{
+			fputs(s_usage, stdout);
+			exit(0);
+		}
+		else if(arg == "-n" || arg == "--namespace")
+		{
+			options.name_space = next();
+		}
+		else if(arg == "-d" || arg == "--define")
+		{
+			string definition = next();
+			size_t equal = definition.find('=');
+			char* end = nullptr;
+			double value = equal == string::npos ? 0.0 : strtod(definition.c_str() + equal + 1, &end);
+			if(equal == string::npos || end == definition.c_str() + equal + 1 || *end != '\0')
+			{
+				throw runtime_error("invalid definition: " + definition);
+			}
+			options.definitions.emplace_back(definition.substr(0, equal), value);
+		}
+		else if(arg.size() > 1 && arg[0] == '-')
+		{
+			throw runtime_error("unknown option " + arg);
+		}
+		else
+		{
+			files.push_back(arg);
+		}
+	}
+
+	if(files.size() != 3)
+	{
+		fputs(s_usage, stderr);
+		exit(2);
+	}
+	options.rules = files[0];
+	options.header = files[1];
+	options.source = files[2];
+	if(options.name_space.empty())
+	{
+		string name = baseName(options.rules);
+		options.name_space = name.substr(0, name.find('.'));
+	}
+	return options;
+}
+
+// A file is only rewritten when its content changes, so what includes it is
+// not rebuilt for nothing.
+static void update(const string& path, const string& content)
+{
+	ifstream in(path, ios::binary);
+	if(in && string(istreambuf_iterator<char>(in), istreambuf_iterator<char>()) == content)
+	{
+		return;
+	}
+	in.close();
+
+	ofstream out(path, ios::binary);
+	out << content;
+	if(!out.flush())
+	{
+		throw runtime_error("cannot write " + path);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		Options options = parseOptions(argc, argv);
+
+		FormulaLoader loader;
+		if(!options.definitions.empty())
+		{
+			FormulaContext context;
+			for(const auto& definition : options.definitions)
+			{
+				context.define(definition.first, definition.second);
+			}
+			loader.setContext(context);
+		}
+
+		FormulaLoader::Result loaded = loader.load(options.rules);
+		FormulaCodegen codegen(options.name_space);
+		vector<FormulaLoader::Error> errors = loaded.errors;
+		for(size_t i = 0; i < loaded.names.size(); i++)
+		{
+			const string& name = loaded.names[i];
+			try
+			{
+				codegen.add(name, loaded.formulas.at(name));
+			}
+			catch(const FormulaException& e)
+			{
+				FormulaLoader::Error error;
+				error.line = loaded.name_lines[i];
+				error.name = name;
+				error.type = e.type();
+				error.message = e.message();
+				errors.push_back(error);
+			}
+		}
+		for(const FormulaLoader::Error& error : errors)
+		{
+			if(error.line)
+			{
+				fprintf(stderr, "%s:%zu: %s: %s\n", options.rules.c_str(), error.line, error.name.c_str(), error.message.c_str());
+			}
+			else
+			{
+				fprintf(stderr, "%s: %s: %s\n", options.rules.c_str(), error.name.c_str(), error.message.c_str());
+			}
+		}
+		if(!errors.empty())
+		{
+			return 1;
+		}
+
+		ostringstream header;
+		ostringstream source;
+		codegen.write(header, source, baseName(options.header));
+		update(options.header, header.str());
+		update(options.source, source.str());
+		return 0;
+	}
+	catch(const exception& e)
+	{
+		fprintf(stderr, "formula_generate: %s\n", e.what());
+		return 1;
+	}
+}
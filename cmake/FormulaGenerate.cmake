@@ -0,0 +1,48 @@
+# formula_generate(<target> FILE <rules> [NAMESPACE <name>] [DEFINE <name=value>...])
+#
+# Generates <rules name>.hpp and <rules name>.cpp from a rules file at build
+# time with the formula_generate tool, adds the source to <target> and puts
+# the header on its include path. The code is in the namespace given, by
+# default the name of the rules file without extension, and is regenerated
+# whenever the rules file changes.
+function(formula_generate target)
+    cmake_parse_arguments(ARG "" "FILE;NAMESPACE" "DEFINE" ${ARGN})
+    if(NOT ARG_FILE)
+        message(FATAL_ERROR "formula_generate: FILE is required")
+    endif()
+    if(NOT TARGET formula_generate)
+        message(FATAL_ERROR "formula_generate: the formula_generate tool is not built, see FORMULA_OPT_BUILD_GENERATOR")
+    endif()
+
+    get_filename_component(rules "${ARG_FILE}" ABSOLUTE)
+    get_filename_component(stem "${ARG_FILE}" NAME_WE)
+    if(NOT ARG_NAMESPACE)
+        set(ARG_NAMESPACE ${stem})
+    endif()
+
+    set(options --namespace ${ARG_NAMESPACE})
+    foreach(definition ${ARG_DEFINE})
+        list(APPEND options --define ${definition})
+    endforeach()
+
+    set(dir "${CMAKE_CURRENT_BINARY_DIR}/formula_generated")
+    set(header "${dir}/${stem}.hpp")
+    set(source "${dir}/${stem}.cpp")
+    set(stamp "${dir}/${stem}.stamp")
+    file(MAKE_DIRECTORY "${dir}")
+    # The tool leaves unchanged files alone, so what includes them is not
+    # rebuilt; the stamp is what tells the build the rules are up to date.
+    add_custom_command(
+        OUTPUT "${stamp}"
+        BYPRODUCTS "${header}" "${source}"
+        COMMAND formula_generate ${options} "${rules}" "${header}" "${source}"
+        COMMAND ${CMAKE_COMMAND} -E touch "${stamp}"
+        DEPENDS "${rules}" formula_generate
+        COMMENT "Generating C++ from formulas in ${ARG_FILE}"
+        VERBATIM
+    )
+
+    target_sources(${target} PRIVATE "${stamp}" "${header}" "${source}")
+    target_include_directories(${target} PUBLIC "${dir}")
+    target_link_libraries(${target} PUBLIC formula)
+endfunction()
@@ -5,9 +5,18 @@
 #include <iostream>
 #include <vector>
 #include <unordered_map>
-#include <unordered_set>
-#include <set>
 #include <functional>
+#include <memory>
+
+#include "formula_approximation.hpp"
+#include "formula_arena.hpp"
+#include "formula_context.hpp"
+#include "formula_grid.hpp"
+#include "formula_interval.hpp"
+#include "formula_records.hpp"
+#include "formula_reduction.hpp"
+#include "formula_stats.hpp"
+#include "formula_tiering.hpp"
 
 
 #ifdef _MSC_VER
@@ -17,11 +26,49 @@ class Formula
 #endif
 {
 public:
+	// Interpreter used by eval. The register machine dispatches only the
+	// operators and function calls; the stack machine runs every token.
+	enum Engine
+	{
+		RegisterMachine,
+		StackMachine
+	};
+
+	// Accuracy of the built-in sin, cos, tan, exp and logarithms. Fast
+	// replaces them with polynomial approximations, see the README for
+	// their maximum error.
+	enum Precision
+	{
+		Exact,
+		Fast
+	};
+
+	// Program eval runs for a formula constructed with tiering: the postfix
+	// code as compiled, then the optimized one.
+	enum Tier
+	{
+		Interpreted,
+		Optimized
+	};
+
     Formula();
 	Formula(const std::string& str);
+	Formula(std::string&& str);
 	Formula(const char* str);
+	Formula(const std::string& str, FormulaArena& arena);
+	Formula(const std::string& str, const FormulaContext& context);
+	Formula(const std::string& str, const FormulaTiering& tiering);
 
+	// Copies share the immutable program and definitions, so they are O(1).
+	Formula(const Formula& other) = default;
+	Formula(Formula&& other) noexcept = default;
+	Formula& operator =(const Formula& other) = default;
+	Formula& operator =(Formula&& other) noexcept = default;
+
+	// Not while the formula is evaluated by another thread; a FormulaHandle
+	// can be reassigned then.
     Formula& operator =(const std::string& str);
+    Formula& operator =(std::string&& str);
     Formula& operator =(const char* str);
     Formula& input(const std::string& str_promt);
 	
@@ -29,21 +76,89 @@ public:
 	bool empty()const;
 	void check()const;
 
-	double eval(const std::unordered_map<std::string, double>& variables);
-    double eval(const std::vector<double>& variables);
+	double eval(const std::unordered_map<std::string, double>& variables)const;
+    double eval(const std::vector<double>& variables)const;
 	template<typename ... DataTypes>
-	double eval(DataTypes ... rest);
+	double eval(DataTypes ... rest)const;
+
+	// Column-wise evaluation of many rows: columns[k][row] is the k-th
+	// positional argument, as in eval(vector). Throws if any row fails.
+	void evalBatch(const std::vector<const double*>& columns, size_t n_rows, double* results)const;
+	std::vector<double> evalBatch(const std::vector<std::vector<double> >& columns)const;
+	// Rows read in place from records, variables by name as in
+	// eval(unordered_map); result r is written results_stride bytes after
+	// result r - 1.
+	void evalBatch(const FormulaRecords& records, size_t n_rows, double* results,
+		size_t results_stride = sizeof(double))const;
+
+	// Sum, extrema and histogram of the results of evalBatch, folded block
+	// by block without storing them. Throws the error of the first failing
+	// row; a failing block is run again row by row to find it.
+	FormulaReduction reduce(const std::vector<const double*>& columns, size_t n_rows,
+		const FormulaReduction::Options& options = FormulaReduction::Options())const;
+	FormulaReduction reduce(const std::vector<std::vector<double> >& columns,
+		const FormulaReduction::Options& options = FormulaReduction::Options())const;
+
+	// Evaluation over the points of a regular grid, one axis per positional
+	// argument, the last axis varying fastest. The coordinates are made
+	// block by block as the rows are run, never stored.
+	void evalGrid(const std::vector<FormulaAxis>& axes, double* results, unsigned threads = 1)const;
+	std::vector<double> evalGrid(const std::vector<FormulaAxis>& axes, unsigned threads = 1)const;
+
+	// Bounds of the results over a box, one interval per positional argument
+	// as in eval(vector). Every value the formula takes in the box lies
+	// within them; points where it fails or is NaN take none, and the
+	// result is empty if no point does. Only built-in functions are called.
+	FormulaInterval evalInterval(const std::vector<FormulaInterval>& variables)const;
 
-	double operator ()(const std::unordered_map<std::string, double>& variables);
-    double operator ()(const std::vector<double>& variables);
+	// Piecewise polynomial proxy over a range, one interval per positional
+	// argument, one or two of them. Its results differ from those of eval by
+	// at most tolerance at the points checked. Throws if the formula fails
+	// in the range or cannot be fitted within tolerance.
+	FormulaApproximation approximate(const std::vector<FormulaInterval>& range, double tolerance)const;
+
+	// Found variable names in dictionary order, and those of them that take
+	// positional arguments, i.e. are not pre-defined.
+	std::vector<std::string> variables()const;
+	std::vector<std::string> arguments()const;
+
+	double operator ()(const std::unordered_map<std::string, double>& variables)const;
+    double operator ()(const std::vector<double>& variables)const;
 	template<typename ... DataTypes>
-	double operator ()(DataTypes ... rest);
+	double operator ()(DataTypes ... rest)const;
 
 	void define(const std::string& var_name, double value);
 	void define(const std::string& func_name, const std::function<double(double)>& f);
+	// A function given as a kernel computing out[i] = f(in[i]) for n
+	// values; in and out never overlap. Batch evaluation calls it once per
+	// block of rows, eval calls the scalar form, or the kernel with n = 1 if
+	// there is none.
+	void define(const std::string& func_name, const std::function<void(const double*, double*, size_t)>& kernel);
+	void define(const std::string& func_name, const std::function<double(double)>& f,
+		const std::function<void(const double*, double*, size_t)>& kernel);
+
+	void setEngine(Engine engine);
+	Engine engine()const;
+	void setPrecision(Precision precision);
+	Precision precision()const;
+
+	// Optimized, unless constructed with tiering and not yet promoted. A
+	// formula bound to a context is folded when bound, so always optimized.
+	Tier tier()const;
+
+	FormulaMemoryUsage memoryUsage()const;
+
+	FormulaStats stats()const;
+	void resetStats();
+	std::string dumpStats()const;
 
 	friend std::ostream& operator <<(std::ostream& out_stream, const Formula& f);
 	friend std::istream& operator >>(std::istream& in_stream, Formula& f);
+	friend class FormulaEvaluator;
+	friend class FormulaContext;
+	friend class FormulaLoader;
+	friend class FormulaCodegen;
+	friend class FormulaPipeline;
 
 private:
 	struct Token
@@ -60,6 +175,8 @@ private:
 		Type type;
 		std::string name;
 		double data;
+		int pos = 0;
+		int length = 0;
 
 	public:
 		Token();
@@ -71,21 +188,86 @@ private:
 		int outerPriority()const;
 	};
 
+	// A function bound to a program: built-ins through a plain pointer,
+	// user definitions through their std::function.
+	struct BoundFunction
+	{
+		double (*f)(double) = nullptr;
+		const std::function<double(double)>* user = nullptr;
+
+		double operator()(double x)const
+		{
+			return f ? f(x) : (*user)(x);
+		}
+	};
+
+	struct BoundKernel
+	{
+		void (*f)(const double*, double*, size_t) = nullptr;
+		const std::function<void(const double*, double*, size_t)>* user = nullptr;
+
+		explicit operator bool()const
+		{
+			return f || user;
+		}
+
+		void operator()(const double* x, double* y, size_t n)const
+		{
+			f ? f(x, y, n) : (*user)(x, y, n);
+		}
+	};
+
+	struct Program;
+	struct Definitions;
+	struct Binding;
+	struct Profile;
+	struct Batch;
+	struct Tiering;
+
 private:
     static void preprocess(std::string& str);
     static Token getNumber(const std::string& str, int& i);
-    Token getWord(const std::string& str, int& i);
-    Token getToken(const std::string& str, int& i);
-    void generatePostfix();
+    static Token getWord(const std::string& str, int& i);
+    static Token getToken(const std::string& str, int& i);
+    static std::vector<Token> generatePostfix(const std::string& str);
+    void compile(std::string source, const std::shared_ptr<FormulaArena::Impl>& arena, const FormulaTiering* tiering = nullptr);
+    void bind(const std::shared_ptr<FormulaContext::Impl>& context);
+    const Program& compiled()const;
+    const Program& tiered()const;
+    const Definitions& definitions()const;
+    std::shared_ptr<const Definitions> contextDefinitions()const;
+    bool callsUserFunctions()const;
+    double evalNamed(const Program& program, const Definitions* context, const std::unordered_map<std::string, double>& variables)const;
+    bool namedValue(const Definitions* context, const std::string& name, double& value)const;
+    double evalPositional(const Program& program, const Definitions* context, const std::vector<double>& variables)const;
+    void bindArguments(const Program& program, size_t n_arguments, double* values, int* argument)const;
+    void bindFunctions(const Program& program, const Definitions* context, BoundFunction* functions,
+        bool* user, BoundKernel* kernels = nullptr)const;
+    double run(const Program& program, const Definitions* context, const double* variables)const;
+    double runStack(const Program& program, const double* variables, const BoundFunction* functions, const bool* user)const;
+    double runRegisters(const Program& program, const double* variables, const BoundFunction* functions, const bool* user)const;
 
 private:
-	std::vector<Token> m_postfix;
-	std::string m_formula_string;
+	// Compiled program, source string and found variable names in one
+	// flat block, owned alone or placed in a FormulaArena.
+	std::shared_ptr<const Program> m_program;
 
-	std::set<std::string> m_found_variables;
+	// Pre-defined variables and functions, replaced as a whole by define().
+	std::shared_ptr<const Definitions> m_definitions;
 
-	std::unordered_map<std::string, double> m_defined_variables;
-    std::unordered_map<std::string, std::function<double(double)> > m_defined_functions;
+	// Set when constructed with a context: m_program folded against it.
+	std::shared_ptr<Binding> m_binding;
+
+	// Set when constructed with tiering: counts calls and holds the
+	// optimized program once made.
+	std::shared_ptr<Tiering> m_tiering;
+
+	Engine m_engine = RegisterMachine;
+	Precision m_precision = Exact;
+
+#ifdef FORMULA_PROFILING
+	std::shared_ptr<Profile> m_profile;
+#endif
 };
 
 std::vector<double> varargin2vector();
@@ -101,14 +283,14 @@ std::vector<double> varargin2vector(double first, DataTypes ... rest)
 }
 
 template<typename ... DataTypes>
-double Formula::eval(DataTypes... varargin)
+double Formula::eval(DataTypes... varargin)const
 {
     std::vector<double> variables = varargin2vector(varargin...);
     return eval(variables);
 }
 
 template<typename ... DataTypes>
-double Formula::operator ()(DataTypes... varargin)
+double Formula::operator ()(DataTypes... varargin)const
 {
     return eval(varargin...);
 }
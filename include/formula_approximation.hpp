@@ -0,0 +1,124 @@
+#ifndef FORMULA_APPROXIMATION_H
+#define FORMULA_APPROXIMATION_H
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Proxy of a formula of one or two variables over a range, made by
+// Formula::approximate. The range is cut into pieces, each with a
+// polynomial of degree at most 8 per variable fitted to the Chebyshev
+// interpolant of the formula there. Evaluating finds the piece of a point in
+// a table and runs its polynomial in Horner form, whatever the formula
+// calls. Results within 1E-6 of 0 are rounded to 0, as eval does; outside
+// the range they are NaN.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaApproximation
+#else
+class FormulaApproximation
+#endif
+{
+public:
+	FormulaApproximation();
+
+	double operator ()(double x)const;
+	double operator ()(double x, double y)const;
+	double eval(const std::vector<double>& variables)const;
+	void evalBatch(const std::vector<const double*>& columns, size_t n_rows, double* results)const;
+	std::vector<double> evalBatch(const std::vector<std::vector<double> >& columns)const;
+
+	unsigned dimensions()const;
+	size_t pieces()const;
+
+	// Largest difference from the formula found at the points checked, at
+	// most the tolerance asked for.
+	double error()const;
+
+private:
+	friend class Formula;
+
+	// A polynomial in t = (x - center) * scale, in [-1, 1] over the piece.
+	struct Piece
+	{
+		double center[2];
+		double scale[2];
+		unsigned degree[2];
+		unsigned offset;
+	};
+
+	double evalPiece(const Piece& piece, double x, double y)const;
+	double evalAt(double x, double y)const;
+
+	unsigned m_dimensions = 0;
+	double m_lower[2] = {0.0, 0.0};
+	double m_upper[2] = {0.0, 0.0};
+
+	// The range is split into cells of the smallest pieces; m_table gives
+	// the piece of each cell, the cells of a row of x first.
+	unsigned m_cells[2] = {1, 1};
+	double m_cell_scale[2] = {0.0, 0.0};
+	std::vector<uint32_t> m_table;
+
+	// Coefficient of t^i u^k at offset + i * (degree[1] + 1) + k.
+	std::vector<Piece> m_pieces;
+	std::vector<double> m_coefficients;
+	double m_error = 0.0;
+};
+
+inline double FormulaApproximation::evalPiece(const Piece& piece, double x, double y)const
+{
+	const double* c = &m_coefficients[piece.offset];
+	double t = (x - piece.center[0]) * piece.scale[0];
+	double result;
+	if(m_dimensions == 1)
+	{
+		result = c[piece.degree[0]];
+		for(unsigned i = piece.degree[0]; i-- > 0;)
+		{
+			result = result * t + c[i];
+		}
+	}
+	else
+	{
+		double u = (y - piece.center[1]) * piece.scale[1];
+		unsigned n = piece.degree[1] + 1;
+		result = 0.0;
+		for(unsigned i = piece.degree[0] + 1; i-- > 0;)
+		{
+			const double* row = c + i * n;
+			double value = row[n - 1];
+			for(unsigned k = n - 1; k-- > 0;)
+			{
+				value = value * u + row[k];
+			}
+			result = result * t + value;
+		}
+	}
+	return std::fabs(result) <= 1E-6 ? 0 : result;
+}
+
+inline double FormulaApproximation::evalAt(double x, double y)const
+{
+	if(!(x >= m_lower[0] && x <= m_upper[0] && y >= m_lower[1] && y <= m_upper[1]))
+	{
+		return std::numeric_limits<double>::quiet_NaN();
+	}
+	size_t i = (size_t)((x - m_lower[0]) * m_cell_scale[0]);
+	size_t k = (size_t)((y - m_lower[1]) * m_cell_scale[1]);
+	i = i < m_cells[0] ? i : m_cells[0] - 1;
+	k = k < m_cells[1] ? k : m_cells[1] - 1;
+	return evalPiece(m_pieces[m_table[i * m_cells[1] + k]], x, y);
+}
+
+inline double FormulaApproximation::operator ()(double x)const
+{
+	return m_dimensions == 1 ? evalAt(x, 0.0) : eval(std::vector<double>{x});
+}
+
+inline double FormulaApproximation::operator ()(double x, double y)const
+{
+	return m_dimensions == 2 ? evalAt(x, y) : eval(std::vector<double>{x, y});
+}
+
+#endif // FORMULA_APPROXIMATION_H
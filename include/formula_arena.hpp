@@ -0,0 +1,64 @@
+#ifndef FORMULA_ARENA_H
+#define FORMULA_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+// Bump allocator shared by a group of formulas. Compiled programs of formulas
+// constructed with an arena are placed in its chunks and their variable and
+// function names are interned, so formulas sharing names share the storage.
+// A program no formula uses any more leaves its block to the next program of
+// about the same size, so reassigning formulas does not grow the arena; the
+// chunks are freed only when the arena and every formula built in it are
+// destroyed. Interned names are kept until then.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaArena
+#else
+class FormulaArena
+#endif
+{
+public:
+	struct Usage
+	{
+		size_t chunks = 0;
+		size_t reserved = 0;
+		size_t used = 0;
+		size_t programs = 0;
+		size_t program_bytes = 0;
+		size_t free_bytes = 0;
+		size_t interned_names = 0;
+		size_t interned_bytes = 0;
+	};
+
+	explicit FormulaArena(size_t chunk_size = 64 * 1024);
+
+	Usage usage()const;
+	std::string report()const;
+
+private:
+	friend class Formula;
+	friend class FormulaLoader;
+	struct Impl;
+
+	std::shared_ptr<Impl> m_impl;
+};
+
+// Memory attributed to one formula. Name characters interned in an arena
+// are shared with other formulas and accounted by the arena instead.
+struct FormulaMemoryUsage
+{
+	bool arena = false;
+	size_t object = 0;
+	size_t program = 0;
+	size_t names = 0;
+	size_t definitions = 0;
+	size_t heap_blocks = 0;
+
+	size_t total()const
+	{
+		return object + program + names + definitions;
+	}
+};
+
+#endif // FORMULA_ARENA_H
@@ -0,0 +1,137 @@
+#ifndef FORMULA_CODEGEN_H
+#define FORMULA_CODEGEN_H
+
+#include "formula.hpp"
+#include "formula_exeption.hpp"
+
+#include <cmath>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Entry of the table of a generated source file. eval takes the arguments
+// in the order of arguments.
+struct FormulaFunction
+{
+	const char* name;
+	const char* expression;
+	unsigned arity;
+	const char* const* arguments;
+	double (*eval)(const double* arguments);
+};
+
+// Writes formulas out as C++: a header with one inline function per formula
+// and a source file with a table of them by name, for find() at runtime.
+// A function takes the variables of its formula in dictionary order, as
+// eval(const std::vector<double>&) does, and gives the same results and
+// errors. The code is that of the register form, after folding the
+// constants pi and e, the variables defined for the formula or its context
+// and the built-in calls on constants. Only built-in functions can be
+// called; a formula using one defined with define() is rejected.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaCodegen
+#else
+class FormulaCodegen
+#endif
+{
+public:
+	// The generated code is placed in the namespace, e.g. "rules" or
+	// "model::curves".
+	explicit FormulaCodegen(const std::string& name_space);
+
+	// name must be a C++ identifier, neither a keyword nor the name of a
+	// standard macro, and unique.
+	void add(const std::string& name, const Formula& formula);
+
+	// header_name is how the source includes the header.
+	void write(std::ostream& header, std::ostream& source, const std::string& header_name)const;
+
+	// Operations of the interpreters, for generated code.
+	static double divide(double x, double y);
+	static double power(double x, double y);
+	// x^n and x^-n for 2 <= n <= 4, the exponents the register form runs
+	// by square-and-multiply; beyond, the result drifts from pow().
+	static double integerPower(double x, unsigned n);
+	static double inversePower(double x, unsigned n);
+	static double multiplyAdd(double a, double b, double c);
+	static double squareRoot(double x);
+	static double result(double x);
+	typedef double (*BuiltInFunction)(double);
+	static BuiltInFunction builtIn(const char* name);
+
+private:
+	struct Function
+	{
+		std::string name;
+		std::string expression;
+		std::vector<std::string> arguments;
+		std::string body;
+	};
+
+	std::string m_namespace;
+	std::vector<Function> m_functions;
+};
+
+inline double FormulaCodegen::divide(double x, double y)
+{
+	if(std::fabs(y) < 1E-6)
+	{
+		throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
+	}
+	return x / y;
+}
+
+inline double FormulaCodegen::power(double x, double y)
+{
+	if(std::fabs(x) < 1E-6 && y < 0)
+	{
+		throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
+	}
+	return std::pow(x, y);
+}
+
+inline double FormulaCodegen::integerPower(double x, unsigned n)
+{
+	double result = 1.0;
+	while(n)
+	{
+		if(n & 1)
+		{
+			result *= x;
+		}
+		x *= x;
+		n >>= 1;
+	}
+	return result;
+}
+
+inline double FormulaCodegen::inversePower(double x, unsigned n)
+{
+	if(std::fabs(x) < 1E-6)
+	{
+		throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
+	}
+	return 1.0 / integerPower(x, n);
+}
+
+inline double FormulaCodegen::multiplyAdd(double a, double b, double c)
+{
+#ifdef FP_FAST_FMA
+	return std::fma(a, b, c);
+#else
+	return a * b + c;
+#endif
+}
+
+inline double FormulaCodegen::squareRoot(double x)
+{
+	return std::isinf(x) ? std::fabs(x) : std::sqrt(x);
+}
+
+inline double FormulaCodegen::result(double x)
+{
+	return std::fabs(x) <= 1E-6 ? 0 : x;
+}
+
+#endif // FORMULA_CODEGEN_H
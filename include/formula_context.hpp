@@ -0,0 +1,54 @@
+#ifndef FORMULA_CONTEXT_H
+#define FORMULA_CONTEXT_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+// Variables and functions shared by the formulas constructed with it. Such a
+// formula looks a name up in its own definitions, then in the context, then
+// among the built-ins. Context variables are folded into the programs of the
+// formulas as constants; defining a name again re-folds only the formulas
+// using it and swaps their programs atomically, also while they are being
+// evaluated. Copies of a context share it.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaContext
+#else
+class FormulaContext
+#endif
+{
+public:
+	struct Stats
+	{
+		size_t variables = 0;
+		size_t functions = 0;
+		size_t formulas = 0;
+		unsigned long long updates = 0;
+		unsigned long long refolds = 0;
+	};
+
+	FormulaContext();
+
+	void define(const std::string& var_name, double value);
+	void define(const std::string& func_name, const std::function<double(double)>& f);
+	void define(const std::string& func_name, const std::function<void(const double*, double*, size_t)>& kernel);
+	void define(const std::string& func_name, const std::function<double(double)>& f,
+		const std::function<void(const double*, double*, size_t)>& kernel);
+
+	// Defines several variables at once: no formula sees some of the new
+	// values without the others.
+	void define(const std::unordered_map<std::string, double>& values);
+
+	Stats stats()const;
+
+private:
+	friend class Formula;
+	friend class FormulaLoader;
+	struct Impl;
+
+	std::shared_ptr<Impl> m_impl;
+};
+
+#endif // FORMULA_CONTEXT_H
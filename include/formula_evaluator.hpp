@@ -0,0 +1,73 @@
+#ifndef FORMULA_EVALUATOR_H
+#define FORMULA_EVALUATOR_H
+
+#include "formula.hpp"
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <memory>
+
+// Stateful evaluator of one Formula: keeps the value of every node of the
+// expression tree and recomputes only the nodes downstream of the variables
+// changed by set() since the last value() call.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaEvaluator
+#else
+class FormulaEvaluator
+#endif
+{
+public:
+	FormulaEvaluator(const Formula& formula);
+
+	void set(const std::string& var_name, double value);
+	double value();
+
+	unsigned long long evaluated()const;
+	unsigned long long skipped()const;
+	void resetCounters();
+
+private:
+	struct Node
+	{
+		enum Type
+		{
+			Number,
+			Variable,
+			Operator,
+			Function
+		};
+
+		Type type;
+		char op;
+		int lhs;
+		int rhs;
+		int index;
+		double data;
+	};
+
+	double compute(const Node& node)const;
+
+private:
+	std::vector<Node> m_nodes;
+	std::vector<double> m_values;
+	std::vector<Formula::BoundFunction> m_functions;
+	std::shared_ptr<const Formula::Definitions> m_definitions;
+	std::shared_ptr<const Formula::Definitions> m_context;
+
+	std::vector<std::string> m_slot_names;
+	std::vector<double> m_slot_values;
+	std::vector<bool> m_slot_bound;
+	std::unordered_map<std::string, int> m_slot_index;
+
+	// Variable slot -> nodes depending on it, in evaluation order.
+	std::vector<std::vector<int> > m_dependents;
+
+	std::vector<bool> m_dirty;
+	std::vector<int> m_pending;
+
+	unsigned long long m_evaluated;
+	unsigned long long m_skipped;
+};
+
+#endif // FORMULA_EVALUATOR_H
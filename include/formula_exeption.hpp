@@ -4,7 +4,7 @@
 #include <string>
 #include <exception>
 
-static bool isOperator(char ch)
+inline bool isOperator(char ch)
 {
 	return ( ch == '+' || ch == '-' || ch == '*' || ch == '/' ||
 			 ch == '^' || ch == '#' || ch == '(' || ch == ')'   );
@@ -31,6 +31,14 @@ public:
         OUT_OF_RANGE,
         EMPTY_STRING,
         NOT_SUPPORTED_CHARACTER,
+        SIZE_MISMATCH,
+        CANNOT_OPEN_FILE,
+        ALREADY_DEFINED,
+        CIRCULAR_REFERENCE,
+        INVALID_NAME,
+        NOT_BUILT_IN_FUNCTION,
+        INVALID_RANGE,
+        TOLERANCE_NOT_MET,
     };
 
     FormulaException(Type code = UNKNOWN, const std::string &_message = "", double _value = 0.0, const std::string &_interval = "");
@@ -0,0 +1,76 @@
+#ifndef FORMULA_GRAPH_H
+#define FORMULA_GRAPH_H
+
+#include "formula.hpp"
+
+#include <exception>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Named formulas whose results are variables of one another, like the cells
+// of a spreadsheet. A variable of a formula is another formula of the graph
+// when one has that name, else an input given by set(), else resolved as
+// eval does. Changing an input or a formula marks the formulas downstream of
+// it; value() recomputes only the marked ones it depends on, evaluate() all
+// of them, independent branches on several threads when there are many.
+// Defining a formula that would depend on itself throws.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaGraph
+#else
+class FormulaGraph
+#endif
+{
+public:
+	// With threads 0, one per core.
+	explicit FormulaGraph(unsigned threads = 0);
+
+	void define(const std::string& name, const Formula& formula);
+	void set(const std::string& name, double value);
+
+	double value(const std::string& name);
+	void evaluate();
+
+	// Names of the formulas, each after the formulas it uses.
+	std::vector<std::string> order()const;
+
+	unsigned long long evaluated()const;
+	void resetCounters();
+
+private:
+	struct Node
+	{
+		std::string name;
+		bool formula = false;
+		Formula expression;
+
+		// Input set, or formula evaluated without error.
+		bool known = false;
+		bool dirty = false;
+		double value = 0.0;
+		std::exception_ptr error;
+
+		// Nodes of the variables of the formula, and formulas using this node.
+		std::vector<int> uses;
+		std::vector<int> dependents;
+		std::unordered_map<std::string, double> arguments;
+	};
+
+	int node(const std::string& name);
+	std::vector<int> mark(const std::vector<int>& from, bool upstream);
+	void invalidate(int id);
+	void compute(Node& node);
+	void update(const std::vector<int>& targets);
+
+private:
+	std::vector<Node> m_nodes;
+	std::unordered_map<std::string, int> m_index;
+
+	// Scratch of the graph walks, all clear between them.
+	std::vector<bool> m_marked;
+	std::vector<int> m_pending;
+	unsigned m_threads;
+	unsigned long long m_evaluated;
+};
+
+#endif // FORMULA_GRAPH_H
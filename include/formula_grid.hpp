@@ -0,0 +1,21 @@
+#ifndef FORMULA_GRID_H
+#define FORMULA_GRID_H
+
+#include <cstddef>
+
+// One axis of a regular grid for Formula::evalGrid: the count values
+// start + i * step for i = 0 .. count - 1.
+struct FormulaAxis
+{
+	double start = 0.0;
+	double step = 1.0;
+	size_t count = 0;
+
+	FormulaAxis() = default;
+	FormulaAxis(double _start, double _step, size_t _count);
+
+	// count values evenly spaced from low to high, both included.
+	static FormulaAxis linspace(double low, double high, size_t count);
+};
+
+#endif // FORMULA_GRID_H
@@ -0,0 +1,65 @@
+#ifndef FORMULA_HANDLE_H
+#define FORMULA_HANDLE_H
+
+#include "formula.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A formula that may be replaced while other threads evaluate it, which a
+// Formula itself must not be. A writer compiles the new expression on a copy
+// of the current formula and publishes it with an atomic store; a reader
+// evaluates the formula current when it started, without a lock, and a
+// replaced formula is destroyed once no reader can still be using it.
+// Writers are serialized. Copies of a handle share it.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaHandle
+#else
+class FormulaHandle
+#endif
+{
+public:
+	FormulaHandle();
+	explicit FormulaHandle(const Formula& formula);
+
+	// Replaces the expression, keeping the definitions, context and other
+	// settings of the current formula. An expression that does not compile
+	// throws and leaves the current formula in place.
+	void assign(const std::string& expression);
+	void store(const Formula& formula);
+
+	// Publishes the current formula as changed by change; if change throws,
+	// nothing is published.
+	void update(const std::function<void(Formula&)>& change);
+
+	// Copy of the current formula.
+	Formula load()const;
+
+	// Number of formulas published since construction.
+	unsigned long long version()const;
+
+	double eval(const std::unordered_map<std::string, double>& variables)const;
+	double eval(const std::vector<double>& variables)const;
+	template<typename ... DataTypes>
+	double eval(DataTypes ... rest)const;
+
+	void evalBatch(const std::vector<const double*>& columns, size_t n_rows, double* results)const;
+	std::vector<double> evalBatch(const std::vector<std::vector<double> >& columns)const;
+
+private:
+	struct Impl;
+
+	std::shared_ptr<Impl> m_impl;
+};
+
+template<typename ... DataTypes>
+double FormulaHandle::eval(DataTypes... varargin)const
+{
+	return eval(varargin2vector(varargin...));
+}
+
+#endif // FORMULA_HANDLE_H
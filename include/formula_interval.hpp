@@ -0,0 +1,24 @@
+#ifndef FORMULA_INTERVAL_H
+#define FORMULA_INTERVAL_H
+
+// Closed interval [lower, upper] of reals, as given to and returned by
+// Formula::evalInterval. Bounds may be infinite. An interval whose lower
+// bound is not at most its upper one, e.g. with NaN bounds, is empty.
+struct FormulaInterval
+{
+	double lower = 0.0;
+	double upper = 0.0;
+
+	FormulaInterval() = default;
+	FormulaInterval(double x);
+	FormulaInterval(double _lower, double _upper);
+
+	bool empty()const;
+	bool contains(double x)const;
+	double width()const;
+
+	static FormulaInterval none();
+	static FormulaInterval entire();
+};
+
+#endif // FORMULA_INTERVAL_H
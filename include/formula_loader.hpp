@@ -0,0 +1,75 @@
+#ifndef FORMULA_LOADER_H
+#define FORMULA_LOADER_H
+
+#include "formula.hpp"
+#include "formula_exeption.hpp"
+
+#include <cstddef>
+#include <istream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Compiles many named formulas at once, e.g. a rules file read at start-up.
+// Each line of a file is "name = expression"; blank lines and lines starting
+// with '#' are skipped. Identical expressions, blanks aside, are compiled
+// once and shared. The others are compiled and checked by a pool of threads,
+// and a line that fails is reported without stopping the rest.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaLoader
+#else
+class FormulaLoader
+#endif
+{
+public:
+	struct Error
+	{
+		size_t line = 0;
+		std::string name;
+		FormulaException::Type type = FormulaException::UNKNOWN;
+		std::string message;
+	};
+
+	struct Result
+	{
+		// Names of the formulas loaded, in input order, and their lines.
+		std::vector<std::string> names;
+		std::vector<size_t> name_lines;
+		std::unordered_map<std::string, Formula> formulas;
+		std::vector<Error> errors;
+		size_t lines = 0;
+		size_t compiled = 0;
+	};
+
+	// With threads 0, one per core.
+	explicit FormulaLoader(unsigned threads = 0);
+
+	// Formulas are bound to the context, or placed in the arena, or both.
+	void setContext(const FormulaContext& context);
+	void setArena(FormulaArena& arena);
+
+	// Formulas are compiled with tiering; those bound to a context are
+	// still folded, and so optimized, when loaded.
+	void setTiering(const FormulaTiering& tiering);
+
+	Result load(const std::string& path)const;
+	Result load(std::istream& in)const;
+
+	// Pairs of name and expression; line numbers are their positions from 1.
+	Result compile(const std::vector<std::pair<std::string, std::string> >& rules)const;
+
+private:
+	struct Line;
+
+	void compile(const std::vector<Line>& lines, Result& result)const;
+	Formula compile(const std::string& expression)const;
+
+	unsigned m_threads;
+	std::shared_ptr<FormulaContext> m_context;
+	std::shared_ptr<FormulaArena> m_arena;
+	std::shared_ptr<FormulaTiering> m_tiering;
+};
+
+#endif // FORMULA_LOADER_H
@@ -0,0 +1,43 @@
+#ifndef FORMULA_MEMO_H
+#define FORMULA_MEMO_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+
+// Caching wrapper of a costly one-argument function, to be passed to
+// Formula::define. Results are kept in a direct-mapped table keyed on the
+// exact bits of the argument; a colliding argument replaces the older entry.
+// Lookups and inserts take no lock, so concurrent eval calls may share one
+// memo. Copies share the table and the counters.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaMemo
+#else
+class FormulaMemo
+#endif
+{
+public:
+	struct Stats
+	{
+		unsigned long long hits = 0;
+		unsigned long long misses = 0;
+		size_t capacity = 0;
+
+		double hitRate()const;
+	};
+
+	// capacity is rounded up to a power of two.
+	explicit FormulaMemo(const std::function<double(double)>& f, size_t capacity = 4096);
+
+	double operator ()(double x)const;
+
+	Stats stats()const;
+	void resetStats();
+
+private:
+	struct Impl;
+
+	std::shared_ptr<Impl> m_impl;
+};
+
+#endif // FORMULA_MEMO_H
@@ -0,0 +1,68 @@
+#ifndef FORMULA_PIPELINE_H
+#define FORMULA_PIPELINE_H
+
+#include "formula.hpp"
+
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+// Evaluates rows pushed from any number of threads on a pool of workers and
+// completes them asynchronously. A row holds the positional arguments of
+// eval(const std::vector<double>&). Workers take every row queued, up to a
+// batch, and run them through evalBatch, so batches grow with the load and
+// a lone row is not kept waiting for others; the results are those of
+// evalBatch whatever the batch. The rows of a formula calling user
+// functions run one at a time, so each function is called once per row
+// even when a row fails. The queue is bounded: push blocks while it is
+// full, tryPush gives up.
+#ifdef _MSC_VER
+class __declspec(dllexport) FormulaPipeline
+#else
+class FormulaPipeline
+#endif
+{
+public:
+	// Called on a worker thread with the result, or with the exception eval
+	// would have thrown for the row. It must not throw.
+	typedef std::function<void(double value, std::exception_ptr error)> Callback;
+
+	struct Stats
+	{
+		unsigned long long rows = 0;
+		unsigned long long batches = 0;
+		unsigned long long failed = 0;
+		unsigned long long blocked = 0;
+		size_t queued = 0;
+
+		double meanBatch()const;
+	};
+
+	// With threads 0, one per core.
+	explicit FormulaPipeline(const Formula& formula, unsigned threads = 0, size_t capacity = 4096, size_t max_batch = 256);
+
+	// Completes the rows still queued, then stops the workers.
+	~FormulaPipeline();
+
+	FormulaPipeline(const FormulaPipeline&) = delete;
+	FormulaPipeline& operator =(const FormulaPipeline&) = delete;
+
+	void push(std::vector<double> row, Callback done);
+	std::future<double> push(std::vector<double> row);
+	bool tryPush(std::vector<double> row, Callback done);
+
+	// Waits until every row pushed so far has been completed.
+	void drain();
+
+	Stats stats()const;
+
+private:
+	struct Impl;
+
+	std::unique_ptr<Impl> m_impl;
+};
+
+#endif // FORMULA_PIPELINE_H
@@ -0,0 +1,21 @@
+#ifndef FORMULA_RECORDS_H
+#define FORMULA_RECORDS_H
+
+#include <cstddef>
+#include <string>
+#include <unordered_map>
+
+// Rows stored as records, e.g. an array of structs, for Formula::evalBatch:
+// row r starts r * stride bytes after base, and each variable named in
+// offsets is the double that many bytes into its row.
+struct FormulaRecords
+{
+	const void* base = nullptr;
+	size_t stride = 0;
+	std::unordered_map<std::string, size_t> offsets;
+
+	FormulaRecords() = default;
+	FormulaRecords(const void* _base, size_t _stride, const std::unordered_map<std::string, size_t>& _offsets);
+};
+
+#endif // FORMULA_RECORDS_H
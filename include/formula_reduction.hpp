@@ -0,0 +1,44 @@
+#ifndef FORMULA_REDUCTION_H
+#define FORMULA_REDUCTION_H
+
+#include <cstddef>
+#include <limits>
+#include <vector>
+
+// Aggregates of the results of a formula over many rows, as computed by
+// Formula::reduce without storing the results. min and max ignore NaN
+// results, which make the sum NaN and fall in no histogram bin; argmin and
+// argmax are the first rows with the smallest and largest result, NONE when
+// there is no row or every result is NaN.
+struct FormulaReduction
+{
+	static constexpr size_t NONE = std::numeric_limits<size_t>::max();
+
+	struct Options
+	{
+		// Threads evaluating the rows, one per core when 0. The result is
+		// the same for any number.
+		unsigned threads = 1;
+
+		// Number of bins of a histogram of the results over [low, high),
+		// none when 0.
+		size_t bins = 0;
+		double low = 0.0;
+		double high = 1.0;
+	};
+
+	size_t count = 0;
+	double sum = 0.0;
+	double min = std::numeric_limits<double>::infinity();
+	double max = -std::numeric_limits<double>::infinity();
+	size_t argmin = NONE;
+	size_t argmax = NONE;
+
+	std::vector<size_t> histogram;
+	size_t below = 0;
+	size_t above = 0;
+
+	double mean()const;
+};
+
+#endif // FORMULA_REDUCTION_H
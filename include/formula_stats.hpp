@@ -0,0 +1,63 @@
+#ifndef FORMULA_STATS_H
+#define FORMULA_STATS_H
+
+#include <string>
+#include <vector>
+
+// Execution statistics of one compiled formula, recorded only when the
+// library is built with FORMULA_OPT_PROFILING (FORMULA_PROFILING defined).
+// The dispatch counts describe the program and are always filled.
+struct FormulaStats
+{
+	enum OpCode
+	{
+		NUMBER,
+		VARIABLE,
+		ADD,
+		SUB,
+		MUL,
+		DIV,
+		POW,
+		FUNCTION,
+		OPCODE_COUNT
+	};
+
+	struct Counter
+	{
+		unsigned long long count = 0;
+		unsigned long long cycles = 0;
+	};
+
+	struct Instruction
+	{
+		OpCode opcode = NUMBER;
+		std::string text;
+		size_t position = 0;
+		size_t length = 0;
+		Counter counter;
+	};
+
+	static const char* opcodeName(OpCode opcode);
+
+	bool enabled = false;
+
+	// Instructions dispatched per evaluation: postfix tokens of the stack
+	// machine, and operations of the register machine before and after
+	// fusing superinstructions.
+	size_t stack_dispatches = 0;
+	size_t register_dispatches = 0;
+	size_t fused_dispatches = 0;
+
+	unsigned long long evals = 0;
+	unsigned long long cycles = 0;
+	unsigned long long built_in_calls = 0;
+	unsigned long long user_calls = 0;
+
+	Counter opcodes[OPCODE_COUNT];
+	std::vector<Instruction> instructions;
+
+	// latency[i] counts evaluations that took [2^i, 2^(i+1)) cycles.
+	std::vector<unsigned long long> latency;
+};
+
+#endif // FORMULA_STATS_H
@@ -0,0 +1,20 @@
+#ifndef FORMULA_TIERING_H
+#define FORMULA_TIERING_H
+
+// Options of a formula constructed with tiering. It is compiled only to the
+// postfix code the stack machine interprets, skipping the register form and
+// the Horner rewrite, so constructing many formulas is cheaper. Its calls
+// are counted, and the one that reaches threshold has the program optimized:
+// constants folded, then lowered as usual. Later calls run the optimized
+// program once it is published; none of them waits for it.
+struct FormulaTiering
+{
+	// Calls of eval or any other evaluation before optimizing; 0 never does.
+	unsigned long long threshold = 1000;
+
+	// Optimize on a background thread shared by all formulas, or in the call
+	// reaching threshold.
+	bool background = true;
+};
+
+#endif // FORMULA_TIERING_H
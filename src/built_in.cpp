@@ -1,10 +1,9 @@
-#include <formula.hpp>
-#include <cmath>
+#include "built_in.hpp"
+#include "../include/formula_exeption.hpp"
 
-static bool isZero(double x)
-{
-	return (fabs(x) < 1E-6);
-}
+#include <cstdint>
+
+using namespace std;
 
 static double _sign(double x)
 {
@@ -24,36 +23,36 @@ static double _sign(double x)
 
 static double _tan(double x)
 {
-	if (isZero(cos(x)))
+	if (BuiltIn::isZero(cos(x)))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "tan", x, "cos(x) != 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "tan", x, "cos(x) != 0");
 	}
 	return tan(x);
 }
 
 static double _csc(double x)
 {
-	if (isZero(sin(x)))
+	if (BuiltIn::isZero(sin(x)))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "csc", x, "sin(x) != 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "csc", x, "sin(x) != 0");
 	}
 	return 1.0 / sin(x);
 }
 
 static double _sec(double x)
 {
-	if (isZero(cos(x)))
+	if (BuiltIn::isZero(cos(x)))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "sec", x, "cos(x) != 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "sec", x, "cos(x) != 0");
 	}
 	return 1.0 / cos(x);
 }
 
 static double _cot(double x)
 {
-	if (isZero(sin(x)))
+	if (BuiltIn::isZero(sin(x)))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "cot", x, "sin(x) != 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "cot", x, "sin(x) != 0");
 	}
 	return cos(x) / sin(x);
 }
@@ -62,7 +61,7 @@ static double _asin(double x)
 {
 	if (!(x >= -1 && x <= 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "asin", x, "x >= -1 && x <= 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "asin", x, "x >= -1 && x <= 1");
 	}
 	return asin(x);
 }
@@ -71,7 +70,7 @@ static double _acos(double x)
 {
 	if (!(x >= -1 && x <= 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "acos", x, "x >= -1 && x <= 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "acos", x, "x >= -1 && x <= 1");
 	}
 	return acos(x);
 }
@@ -80,7 +79,7 @@ static double _acsc(double x)
 {
 	if (!(x <= -1 || x >= 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "acsc", x, "x <= -1 || x >= 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "acsc", x, "x <= -1 || x >= 1");
 	}
 	return asin(1.0 / x);
 }
@@ -89,7 +88,7 @@ static double _asec(double x)
 {
 	if (!(x <= -1 || x >= 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "asec", x, "x <= -1 || x >= 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "asec", x, "x <= -1 || x >= 1");
 	}
 	return acos(1.0 / x);
 }
@@ -112,9 +111,9 @@ static double _acot(double x)
 
 static double _csch(double x)
 {
-	if (isZero(x))
+	if (BuiltIn::isZero(x))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "csch", x, "x != 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "csch", x, "x != 0");
 	}
 	return 1 / sinh(x);
 }
@@ -126,9 +125,9 @@ static double _sech(double x)
 
 static double _coth(double x)
 {
-	if (isZero(x))
+	if (BuiltIn::isZero(x))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "coth", x, "x != 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "coth", x, "x != 0");
 	}
 	return 1 / tanh(x);
 }
@@ -137,7 +136,7 @@ static double _acosh(double x)
 {
 	if (!(x >= 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "acosh", x, "x >= 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "acosh", x, "x >= 1");
 	}
 	return acosh(x);
 }
@@ -146,7 +145,7 @@ static double _atanh(double x)
 {
 	if (!(x > -1 && x < 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "atanh", x, "x > -1 && x < 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "atanh", x, "x > -1 && x < 1");
 	}
 	return atanh(x);
 }
@@ -155,7 +154,7 @@ static double _acsch(double x)
 {
 	if (!(x > -1 && x < 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "acsch", x, "x > -1 && x < 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "acsch", x, "x > -1 && x < 1");
 	}
 	return log((1 + _sign(x) * sqrt(1 + x * x)) / x);
 }
@@ -164,7 +163,7 @@ static double _asech(double x)
 {
 	if (!(x > 0 && x <= 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "asech", x, "x > 0 && x <= 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "asech", x, "x > 0 && x <= 1");
 	}
 	return log((1 + sqrt(1 - x * x)) / x);
 }
@@ -173,7 +172,7 @@ static double _acoth(double x)
 {
 	if (!(x < -1 || x > 1))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "acoth", x, "x < -1 || x > 1");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "acoth", x, "x < -1 || x > 1");
 	}
 	return 0.5 * log((x + 1) / (x - 1));
 }
@@ -182,7 +181,7 @@ static double _log(double x)
 {
 	if (!(x > 0))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "log", x, "x > 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "log", x, "x > 0");
 	}
 	return log(x);
 }
@@ -191,7 +190,7 @@ static double _log10(double x)
 {
 	if (!(x > 0))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "log10", x, "x > 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "log10", x, "x > 0");
 	}
 	return log10(x);
 }
@@ -200,7 +199,7 @@ static double _log2(double x)
 {
 	if (!(x > 0))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "log2", x, "x > 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "log2", x, "x > 0");
 	}
 	return log2(x);
 }
@@ -209,75 +208,170 @@ static double _sqrt(double x)
 {
 	if (!(x >= 0))
 	{
-		throw Formula::Exception(Formula::Exception::OUT_OF_RANGE, "sqrt", x, "x >= 0");
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "sqrt", x, "x >= 0");
 	}
 	return sqrt(x);
 }
 
-#define FUNCTION(func_name) [](double x) -> double { return func_name(x); }
+struct Function
+{
+	string_view name;
+	double (*f)(double);
+};
 
-const std::unordered_map<std::string, std::function<double(double)>> Formula::s_built_in_functions =
-	{
-		{"sin", FUNCTION(sin)},
-		{"cos", FUNCTION(cos)},
-		{"tan", FUNCTION(_tan)},
-		{"csc", FUNCTION(_csc)},
-		{"sec", FUNCTION(_sec)},
-		{"cot", FUNCTION(_cot)},
-
-		{"asin", FUNCTION(_asin)},
-		{"acos", FUNCTION(_acos)},
-		{"atan", FUNCTION(atan)},
-		{"acsc", FUNCTION(_acsc)},
-		{"asec", FUNCTION(_asec)},
-		{"acot", FUNCTION(_acot)},
-
-		{"arcsin", FUNCTION(_asin)},
-		{"arccos", FUNCTION(_acos)},
-		{"arctan", FUNCTION(atan)},
-		{"arccsc", FUNCTION(_acsc)},
-		{"arcsec", FUNCTION(_asec)},
-		{"arccot", FUNCTION(_acot)},
-
-		{"sinh", FUNCTION(sinh)},
-		{"cosh", FUNCTION(cosh)},
-		{"tanh", FUNCTION(tanh)},
-		{"csch", FUNCTION(_csch)},
-		{"sech", FUNCTION(_sech)},
-		{"coth", FUNCTION(_coth)},
-
-		{"asinh", FUNCTION(asinh)},
-		{"acosh", FUNCTION(_acosh)},
-		{"atanh", FUNCTION(_atanh)},
-		{"acsch", FUNCTION(_acsch)},
-		{"asech", FUNCTION(_asech)},
-		{"acoth", FUNCTION(_acoth)},
-
-		{"arcsinh", FUNCTION(asinh)},
-		{"arccosh", FUNCTION(_acosh)},
-		{"arctanh", FUNCTION(_atanh)},
-		{"arccsch", FUNCTION(_acsch)},
-		{"arcsech", FUNCTION(_asech)},
-		{"arccoth", FUNCTION(_acoth)},
-
-		{"exp", FUNCTION(exp)},
-		{"log", FUNCTION(_log)},
-		{"lg", FUNCTION(_log10)},
-		{"log10", FUNCTION(_log10)},
-		{"ln", FUNCTION(_log)},
-		{"log2", FUNCTION(_log2)},
-
-		{"sqrt", FUNCTION(_sqrt)},
-		{"abs", FUNCTION(fabs)},
-		{"fabs", FUNCTION(fabs)},
-		{"sign", FUNCTION(_sign)},
-		{"sgn", FUNCTION(_sign)},
+struct Variable
+{
+	string_view name;
+	double value;
 };
 
+#define FUNCTION(func_name) {#func_name, [](double x) -> double { return func_name(x); }}
+#define ALIAS(name, func_name) {name, [](double x) -> double { return func_name(x); }}
+
+static constexpr Function s_functions[] =
+	{
+		FUNCTION(sin),
+		FUNCTION(cos),
+		ALIAS("tan", _tan),
+		ALIAS("csc", _csc),
+		ALIAS("sec", _sec),
+		ALIAS("cot", _cot),
+
+		ALIAS("asin", _asin),
+		ALIAS("acos", _acos),
+		FUNCTION(atan),
+		ALIAS("acsc", _acsc),
+		ALIAS("asec", _asec),
+		ALIAS("acot", _acot),
+
+		ALIAS("arcsin", _asin),
+		ALIAS("arccos", _acos),
+		ALIAS("arctan", atan),
+		ALIAS("arccsc", _acsc),
+		ALIAS("arcsec", _asec),
+		ALIAS("arccot", _acot),
+
+		FUNCTION(sinh),
+		FUNCTION(cosh),
+		FUNCTION(tanh),
+		ALIAS("csch", _csch),
+		ALIAS("sech", _sech),
+		ALIAS("coth", _coth),
+
+		FUNCTION(asinh),
+		ALIAS("acosh", _acosh),
+		ALIAS("atanh", _atanh),
+		ALIAS("acsch", _acsch),
+		ALIAS("asech", _asech),
+		ALIAS("acoth", _acoth),
+
+		ALIAS("arcsinh", asinh),
+		ALIAS("arccosh", _acosh),
+		ALIAS("arctanh", _atanh),
+		ALIAS("arccsch", _acsch),
+		ALIAS("arcsech", _asech),
+		ALIAS("arccoth", _acoth),
+
+		FUNCTION(exp),
+		ALIAS("log", _log),
+		ALIAS("lg", _log10),
+		ALIAS("log10", _log10),
+		ALIAS("ln", _log),
+		ALIAS("log2", _log2),
+
+		ALIAS("sqrt", _sqrt),
+		ALIAS("abs", fabs),
+		FUNCTION(fabs),
+		ALIAS("sign", _sign),
+		ALIAS("sgn", _sign),
+	};
+#undef ALIAS
 #undef FUNCTION
 
-const std::unordered_map<std::string, double> Formula::s_built_in_variables =
+// Same values as 4 * atan(1) and exp(1).
+static constexpr Variable s_variables[] =
 	{
-		{"PI", 4 * atan(1)},
-		{"pi", 4 * atan(1)},
-		{"e", exp(1)}};
\ No newline at end of file
+		{"PI", 3.14159265358979323846},
+		{"pi", 3.14159265358979323846},
+		{"e", 2.71828182845904523536},
+	};
+
+static constexpr uint32_t hashName(string_view name, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ seed;
+	for(char c : name)
+	{
+		h = (h ^ (unsigned char)c) * 16777619u;
+	}
+	return h ^ (h >> 15);
+}
+
+// Slot of every name under the first seed that maps no two names to the
+// same slot. SLOTS is a power of two a few times the number of names, so
+// a seed is found after a few tries.
+template<size_t N, size_t SLOTS>
+struct PerfectHash
+{
+	static_assert((SLOTS & (SLOTS - 1)) == 0 && N < SLOTS && N < 255, "");
+	static const unsigned char EMPTY = 255;
+
+	template<typename Entry>
+	constexpr PerfectHash(const Entry (&entries)[N]):
+	seed(0), slots{}
+	{
+		for(;; seed++)
+		{
+			for(unsigned char& slot : slots)
+			{
+				slot = EMPTY;
+			}
+
+			size_t i = 0;
+			for(; i < N; i++)
+			{
+				unsigned char& slot = slots[hashName(entries[i].name, seed) & (SLOTS - 1)];
+				if(slot != EMPTY)
+				{
+					break;
+				}
+				slot = (unsigned char)i;
+			}
+			if(i == N)
+			{
+				return;
+			}
+		}
+	}
+
+	template<typename Entry>
+	constexpr const Entry* find(const Entry (&entries)[N], string_view name)const
+	{
+		unsigned char slot = slots[hashName(name, seed) & (SLOTS - 1)];
+		return slot != EMPTY && entries[slot].name == name ? &entries[slot] : nullptr;
+	}
+
+	uint32_t seed;
+	unsigned char slots[SLOTS];
+};
+
+static constexpr size_t N_FUNCTIONS = sizeof(s_functions) / sizeof(s_functions[0]);
+static constexpr size_t N_VARIABLES = sizeof(s_variables) / sizeof(s_variables[0]);
+
+static constexpr PerfectHash<N_FUNCTIONS, 256> s_function_hash(s_functions);
+static constexpr PerfectHash<N_VARIABLES, 8> s_variable_hash(s_variables);
+
+static_assert(s_function_hash.find(s_functions, "arccoth") == &s_functions[35], "");
+static_assert(s_function_hash.find(s_functions, "tan2") == nullptr, "");
+static_assert(s_variable_hash.find(s_variables, "pi") == &s_variables[1], "");
+
+BuiltIn::Function BuiltIn::function(string_view name)
+{
+	const ::Function* found = s_function_hash.find(s_functions, name);
+	return found ? found->f : nullptr;
+}
+
+const double* BuiltIn::variable(string_view name)
+{
+	const Variable* found = s_variable_hash.find(s_variables, name);
+	return found ? &found->value : nullptr;
+}
@@ -1,320 +1,59 @@
 #ifndef BUILT_IN_H
 #define BUILT_IN_H
 
-#include "../include/formula_exeption.hpp"
-
 #include <cmath>
-#include <unordered_map>
-#include <unordered_set>
-#include <functional>
-#include <vector>
+#include <string_view>
 
+// Built-in functions and constants. Names are resolved through perfect-hash
+// tables computed at compile time in built_in.cpp: one hash of the name and
+// one comparison, with nothing to initialize first.
 namespace BuiltIn
 {
-	static const std::unordered_set<char> &s_supported_chars()
-	{
-		static const std::unordered_set<char> v =
-			{
-				'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j', 'k', 'l', 'm',
-				'n', 'o', 'p', 'q', 'r', 's', 't', 'u', 'v', 'w', 'x', 'y', 'z',
-				'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H', 'I', 'J', 'K', 'L', 'M',
-				'N', 'O', 'P', 'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X', 'Y', 'Z',
-				'+', '-', '*', '/', '^', '(', ')',
-				'0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
-				'.', ' ', '\t', '\r', '\n'};
-
-		return v;
-	}
-
-	static bool isZero(double x)
-	{
-		return (fabs(x) < 1E-6);
-	}
-
-	static double _sign(double x)
-	{
-		if (x > 0)
-		{
-			return 1;
-		}
-		else if (x < 0)
-		{
-			return -1;
-		}
-		else
-		{
-			return 0;
-		}
-	}
-
-	static double _tan(double x)
-	{
-		if (isZero(cos(x)))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "tan", x, "cos(x) != 0");
-		}
-		return tan(x);
-	}
-
-	static double _csc(double x)
-	{
-		if (isZero(sin(x)))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "csc", x, "sin(x) != 0");
-		}
-		return 1.0 / sin(x);
-	}
-
-	static double _sec(double x)
-	{
-		if (isZero(cos(x)))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "sec", x, "cos(x) != 0");
-		}
-		return 1.0 / cos(x);
-	}
-
-	static double _cot(double x)
-	{
-		if (isZero(sin(x)))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "cot", x, "sin(x) != 0");
-		}
-		return cos(x) / sin(x);
-	}
-
-	static double _asin(double x)
-	{
-		if (!(x >= -1 && x <= 1))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "asin", x, "x >= -1 && x <= 1");
-		}
-		return asin(x);
-	}
-
-	static double _acos(double x)
-	{
-		if (!(x >= -1 && x <= 1))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "acos", x, "x >= -1 && x <= 1");
-		}
-		return acos(x);
-	}
-
-	static double _acsc(double x)
+	struct CharClass
 	{
-		if (!(x <= -1 || x >= 1))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "acsc", x, "x <= -1 || x >= 1");
-		}
-		return asin(1.0 / x);
-	}
+		bool supported[256];
+	};
 
-	static double _asec(double x)
+	constexpr CharClass supportedChars()
 	{
-		if (!(x <= -1 || x >= 1))
+		CharClass chars{};
+		for(char c = 'a'; c <= 'z'; c++)
 		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "asec", x, "x <= -1 || x >= 1");
+			chars.supported[(unsigned char)c] = true;
 		}
-		return acos(1.0 / x);
-	}
-
-	static double _acot(double x)
-	{
-		if (x < 0)
+		for(char c = 'A'; c <= 'Z'; c++)
 		{
-			return 4 * atan(1) + atan(1.0 / x);
+			chars.supported[(unsigned char)c] = true;
 		}
-		else if (x > 0)
+		for(char c = '0'; c <= '9'; c++)
 		{
-			return atan(1.0 / x);
+			chars.supported[(unsigned char)c] = true;
 		}
-		else
+		for(char c : std::string_view("+-*/^(). \t\r\n"))
 		{
-			return 2 * atan(1);
+			chars.supported[(unsigned char)c] = true;
 		}
+		return chars;
 	}
 
-	static double _csch(double x)
-	{
-		if (isZero(x))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "csch", x, "x != 0");
-		}
-		return 1 / sinh(x);
-	}
+	inline constexpr CharClass s_supported_chars = supportedChars();
 
-	static double _sech(double x)
+	inline bool isSupported(char c)
 	{
-		return 1 / cosh(x);
+		return s_supported_chars.supported[(unsigned char)c];
 	}
 
-	static double _coth(double x)
+	inline bool isZero(double x)
 	{
-		if (isZero(x))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "coth", x, "x != 0");
-		}
-		return 1 / tanh(x);
-	}
-
-	static double _acosh(double x)
-	{
-		if (!(x >= 1))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "acosh", x, "x >= 1");
-		}
-		return acosh(x);
-	}
-
-	static double _atanh(double x)
-	{
-		if (!(x > -1 && x < 1))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "atanh", x, "x > -1 && x < 1");
-		}
-		return atanh(x);
-	}
-
-	static double _acsch(double x)
-	{
-		if (!(x > -1 && x < 1))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "acsch", x, "x > -1 && x < 1");
-		}
-		return log((1 + _sign(x) * sqrt(1 + x * x)) / x);
-	}
-
-	static double _asech(double x)
-	{
-		if (!(x > 0 && x <= 1))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "asech", x, "x > 0 && x <= 1");
-		}
-		return log((1 + sqrt(1 - x * x)) / x);
-	}
-
-	static double _acoth(double x)
-	{
-		if (!(x < -1 || x > 1))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "acoth", x, "x < -1 || x > 1");
-		}
-		return 0.5 * log((x + 1) / (x - 1));
-	}
-
-	static double _log(double x)
-	{
-		if (!(x > 0))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "log", x, "x > 0");
-		}
-		return log(x);
-	}
-
-	static double _log10(double x)
-	{
-		if (!(x > 0))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "log10", x, "x > 0");
-		}
-		return log10(x);
-	}
-
-	static double _log2(double x)
-	{
-		if (!(x > 0))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "log2", x, "x > 0");
-		}
-		return log2(x);
-	}
-
-	static double _sqrt(double x)
-	{
-		if (!(x >= 0))
-		{
-			throw FormulaException(FormulaException::OUT_OF_RANGE, "sqrt", x, "x >= 0");
-		}
-		return sqrt(x);
+		return (fabs(x) < 1E-6);
 	}
 
-#define FUNCTION(func_name) [](double x) -> double { return func_name(x); }
-
-	static const std::unordered_map<std::string, std::function<double(double)>> &s_built_in_functions()
-	{
-		static const std::unordered_map<std::string, std::function<double(double)>> v =
-			{
-				{"sin", FUNCTION(sin)},
-				{"cos", FUNCTION(cos)},
-				{"tan", FUNCTION(_tan)},
-				{"csc", FUNCTION(_csc)},
-				{"sec", FUNCTION(_sec)},
-				{"cot", FUNCTION(_cot)},
-
-				{"asin", FUNCTION(_asin)},
-				{"acos", FUNCTION(_acos)},
-				{"atan", FUNCTION(atan)},
-				{"acsc", FUNCTION(_acsc)},
-				{"asec", FUNCTION(_asec)},
-				{"acot", FUNCTION(_acot)},
-
-				{"arcsin", FUNCTION(_asin)},
-				{"arccos", FUNCTION(_acos)},
-				{"arctan", FUNCTION(atan)},
-				{"arccsc", FUNCTION(_acsc)},
-				{"arcsec", FUNCTION(_asec)},
-				{"arccot", FUNCTION(_acot)},
-
-				{"sinh", FUNCTION(sinh)},
-				{"cosh", FUNCTION(cosh)},
-				{"tanh", FUNCTION(tanh)},
-				{"csch", FUNCTION(_csch)},
-				{"sech", FUNCTION(_sech)},
-				{"coth", FUNCTION(_coth)},
-
-				{"asinh", FUNCTION(asinh)},
-				{"acosh", FUNCTION(_acosh)},
-				{"atanh", FUNCTION(_atanh)},
-				{"acsch", FUNCTION(_acsch)},
-				{"asech", FUNCTION(_asech)},
-				{"acoth", FUNCTION(_acoth)},
+	typedef double (*Function)(double);
 
-				{"arcsinh", FUNCTION(asinh)},
-				{"arccosh", FUNCTION(_acosh)},
-				{"arctanh", FUNCTION(_atanh)},
-				{"arccsch", FUNCTION(_acsch)},
-				{"arcsech", FUNCTION(_asech)},
-				{"arccoth", FUNCTION(_acoth)},
-
-				{"exp", FUNCTION(exp)},
-				{"log", FUNCTION(_log)},
-				{"lg", FUNCTION(_log10)},
-				{"log10", FUNCTION(_log10)},
-				{"ln", FUNCTION(_log)},
-				{"log2", FUNCTION(_log2)},
-
-				{"sqrt", FUNCTION(_sqrt)},
-				{"abs", FUNCTION(fabs)},
-				{"fabs", FUNCTION(fabs)},
-				{"sign", FUNCTION(_sign)},
-				{"sgn", FUNCTION(_sign)},
-			};
-			return v;
-		}
-#undef FUNCTION
-
-		static const std::unordered_map<std::string, double> &s_built_in_variables()
-		{
-			static const std::unordered_map<std::string, double> v =
-				{
-					{"PI", 4 * atan(1)},
-					{"pi", 4 * atan(1)},
-					{"e", exp(1)}};
-
-			return v;
-		}
+	// Null when name is not a built-in.
+	Function function(std::string_view name);
+	const double* variable(std::string_view name);
 
-	}; // namespace BuiltIn
+} // namespace BuiltIn
 
-#endif // BUILT_IN_H
\ No newline at end of file
+#endif // BUILT_IN_H
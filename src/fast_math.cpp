@@ -0,0 +1,350 @@
+#include "fast_math.hpp"
+#include "../include/formula_exeption.hpp"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+using namespace std;
+
+static const double SHIFT = 6755399441055744.0; // 1.5 * 2^52
+
+static const double LOG2E = 1.44269504088896338700e+00;
+static const double LN2_HI = 6.93147180369123816490e-01;
+static const double LN2_LO = 1.90821492927058770002e-10;
+static const double LN2 = 6.93147180559945286227e-01;
+static const double LOG10_2 = 3.01029995663981198017e-01;
+
+static const double TWO_OVER_PI = 6.36619772367581382433e-01;
+static const double PIO2_HI = 1.57079632673412561417e+00;
+static const double PIO2_LO = 6.07710050650619224932e-11;
+
+// Beyond this, reducing by pi/2 in two parts loses accuracy.
+static const double TRIG_LIMIT = 1e5;
+
+static inline uint64_t bits(double x)
+{
+	uint64_t u;
+	memcpy(&u, &x, sizeof(u));
+	return u;
+}
+
+static inline double fromBits(uint64_t u)
+{
+	double x;
+	memcpy(&x, &u, sizeof(x));
+	return x;
+}
+
+// Adding SHIFT rounds to an integer that ends up in the low mantissa bits.
+static inline double roundShifted(double x)
+{
+	return x + SHIFT;
+}
+
+static inline double sinPolynomial(double r)
+{
+	double r2 = r * r;
+	return r + r * r2 * (-1.66666666666666657415e-01 + r2 * (8.33333333333333321769e-03 + r2 * (-1.98412698412698412526e-04 +
+		r2 * (2.75573192239858906526e-06 + r2 * (-2.50521083854417187751e-08 + r2 * 1.60590438368216145994e-10)))));
+}
+
+static inline double cosPolynomial(double r)
+{
+	double r2 = r * r;
+	return 1.0 + r2 * (-0.5 + r2 * (4.16666666666666643537e-02 + r2 * (-1.38888888888888894189e-03 + r2 * (2.48015873015873015658e-05 +
+		r2 * (-2.75573192239858906526e-07 + r2 * (2.08767569878680989792e-09 + r2 * -1.14707455977297247139e-11))))));
+}
+
+// x = k*pi/2 + r with |r| <= pi/4; the quadrant k mod 4 picks the
+// polynomial and the sign.
+static inline double sinCore(double x, uint64_t offset)
+{
+	double shifted = roundShifted(x * TWO_OVER_PI);
+	double k = shifted - SHIFT;
+	uint64_t quadrant = bits(shifted) + offset;
+
+	double r = (x - k * PIO2_HI) - k * PIO2_LO;
+	double s = sinPolynomial(r);
+	double c = cosPolynomial(r);
+	// Selects and the sign flip are done on the bits: SSE2 has no 64-bit
+	// integer compare to build a select from.
+	uint64_t odd = 0 - (quadrant & 1);
+	uint64_t y = (bits(c) & odd) | (bits(s) & ~odd);
+	return fromBits(y ^ ((quadrant & 2) << 62));
+}
+
+static double fastSin(double x)
+{
+	return fabs(x) <= TRIG_LIMIT ? sinCore(x, 0) : sin(x);
+}
+
+static double fastCos(double x)
+{
+	return fabs(x) <= TRIG_LIMIT ? sinCore(x, 1) : cos(x);
+}
+
+// Arguments outside the reduction range are rare, so an array holding any
+// goes through the scalar form. It is checked before anything is written,
+// as y may be x itself.
+static bool anyLarge(const double* x, size_t n)
+{
+	// The sign of TRIG_LIMIT - |x| marks them; NaN goes through the
+	// polynomial and stays NaN.
+	uint64_t large = 0;
+	for(size_t i = 0; i < n; i++)
+	{
+		large |= bits(TRIG_LIMIT - fabs(x[i]));
+	}
+	return (large >> 63) != 0;
+}
+
+static void fastSinArray(const double* x, double* y, size_t n)
+{
+	if(anyLarge(x, n))
+	{
+		for(size_t i = 0; i < n; i++)
+		{
+			y[i] = fastSin(x[i]);
+		}
+		return;
+	}
+
+	for(size_t i = 0; i < n; i++)
+	{
+		y[i] = sinCore(x[i], 0);
+	}
+}
+
+static void fastCosArray(const double* x, double* y, size_t n)
+{
+	if(anyLarge(x, n))
+	{
+		for(size_t i = 0; i < n; i++)
+		{
+			y[i] = fastCos(x[i]);
+		}
+		return;
+	}
+
+	for(size_t i = 0; i < n; i++)
+	{
+		y[i] = sinCore(x[i], 1);
+	}
+}
+
+static double fastTan(double x)
+{
+	double c = fastCos(x);
+	if(fabs(c) < 1E-6)
+	{
+		throw FormulaException(FormulaException::OUT_OF_RANGE, "tan", x, "cos(x) != 0");
+	}
+	return fastSin(x) / c;
+}
+
+// A pole is only known once the cosine is computed, so each chunk of x is
+// saved first: near a pole the scalar form reports it or recomputes the
+// chunk from the copy, even when y is x.
+static void fastTanArray(const double* x, double* y, size_t n)
+{
+	if(anyLarge(x, n))
+	{
+		for(size_t i = 0; i < n; i++)
+		{
+			y[i] = fastTan(x[i]);
+		}
+		return;
+	}
+
+	const size_t CHUNK = 64;
+	double saved[CHUNK];
+	for(size_t begin = 0; begin < n; begin += CHUNK)
+	{
+		size_t m = n - begin < CHUNK ? n - begin : CHUNK;
+		memcpy(saved, x + begin, m * sizeof(double));
+
+		uint64_t pole = 0;
+		for(size_t i = 0; i < m; i++)
+		{
+			double c = sinCore(saved[i], 1);
+			y[begin + i] = sinCore(saved[i], 0) / c;
+			pole |= bits(fabs(c) - 1E-6);
+		}
+
+		if((pole >> 63) != 0)
+		{
+			for(size_t i = 0; i < m; i++)
+			{
+				y[begin + i] = fastTan(saved[i]);
+			}
+		}
+	}
+}
+
+// x = k*ln2 + r with |r| <= ln2/2, so exp(x) = 2^k * exp(r).
+static inline double expCore(double x)
+{
+	double clamped = x < -708.0 ? -708.0 : (x > 709.8 ? 709.8 : x);
+	double shifted = roundShifted(clamped * LOG2E);
+	double k = shifted - SHIFT;
+	double r = (clamped - k * LN2_HI) - k * LN2_LO;
+
+	double p = 1.0 + r * (1.0 + r * (0.5 + r * (1.66666666666666657415e-01 + r * (4.16666666666666643537e-02 +
+		r * (8.33333333333333321769e-03 + r * (1.38888888888888894189e-03 + r * (1.98412698412698412526e-04 +
+		r * (2.48015873015873015658e-05 + r * 2.75573192239858906526e-06))))))));
+
+	// 2^(k-1) stays a normal number for every k the clamping allows.
+	double scale = fromBits((bits(shifted) - bits(SHIFT) + 1022) << 52);
+	double y = p * scale * 2.0;
+
+	y = x > 709.782712893384 ? numeric_limits<double>::infinity() : y;
+	y = x < -708.0 ? 0.0 : y;
+	return x != x ? x : y;
+}
+
+static double fastExp(double x)
+{
+	return expCore(x);
+}
+
+static void fastExpArray(const double* x, double* y, size_t n)
+{
+	for(size_t i = 0; i < n; i++)
+	{
+		y[i] = expCore(x[i]);
+	}
+}
+
+// x = m * 2^e with sqrt(2)/2 <= m < sqrt(2); log(m) = 2*atanh(f) for
+// f = (m-1)/(m+1), |f| < 0.172. Expects x > 0.
+static inline double logCore(double x)
+{
+	// Subnormals are scaled into the normal range first.
+	bool tiny = x < 2.2250738585072014e-308;
+	double scaled = tiny ? x * 18014398509481984.0 : x; // 2^54
+
+	// The biased exponent is turned into a double through the mantissa of
+	// 2^52, which unlike an integer conversion vectorizes.
+	uint64_t u = bits(scaled);
+	double e = fromBits((u >> 52) | 0x4330000000000000ULL) - 4503599627370496.0 - 1023.0;
+	double m = fromBits((u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL);
+
+	bool high = m > 1.41421356237309504880;
+	m = high ? 0.5 * m : m;
+	e = e + (high ? 1.0 : 0.0) - (tiny ? 54.0 : 0.0);
+
+	double f = (m - 1.0) / (m + 1.0);
+	double f2 = f * f;
+	double series = f2 * (0.66666666666666666667 + f2 * (0.4 + f2 * (0.28571428571428571429 + f2 * (0.22222222222222222222 +
+		f2 * (0.18181818181818181818 + f2 * (0.15384615384615384615 + f2 * 0.13333333333333333333))))));
+	double y = e * LN2 + (2.0 * f + f * series);
+
+	return x == numeric_limits<double>::infinity() ? x : y;
+}
+
+[[noreturn]] static void logDomainError(const char* name, double x)
+{
+	throw FormulaException(FormulaException::OUT_OF_RANGE, name, x, "x > 0");
+}
+
+static double fastLog(double x)
+{
+	if(!(x > 0))
+	{
+		logDomainError("log", x);
+	}
+	return logCore(x);
+}
+
+static double fastLog2(double x)
+{
+	if(!(x > 0))
+	{
+		logDomainError("log2", x);
+	}
+	return logCore(x) * LOG2E;
+}
+
+static double fastLog10(double x)
+{
+	if(!(x > 0))
+	{
+		logDomainError("log10", x);
+	}
+	return logCore(x) * (LOG10_2 * LOG2E);
+}
+
+// The domain is checked for the whole array before anything is computed.
+static void checkLogDomain(const char* name, const double* x, size_t n)
+{
+	uint64_t outside = 0;
+	for(size_t i = 0; i < n; i++)
+	{
+		outside |= x[i] > 0 ? 0 : 1;
+	}
+
+	if(outside != 0)
+	{
+		for(size_t i = 0; i < n; i++)
+		{
+			if(!(x[i] > 0))
+			{
+				logDomainError(name, x[i]);
+			}
+		}
+	}
+}
+
+static void fastLogArray(const double* x, double* y, size_t n)
+{
+	checkLogDomain("log", x, n);
+	for(size_t i = 0; i < n; i++)
+	{
+		y[i] = logCore(x[i]);
+	}
+}
+
+static void fastLog2Array(const double* x, double* y, size_t n)
+{
+	checkLogDomain("log2", x, n);
+	for(size_t i = 0; i < n; i++)
+	{
+		y[i] = logCore(x[i]) * LOG2E;
+	}
+}
+
+static void fastLog10Array(const double* x, double* y, size_t n)
+{
+	checkLogDomain("log10", x, n);
+	for(size_t i = 0; i < n; i++)
+	{
+		y[i] = logCore(x[i]) * (LOG10_2 * LOG2E);
+	}
+}
+
+static constexpr FastMath::Function s_functions[] =
+	{
+		{"sin", fastSin, fastSinArray},
+		{"cos", fastCos, fastCosArray},
+		{"tan", fastTan, fastTanArray},
+		{"exp", fastExp, fastExpArray},
+		{"log", fastLog, fastLogArray},
+		{"ln", fastLog, fastLogArray},
+		{"log2", fastLog2, fastLog2Array},
+		{"lg", fastLog10, fastLog10Array},
+		{"log10", fastLog10, fastLog10Array},
+	};
+
+const FastMath::Function* FastMath::function(string_view name)
+{
+	for(const Function& function : s_functions)
+	{
+		if(function.name == name)
+		{
+			return &function;
+		}
+	}
+	return nullptr;
+}
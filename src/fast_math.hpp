@@ -0,0 +1,31 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <cstddef>
+#include <string_view>
+
+// Polynomial approximations of the most used built-in functions, selected by
+// Formula::Fast. Each comes in a scalar form and in a form over an array,
+// written without branches so the compiler can vectorize it; y may be x
+// itself, as a batch evaluates in place. Domain errors are reported like the
+// exact built-ins do.
+//
+// Measured maximum errors, see the precision/ benchmarks:
+//   sin, cos           absolute 3e-14 for |x| <= 1e5, exact beyond
+//   tan                relative 4e-14 away from the poles
+//   exp                relative 1e-11; results below exp(-708) flush to zero
+//   log, log2, log10   relative 4e-14
+namespace FastMath
+{
+	struct Function
+	{
+		std::string_view name;
+		double (*scalar)(double);
+		void (*vector)(const double*, double*, size_t);
+	};
+
+	// Null when name has no fast form.
+	const Function* function(std::string_view name);
+}
+
+#endif // FAST_MATH_H
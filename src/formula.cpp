@@ -1,6 +1,11 @@
 #include "../include/formula.hpp"
 #include "built_in.hpp"
+#include "fast_math.hpp"
+#include "formula_epoch.hpp"
+#include "formula_profile.hpp"
+#include "formula_program.hpp"
 
+#include <algorithm>
 #include <stack>
 #include <cmath>
 #include <math.h>
@@ -12,6 +17,17 @@ static bool isZero(double x)
     return (fabs(x) < 1E-6);
 }
 
+// A single rounding where the hardware fuses multiply-add, otherwise exactly
+// the separate multiplication and addition of the stack machine.
+static inline double multiplyAdd(double a, double b, double c)
+{
+#ifdef FP_FAST_FMA
+	return fma(a, b, c);
+#else
+	return a * b + c;
+#endif
+}
+
 static bool isNumber(char ch)
 {
     return ( (ch >= '0' && ch <= '9') || ch == '.');
@@ -119,24 +135,62 @@ int Formula::Token::outerPriority()const
 
 Formula::Formula() {}
 
-Formula::Formula(const string& str):
-    m_formula_string(str)
+Formula::Formula(const string& str)
+{
+	compile(str, nullptr);
+}
+
+Formula::Formula(string&& str)
 {
-	generatePostfix();
+	compile(std::move(str), nullptr);
 }
 
-Formula::Formula(const char* str):
-	m_formula_string(std::string(str))
+Formula::Formula(const char* str)
 {
-	generatePostfix();
+	compile(string(str), nullptr);
+}
+
+Formula::Formula(const string& str, FormulaArena& arena)
+{
+	compile(str, arena.m_impl);
+}
+
+Formula::Formula(const string& str, const FormulaContext& context)
+{
+	compile(str, nullptr);
+	bind(context.m_impl);
+}
+
+Formula::Formula(const string& str, const FormulaTiering& tiering)
+{
+	compile(str, nullptr, &tiering);
 }
 
 Formula& Formula::operator =(const string& str)
 {
-    Formula temp(str);
-    m_postfix = temp.m_postfix;
-    m_formula_string = temp.m_formula_string;
-    m_found_variables = temp.m_found_variables;
+	return (*this = string(str));
+}
+
+Formula& Formula::operator =(string&& str)
+{
+	// A formula built in an arena keeps compiling into it, one with tiering
+	// starts interpreted again with the same options, and one bound to a
+	// context stays bound.
+	FormulaTiering tiering = m_tiering ? m_tiering->options : FormulaTiering();
+	const FormulaTiering* options = m_tiering ? &tiering : nullptr;
+	if(m_program && m_program->arena)
+	{
+		compile(std::move(str), m_program->arena->shared_from_this(), options);
+	}
+	else
+	{
+		compile(std::move(str), nullptr, options);
+	}
+
+	if(m_binding)
+	{
+		bind(m_binding->context);
+	}
 
     return *this;
 }
@@ -148,73 +202,34 @@ Formula& Formula::operator =(const char* str)
 
 void Formula::check()const
 {
-	if( m_postfix.empty() )
+	if( !m_program )
 	{
 		return;
 	}
-	
-	stack<double> operants;
-	for(auto token = m_postfix.cbegin(); token != m_postfix.cend(); token++)
-	{
-		switch(token->type)
-		{
-			case Token::Error:
-			{
-				throw FormulaException(FormulaException::NOT_SUPPORTED_TOKEN, token->name);
-			}
-			case Token::Number:
-			case Token::Variable:
-			{
-				operants.push(0);
-				break;
-			}
-			case Token::Operator:
-			{
-				if(token->name != "+" &&
-				   token->name != "-" &&
-				   token->name != "*" &&
-				   token->name != "/" &&
-				   token->name != "^")
-				{
-					throw FormulaException(FormulaException::WRONG_FORMAT, token->name);
-				}
-
-				if(operants.size() < 2)
-				{
-					throw FormulaException(FormulaException::NOT_ENOUGH_OPERANDS, token->name);
-				}
-				
-				operants.pop();
-				break;
-			}
-			case Token::Function:
-			{
-				if(operants.empty())
-				{
-					throw FormulaException(FormulaException::NOT_ENOUGH_OPERANDS, token->name);
-				}
-
-				operants.pop();
 
-				if(m_defined_functions.count(token->name) == 0)
-				{
-					throw FormulaException(FormulaException::NOT_DEFINED_FUNCTION, token->name);
-				}
-				operants.push(0);
-				break;
-			}
-		}
+	if( !m_program->valid )
+	{
+		throw FormulaException(m_program->error, string(m_program->error_name));
 	}
 
-    if(operants.size() != 1)
+	shared_ptr<const Definitions> context = contextDefinitions();
+	for(unsigned i = 0; i < m_program->n_functions; i++)
 	{
-		throw FormulaException(FormulaException::WRONG_FORMAT);
+		string name(m_program->functions[i]);
+		if(definitions().functions.count(name) == 0 && !BuiltIn::function(name) &&
+		   (!context || context->functions.count(name) == 0))
+		{
+			throw FormulaException(FormulaException::NOT_DEFINED_FUNCTION, name);
+		}
 	}
 }
 
 ostream& operator <<(ostream& o, const Formula& f)
 {
-	o << f.m_formula_string;
+	if(f.m_program)
+	{
+		o << f.m_program->source;
+	}
 	return o;
 }
 
@@ -244,184 +259,664 @@ Formula& Formula::input(const string& str_promt)
 
 void Formula::clear()
 {
-    m_postfix.clear();
-    m_formula_string.clear();
-    m_found_variables.clear();
-    m_defined_variables.clear();
-    m_defined_functions.clear();
+    m_program.reset();
+    m_definitions.reset();
+    m_binding.reset();
+    m_tiering.reset();
+#ifdef FORMULA_PROFILING
+    m_profile.reset();
+#endif
 }
 
 bool Formula::empty()const
 {
-	return m_postfix.empty();
+	return !m_program || (m_program->valid && m_program->size == 0);
+}
+
+vector<string> Formula::variables()const
+{
+	vector<string> names;
+	if(m_program)
+	{
+		names.assign(m_program->variables, m_program->variables + m_program->n_variables);
+	}
+	return names;
 }
 
+vector<string> Formula::arguments()const
+{
+	shared_ptr<const Definitions> context = contextDefinitions();
+	vector<string> names;
+	for(const string& name : variables())
+	{
+		if(definitions().variables.count(name) == 0 && (!context || context->variables.count(name) == 0))
+		{
+			names.push_back(name);
+		}
+	}
+	return names;
+}
+
+// Definitions are shared between copies, so a change is made on a new copy.
 void Formula::define(const string& var_name, double value)
 {
-	m_defined_variables[var_name] = value;
+	shared_ptr<Definitions> definitions = make_shared<Definitions>(this->definitions());
+	definitions->variables[var_name] = value;
+	m_definitions = definitions;
+	if(m_binding)
+	{
+		bind(m_binding->context);
+	}
 }
 
 void Formula::define(const string& func_name, const std::function<double(double)>& f)
 {
-	m_defined_functions[func_name] = f;
+	shared_ptr<Definitions> definitions = make_shared<Definitions>(this->definitions());
+	definitions->functions[func_name] = f;
+	definitions->kernels.erase(func_name);
+	m_definitions = definitions;
+	if(m_binding)
+	{
+		bind(m_binding->context);
+	}
+}
+
+void Formula::define(const string& func_name, const std::function<void(const double*, double*, size_t)>& kernel)
+{
+	define(func_name, [kernel](double x)
+	{
+		double y;
+		kernel(&x, &y, 1);
+		return y;
+	}, kernel);
+}
+
+void Formula::define(const string& func_name, const std::function<double(double)>& f,
+	const std::function<void(const double*, double*, size_t)>& kernel)
+{
+	shared_ptr<Definitions> definitions = make_shared<Definitions>(this->definitions());
+	definitions->functions[func_name] = f;
+	definitions->kernels[func_name] = kernel;
+	m_definitions = definitions;
+	if(m_binding)
+	{
+		bind(m_binding->context);
+	}
+}
+
+const Formula::Definitions& Formula::definitions()const
+{
+	static const Definitions none;
+	return m_definitions ? *m_definitions : none;
+}
+
+shared_ptr<const Formula::Definitions> Formula::contextDefinitions()const
+{
+	return m_binding ? m_binding->context->snapshot() : nullptr;
 }
 
-double Formula::eval(const unordered_map<string, double>& variables)
+// User functions may have side effects, so callers that would run a row
+// twice ask first.
+bool Formula::callsUserFunctions()const
 {
-    if (m_postfix.empty())
+	if(empty() || !m_program->valid)
+	{
+		return false;
+	}
+
+	shared_ptr<const Definitions> context = contextDefinitions();
+	for(unsigned i = 0; i < m_program->n_functions; i++)
+	{
+		string name(m_program->functions[i]);
+		if(definitions().functions.count(name) != 0 || (context && context->functions.count(name) != 0))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// A binding belongs to one set of definitions and one precision, so it is
+// made anew when either changes.
+void Formula::bind(const shared_ptr<FormulaContext::Impl>& context)
+{
+	if(!m_program)
+	{
+		m_binding.reset();
+		return;
+	}
+
+	shared_ptr<Binding> binding = make_shared<Binding>();
+	binding->context = context;
+	binding->source = m_program;
+	binding->definitions = m_definitions;
+	binding->precision = m_precision;
+	context->bind(binding);
+	m_binding = binding;
+}
+
+const Formula::Program& Formula::compiled()const
+{
+    if (empty())
     {
         throw FormulaException(FormulaException::EMPTY_STRING);
     }
 
-	stack<double> operants;
+	if(!m_program->valid)
+	{
+		throw FormulaException(m_program->error, string(m_program->error_name));
+	}
+
+	return *m_program;
+}
+
+// The program run without a context.
+const Formula::Program& Formula::tiered()const
+{
+	return m_tiering ? m_tiering->program() : *m_program;
+}
+
+double Formula::eval(const unordered_map<string, double>& variables)const
+{
+	const Program& program = compiled();
+	if(!m_binding)
+	{
+		return evalNamed(tiered(), nullptr, variables);
+	}
+
+	// A given value overrides a context variable, so if one was folded the
+	// program is run as compiled.
+	Epoch::Guard guard;
+	const Binding::State& state = m_binding->current();
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		string name(program.variables[i]);
+		if(variables.count(name) != 0 && state.context->variables.count(name) != 0)
+		{
+			return evalNamed(program, state.context.get(), variables);
+		}
+	}
+	return evalNamed(*state.program, state.context.get(), variables);
+}
+
+double Formula::evalNamed(const Program& program, const Definitions* context, const unordered_map<string, double>& variables)const
+{
+	SmallBuffer<double, 16> values(program.n_variables);
+	SmallBuffer<bool, 16> undefined(program.n_variables);
+	bool missing = false;
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		string name(program.variables[i]);
+		undefined[i] = false;
+
+		auto given = variables.find(name);
+		if(given != variables.end())
+		{
+			values[i] = given->second;
+			continue;
+		}
+
+		if(!namedValue(context, name, values[i]))
+		{
+			undefined[i] = true;
+			missing = true;
+		}
+	}
+
+	if(missing)
+	{
+		program.undefinedVariable(undefined.data());
+	}
+
+	return run(program, context, values.data());
+}
+
+// A variable not given a value is looked up in the formula's definitions,
+// then in the context, then among the built-ins.
+bool Formula::namedValue(const Definitions* context, const string& name, double& value)const
+{
+	const Definitions& definitions = this->definitions();
+	auto defined = definitions.variables.find(name);
+	if(defined != definitions.variables.end())
+	{
+		value = defined->second;
+		return true;
+	}
+
+	if(context)
+	{
+		auto shared = context->variables.find(name);
+		if(shared != context->variables.end())
+		{
+			value = shared->second;
+			return true;
+		}
+	}
+
+	const double* built_in = BuiltIn::variable(name);
+	if(built_in)
+	{
+		value = *built_in;
+		return true;
+	}
+	return false;
+}
+
+// Context variables are folded into the program, so only the functions are
+// looked up in the context.
+double Formula::eval(const vector<double>& vector_variables)const
+{
+	compiled();
+	if(!m_binding)
+	{
+		return evalPositional(tiered(), nullptr, vector_variables);
+	}
+
+	Epoch::Guard guard;
+	const Binding::State& state = m_binding->current();
+	return evalPositional(*state.program, state.context.get(), vector_variables);
+}
+
+double Formula::evalPositional(const Program& program, const Definitions* context, const vector<double>& vector_variables)const
+{
+	SmallBuffer<double, 16> values(program.n_variables);
+	SmallBuffer<int, 16> argument(program.n_variables);
+	bindArguments(program, vector_variables.size(), values.data(), argument.data());
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		if(argument[i] >= 0)
+		{
+			values[i] = vector_variables[argument[i]];
+		}
+	}
+
+	return run(program, context, values.data());
+}
+
+// Variables not pre-defined take the positional arguments in dictionary
+// order; once those run out, only built-in constants can fill the rest.
+void Formula::bindArguments(const Program& program, size_t n_arguments, double* values, int* argument)const
+{
+	const Definitions& definitions = this->definitions();
+
+	size_t k = 0;
+	SmallBuffer<bool, 16> undefined(program.n_variables);
+	bool missing = false;
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		string name(program.variables[i]);
+		undefined[i] = false;
+		argument[i] = -1;
+		values[i] = 0.0;
+
+		auto defined = definitions.variables.find(name);
+		if(defined != definitions.variables.end())
+		{
+			values[i] = defined->second;
+			continue;
+		}
+
+		if(k < n_arguments)
+		{
+			argument[i] = k++;
+			continue;
+		}
+
+		const double* built_in = BuiltIn::variable(name);
+		if(built_in)
+		{
+			values[i] = *built_in;
+			continue;
+		}
+
+		undefined[i] = true;
+		missing = true;
+	}
+
+	if(missing)
+	{
+		program.undefinedVariable(undefined.data());
+	}
+}
+
+// Kernels, when asked for, are the array forms of the functions; null for
+// those that have none.
+void Formula::bindFunctions(const Program& program, const Definitions* context, BoundFunction* functions,
+	bool* user, BoundKernel* kernels)const
+{
+	const Definitions& definitions = this->definitions();
+
+	for(unsigned i = 0; i < program.n_functions; i++)
+	{
+		string name(program.functions[i]);
+		functions[i] = BoundFunction();
+		if(kernels)
+		{
+			kernels[i] = BoundKernel();
+		}
+
+		// User functions of the formula, then of the context.
+		const Definitions* owner = &definitions;
+		auto defined = definitions.functions.find(name);
+		if(defined == definitions.functions.end() && context)
+		{
+			owner = context;
+			defined = context->functions.find(name);
+		}
+		if(user)
+		{
+			user[i] = (defined != owner->functions.end());
+		}
+		if(defined != owner->functions.end())
+		{
+			functions[i].user = &defined->second;
+			auto kernel = owner->kernels.find(name);
+			if(kernels && kernel != owner->kernels.end())
+			{
+				kernels[i].user = &kernel->second;
+			}
+			continue;
+		}
+
+		if(m_precision == Fast)
+		{
+			const FastMath::Function* fast = FastMath::function(name);
+			if(fast)
+			{
+				functions[i].f = fast->scalar;
+				if(kernels)
+				{
+					kernels[i].f = fast->vector;
+				}
+				continue;
+			}
+		}
+
+		functions[i].f = BuiltIn::function(name);
+		if(!functions[i].f)
+		{
+			throw FormulaException(FormulaException::NOT_DEFINED_FUNCTION, name);
+		}
+	}
+}
+
+double Formula::run(const Program& program, const Definitions* context, const double* variables)const
+{
+
+#ifdef FORMULA_PROFILING
+	unsigned long long eval_start = Profile::clock();
+	SmallBuffer<bool, 8> user_function(program.n_functions);
+	bool* user = user_function.data();
+#else
+	bool* user = nullptr;
+#endif
+
+	SmallBuffer<BoundFunction, 8> functions(program.n_functions);
+	bindFunctions(program, context, functions.data(), user);
+
+	double result = (m_engine == RegisterMachine && program.lowered) ?
+		runRegisters(program, variables, functions.data(), user) :
+		runStack(program, variables, functions.data(), user);
+
+#ifdef FORMULA_PROFILING
+	m_profile->eval(Profile::clock() - eval_start);
+#endif
+
+	if( fabs( result ) <= 1E-6 )
+	{
+		return 0;
+	}
+	else
+	{
+		return result;
+	}
+}
+
+double Formula::runStack(const Program& program, const double* variables, const BoundFunction* functions, const bool* user)const
+{
+	(void)user;
+
+	// The bottom slot is set up front, so a program without code gives 0.
+	SmallBuffer<double, 32> stack(max(program.max_stack, 1u));
+	stack[0] = 0.0;
+	double* top = stack.data();
 
-	double x, y;
-	for(auto token = m_postfix.cbegin(); token != m_postfix.cend(); token++)
+	for(unsigned i = 0; i < program.size; i++)
 	{
-		switch(token->type)
+#ifdef FORMULA_PROFILING
+		unsigned long long instruction_start = Profile::clock();
+#endif
+
+		const Program::Instruction& instruction = program.code[i];
+		switch(instruction.op)
 		{
-			case Token::Error:
+			case Program::Const:
+			{
+				*top++ = instruction.value;
+				break;
+			}
+			case Program::Load:
+			{
+				*top++ = variables[instruction.arg];
+				break;
+			}
+			case Program::Add:
+			{
+				top--;
+				top[-1] += top[0];
+				break;
+			}
+			case Program::Sub:
 			{
-				throw FormulaException(FormulaException::NOT_SUPPORTED_TOKEN, token->name);
+				top--;
+				top[-1] -= top[0];
+				break;
 			}
-			case Token::Number:
+			case Program::Mul:
 			{
-				operants.push(token->data);
+				top--;
+				top[-1] *= top[0];
 				break;
 			}
-			case Token::Variable:
+			case Program::Div:
 			{
-				if(variables.count(token->name) != 0)
+				top--;
+				if(isZero(top[0]))
 				{
-					operants.push(variables.at(token->name));
+					throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
 				}
-				else if(m_defined_variables.count(token->name) != 0)
+				top[-1] /= top[0];
+				break;
+			}
+			case Program::Pow:
+			{
+				top--;
+				if(isZero(top[-1]) && top[0] < 0)
 				{
-					operants.push(m_defined_variables.at(token->name));
+					throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
 				}
-				else if(BuiltIn::s_built_in_variables().count(token->name) != 0)
+				top[-1] = pow(top[-1], top[0]);
+				break;
+			}
+			case Program::Call:
+			{
+				top[-1] = functions[instruction.arg](top[-1]);
+#ifdef FORMULA_PROFILING
+				if(user[instruction.arg])
 				{
-					operants.push(BuiltIn::s_built_in_variables().at(token->name));
+					m_profile->user_calls.fetch_add(1, memory_order_relaxed);
 				}
 				else
 				{
-					throw FormulaException(FormulaException::NOT_DEFINED_VARIABLE, token->name);
+					m_profile->built_in_calls.fetch_add(1, memory_order_relaxed);
 				}
+#endif
 				break;
 			}
-			case Token::Operator:
+			default:
 			{
-				if(token->name != "+" &&
-				   token->name != "-" &&
-				   token->name != "*" &&
-				   token->name != "/" &&
-				   token->name != "^")
-				{
-					throw FormulaException(FormulaException::WRONG_FORMAT);
-				}
+				// Superinstructions are only ever lowered to operations.
+				break;
+			}
+		}
 
-				if(operants.size() < 2)
-				{
-					throw FormulaException(FormulaException::NOT_ENOUGH_OPERANDS, token->name);
-				}
-				
-				y = operants.top();
-				operants.pop();
+#ifdef FORMULA_PROFILING
+		m_profile->instruction(program.origins[i], Profile::clock() - instruction_start);
+#endif
+	}
 
-				x = operants.top();
-				operants.pop();
+	return stack[0];
+}
 
-				if(token->name == "+") operants.push(x + y);
-				else if(token->name == "-") operants.push(x - y);
-				else if(token->name == "*") operants.push(x * y);
-				else if(token->name == "/")
-				{
-					if(isZero(y))
-					{
-						throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
-					}
-					operants.push(x / y);
-				}
-				else // if(token->name == "^")
+// Variables and constants are copied into their registers once; after that
+// only operators and calls are dispatched, each reading its operands from
+// and writing its result to a register.
+double Formula::runRegisters(const Program& program, const double* variables, const BoundFunction* functions, const bool* user)const
+{
+	(void)user;
+
+	SmallBuffer<double, 64> registers(program.n_registers);
+	double* r = registers.data();
+	copy(variables, variables + program.n_variables, r);
+	copy(program.constants, program.constants + program.n_constants, r + program.n_variables);
+
+	for(unsigned i = 0; i < program.n_operations; i++)
+	{
+#ifdef FORMULA_PROFILING
+		unsigned long long instruction_start = Profile::clock();
+#endif
+
+		const Program::Operation& operation = program.operations[i];
+		switch(operation.op)
+		{
+			case Program::Add:
+			{
+				r[operation.dst] = r[operation.lhs] + r[operation.rhs];
+				break;
+			}
+			case Program::Sub:
+			{
+				r[operation.dst] = r[operation.lhs] - r[operation.rhs];
+				break;
+			}
+			case Program::Mul:
+			{
+				r[operation.dst] = r[operation.lhs] * r[operation.rhs];
+				break;
+			}
+			case Program::Div:
+			{
+				if(isZero(r[operation.rhs]))
 				{
-					if(isZero(x) && y < 0)
-					{
-                        throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
-					}
-					operants.push(pow(x, y));
+					throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
 				}
-
+				r[operation.dst] = r[operation.lhs] / r[operation.rhs];
 				break;
 			}
-			case Token::Function:
+			case Program::Pow:
 			{
-				if(operants.empty())
+				if(isZero(r[operation.lhs]) && r[operation.rhs] < 0)
 				{
-					throw FormulaException(FormulaException::NOT_ENOUGH_OPERANDS, token->name);
+					throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
 				}
-
-				x = operants.top();
-				operants.pop();
-
-				if(m_defined_functions.count(token->name) != 0)
+				r[operation.dst] = pow(r[operation.lhs], r[operation.rhs]);
+				break;
+			}
+			case Program::MulAdd:
+			{
+				r[operation.dst] = multiplyAdd(r[operation.lhs], r[operation.rhs], r[operation.acc]);
+				break;
+			}
+			case Program::MulSub:
+			{
+				r[operation.dst] = multiplyAdd(r[operation.lhs], r[operation.rhs], -r[operation.acc]);
+				break;
+			}
+			case Program::NegMulAdd:
+			{
+				r[operation.dst] = multiplyAdd(-r[operation.lhs], r[operation.rhs], r[operation.acc]);
+				break;
+			}
+			case Program::PowInt:
+			{
+				r[operation.dst] = Program::integerPower(r[operation.lhs], operation.acc);
+				break;
+			}
+			case Program::PowNegInt:
+			{
+				if(isZero(r[operation.lhs]))
 				{
-					operants.push( m_defined_functions[token->name](x) );
+					throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
 				}
-				else if(BuiltIn::s_built_in_functions().count(token->name) != 0)
+				r[operation.dst] = 1.0 / Program::integerPower(r[operation.lhs], operation.acc);
+				break;
+			}
+			case Program::Sqrt:
+			{
+				// pow(-inf, 0.5) is +inf where sqrt gives NaN.
+				double x = r[operation.lhs];
+				r[operation.dst] = isinf(x) ? fabs(x) : sqrt(x);
+				break;
+			}
+			case Program::Call:
+			{
+				r[operation.dst] = functions[operation.rhs](r[operation.lhs]);
+#ifdef FORMULA_PROFILING
+				if(user[operation.rhs])
 				{
-					operants.push(BuiltIn::s_built_in_functions().at(token->name)(x) );
+					m_profile->user_calls.fetch_add(1, memory_order_relaxed);
 				}
 				else
 				{
-					throw FormulaException(FormulaException::NOT_DEFINED_FUNCTION, token->name);
+					m_profile->built_in_calls.fetch_add(1, memory_order_relaxed);
 				}
+#endif
+				break;
+			}
+			default:
+			{
+				break;
 			}
 		}
-	}
 
-    if(operants.size() != 1)
-	{
-		throw FormulaException(FormulaException::WRONG_FORMAT);
+#ifdef FORMULA_PROFILING
+		m_profile->instruction(program.origins[operation.source], Profile::clock() - instruction_start);
+#endif
 	}
-	else
+
+	return r[program.result];
+}
+
+void Formula::setEngine(Engine engine)
+{
+	m_engine = engine;
+}
+
+Formula::Engine Formula::engine()const
+{
+	return m_engine;
+}
+
+void Formula::setPrecision(Precision precision)
+{
+	m_precision = precision;
+	if(m_binding)
 	{
-		if( fabs( operants.top() ) <= 1E-6 )
-		{
-			return 0;
-		}
-		else
-		{
-			return operants.top();
-		}
+		bind(m_binding->context);
 	}
 }
 
-double Formula::eval(const vector<double>& vector_variables)
+Formula::Precision Formula::precision()const
 {
-    unsigned i = 0;
-    unordered_map<string, double> variables;
-    for (const string& name : m_found_variables)
-    {
-        if (!m_defined_variables.count(name))
-        {
-            if (i >= vector_variables.size())
-            {
-                break;
-            }
-            variables[name] = vector_variables[i];
-            i++;
-        }
-    }
-
-    return eval(variables);
+	return m_precision;
 }
 
-double Formula::operator ()(const unordered_map<string, double>& variables)
+double Formula::operator ()(const unordered_map<string, double>& variables)const
 {
     return eval(variables);
 }
 
-double Formula::operator ()(const vector<double>& vector_variales)
+double Formula::operator ()(const vector<double>& vector_variales)const
 {
     return eval(vector_variales);
 }
@@ -433,7 +928,7 @@ void Formula::preprocess(string& str)
 	// Delete all spaces in string.
 	for(auto it = str.begin(); it != str.end();)
 	{
-		if(BuiltIn::s_supported_chars().count(*it) == 0)
+		if(!BuiltIn::isSupported(*it))
 		{
 			string error_char;
 			error_char.push_back(*it);
@@ -503,39 +998,55 @@ Formula::Token Formula::getWord(const string& str, int& i)
 	else
 	{
 		token.type = Token::Variable;
-		m_found_variables.insert(token.name);
 	}
 	return token;
 }
 
 Formula::Token Formula::getToken(const string& str, int& i)
 {
+	int start = i;
+	Token token;
 	if( isNumber(str[i]) )
 	{
-		return getNumber(str, i);
+		token = getNumber(str, i);
 	}
 	else if( isOperator(str[i]) )
 	{
         i++;
-		return Token(str[i-1]);
+		token = Token(str[i-1]);
 	}
 	else
 	{
-		return getWord(str, i);
+		token = getWord(str, i);
 	}
+
+	token.pos = start;
+	token.length = i - start;
+	return token;
 }
 
-void Formula::generatePostfix()
+void Formula::compile(string source, const shared_ptr<FormulaArena::Impl>& arena, const FormulaTiering* tiering)
 {
-    stack<Token> operators;
+	preprocess(source);
+
+	shared_ptr<const Program> program = Program::compile(source, generatePostfix(source), arena, !tiering);
+#ifdef FORMULA_PROFILING
+	m_profile = make_shared<Profile>(program->size);
+#endif
+	m_program = program;
+	m_tiering = tiering ? make_shared<Tiering>(program, *tiering) : nullptr;
+}
 
-    preprocess(m_formula_string);
+vector<Formula::Token> Formula::generatePostfix(const string& str)
+{
+    vector<Token> postfix;
+    stack<Token> operators;
 
     operators.push( Token("#") );
 
-	int n = m_formula_string.size();
+	int n = str.size();
 	int i = 0;
-	Token token = getToken(m_formula_string, i);
+	Token token = getToken(str, i);
 
     while(i < n || operators.top().name != "#")
 	{
@@ -546,8 +1057,8 @@ void Formula::generatePostfix()
 		
 		if(token.type == Token::Number || token.type == Token::Variable)
 		{
-			m_postfix.push_back(token);
-			token = getToken(m_formula_string, i);
+			postfix.push_back(token);
+			token = getToken(str, i);
 		}
 		else
 		{
@@ -556,11 +1067,11 @@ void Formula::generatePostfix()
 			if( outer_priority > inner_priority )
 			{
 				operators.push( token );
-				token = getToken(m_formula_string, i);
+				token = getToken(str, i);
 			}
 			else if( outer_priority < inner_priority )
 			{
-				m_postfix.push_back( operators.top() );
+				postfix.push_back( operators.top() );
 				operators.pop();
 			}
 			else //if( outer_priority == inner_priority )
@@ -569,9 +1080,11 @@ void Formula::generatePostfix()
 				operators.pop();
 				if( token_temp.name == "(" )
 				{
-					token = getToken(m_formula_string, i);
+					token = getToken(str, i);
 				}
 			}
 		}
 	}
+
+	return postfix;
 }
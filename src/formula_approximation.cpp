@@ -0,0 +1,448 @@
+#include "../include/formula.hpp"
+#include "formula_epoch.hpp"
+#include "formula_program.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+#include <string>
+
+using namespace std;
+
+static const double PI = 3.14159265358979323846;
+
+// Largest degree of a piece per variable, and the Chebyshev nodes fitting it.
+static const unsigned DEGREE = 8;
+static const unsigned NODES = DEGREE + 1;
+
+// Points per variable, evenly spaced with the ends, where the error of a
+// piece is checked.
+static const unsigned CHECKS = 2 * DEGREE + 3;
+
+// A piece is halved at most this many times per variable: the table has at
+// most 2^16 cells.
+static const unsigned MAX_DEPTH[] = {16, 8};
+
+namespace
+{
+	// Piece of the range at position index among the 2^depth along each
+	// variable.
+	struct Box
+	{
+		unsigned index[2];
+		unsigned depth[2];
+	};
+
+	// Chebyshev series of the fit, and its tail beyond each degree.
+	struct Series
+	{
+		double coefficients[NODES][NODES];
+		unsigned degree[2];
+	};
+}
+
+FormulaApproximation::FormulaApproximation()
+{
+}
+
+double FormulaApproximation::eval(const vector<double>& variables)const
+{
+	if(!m_dimensions || variables.size() != m_dimensions)
+	{
+		throw FormulaException(FormulaException::SIZE_MISMATCH,
+			"approximation of " + to_string(m_dimensions) + " variables given " + to_string(variables.size()));
+	}
+	return evalAt(variables[0], m_dimensions == 2 ? variables[1] : 0.0);
+}
+
+void FormulaApproximation::evalBatch(const vector<const double*>& columns, size_t n_rows, double* results)const
+{
+	if(!m_dimensions || columns.size() != m_dimensions)
+	{
+		throw FormulaException(FormulaException::SIZE_MISMATCH,
+			"approximation of " + to_string(m_dimensions) + " variables given " + to_string(columns.size()) + " columns");
+	}
+	const double* x = columns[0];
+	if(m_dimensions == 1)
+	{
+		for(size_t row = 0; row < n_rows; row++)
+		{
+			results[row] = evalAt(x[row], 0.0);
+		}
+		return;
+	}
+	const double* y = columns[1];
+	for(size_t row = 0; row < n_rows; row++)
+	{
+		results[row] = evalAt(x[row], y[row]);
+	}
+}
+
+vector<double> FormulaApproximation::evalBatch(const vector<vector<double> >& columns)const
+{
+	size_t n_rows = columns.empty() ? 0 : columns[0].size();
+
+	vector<const double*> pointers;
+	for(const vector<double>& column : columns)
+	{
+		if(column.size() != n_rows)
+		{
+			throw FormulaException(FormulaException::SIZE_MISMATCH, "columns have different lengths");
+		}
+		pointers.push_back(column.data());
+	}
+
+	vector<double> results(n_rows);
+	evalBatch(pointers, n_rows, results.data());
+	return results;
+}
+
+unsigned FormulaApproximation::dimensions()const
+{
+	return m_dimensions;
+}
+
+size_t FormulaApproximation::pieces()const
+{
+	return m_pieces.size();
+}
+
+double FormulaApproximation::error()const
+{
+	return m_error;
+}
+
+// Pieces are fitted one at a time, smallest first in no particular order:
+// the formula is sampled at the Chebyshev nodes of a piece, the series is
+// cut where its tail is below a fraction of the tolerance, turned into a
+// polynomial and checked against the formula on a finer grid. A piece that
+// fails, even with all the terms, is halved along the variable whose last
+// terms are largest. The formula is sampled through evalBatch's blocks,
+// before small results are rounded to 0, so user functions are called a
+// block at a time.
+FormulaApproximation Formula::approximate(const vector<FormulaInterval>& range, double tolerance)const
+{
+	compiled();
+	unsigned dimensions = (unsigned)range.size();
+	if(dimensions < 1 || dimensions > 2)
+	{
+		throw FormulaException(FormulaException::SIZE_MISMATCH, "approximate takes one or two ranges");
+	}
+	for(const FormulaInterval& interval : range)
+	{
+		if(!(interval.lower < interval.upper) || !isfinite(interval.lower) || !isfinite(interval.upper))
+		{
+			ostringstream out;
+			out << "approximation over [" << interval.lower << ", " << interval.upper << "]";
+			throw FormulaException(FormulaException::INVALID_RANGE, out.str());
+		}
+	}
+	if(!(tolerance > 0))
+	{
+		ostringstream out;
+		out << "tolerance " << tolerance;
+		throw FormulaException(FormulaException::INVALID_RANGE, out.str());
+	}
+
+	Epoch::Guard guard;
+	const Binding::State* state = m_binding ? &m_binding->current() : nullptr;
+	Batch batch(*this, state ? *state->program : tiered(), state ? state->context.get() : nullptr,
+		vector<const double*>(dimensions));
+
+	// Values of the formula at the points of a grid, the last variable
+	// varying fastest.
+	vector<double> columns[2];
+	vector<double> values;
+	auto sample = [&](const vector<double>* axes)
+	{
+		size_t n_rows = dimensions == 1 ? axes[0].size() : axes[0].size() * axes[1].size();
+		for(unsigned d = 0; d < dimensions; d++)
+		{
+			columns[d].resize(n_rows);
+		}
+		for(size_t row = 0; row < n_rows; row++)
+		{
+			columns[0][row] = axes[0][dimensions == 1 ? row : row / axes[1].size()];
+			if(dimensions == 2)
+			{
+				columns[1][row] = axes[1][row % axes[1].size()];
+			}
+		}
+		values.resize(n_rows);
+		for(unsigned d = 0; d < dimensions; d++)
+		{
+			batch.columns[d] = columns[d].data();
+		}
+		for(size_t row = 0; row < n_rows; row += BATCH_BLOCK)
+		{
+			size_t m = min(BATCH_BLOCK, n_rows - row);
+			copy_n(batch.run(row, m), m, &values[row]);
+		}
+	};
+
+	// cheb[j][k] = 2/N cos(pi j (k + 1/2) / N), halved for j = 0: the series
+	// from the values at the nodes. power[j][i] is the coefficient of t^i in
+	// the Chebyshev polynomial T_j.
+	double cheb[NODES][NODES];
+	double power[NODES][NODES] = {};
+	for(unsigned j = 0; j < NODES; j++)
+	{
+		for(unsigned k = 0; k < NODES; k++)
+		{
+			cheb[j][k] = (j ? 2.0 : 1.0) / NODES * cos(PI * j * (k + 0.5) / NODES);
+		}
+		if(j == 0)
+		{
+			power[0][0] = 1.0;
+		}
+		else if(j == 1)
+		{
+			power[1][1] = 1.0;
+		}
+		else
+		{
+			for(unsigned i = 0; i < NODES; i++)
+			{
+				power[j][i] = (i ? 2 * power[j - 1][i - 1] : 0.0) - power[j - 2][i];
+			}
+		}
+	}
+
+	FormulaApproximation approximation;
+	approximation.m_dimensions = dimensions;
+	for(unsigned d = 0; d < 2; d++)
+	{
+		approximation.m_lower[d] = d < dimensions ? range[d].lower : 0.0;
+		approximation.m_upper[d] = d < dimensions ? range[d].upper : 0.0;
+	}
+
+	auto bounds = [&](const Box& box, unsigned d, double& lower, double& upper)
+	{
+		double width = (range[d].upper - range[d].lower) / (1u << box.depth[d]);
+		lower = range[d].lower + width * box.index[d];
+		upper = box.index[d] + 1 == (1u << box.depth[d]) ? range[d].upper : lower + width;
+	};
+
+	vector<Box> boxes(1, Box{{0, 0}, {0, 0}});
+	vector<Box> fitted;
+	vector<double> axes[2];
+	while(!boxes.empty())
+	{
+		Box box = boxes.back();
+		boxes.pop_back();
+
+		FormulaApproximation::Piece piece;
+		double lower[2] = {0.0, 0.0};
+		double upper[2] = {0.0, 0.0};
+		for(unsigned d = 0; d < 2; d++)
+		{
+			if(d < dimensions)
+			{
+				bounds(box, d, lower[d], upper[d]);
+			}
+			piece.center[d] = 0.5 * (lower[d] + upper[d]);
+			piece.scale[d] = d < dimensions ? 2 / (upper[d] - lower[d]) : 0.0;
+		}
+
+		// Nodes x_k = cos(pi (k + 1/2) / N) over the piece.
+		for(unsigned d = 0; d < dimensions; d++)
+		{
+			axes[d].resize(NODES);
+			for(unsigned k = 0; k < NODES; k++)
+			{
+				axes[d][k] = piece.center[d] + cos(PI * (k + 0.5) / NODES) / piece.scale[d];
+			}
+		}
+		sample(axes);
+
+		Series series = {};
+		unsigned nodes[2] = {NODES, dimensions == 2 ? NODES : 1};
+		for(unsigned j = 0; j < nodes[0]; j++)
+		{
+			for(unsigned m = 0; m < nodes[1]; m++)
+			{
+				double sum = 0.0;
+				for(unsigned k = 0; k < nodes[0]; k++)
+				{
+					for(unsigned l = 0; l < nodes[1]; l++)
+					{
+						sum += cheb[j][k] * (dimensions == 2 ? cheb[m][l] : 1.0) * values[k * nodes[1] + l];
+					}
+				}
+				series.coefficients[j][m] = sum;
+			}
+		}
+
+		// Smallest degrees whose dropped terms sum to at most half the
+		// tolerance, shared between the variables.
+		double tail[2][NODES + 1] = {};
+		for(unsigned j = NODES; j-- > 0;)
+		{
+			for(unsigned m = 0; m < nodes[1]; m++)
+			{
+				tail[0][j] += fabs(series.coefficients[j][m]);
+			}
+			tail[0][j] += tail[0][j + 1];
+		}
+		for(unsigned m = nodes[1]; m-- > 0;)
+		{
+			for(unsigned j = 0; j < nodes[0]; j++)
+			{
+				tail[1][m] += fabs(series.coefficients[j][m]);
+			}
+			tail[1][m] += tail[1][m + 1];
+		}
+		for(unsigned d = 0; d < 2; d++)
+		{
+			series.degree[d] = 0;
+			while(series.degree[d] + 1 < nodes[d] && tail[d][series.degree[d] + 1] > tolerance / (2 * dimensions))
+			{
+				series.degree[d]++;
+			}
+		}
+
+		// The checks do not depend on the degree.
+		for(unsigned d = 0; d < dimensions; d++)
+		{
+			axes[d].resize(CHECKS);
+			for(unsigned q = 0; q < CHECKS; q++)
+			{
+				axes[d][q] = q + 1 == CHECKS ? upper[d] : lower[d] + (upper[d] - lower[d]) * q / (CHECKS - 1);
+			}
+		}
+		sample(axes);
+		vector<double> expected = values;
+
+		bool accepted = false;
+		double error = 0.0;
+		for(int attempt = 0; attempt < 2 && !accepted; attempt++)
+		{
+			if(attempt == 1)
+			{
+				if(series.degree[0] + 1 == nodes[0] && series.degree[1] + 1 == nodes[1])
+				{
+					break;
+				}
+				series.degree[0] = nodes[0] - 1;
+				series.degree[1] = nodes[1] - 1;
+			}
+
+			piece.degree[0] = series.degree[0];
+			piece.degree[1] = series.degree[1];
+			piece.offset = (unsigned)approximation.m_coefficients.size();
+			for(unsigned i = 0; i <= piece.degree[0]; i++)
+			{
+				for(unsigned k = 0; k <= piece.degree[1]; k++)
+				{
+					double sum = 0.0;
+					for(unsigned j = i; j <= piece.degree[0]; j++)
+					{
+						for(unsigned m = k; m <= piece.degree[1]; m++)
+						{
+							sum += series.coefficients[j][m] * power[j][i] * (dimensions == 2 ? power[m][k] : 1.0);
+						}
+					}
+					approximation.m_coefficients.push_back(sum);
+				}
+			}
+
+			// Checked as evaluated, before rounding small results to 0.
+			error = 0.0;
+			size_t n = dimensions == 2 ? CHECKS : 1;
+			for(size_t row = 0; row < expected.size() && error == error; row++)
+			{
+				double x = axes[0][row / n];
+				double y = dimensions == 2 ? axes[1][row % n] : 0.0;
+				const double* c = &approximation.m_coefficients[piece.offset];
+				double t = (x - piece.center[0]) * piece.scale[0];
+				double u = (y - piece.center[1]) * piece.scale[1];
+				double result = 0.0;
+				for(unsigned i = piece.degree[0] + 1; i-- > 0;)
+				{
+					double value = 0.0;
+					for(unsigned k = piece.degree[1] + 1; k-- > 0;)
+					{
+						value = value * u + c[i * (piece.degree[1] + 1) + k];
+					}
+					result = result * t + value;
+				}
+				error = max(error, fabs(result - expected[row]));
+				if(expected[row] != expected[row] || result != result)
+				{
+					error = expected[row];
+				}
+			}
+
+			accepted = error <= tolerance;
+			if(!accepted)
+			{
+				approximation.m_coefficients.resize(piece.offset);
+			}
+		}
+
+		if(accepted)
+		{
+			approximation.m_pieces.push_back(piece);
+			approximation.m_error = max(approximation.m_error, error);
+			fitted.push_back(box);
+			continue;
+		}
+
+		// Halved along the variable whose last two terms are largest.
+		unsigned axis = 0;
+		if(dimensions == 2)
+		{
+			double last[2] = {tail[0][NODES - 2], tail[1][NODES - 2]};
+			axis = last[1] > last[0] ? 1 : 0;
+			if(box.depth[axis] == MAX_DEPTH[1])
+			{
+				axis = 1 - axis;
+			}
+		}
+		if(box.depth[axis] == MAX_DEPTH[dimensions - 1])
+		{
+			ostringstream out;
+			out << "error " << error << " over [" << lower[0] << ", " << upper[0] << "]";
+			if(dimensions == 2)
+			{
+				out << " x [" << lower[1] << ", " << upper[1] << "]";
+			}
+			out << ", tolerance " << tolerance;
+			throw FormulaException(FormulaException::TOLERANCE_NOT_MET, out.str());
+		}
+		for(unsigned half = 0; half < 2; half++)
+		{
+			Box child = box;
+			child.index[axis] = 2 * box.index[axis] + half;
+			child.depth[axis]++;
+			boxes.push_back(child);
+		}
+	}
+
+	// Cells of the smallest pieces.
+	unsigned depth[2] = {0, 0};
+	for(const Box& box : fitted)
+	{
+		depth[0] = max(depth[0], box.depth[0]);
+		depth[1] = max(depth[1], box.depth[1]);
+	}
+	for(unsigned d = 0; d < 2; d++)
+	{
+		approximation.m_cells[d] = 1u << depth[d];
+		approximation.m_cell_scale[d] = d < dimensions ? approximation.m_cells[d] / (range[d].upper - range[d].lower) : 0.0;
+	}
+	approximation.m_table.resize((size_t)approximation.m_cells[0] * approximation.m_cells[1]);
+	for(size_t p = 0; p < fitted.size(); p++)
+	{
+		const Box& box = fitted[p];
+		unsigned span[2] = {1u << (depth[0] - box.depth[0]), 1u << (depth[1] - box.depth[1])};
+		for(unsigned i = box.index[0] * span[0]; i < (box.index[0] + 1) * span[0]; i++)
+		{
+			for(unsigned k = box.index[1] * span[1]; k < (box.index[1] + 1) * span[1]; k++)
+			{
+				approximation.m_table[(size_t)i * approximation.m_cells[1] + k] = (uint32_t)p;
+			}
+		}
+	}
+	return approximation;
+}
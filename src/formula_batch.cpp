@@ -0,0 +1,695 @@
+#include "../include/formula.hpp"
+#include "built_in.hpp"
+#include "formula_epoch.hpp"
+#include "formula_program.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <thread>
+
+using namespace std;
+
+Formula::Batch::Batch(const Program& _program):
+program(_program),
+values(_program.n_variables),
+argument(_program.n_variables),
+functions(_program.n_functions),
+kernels(_program.n_functions),
+constants(_program.n_variables * BATCH_BLOCK),
+variables(_program.n_variables),
+buffers((_program.horner_stack + 1) * BATCH_BLOCK),
+levels(_program.horner_stack),
+stack(_program.horner_stack)
+{
+	for(unsigned i = 0; i < program.horner_stack; i++)
+	{
+		levels[i] = &buffers[i * BATCH_BLOCK];
+	}
+	spare = &buffers[program.horner_stack * BATCH_BLOCK];
+}
+
+Formula::Batch::Batch(const Formula& formula, const Program& _program, const Definitions* context, const vector<const double*>& _columns):
+Batch(_program)
+{
+	columns = _columns;
+	formula.bindArguments(program, columns.size(), values.data(), argument.data());
+	formula.bindFunctions(program, context, functions.data(), nullptr, kernels.data());
+	bindConstants();
+}
+
+Formula::Batch::Batch(const Formula& formula, const Program& _program, const Definitions* context, const FormulaRecords& records):
+Batch(_program)
+{
+	SmallBuffer<bool, 16> undefined(program.n_variables);
+	bool missing = false;
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		string name(program.variables[i]);
+		undefined[i] = false;
+		argument[i] = -1;
+		values[i] = 0.0;
+		if(records.offsets.count(name) != 0)
+		{
+			argument[i] = columns.size();
+			columns.push_back(nullptr);
+		}
+		else if(!formula.namedValue(context, name, values[i]))
+		{
+			undefined[i] = true;
+			missing = true;
+		}
+	}
+	if(missing)
+	{
+		program.undefinedVariable(undefined.data());
+	}
+
+	formula.bindFunctions(program, context, functions.data(), nullptr, kernels.data());
+	bindConstants();
+}
+
+// Variables not taken from a column hold the same value in every row.
+void Formula::Batch::bindConstants()
+{
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		if(argument[i] < 0)
+		{
+			fill_n(&constants[i * BATCH_BLOCK], BATCH_BLOCK, values[i]);
+			variables[i] = &constants[i * BATCH_BLOCK];
+		}
+	}
+}
+
+const double* Formula::Batch::run(size_t row, size_t m)
+{
+	// Polynomials run in Horner form, without a pow() per term and row.
+	size_t top = 0;
+	for(unsigned i = 0; i < program.horner_size; i++)
+	{
+		const Program::Instruction& instruction = program.horner_code[i];
+		if(instruction.op == Program::Const)
+		{
+			double* out = levels[top];
+			fill_n(out, m, instruction.value);
+			stack[top++] = out;
+			continue;
+		}
+
+		if(instruction.op == Program::Load)
+		{
+			int k = argument[instruction.arg];
+			stack[top++] = k >= 0 ? columns[k] + row : variables[instruction.arg];
+			continue;
+		}
+
+		if(instruction.op == Program::Call)
+		{
+			const double* x = stack[top - 1];
+			double* out = levels[top - 1];
+			if(kernels[instruction.arg])
+			{
+				// A kernel writes to the spare buffer, never to its input,
+				// and the level takes that buffer in exchange for its own.
+				kernels[instruction.arg](x, spare, m);
+				swap(levels[top - 1], spare);
+				out = levels[top - 1];
+			}
+			else if(functions[instruction.arg].f)
+			{
+				double (*f)(double) = functions[instruction.arg].f;
+				for(size_t j = 0; j < m; j++)
+				{
+					out[j] = f(x[j]);
+				}
+			}
+			else
+			{
+				const std::function<double(double)>& f = *functions[instruction.arg].user;
+				for(size_t j = 0; j < m; j++)
+				{
+					out[j] = f(x[j]);
+				}
+			}
+			stack[top - 1] = out;
+			continue;
+		}
+
+		top--;
+		const double* x = stack[top - 1];
+		const double* y = stack[top];
+		double* out = levels[top - 1];
+		switch(instruction.op)
+		{
+			case Program::Add:
+			{
+				for(size_t j = 0; j < m; j++) out[j] = x[j] + y[j];
+				break;
+			}
+			case Program::Sub:
+			{
+				for(size_t j = 0; j < m; j++) out[j] = x[j] - y[j];
+				break;
+			}
+			case Program::Mul:
+			{
+				for(size_t j = 0; j < m; j++) out[j] = x[j] * y[j];
+				break;
+			}
+			case Program::Div:
+			{
+				bool zero = false;
+				for(size_t j = 0; j < m; j++) zero |= fabs(y[j]) < 1E-6;
+				if(zero)
+				{
+					throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
+				}
+				for(size_t j = 0; j < m; j++) out[j] = x[j] / y[j];
+				break;
+			}
+			default: // case Program::Pow:
+			{
+				// A constant exponent is applied as the register form of
+				// eval applies it, so both agree to the bit.
+				const Program::Instruction& exponent = program.horner_code[i - 1];
+				if(exponent.op == Program::Const && Program::integerExponent(exponent.value))
+				{
+					unsigned n = (unsigned)fabs(exponent.value);
+					if(exponent.value > 0)
+					{
+						for(size_t j = 0; j < m; j++) out[j] = Program::integerPower(x[j], n);
+						break;
+					}
+					for(size_t j = 0; j < m; j++)
+					{
+						if(BuiltIn::isZero(x[j]))
+						{
+							throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
+						}
+					}
+					for(size_t j = 0; j < m; j++) out[j] = 1.0 / Program::integerPower(x[j], n);
+					break;
+				}
+				if(exponent.op == Program::Const && exponent.value == 0.5)
+				{
+					// pow(-inf, 0.5) is +inf where sqrt gives NaN.
+					for(size_t j = 0; j < m; j++) out[j] = isinf(x[j]) ? fabs(x[j]) : sqrt(x[j]);
+					break;
+				}
+
+				for(size_t j = 0; j < m; j++)
+				{
+					if(BuiltIn::isZero(x[j]) && y[j] < 0)
+					{
+						throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
+					}
+					out[j] = pow(x[j], y[j]);
+				}
+				break;
+			}
+		}
+		stack[top - 1] = out;
+	}
+	return stack[0];
+}
+
+void Formula::evalBatch(const vector<const double*>& columns, size_t n_rows, double* results)const
+{
+	compiled();
+
+	// A formula bound to a context runs its folded program; the guard keeps
+	// it alive for the whole call.
+	Epoch::Guard guard;
+	const Binding::State* state = m_binding ? &m_binding->current() : nullptr;
+	Batch batch(*this, state ? *state->program : tiered(), state ? state->context.get() : nullptr, columns);
+
+	for(size_t row = 0; row < n_rows; row += BATCH_BLOCK)
+	{
+		size_t m = min(BATCH_BLOCK, n_rows - row);
+		const double* result = batch.run(row, m);
+		for(size_t j = 0; j < m; j++)
+		{
+			results[row + j] = fabs(result[j]) <= 1E-6 ? 0 : result[j];
+		}
+	}
+}
+
+vector<double> Formula::evalBatch(const vector<vector<double> >& columns)const
+{
+	size_t n_rows = columns.empty() ? 0 : columns[0].size();
+
+	vector<const double*> pointers;
+	for(const vector<double>& column : columns)
+	{
+		if(column.size() != n_rows)
+		{
+			throw FormulaException(FormulaException::SIZE_MISMATCH, "columns have different lengths");
+		}
+		pointers.push_back(column.data());
+	}
+
+	vector<double> results(n_rows);
+	evalBatch(pointers, n_rows, results.data());
+	return results;
+}
+
+FormulaRecords::FormulaRecords(const void* _base, size_t _stride, const unordered_map<string, size_t>& _offsets):
+base(_base),
+stride(_stride),
+offsets(_offsets)
+{
+}
+
+// Each block of rows is gathered from the records into one buffer per
+// variable, then run as columns, so the records are read once and never
+// transposed as a whole. A variable of records that are plain aligned
+// doubles is a column already and is read in place.
+void Formula::evalBatch(const FormulaRecords& records, size_t n_rows, double* results, size_t results_stride)const
+{
+	const Program& compiled = this->compiled();
+
+	// A record overrides a context variable, as a value given to eval
+	// does, so if one was folded the program is run as compiled.
+	Epoch::Guard guard;
+	const Binding::State* state = m_binding ? &m_binding->current() : nullptr;
+	const Program* program = state ? state->program.get() : &tiered();
+	for(unsigned i = 0; state && i < compiled.n_variables; i++)
+	{
+		string name(compiled.variables[i]);
+		if(records.offsets.count(name) != 0 && state->context->variables.count(name) != 0)
+		{
+			program = &compiled;
+			break;
+		}
+	}
+	Batch batch(*this, *program, state ? state->context.get() : nullptr, records);
+
+	vector<size_t> offsets(batch.columns.size());
+	for(unsigned i = 0; i < program->n_variables; i++)
+	{
+		if(batch.argument[i] >= 0)
+		{
+			offsets[batch.argument[i]] = records.offsets.find(string(program->variables[i]))->second;
+		}
+	}
+
+	const char* base = (const char*)records.base;
+	vector<double> gathered(offsets.size() * BATCH_BLOCK);
+	for(size_t row = 0; row < n_rows; row += BATCH_BLOCK)
+	{
+		size_t m = min(BATCH_BLOCK, n_rows - row);
+		const char* first = base + row * records.stride;
+		for(size_t k = 0; k < offsets.size(); k++)
+		{
+			const char* in = first + offsets[k];
+			if(records.stride == sizeof(double) && (uintptr_t)in % alignof(double) == 0)
+			{
+				batch.columns[k] = (const double*)in;
+				continue;
+			}
+			double* out = &gathered[k * BATCH_BLOCK];
+			for(size_t j = 0; j < m; j++)
+			{
+				memcpy(&out[j], in + j * records.stride, sizeof(double));
+			}
+			batch.columns[k] = out;
+		}
+
+		const double* result = batch.run(0, m);
+		char* out = (char*)results + row * results_stride;
+		for(size_t j = 0; j < m; j++)
+		{
+			double value = fabs(result[j]) <= 1E-6 ? 0 : result[j];
+			memcpy(out + j * results_stride, &value, sizeof(double));
+		}
+	}
+}
+
+// Rows processed by a thread at a time. They are cut into chunks the same way
+// for any number of threads, so a reduction combining one partial result per
+// chunk in row order does not depend on it.
+static const size_t CHUNK_ROWS = 16 * BATCH_BLOCK;
+
+static unsigned chunkThreads(unsigned threads, size_t n_chunks)
+{
+	threads = threads ? threads : max(1u, thread::hardware_concurrency());
+	return (unsigned)max<size_t>(1, min<size_t>(threads, n_chunks));
+}
+
+// Calls work(k, chunk) for every chunk, where k < n_threads is the thread
+// running it; the calling thread is thread 0. Once a chunk fails, those
+// after it are skipped and the error of the first failing one is thrown, as
+// a single thread running the chunks in order would.
+template<typename Work>
+static void forEachChunk(size_t n_chunks, unsigned n_threads, const Work& work)
+{
+	vector<exception_ptr> errors(n_chunks);
+	atomic<size_t> next{0};
+	atomic<size_t> failed{n_chunks};
+	auto run = [&](unsigned k)
+	{
+		for(size_t chunk = next++; chunk < n_chunks; chunk = next++)
+		{
+			if(chunk > failed)
+			{
+				continue;
+			}
+			try
+			{
+				work(k, chunk);
+			}
+			catch(...)
+			{
+				errors[chunk] = current_exception();
+				for(size_t first = failed; chunk < first && !failed.compare_exchange_weak(first, chunk);)
+				{
+				}
+			}
+		}
+	};
+
+	vector<thread> workers;
+	for(unsigned k = 1; k < n_threads; k++)
+	{
+		workers.emplace_back(run, k);
+	}
+	run(0);
+	for(thread& worker : workers)
+	{
+		worker.join();
+	}
+	if(failed < n_chunks)
+	{
+		rethrow_exception(errors[failed]);
+	}
+}
+
+namespace
+{
+	struct Partial
+	{
+		double sum = 0.0;
+		double min = numeric_limits<double>::infinity();
+		double max = -numeric_limits<double>::infinity();
+		size_t argmin = FormulaReduction::NONE;
+		size_t argmax = FormulaReduction::NONE;
+	};
+}
+
+double FormulaReduction::mean()const
+{
+	return count ? sum / count : numeric_limits<double>::quiet_NaN();
+}
+
+FormulaReduction Formula::reduce(const vector<const double*>& columns, size_t n_rows, const FormulaReduction::Options& options)const
+{
+	compiled();
+	if(options.bins && !(options.low < options.high))
+	{
+		throw FormulaException(FormulaException::INVALID_RANGE,
+			"histogram [" + to_string(options.low) + ", " + to_string(options.high) + ")");
+	}
+
+	Epoch::Guard guard;
+	const Binding::State* state = m_binding ? &m_binding->current() : nullptr;
+	const Program& program = state ? *state->program : tiered();
+	const Definitions* context = state ? state->context.get() : nullptr;
+
+	size_t n_chunks = (n_rows + CHUNK_ROWS - 1) / CHUNK_ROWS;
+	vector<Partial> partials(n_chunks);
+
+	// Four running sums, so the additions of a block overlap. NaN results
+	// fail every comparison, so the extrema skip them.
+	auto fold = [](Partial& partial, const double* x, size_t row, size_t m)
+	{
+		double sums[4] = {0.0, 0.0, 0.0, 0.0};
+		double low = partial.min;
+		double high = partial.max;
+		size_t j = 0;
+		for(; j + 4 <= m; j += 4)
+		{
+			for(size_t k = 0; k < 4; k++)
+			{
+				sums[k] += x[j + k];
+				low = x[j + k] < low ? x[j + k] : low;
+				high = x[j + k] > high ? x[j + k] : high;
+			}
+		}
+		for(; j < m; j++)
+		{
+			sums[0] += x[j];
+			low = x[j] < low ? x[j] : low;
+			high = x[j] > high ? x[j] : high;
+		}
+		partial.sum += (sums[0] + sums[1]) + (sums[2] + sums[3]);
+
+		// Only a block holding a new extremum is searched for its row.
+		if(low < partial.min || partial.argmin == FormulaReduction::NONE)
+		{
+			size_t i = find(x, x + m, low) - x;
+			if(i < m)
+			{
+				partial.min = low;
+				partial.argmin = row + i;
+			}
+		}
+		if(high > partial.max || partial.argmax == FormulaReduction::NONE)
+		{
+			size_t i = find(x, x + m, high) - x;
+			if(i < m)
+			{
+				partial.max = high;
+				partial.argmax = row + i;
+			}
+		}
+	};
+
+	double scale = options.bins / (options.high - options.low);
+	auto count = [&](vector<size_t>& histogram, size_t& below, size_t& above, const double* x, size_t m)
+	{
+		for(size_t j = 0; j < m; j++)
+		{
+			if(x[j] < options.low)
+			{
+				below++;
+			}
+			else if(x[j] >= options.high)
+			{
+				above++;
+			}
+			else if(x[j] == x[j])
+			{
+				histogram[min(options.bins - 1, (size_t)((x[j] - options.low) * scale))]++;
+			}
+		}
+	};
+
+	// Each thread counts into a histogram of its own; the counts add up
+	// exactly.
+	unsigned n_threads = chunkThreads(options.threads, n_chunks);
+	vector<unique_ptr<Batch> > batches(n_threads);
+	vector<vector<size_t> > histograms(n_threads, vector<size_t>(options.bins));
+	vector<size_t> below(n_threads);
+	vector<size_t> above(n_threads);
+	forEachChunk(n_chunks, n_threads, [&](unsigned k, size_t chunk)
+	{
+		if(!batches[k])
+		{
+			batches[k].reset(new Batch(*this, program, context, columns));
+		}
+
+		double block[BATCH_BLOCK];
+		size_t end = min(n_rows, (chunk + 1) * CHUNK_ROWS);
+		for(size_t row = chunk * CHUNK_ROWS; row < end; row += BATCH_BLOCK)
+		{
+			size_t m = min(BATCH_BLOCK, end - row);
+			const double* result;
+			try
+			{
+				result = batches[k]->run(row, m);
+			}
+			catch(...)
+			{
+				// A block fails at its first failing instruction, which may
+				// be that of a later row; run one row at a time, the first
+				// failing row throws its own error.
+				for(size_t j = 0; j < m; j++)
+				{
+					batches[k]->run(row + j, 1);
+				}
+				throw;
+			}
+			for(size_t j = 0; j < m; j++)
+			{
+				block[j] = fabs(result[j]) <= 1E-6 ? 0 : result[j];
+			}
+			fold(partials[chunk], block, row, m);
+			if(options.bins)
+			{
+				count(histograms[k], below[k], above[k], block, m);
+			}
+		}
+	});
+
+	FormulaReduction reduction;
+	reduction.count = n_rows;
+	reduction.histogram = std::move(histograms[0]);
+	for(unsigned k = 0; k < n_threads; k++)
+	{
+		for(size_t i = 0; k && i < options.bins; i++)
+		{
+			reduction.histogram[i] += histograms[k][i];
+		}
+		reduction.below += below[k];
+		reduction.above += above[k];
+	}
+
+	// Ties go to the earlier chunk, so argmin and argmax are the first rows.
+	for(const Partial& partial : partials)
+	{
+		reduction.sum += partial.sum;
+		if(partial.argmin != FormulaReduction::NONE && (partial.min < reduction.min || reduction.argmin == FormulaReduction::NONE))
+		{
+			reduction.min = partial.min;
+			reduction.argmin = partial.argmin;
+		}
+		if(partial.argmax != FormulaReduction::NONE && (partial.max > reduction.max || reduction.argmax == FormulaReduction::NONE))
+		{
+			reduction.max = partial.max;
+			reduction.argmax = partial.argmax;
+		}
+	}
+	return reduction;
+}
+
+FormulaReduction Formula::reduce(const vector<vector<double> >& columns, const FormulaReduction::Options& options)const
+{
+	size_t n_rows = columns.empty() ? 0 : columns[0].size();
+
+	vector<const double*> pointers;
+	for(const vector<double>& column : columns)
+	{
+		if(column.size() != n_rows)
+		{
+			throw FormulaException(FormulaException::SIZE_MISMATCH, "columns have different lengths");
+		}
+		pointers.push_back(column.data());
+	}
+	return reduce(pointers, n_rows, options);
+}
+
+FormulaAxis::FormulaAxis(double _start, double _step, size_t _count):
+start(_start),
+step(_step),
+count(_count)
+{
+}
+
+FormulaAxis FormulaAxis::linspace(double low, double high, size_t count)
+{
+	return FormulaAxis(low, count > 1 ? (high - low) / (count - 1) : 0.0, count);
+}
+
+static size_t gridSize(const vector<FormulaAxis>& axes)
+{
+	size_t n_rows = 1;
+	for(const FormulaAxis& axis : axes)
+	{
+		if(axis.count && n_rows > FormulaReduction::NONE / axis.count)
+		{
+			throw FormulaException(FormulaException::SIZE_MISMATCH, "grid has too many points");
+		}
+		n_rows *= axis.count;
+	}
+	return n_rows;
+}
+
+// Each thread makes the coordinates of a block of rows in buffers of its own
+// and runs the block on them as columns. A point is start + i * step, not a
+// running sum, so its coordinates are the same in every block and thread.
+void Formula::evalGrid(const vector<FormulaAxis>& axes, double* results, unsigned threads)const
+{
+	compiled();
+
+	// Rows taken by one step along each axis.
+	size_t n_rows = gridSize(axes);
+	vector<size_t> strides(axes.size());
+	for(size_t a = axes.size(), stride = 1; a-- > 0; stride *= axes[a].count)
+	{
+		strides[a] = stride;
+	}
+
+	Epoch::Guard guard;
+	const Binding::State* state = m_binding ? &m_binding->current() : nullptr;
+	const Program& program = state ? *state->program : tiered();
+	const Definitions* context = state ? state->context.get() : nullptr;
+
+	size_t n_chunks = (n_rows + CHUNK_ROWS - 1) / CHUNK_ROWS;
+	unsigned n_threads = chunkThreads(threads, n_chunks);
+	vector<unique_ptr<Batch> > batches(n_threads);
+	vector<vector<double> > coordinates(n_threads);
+	forEachChunk(n_chunks, n_threads, [&](unsigned k, size_t chunk)
+	{
+		Batch* batch = batches[k].get();
+		if(!batch)
+		{
+			coordinates[k].resize(axes.size() * BATCH_BLOCK);
+			batches[k].reset(batch = new Batch(*this, program, context, vector<const double*>(axes.size())));
+			for(size_t a = 0; a < axes.size(); a++)
+			{
+				batch->columns[a] = &coordinates[k][a * BATCH_BLOCK];
+			}
+		}
+
+		size_t end = min(n_rows, (chunk + 1) * CHUNK_ROWS);
+		for(size_t row = chunk * CHUNK_ROWS; row < end; row += BATCH_BLOCK)
+		{
+			size_t m = min(BATCH_BLOCK, end - row);
+			for(size_t a = 0; a < axes.size(); a++)
+			{
+				const FormulaAxis& axis = axes[a];
+				double* out = &coordinates[k][a * BATCH_BLOCK];
+				size_t i = row / strides[a] % axis.count;
+				if(strides[a] == 1)
+				{
+					for(size_t j = 0; j < m; j++)
+					{
+						out[j] = axis.start + i * axis.step;
+						i = i + 1 < axis.count ? i + 1 : 0;
+					}
+					continue;
+				}
+
+				// Runs of rows with the same coordinate.
+				size_t left = strides[a] - row % strides[a];
+				for(size_t j = 0; j < m; i = i + 1 < axis.count ? i + 1 : 0)
+				{
+					size_t n = min(left, m - j);
+					fill_n(out + j, n, axis.start + i * axis.step);
+					j += n;
+					left = strides[a];
+				}
+			}
+
+			const double* result = batch->run(0, m);
+			for(size_t j = 0; j < m; j++)
+			{
+				results[row + j] = fabs(result[j]) <= 1E-6 ? 0 : result[j];
+			}
+		}
+	});
+}
+
+vector<double> Formula::evalGrid(const vector<FormulaAxis>& axes, unsigned threads)const
+{
+	vector<double> results(gridSize(axes));
+	evalGrid(axes, results.data(), threads);
+	return results;
+}
@@ -0,0 +1,440 @@
+#include "../include/formula_codegen.hpp"
+#include "built_in.hpp"
+#include "formula_program.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <sstream>
+#include <unordered_set>
+
+using namespace std;
+
+// Names the generated code cannot use as they are: keywords up to C++20,
+// macros of the standard headers and predefined ones that a short name
+// could collide with, and the identifiers reserved to the implementation.
+static bool isReserved(const string& name)
+{
+	static const unordered_set<string> reserved =
+	{
+		"alignas", "alignof", "and", "and_eq", "asm", "auto", "bitand", "bitor", "bool", "break",
+		"case", "catch", "char", "char8_t", "char16_t", "char32_t", "class", "compl", "concept",
+		"const", "consteval", "constexpr", "constinit", "const_cast", "continue", "co_await",
+		"co_return", "co_yield", "decltype", "default", "delete", "do", "double", "dynamic_cast",
+		"else", "enum", "explicit", "export", "extern", "false", "float", "for", "friend", "goto",
+		"if", "inline", "int", "long", "mutable", "namespace", "new", "noexcept", "not", "not_eq",
+		"nullptr", "operator", "or", "or_eq", "private", "protected", "public", "register",
+		"reinterpret_cast", "requires", "return", "short", "signed", "sizeof", "static",
+		"static_assert", "static_cast", "struct", "switch", "template", "this", "thread_local",
+		"throw", "true", "try", "typedef", "typeid", "typename", "union", "unsigned", "using",
+		"virtual", "void", "volatile", "wchar_t", "while", "xor", "xor_eq",
+
+		"assert", "errno", "math_errhandling", "offsetof", "setjmp", "stdin", "stdout", "stderr",
+		"va_arg", "va_copy", "va_end", "va_start", "EDOM", "EILSEQ", "ERANGE", "EOF", "BUFSIZ",
+		"INFINITY", "NAN", "NULL", "CHAR_BIT", "DECIMAL_DIG", "FP_INFINITE", "FP_NAN", "FP_NORMAL",
+		"FP_SUBNORMAL", "FP_ZERO", "HUGE_VAL", "HUGE_VALF", "HUGE_VALL", "MATH_ERRNO",
+		"MATH_ERREXCEPT", "RAND_MAX", "EXIT_SUCCESS", "EXIT_FAILURE", "MB_CUR_MAX",
+		"CLOCKS_PER_SEC", "unix", "linux", "i386"
+	};
+	if(reserved.count(name) != 0 || name.find("__") != string::npos)
+	{
+		return true;
+	}
+	return name.size() > 1 && name[0] == '_' && isupper((unsigned char)name[1]);
+}
+
+static bool isIdentifier(const string& name)
+{
+	if(name.empty() || isdigit((unsigned char)name[0]))
+	{
+		return false;
+	}
+	for(char c : name)
+	{
+		if(!isalnum((unsigned char)c) && c != '_')
+		{
+			return false;
+		}
+	}
+	return !isReserved(name);
+}
+
+static vector<string> splitNamespace(const string& name_space)
+{
+	vector<string> parts;
+	size_t begin = 0;
+	while(true)
+	{
+		size_t end = name_space.find("::", begin);
+		parts.push_back(name_space.substr(begin, end - begin));
+		if(end == string::npos)
+		{
+			return parts;
+		}
+		begin = end + 2;
+	}
+}
+
+// Enough digits for the value to read back exactly.
+static string literal(double value)
+{
+	if(isnan(value))
+	{
+		return "std::numeric_limits<double>::quiet_NaN()";
+	}
+	if(isinf(value))
+	{
+		return value > 0 ? "std::numeric_limits<double>::infinity()" : "(-std::numeric_limits<double>::infinity())";
+	}
+
+	char buffer[32];
+	snprintf(buffer, sizeof(buffer), "%.17g", value);
+	string text = buffer;
+	if(text.find_first_of(".e") == string::npos)
+	{
+		text += ".0";
+	}
+	return signbit(value) ? "(" + text + ")" : text;
+}
+
+static string quoted(const string& str)
+{
+	string text = "\"";
+	for(char c : str)
+	{
+		if(c == '"' || c == '\\')
+		{
+			text += '\\';
+		}
+		text += c;
+	}
+	return text + "\"";
+}
+
+// Preprocessed source without its end mark, on one line for a comment.
+static string expressionText(string_view str)
+{
+	if(!str.empty() && str.back() == '#')
+	{
+		str.remove_suffix(1);
+	}
+
+	string text;
+	for(char c : str)
+	{
+		bool blank = c == ' ' || c == '\t' || c == '\r' || c == '\n';
+		if(!blank)
+		{
+			text += c;
+		}
+		else if(!text.empty() && text.back() != ' ')
+		{
+			text += ' ';
+		}
+	}
+	while(!text.empty() && text.back() == ' ')
+	{
+		text.pop_back();
+	}
+	return text;
+}
+
+// Built-ins that are the standard functions, without a check of their own:
+// the compiler can inline and vectorize those.
+static const char* standardFunction(string_view name)
+{
+	static const pair<const char*, const char*> functions[] =
+	{
+		{"sin", "std::sin"}, {"cos", "std::cos"}, {"atan", "std::atan"}, {"arctan", "std::atan"},
+		{"sinh", "std::sinh"}, {"cosh", "std::cosh"}, {"tanh", "std::tanh"},
+		{"asinh", "std::asinh"}, {"arcsinh", "std::asinh"}, {"exp", "std::exp"},
+		{"fabs", "std::fabs"}, {"abs", "std::fabs"}
+	};
+	for(const auto& function : functions)
+	{
+		if(name == function.first)
+		{
+			return function.second;
+		}
+	}
+	return nullptr;
+}
+
+FormulaCodegen::FormulaCodegen(const string& name_space):
+m_namespace(name_space)
+{
+	for(const string& part : splitNamespace(name_space))
+	{
+		if(!isIdentifier(part))
+		{
+			throw FormulaException(FormulaException::INVALID_NAME, name_space);
+		}
+	}
+}
+
+void FormulaCodegen::add(const string& name, const Formula& formula)
+{
+	// The source file keeps its own tables in the namespace "generated".
+	if(!isIdentifier(name) || name == "find" || name == "functions" || name == "n_functions" || name == "generated")
+	{
+		throw FormulaException(FormulaException::INVALID_NAME, name);
+	}
+	for(const Function& function : m_functions)
+	{
+		if(function.name == name)
+		{
+			throw FormulaException(FormulaException::ALREADY_DEFINED, name);
+		}
+	}
+
+	const Formula::Program& source = formula.compiled();
+	const Formula::Definitions& own = formula.definitions();
+	shared_ptr<const Formula::Definitions> context = formula.contextDefinitions();
+	auto userFunction = [&](const string& key)
+	{
+		return own.functions.count(key) != 0 || (context && context->functions.count(key) != 0);
+	};
+
+	shared_ptr<const Formula::Program> program = Formula::Program::fold(source,
+		[&](string_view variable, double& value)
+		{
+			string key(variable);
+			auto defined = own.variables.find(key);
+			if(defined != own.variables.end())
+			{
+				value = defined->second;
+				return true;
+			}
+			if(context)
+			{
+				defined = context->variables.find(key);
+				if(defined != context->variables.end())
+				{
+					value = defined->second;
+					return true;
+				}
+			}
+			const double* built_in = BuiltIn::variable(variable);
+			if(built_in)
+			{
+				value = *built_in;
+				return true;
+			}
+			return false;
+		},
+		[&](string_view function) -> BuiltIn::Function
+		{
+			return userFunction(string(function)) ? nullptr : BuiltIn::function(function);
+		});
+
+	Function function;
+	function.name = name;
+	function.expression = expressionText(source.source);
+
+	vector<string> registers(program->n_registers);
+	for(unsigned i = 0; i < program->n_variables; i++)
+	{
+		// Variable names have no underscore, unlike the locals below, so a
+		// reserved one is renamed by appending one.
+		string variable(program->variables[i]);
+		function.arguments.push_back(variable);
+		registers[i] = isReserved(variable) ? variable + "_" : variable;
+	}
+	for(unsigned i = 0; i < program->n_constants; i++)
+	{
+		registers[program->n_variables + i] = literal(program->constants[i]);
+	}
+
+	ostringstream statics;
+	ostringstream body;
+	unordered_set<string> checked;
+	for(unsigned i = 0; i < program->n_operations; i++)
+	{
+		const Formula::Program::Operation& operation = program->operations[i];
+		const string& x = registers[operation.lhs];
+		// Call keeps the function index in rhs.
+		string y = operation.op == Formula::Program::Call ? string() : registers[operation.rhs];
+		string expression;
+		switch(operation.op)
+		{
+			case Formula::Program::Add: expression = x + " + " + y; break;
+			case Formula::Program::Sub: expression = x + " - " + y; break;
+			case Formula::Program::Mul: expression = x + " * " + y; break;
+			case Formula::Program::Div: expression = "FormulaCodegen::divide(" + x + ", " + y + ")"; break;
+			case Formula::Program::Pow: expression = "FormulaCodegen::power(" + x + ", " + y + ")"; break;
+			case Formula::Program::MulAdd:
+			{
+				expression = "FormulaCodegen::multiplyAdd(" + x + ", " + y + ", " + registers[operation.acc] + ")";
+				break;
+			}
+			case Formula::Program::MulSub:
+			{
+				expression = "FormulaCodegen::multiplyAdd(" + x + ", " + y + ", -" + registers[operation.acc] + ")";
+				break;
+			}
+			case Formula::Program::NegMulAdd:
+			{
+				expression = "FormulaCodegen::multiplyAdd(-" + x + ", " + y + ", " + registers[operation.acc] + ")";
+				break;
+			}
+			case Formula::Program::PowInt:
+			{
+				expression = "FormulaCodegen::integerPower(" + x + ", " + to_string(operation.acc) + ")";
+				break;
+			}
+			case Formula::Program::PowNegInt:
+			{
+				expression = "FormulaCodegen::inversePower(" + x + ", " + to_string(operation.acc) + ")";
+				break;
+			}
+			case Formula::Program::Sqrt: expression = "FormulaCodegen::squareRoot(" + x + ")"; break;
+			default: // case Formula::Program::Call:
+			{
+				string called(program->functions[operation.rhs]);
+				if(userFunction(called))
+				{
+					throw FormulaException(FormulaException::NOT_BUILT_IN_FUNCTION, called);
+				}
+				if(!BuiltIn::function(called))
+				{
+					throw FormulaException(FormulaException::NOT_DEFINED_FUNCTION, called);
+				}
+
+				const char* standard = standardFunction(called);
+				if(standard)
+				{
+					expression = string(standard) + "(" + x + ")";
+					break;
+				}
+				if(checked.insert(called).second)
+				{
+					statics << "\tstatic const FormulaCodegen::BuiltInFunction f_" << called
+						<< " = FormulaCodegen::builtIn(" << quoted(called) << ");\n";
+				}
+				expression = "f_" + called + "(" + x + ")";
+				break;
+			}
+		}
+
+		string local = "t_" + to_string(i);
+		body << "\tconst double " << local << " = " << expression << ";\n";
+		registers[operation.dst] = local;
+	}
+	body << "\treturn FormulaCodegen::result(" << registers[program->result] << ");\n";
+
+	ostringstream definition;
+	definition << "inline double " << name << "(";
+	for(unsigned i = 0; i < program->n_variables; i++)
+	{
+		definition << (i ? ", " : "") << "double " << registers[i];
+	}
+	definition << ")\n{\n" << statics.str() << body.str() << "}\n";
+	function.body = definition.str();
+	m_functions.push_back(function);
+}
+
+void FormulaCodegen::write(ostream& header, ostream& source, const string& header_name)const
+{
+	string guard = "FORMULA_GENERATED_";
+	for(char c : m_namespace)
+	{
+		guard += c == ':' ? '_' : (char)toupper((unsigned char)c);
+	}
+	guard += "_H";
+
+	header << "// Generated by FormulaCodegen; do not edit.\n"
+		<< "#ifndef " << guard << "\n"
+		<< "#define " << guard << "\n\n"
+		<< "#include <formula_codegen.hpp>\n\n"
+		<< "#include <cmath>\n"
+		<< "#include <cstddef>\n"
+		<< "#include <functional>\n"
+		<< "#include <limits>\n"
+		<< "#include <string>\n\n"
+		<< "namespace " << m_namespace << "\n{\n\n";
+	for(const Function& function : m_functions)
+	{
+		header << "// " << function.expression << "\n" << function.body << "\n";
+	}
+	header << "// The functions above sorted by name, and the one called name or null.\n"
+		<< "extern const FormulaFunction functions[];\n"
+		<< "extern const size_t n_functions;\n"
+		<< "const FormulaFunction* find(const std::string& name);\n\n"
+		<< "} // namespace " << m_namespace << "\n\n"
+		<< "#endif // " << guard << "\n";
+
+	vector<const Function*> sorted;
+	for(const Function& function : m_functions)
+	{
+		sorted.push_back(&function);
+	}
+	sort(sorted.begin(), sorted.end(), [](const Function* a, const Function* b) { return a->name < b->name; });
+
+	source << "// Generated by FormulaCodegen; do not edit.\n"
+		<< "#include " << quoted(header_name) << "\n\n"
+		<< "#include <algorithm>\n\n"
+		<< "namespace " << m_namespace << "\n{\n\n"
+		<< "namespace generated\n{\n\n"
+		<< "namespace arguments\n{\n";
+	for(const Function* function : sorted)
+	{
+		if(!function->arguments.empty())
+		{
+			source << "const char* const " << function->name << "[] = {";
+			for(size_t i = 0; i < function->arguments.size(); i++)
+			{
+				source << (i ? ", " : "") << quoted(function->arguments[i]);
+			}
+			source << "};\n";
+		}
+	}
+	source << "} // namespace arguments\n\n"
+		<< "namespace eval\n{\n";
+	for(const Function* function : sorted)
+	{
+		source << "double " << function->name << "(const double* arguments)\n{\n";
+		if(function->arguments.empty())
+		{
+			source << "\t(void)arguments;\n";
+		}
+		source << "\treturn ::" << m_namespace << "::" << function->name << "(";
+		for(size_t i = 0; i < function->arguments.size(); i++)
+		{
+			source << (i ? ", " : "") << "arguments[" << i << "]";
+		}
+		source << ");\n}\n";
+	}
+	source << "} // namespace eval\n\n";
+	source << "} // namespace generated\n\n"
+		<< "const FormulaFunction functions[] =\n{\n";
+	for(const Function* function : sorted)
+	{
+		source << "\t{" << quoted(function->name) << ", " << quoted(function->expression) << ", "
+			<< function->arguments.size() << ", "
+			<< (function->arguments.empty() ? "nullptr" : "generated::arguments::" + function->name) << ", "
+			<< "generated::eval::" << function->name << "},\n";
+	}
+	if(sorted.empty())
+	{
+		source << "\t{nullptr, nullptr, 0, nullptr, nullptr}\n";
+	}
+	source << "};\n"
+		<< "const size_t n_functions = " << sorted.size() << ";\n\n"
+		<< "const FormulaFunction* find(const std::string& name)\n{\n"
+		<< "\tconst FormulaFunction* end = functions + n_functions;\n"
+		<< "\tconst FormulaFunction* found = std::lower_bound(functions, end, name,\n"
+		<< "\t\t[](const FormulaFunction& function, const std::string& key) { return key.compare(function.name) > 0; });\n"
+		<< "\treturn found != end && name == found->name ? found : nullptr;\n"
+		<< "}\n\n"
+		<< "} // namespace " << m_namespace << "\n";
+}
+
+FormulaCodegen::BuiltInFunction FormulaCodegen::builtIn(const char* name)
+{
+	BuiltIn::Function function = BuiltIn::function(name);
+	if(!function)
+	{
+		throw FormulaException(FormulaException::NOT_DEFINED_FUNCTION, name);
+	}
+	return function;
+}
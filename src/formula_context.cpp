@@ -0,0 +1,242 @@
+#include "../include/formula_context.hpp"
+#include "built_in.hpp"
+#include "fast_math.hpp"
+#include "formula_epoch.hpp"
+#include "formula_program.hpp"
+
+#include <algorithm>
+#include <unordered_set>
+
+using namespace std;
+
+FormulaContext::FormulaContext():
+m_impl(make_shared<Impl>())
+{
+	m_impl->definitions = make_shared<Formula::Definitions>();
+}
+
+void FormulaContext::define(const string& var_name, double value)
+{
+	m_impl->update({var_name}, [&](Formula::Definitions& definitions)
+	{
+		definitions.variables[var_name] = value;
+	});
+}
+
+void FormulaContext::define(const string& func_name, const std::function<double(double)>& f)
+{
+	m_impl->update({func_name}, [&](Formula::Definitions& definitions)
+	{
+		definitions.functions[func_name] = f;
+		definitions.kernels.erase(func_name);
+	});
+}
+
+void FormulaContext::define(const string& func_name, const std::function<void(const double*, double*, size_t)>& kernel)
+{
+	define(func_name, [kernel](double x)
+	{
+		double y;
+		kernel(&x, &y, 1);
+		return y;
+	}, kernel);
+}
+
+void FormulaContext::define(const string& func_name, const std::function<double(double)>& f,
+	const std::function<void(const double*, double*, size_t)>& kernel)
+{
+	m_impl->update({func_name}, [&](Formula::Definitions& definitions)
+	{
+		definitions.functions[func_name] = f;
+		definitions.kernels[func_name] = kernel;
+	});
+}
+
+void FormulaContext::define(const unordered_map<string, double>& values)
+{
+	vector<string> names;
+	for(const auto& value : values)
+	{
+		names.push_back(value.first);
+	}
+
+	m_impl->update(names, [&](Formula::Definitions& definitions)
+	{
+		for(const auto& value : values)
+		{
+			definitions.variables[value.first] = value.second;
+		}
+	});
+}
+
+FormulaContext::Stats FormulaContext::stats()const
+{
+	lock_guard<mutex> lock(m_impl->mtx);
+
+	Stats stats;
+	stats.variables = m_impl->definitions->variables.size();
+	stats.functions = m_impl->definitions->functions.size();
+	stats.updates = m_impl->updates;
+	stats.refolds = m_impl->refolds;
+
+	unordered_set<const Formula::Binding*> bindings;
+	for(const auto& dependents : m_impl->dependents)
+	{
+		for(const weak_ptr<Formula::Binding>& dependent : dependents.second)
+		{
+			shared_ptr<Formula::Binding> binding = dependent.lock();
+			if(binding)
+			{
+				bindings.insert(binding.get());
+			}
+		}
+	}
+	stats.formulas = bindings.size();
+	return stats;
+}
+
+shared_ptr<const Formula::Definitions> FormulaContext::Impl::snapshot()const
+{
+	lock_guard<mutex> lock(mtx);
+	return definitions;
+}
+
+void FormulaContext::Impl::bind(const shared_ptr<Formula::Binding>& binding)
+{
+	unique_lock<mutex> lock(mtx);
+
+	const Formula::Program& program = *binding->source;
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		dependents[string(program.variables[i])].push_back(binding);
+	}
+	for(unsigned i = 0; i < program.n_functions; i++)
+	{
+		dependents[string(program.functions[i])].push_back(binding);
+	}
+	n_dependents += program.n_variables + program.n_functions;
+
+	if(n_dependents >= sweep_at)
+	{
+		n_dependents = 0;
+		for(auto it = dependents.begin(); it != dependents.end();)
+		{
+			vector<weak_ptr<Formula::Binding> >& bindings = it->second;
+			bindings.erase(remove_if(bindings.begin(), bindings.end(),
+				[](const weak_ptr<Formula::Binding>& dependent) { return dependent.expired(); }), bindings.end());
+			n_dependents += bindings.size();
+			it = bindings.empty() ? dependents.erase(it) : next(it);
+		}
+		sweep_at = max<size_t>(1024, 2 * n_dependents);
+	}
+
+	// Once registered the binding is refolded by updates, so a fold of
+	// definitions that changed meanwhile is redone before publishing.
+	shared_ptr<const Formula::Definitions> folded = definitions;
+	lock.unlock();
+	shared_ptr<const Formula::Binding::State> next = binding->fold(folded);
+	lock.lock();
+	if(definitions != folded)
+	{
+		next = binding->fold(definitions);
+	}
+	binding->publish(next);
+}
+
+void FormulaContext::Impl::update(const vector<string>& names, const std::function<void(Formula::Definitions&)>& change)
+{
+	lock_guard<mutex> lock(mtx);
+
+	shared_ptr<Formula::Definitions> next = make_shared<Formula::Definitions>(*definitions);
+	change(*next);
+	definitions = next;
+	updates++;
+
+	// A binding using several of the names is refolded once.
+	unordered_set<Formula::Binding*> refolded;
+	for(const string& name : names)
+	{
+		auto found = dependents.find(name);
+		if(found == dependents.end())
+		{
+			continue;
+		}
+
+		for(const weak_ptr<Formula::Binding>& dependent : found->second)
+		{
+			shared_ptr<Formula::Binding> binding = dependent.lock();
+			if(binding && refolded.insert(binding.get()).second)
+			{
+				binding->refold(definitions);
+				refolds++;
+			}
+		}
+	}
+}
+
+shared_ptr<const Formula::Binding::State> Formula::Binding::fold(const shared_ptr<const Definitions>& context)const
+{
+	static const Definitions none;
+	const Definitions& own = definitions ? *definitions : none;
+
+	shared_ptr<State> next = make_shared<State>();
+	next->context = context;
+
+	if(!source->valid || source->size == 0)
+	{
+		next->program = source;
+	}
+	else
+	{
+		// Names defined by the formula itself are never taken from the
+		// context; calls are folded only for the built-ins eval would run.
+		next->program = Program::fold(*source,
+			[&](string_view name, double& value)
+			{
+				string key(name);
+				auto found = context->variables.find(key);
+				if(own.variables.count(key) != 0 || found == context->variables.end())
+				{
+					return false;
+				}
+				value = found->second;
+				return true;
+			},
+			[&](string_view name) -> BuiltIn::Function
+			{
+				string key(name);
+				if(own.functions.count(key) != 0 || context->functions.count(key) != 0)
+				{
+					return nullptr;
+				}
+				if(precision == Fast)
+				{
+					const FastMath::Function* fast = FastMath::function(name);
+					if(fast)
+					{
+						return fast->scalar;
+					}
+				}
+				return BuiltIn::function(name);
+			});
+	}
+
+	return next;
+}
+
+void Formula::Binding::publish(const shared_ptr<const State>& next)
+{
+	shared_ptr<const State> previous = owner;
+	owner = next;
+	state.store(owner.get(), memory_order_release);
+	if(previous)
+	{
+		Epoch::retire(previous);
+	}
+}
+
+shared_ptr<const Formula::Program> Formula::Binding::folded()const
+{
+	lock_guard<mutex> lock(context->mtx);
+	return owner->program;
+}
@@ -0,0 +1,129 @@
+#include "formula_epoch.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+using namespace std;
+
+// Every thread that ever held a guard owns a record in a list that only
+// grows; a record is reused by a later thread once its owner has exited.
+// active is 0 outside of guards, else the epoch read when entering them.
+struct Record
+{
+	atomic<uint64_t> active{0};
+	atomic<bool> used{false};
+	unsigned depth = 0;
+	Record* next = nullptr;
+};
+
+struct Retired
+{
+	uint64_t epoch;
+	shared_ptr<const void> object;
+};
+
+static atomic<uint64_t> s_epoch{1};
+static atomic<Record*> s_records{nullptr};
+
+static mutex s_retired_mutex;
+static vector<Retired> s_retired;
+
+static Record* acquireRecord()
+{
+	for(Record* record = s_records.load(memory_order_acquire); record; record = record->next)
+	{
+		bool used = false;
+		if(!record->used.load(memory_order_relaxed) && record->used.compare_exchange_strong(used, true))
+		{
+			return record;
+		}
+	}
+
+	Record* record = new Record;
+	record->used.store(true, memory_order_relaxed);
+	record->next = s_records.load(memory_order_relaxed);
+	while(!s_records.compare_exchange_weak(record->next, record, memory_order_release, memory_order_relaxed))
+	{
+	}
+	return record;
+}
+
+struct ThreadRecord
+{
+	ThreadRecord():
+	record(acquireRecord()) {}
+
+	~ThreadRecord()
+	{
+		record->active.store(0, memory_order_release);
+		record->used.store(false, memory_order_release);
+	}
+
+	Record* record;
+};
+
+static Record& threadRecord()
+{
+	static thread_local ThreadRecord thread_record;
+	return *thread_record.record;
+}
+
+// The exchange orders the announcement before the reader's loads of shared
+// pointers; a writer that scans after retiring either sees it or has
+// published the new pointer where the reader will load it.
+Epoch::Guard::Guard()
+{
+	Record& record = threadRecord();
+	if(record.depth++ == 0)
+	{
+		record.active.exchange(s_epoch.load(memory_order_acquire), memory_order_seq_cst);
+	}
+}
+
+Epoch::Guard::~Guard()
+{
+	Record& record = threadRecord();
+	if(--record.depth == 0)
+	{
+		record.active.store(0, memory_order_release);
+	}
+}
+
+void Epoch::retire(shared_ptr<const void> object)
+{
+	vector<shared_ptr<const void> > expired;
+	{
+		lock_guard<mutex> lock(s_retired_mutex);
+		s_retired.push_back(Retired{s_epoch.fetch_add(1, memory_order_seq_cst), std::move(object)});
+		atomic_thread_fence(memory_order_seq_cst);
+
+		uint64_t oldest = UINT64_MAX;
+		for(Record* record = s_records.load(memory_order_acquire); record; record = record->next)
+		{
+			uint64_t active = record->active.load(memory_order_acquire);
+			if(active != 0 && active < oldest)
+			{
+				oldest = active;
+			}
+		}
+
+		// An object retired in epoch e may be in use by guards entered in e
+		// or earlier.
+		size_t kept = 0;
+		for(Retired& retired : s_retired)
+		{
+			if(retired.epoch < oldest)
+			{
+				expired.push_back(std::move(retired.object));
+			}
+			else
+			{
+				s_retired[kept++] = std::move(retired);
+			}
+		}
+		s_retired.resize(kept);
+	}
+	// Destroyed outside of the lock, in case destroying one retires another.
+}
@@ -0,0 +1,27 @@
+#ifndef FORMULA_EPOCH_H
+#define FORMULA_EPOCH_H
+
+#include <memory>
+
+// Deferred destruction of objects that readers use without a lock. A reader
+// holds a Guard while it uses a pointer loaded from shared state; a writer
+// that replaced the pointer hands the old object to retire(), which destroys
+// it once every guard that might have seen it has been released. Guards nest
+// and cost one atomic exchange; retired objects are destroyed by later calls
+// to retire().
+namespace Epoch
+{
+	class Guard
+	{
+	public:
+		Guard();
+		~Guard();
+
+		Guard(const Guard&) = delete;
+		Guard& operator =(const Guard&) = delete;
+	};
+
+	void retire(std::shared_ptr<const void> object);
+}
+
+#endif // FORMULA_EPOCH_H
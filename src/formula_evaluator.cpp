@@ -0,0 +1,301 @@
+#include "../include/formula_evaluator.hpp"
+#include "built_in.hpp"
+#include "formula_program.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+FormulaEvaluator::FormulaEvaluator(const Formula& formula):
+m_evaluated(0),
+m_skipped(0)
+{
+	if(formula.empty())
+	{
+		return;
+	}
+
+	const Formula::Program& program = formula.compiled();
+	shared_ptr<const Formula::Definitions> context = formula.contextDefinitions();
+	static const Formula::Definitions none;
+	const Formula::Definitions& shared = context ? *context : none;
+
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		string name(program.variables[i]);
+		m_slot_index.emplace(name, i);
+		m_slot_names.push_back(name);
+		m_dependents.emplace_back();
+
+		auto defined = formula.definitions().variables.find(name);
+		auto in_context = shared.variables.find(name);
+		const double* built_in = BuiltIn::variable(name);
+		if(defined != formula.definitions().variables.end())
+		{
+			m_slot_values.push_back(defined->second);
+			m_slot_bound.push_back(true);
+		}
+		else if(in_context != shared.variables.end())
+		{
+			m_slot_values.push_back(in_context->second);
+			m_slot_bound.push_back(true);
+		}
+		else if(built_in)
+		{
+			m_slot_values.push_back(*built_in);
+			m_slot_bound.push_back(true);
+		}
+		else
+		{
+			m_slot_values.push_back(0.0);
+			m_slot_bound.push_back(false);
+		}
+	}
+
+	// The same binding as eval(), so the precision of the formula applies.
+	// User functions are held by the definitions, kept alive here.
+	m_definitions = formula.m_definitions;
+	m_context = context;
+	m_functions.resize(program.n_functions);
+	formula.bindFunctions(program, context.get(), m_functions.data(), nullptr);
+
+	vector<int> operands;
+	for(unsigned i = 0; i < program.size; i++)
+	{
+		const Formula::Program::Instruction& instruction = program.code[i];
+
+		Node node;
+		node.type = Node::Operator;
+		node.op = 0;
+		node.lhs = -1;
+		node.rhs = -1;
+		node.index = -1;
+		node.data = 0.0;
+
+		switch(instruction.op)
+		{
+			case Formula::Program::Const:
+			{
+				node.type = Node::Number;
+				node.data = instruction.value;
+				break;
+			}
+			case Formula::Program::Load:
+			{
+				node.type = Node::Variable;
+				node.index = instruction.arg;
+				break;
+			}
+			case Formula::Program::Call:
+			{
+				node.type = Node::Function;
+				node.index = instruction.arg;
+				node.lhs = operands.back();
+				operands.pop_back();
+				break;
+			}
+			default:
+			{
+				switch(instruction.op)
+				{
+					case Formula::Program::Add: node.op = '+'; break;
+					case Formula::Program::Sub: node.op = '-'; break;
+					case Formula::Program::Mul: node.op = '*'; break;
+					case Formula::Program::Div: node.op = '/'; break;
+					default: node.op = '^'; break;
+				}
+				node.rhs = operands.back();
+				operands.pop_back();
+				node.lhs = operands.back();
+				operands.pop_back();
+				break;
+			}
+		}
+
+		operands.push_back(m_nodes.size());
+		m_nodes.push_back(node);
+	}
+
+	// Every node is downstream of the variables found in its subtree, so
+	// walking from each variable leaf up to the root collects its dependents.
+	vector<int> parents(m_nodes.size(), -1);
+	for(size_t i = 0; i < m_nodes.size(); i++)
+	{
+		if(m_nodes[i].lhs >= 0) parents[m_nodes[i].lhs] = i;
+		if(m_nodes[i].rhs >= 0) parents[m_nodes[i].rhs] = i;
+	}
+
+	for(size_t i = 0; i < m_nodes.size(); i++)
+	{
+		if(m_nodes[i].type != Node::Variable)
+		{
+			continue;
+		}
+
+		vector<int>& dependents = m_dependents[m_nodes[i].index];
+		for(int node = i; node >= 0; node = parents[node])
+		{
+			dependents.push_back(node);
+		}
+	}
+
+	for(vector<int>& dependents : m_dependents)
+	{
+		sort(dependents.begin(), dependents.end());
+		dependents.erase(unique(dependents.begin(), dependents.end()), dependents.end());
+	}
+
+	// Nothing has been computed yet.
+	m_values.assign(m_nodes.size(), 0.0);
+	m_dirty.assign(m_nodes.size(), true);
+	for(size_t i = 0; i < m_nodes.size(); i++)
+	{
+		m_pending.push_back(i);
+	}
+}
+
+void FormulaEvaluator::set(const string& var_name, double value)
+{
+	auto it = m_slot_index.find(var_name);
+	if(it == m_slot_index.end())
+	{
+		return;
+	}
+
+	int slot = it->second;
+	if(m_slot_bound[slot] && m_slot_values[slot] == value)
+	{
+		return;
+	}
+
+	m_slot_values[slot] = value;
+	m_slot_bound[slot] = true;
+	for(int node : m_dependents[slot])
+	{
+		if(!m_dirty[node])
+		{
+			m_dirty[node] = true;
+			m_pending.push_back(node);
+		}
+	}
+}
+
+double FormulaEvaluator::value()
+{
+	if(m_nodes.empty())
+	{
+		throw FormulaException(FormulaException::EMPTY_STRING);
+	}
+
+	for(size_t slot = 0; slot < m_slot_names.size(); slot++)
+	{
+		if(!m_slot_bound[slot])
+		{
+			throw FormulaException(FormulaException::NOT_DEFINED_VARIABLE, m_slot_names[slot]);
+		}
+	}
+
+	if(!m_pending.empty())
+	{
+		// Node indices follow the postfix order, so children come first.
+		sort(m_pending.begin(), m_pending.end());
+		for(int node : m_pending)
+		{
+			m_values[node] = compute(m_nodes[node]);
+		}
+
+		for(int node : m_pending)
+		{
+			m_dirty[node] = false;
+		}
+	}
+
+	m_evaluated += m_pending.size();
+	m_skipped += m_nodes.size() - m_pending.size();
+	m_pending.clear();
+
+	double result = m_values.back();
+	if( fabs( result ) <= 1E-6 )
+	{
+		return 0;
+	}
+	return result;
+}
+
+unsigned long long FormulaEvaluator::evaluated()const
+{
+	return m_evaluated;
+}
+
+unsigned long long FormulaEvaluator::skipped()const
+{
+	return m_skipped;
+}
+
+void FormulaEvaluator::resetCounters()
+{
+	m_evaluated = 0;
+	m_skipped = 0;
+}
+
+double FormulaEvaluator::compute(const Node& node)const
+{
+	switch(node.type)
+	{
+		case Node::Number:
+		{
+			return node.data;
+		}
+		case Node::Variable:
+		{
+			return m_slot_values[node.index];
+		}
+		case Node::Function:
+		{
+			return m_functions[node.index](m_values[node.lhs]);
+		}
+		case Node::Operator:
+		default:
+		{
+			double x = m_values[node.lhs];
+			double y = m_values[node.rhs];
+			switch(node.op)
+			{
+				case '+': return x + y;
+				case '-': return x - y;
+				case '*': return x * y;
+				case '/':
+				{
+					if(BuiltIn::isZero(y))
+					{
+						throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
+					}
+					return x / y;
+				}
+				default: // case '^':
+				{
+					if(BuiltIn::isZero(x) && y < 0)
+					{
+						throw FormulaException(FormulaException::DIVIDIED_BY_ZERO);
+					}
+
+					// Constant exponents take the shortcuts of the register machine.
+					if(m_nodes[node.rhs].type == Node::Number)
+					{
+						if(Formula::Program::integerExponent(y))
+						{
+							double power = Formula::Program::integerPower(x, (unsigned)fabs(y));
+							return y > 0 ? power : 1.0 / power;
+						}
+						if(y == 0.5)
+						{
+							return isinf(x) ? fabs(x) : sqrt(x);
+						}
+					}
+					return pow(x, y);
+				}
+			}
+		}
+	}
+}
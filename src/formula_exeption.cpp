@@ -27,6 +27,14 @@ FormulaException::FormulaException(FormulaException::Type _type, const std::stri
     case OUT_OF_RANGE: m_message = ("Operand x = " + std::to_string(_value) + " is out of function " + _message + "'s domain: " + _interval); break;
     case EMPTY_STRING: m_message = "Empty string"; break;
     case NOT_SUPPORTED_CHARACTER: m_message = "Not suppored character: " + _message; break;
+    case SIZE_MISMATCH: m_message = "Size mismatch: " + _message; break;
+    case CANNOT_OPEN_FILE: m_message = "Cannot open file: " + _message; break;
+    case ALREADY_DEFINED: m_message = "Already defined: " + _message; break;
+    case CIRCULAR_REFERENCE: m_message = "Circular reference: " + _message; break;
+    case INVALID_NAME: m_message = "Invalid name: " + _message; break;
+    case NOT_BUILT_IN_FUNCTION: m_message = "Not a built-in function: " + _message; break;
+    case INVALID_RANGE: m_message = "Invalid range: " + _message; break;
+    case TOLERANCE_NOT_MET: m_message = "Tolerance not met: " + _message; break;
     default: m_message = "Unknown error occured"; break;
     }
 }
@@ -0,0 +1,359 @@
+#include "../include/formula_graph.hpp"
+#include "../include/formula_exeption.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// Below this many formulas to recompute, starting threads costs more than
+// it saves.
+static const size_t PARALLEL_MIN = 256;
+
+FormulaGraph::FormulaGraph(unsigned threads):
+m_threads(threads ? threads : max(1u, thread::hardware_concurrency())),
+m_evaluated(0)
+{}
+
+int FormulaGraph::node(const string& name)
+{
+	auto found = m_index.find(name);
+	if(found != m_index.end())
+	{
+		return found->second;
+	}
+
+	int id = m_nodes.size();
+	m_nodes.emplace_back();
+	m_nodes.back().name = name;
+	m_index.emplace(name, id);
+	m_marked.push_back(false);
+	m_pending.push_back(0);
+	return id;
+}
+
+// Marks and returns the nodes reachable from the given ones: through the
+// dirty formulas they use, or through the formulas using them.
+vector<int> FormulaGraph::mark(const vector<int>& from, bool upstream)
+{
+	vector<int> nodes;
+	for(int id : from)
+	{
+		if(!m_marked[id])
+		{
+			m_marked[id] = true;
+			nodes.push_back(id);
+		}
+	}
+	for(size_t i = 0; i < nodes.size(); i++)
+	{
+		const vector<int>& next = upstream ? m_nodes[nodes[i]].uses : m_nodes[nodes[i]].dependents;
+		for(int id : next)
+		{
+			if(!m_marked[id] && (!upstream || m_nodes[id].dirty))
+			{
+				m_marked[id] = true;
+				nodes.push_back(id);
+			}
+		}
+	}
+	return nodes;
+}
+
+void FormulaGraph::define(const string& name, const Formula& formula)
+{
+	formula.check();
+	vector<string> names = formula.variables();
+
+	// The new formula closes a cycle if one of its variables is the node
+	// itself or downstream of it.
+	auto found = m_index.find(name);
+	if(found == m_index.end())
+	{
+		if(find(names.begin(), names.end(), name) != names.end())
+		{
+			throw FormulaException(FormulaException::CIRCULAR_REFERENCE, name);
+		}
+	}
+	else
+	{
+		vector<int> downstream = mark({found->second}, false);
+		string through;
+		for(const string& variable : names)
+		{
+			auto used = m_index.find(variable);
+			if(through.empty() && used != m_index.end() && m_marked[used->second])
+			{
+				through = variable;
+			}
+		}
+		for(int id : downstream)
+		{
+			m_marked[id] = false;
+		}
+		if(!through.empty())
+		{
+			throw FormulaException(FormulaException::CIRCULAR_REFERENCE, name + " through " + through);
+		}
+	}
+
+	int id = node(name);
+	for(int used : m_nodes[id].uses)
+	{
+		vector<int>& dependents = m_nodes[used].dependents;
+		dependents.erase(find(dependents.begin(), dependents.end(), id));
+	}
+
+	vector<int> uses;
+	for(const string& variable : names)
+	{
+		uses.push_back(node(variable));
+	}
+	for(int used : uses)
+	{
+		m_nodes[used].dependents.push_back(id);
+	}
+
+	Node& n = m_nodes[id];
+	n.formula = true;
+	n.expression = formula;
+	n.known = false;
+	n.error = nullptr;
+	n.uses = uses;
+	n.arguments.clear();
+	n.dirty = false;
+	invalidate(id);
+}
+
+void FormulaGraph::set(const string& name, double value)
+{
+	int id = node(name);
+	Node& n = m_nodes[id];
+	if(n.formula)
+	{
+		throw FormulaException(FormulaException::ALREADY_DEFINED, name);
+	}
+	if(n.known && n.value == value)
+	{
+		return;
+	}
+
+	n.value = value;
+	n.known = true;
+	for(int dependent : n.dependents)
+	{
+		invalidate(dependent);
+	}
+}
+
+// A dirty node has only dirty dependents, so the walk stops at the first
+// dirty one.
+void FormulaGraph::invalidate(int id)
+{
+	vector<int> stack = {id};
+	while(!stack.empty())
+	{
+		Node& n = m_nodes[stack.back()];
+		stack.pop_back();
+		if(!n.dirty)
+		{
+			n.dirty = true;
+			stack.insert(stack.end(), n.dependents.begin(), n.dependents.end());
+		}
+	}
+}
+
+double FormulaGraph::value(const string& name)
+{
+	auto found = m_index.find(name);
+	if(found == m_index.end() || (!m_nodes[found->second].formula && !m_nodes[found->second].known))
+	{
+		throw FormulaException(FormulaException::NOT_DEFINED_VARIABLE, name);
+	}
+
+	int id = found->second;
+	if(m_nodes[id].dirty)
+	{
+		update({id});
+	}
+	if(m_nodes[id].error)
+	{
+		rethrow_exception(m_nodes[id].error);
+	}
+	return m_nodes[id].value;
+}
+
+void FormulaGraph::evaluate()
+{
+	vector<int> targets;
+	for(size_t id = 0; id < m_nodes.size(); id++)
+	{
+		if(m_nodes[id].dirty)
+		{
+			targets.push_back(id);
+		}
+	}
+	update(targets);
+}
+
+// An error of a formula is also the error of the formulas using it.
+void FormulaGraph::compute(Node& n)
+{
+	n.dirty = false;
+	n.known = false;
+	n.error = nullptr;
+	for(int used : n.uses)
+	{
+		const Node& input = m_nodes[used];
+		if(input.error)
+		{
+			n.error = input.error;
+			return;
+		}
+		if(input.known)
+		{
+			n.arguments[input.name] = input.value;
+		}
+		else
+		{
+			n.arguments.erase(input.name);
+		}
+	}
+
+	try
+	{
+		n.value = n.expression.eval(n.arguments);
+		n.known = true;
+	}
+	catch(...)
+	{
+		n.error = current_exception();
+	}
+}
+
+// Recomputes the dirty formulas the targets depend on, each once all the
+// dirty formulas it uses are done. Ready formulas are taken from a shared
+// queue, so independent branches run on different threads.
+void FormulaGraph::update(const vector<int>& targets)
+{
+	vector<int> nodes = mark(targets, true);
+	vector<bool>& needed = m_marked;
+	vector<int>& pending = m_pending;
+	deque<int> ready;
+	for(int id : nodes)
+	{
+		for(int used : m_nodes[id].uses)
+		{
+			pending[id] += needed[used];
+		}
+		if(pending[id] == 0)
+		{
+			ready.push_back(id);
+		}
+	}
+
+	mutex mtx;
+	condition_variable wake;
+	size_t done = 0;
+	auto work = [&]()
+	{
+		unique_lock<mutex> lock(mtx);
+		while(true)
+		{
+			wake.wait(lock, [&]() { return !ready.empty() || done == nodes.size(); });
+			if(ready.empty())
+			{
+				return;
+			}
+
+			int id = ready.front();
+			ready.pop_front();
+			lock.unlock();
+			compute(m_nodes[id]);
+			lock.lock();
+
+			done++;
+			size_t woken = 0;
+			for(int dependent : m_nodes[id].dependents)
+			{
+				if(needed[dependent] && --pending[dependent] == 0)
+				{
+					ready.push_back(dependent);
+					woken++;
+				}
+			}
+			if(done == nodes.size() || woken > 1)
+			{
+				wake.notify_all();
+			}
+		}
+	};
+
+	vector<thread> workers;
+	unsigned n_threads = nodes.size() < PARALLEL_MIN ? 1 : (unsigned)min<size_t>(m_threads, nodes.size());
+	for(unsigned k = 1; k < n_threads; k++)
+	{
+		workers.emplace_back(work);
+	}
+	work();
+	for(thread& worker : workers)
+	{
+		worker.join();
+	}
+
+	for(int id : nodes)
+	{
+		needed[id] = false;
+	}
+	m_evaluated += nodes.size();
+}
+
+vector<string> FormulaGraph::order()const
+{
+	vector<int> pending(m_nodes.size(), 0);
+	deque<int> ready;
+	for(size_t id = 0; id < m_nodes.size(); id++)
+	{
+		if(!m_nodes[id].formula)
+		{
+			continue;
+		}
+		for(int used : m_nodes[id].uses)
+		{
+			pending[id] += m_nodes[used].formula;
+		}
+		if(pending[id] == 0)
+		{
+			ready.push_back(id);
+		}
+	}
+
+	vector<string> names;
+	while(!ready.empty())
+	{
+		int id = ready.front();
+		ready.pop_front();
+		names.push_back(m_nodes[id].name);
+		for(int dependent : m_nodes[id].dependents)
+		{
+			if(--pending[dependent] == 0)
+			{
+				ready.push_back(dependent);
+			}
+		}
+	}
+	return names;
+}
+
+unsigned long long FormulaGraph::evaluated()const
+{
+	return m_evaluated;
+}
+
+void FormulaGraph::resetCounters()
+{
+	m_evaluated = 0;
+}
@@ -0,0 +1,101 @@
+#include "../include/formula_handle.hpp"
+#include "formula_epoch.hpp"
+
+#include <atomic>
+#include <mutex>
+
+using namespace std;
+
+// The current formula is owned by owner and read through current; a reader
+// holds an Epoch::Guard while it uses it. A replaced formula is retired, not
+// destroyed, so readers that loaded it finish with it first.
+struct FormulaHandle::Impl
+{
+	void publish(const shared_ptr<const Formula>& next)
+	{
+		shared_ptr<const Formula> previous = owner;
+		owner = next;
+		current.store(owner.get(), memory_order_release);
+		version.fetch_add(1, memory_order_relaxed);
+		if(previous)
+		{
+			Epoch::retire(previous);
+		}
+	}
+
+	mutex writer;
+	shared_ptr<const Formula> owner;
+	atomic<const Formula*> current{nullptr};
+	atomic<unsigned long long> version{0};
+};
+
+FormulaHandle::FormulaHandle():
+FormulaHandle(Formula()) {}
+
+FormulaHandle::FormulaHandle(const Formula& formula):
+m_impl(make_shared<Impl>())
+{
+	m_impl->owner = make_shared<const Formula>(formula);
+	m_impl->current.store(m_impl->owner.get(), memory_order_release);
+}
+
+void FormulaHandle::assign(const string& expression)
+{
+	update([&](Formula& formula)
+	{
+		formula = expression;
+		formula.check();
+	});
+}
+
+void FormulaHandle::store(const Formula& formula)
+{
+	shared_ptr<const Formula> next = make_shared<const Formula>(formula);
+	lock_guard<mutex> lock(m_impl->writer);
+	m_impl->publish(next);
+}
+
+// The copy is taken under the writer lock, so a concurrent update is not
+// lost; readers never take it.
+void FormulaHandle::update(const std::function<void(Formula&)>& change)
+{
+	lock_guard<mutex> lock(m_impl->writer);
+	shared_ptr<Formula> next = make_shared<Formula>(*m_impl->owner);
+	change(*next);
+	m_impl->publish(next);
+}
+
+Formula FormulaHandle::load()const
+{
+	Epoch::Guard guard;
+	return *m_impl->current.load(memory_order_acquire);
+}
+
+unsigned long long FormulaHandle::version()const
+{
+	return m_impl->version.load(memory_order_relaxed);
+}
+
+double FormulaHandle::eval(const unordered_map<string, double>& variables)const
+{
+	Epoch::Guard guard;
+	return m_impl->current.load(memory_order_acquire)->eval(variables);
+}
+
+double FormulaHandle::eval(const vector<double>& variables)const
+{
+	Epoch::Guard guard;
+	return m_impl->current.load(memory_order_acquire)->eval(variables);
+}
+
+void FormulaHandle::evalBatch(const vector<const double*>& columns, size_t n_rows, double* results)const
+{
+	Epoch::Guard guard;
+	m_impl->current.load(memory_order_acquire)->evalBatch(columns, n_rows, results);
+}
+
+vector<double> FormulaHandle::evalBatch(const vector<vector<double> >& columns)const
+{
+	Epoch::Guard guard;
+	return m_impl->current.load(memory_order_acquire)->evalBatch(columns);
+}
@@ -0,0 +1,631 @@
+#include "../include/formula.hpp"
+#include "formula_epoch.hpp"
+#include "formula_program.hpp"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <limits>
+#include <string_view>
+
+using namespace std;
+
+typedef FormulaInterval Interval;
+
+static const double INF = numeric_limits<double>::infinity();
+static const double PI = 3.14159265358979323846;
+
+// Magnitude below which divisors, bases of negative powers and the
+// denominators of tan, cot, csc and sec make the interpreters fail, as
+// BuiltIn::isZero.
+static const double ZERO = 1E-6;
+
+// Where |cos(x)| >= ZERO, |tan(x)| <= 1 / ZERO, and so for cot and sin.
+static const double POLE_BOUND = 1.000001 / ZERO;
+
+// Arithmetic rounds to nearest, within half an ulp of the exact result, so
+// moving each bound one ulp outward covers it. The C library functions are
+// within a few ulps.
+static const int FUNCTION_ULPS = 4;
+
+// x^n for the small n of Program::integerExponent is run by square-and-
+// multiply: up to two products and a reciprocal, each off by up to an ulp.
+static const int PRODUCT_ULPS = 3;
+
+// Maximum errors of the Formula::Fast functions, see fast_math.hpp: absolute
+// for sin and cos, relative for the others.
+static const double FAST_TRIG_ERROR = 3E-14;
+static const double FAST_TAN_ERROR = 4E-14;
+static const double FAST_EXP_ERROR = 1E-11;
+static const double FAST_LOG_ERROR = 4E-14;
+
+// Below this, the fast exp flushes its result to 0.
+static const double FAST_EXP_FLUSH = -708.0;
+
+FormulaInterval::FormulaInterval(double x):
+lower(x),
+upper(x)
+{
+}
+
+FormulaInterval::FormulaInterval(double _lower, double _upper):
+lower(_lower),
+upper(_upper)
+{
+}
+
+bool FormulaInterval::empty()const
+{
+	return !(lower <= upper);
+}
+
+bool FormulaInterval::contains(double x)const
+{
+	return lower <= x && x <= upper;
+}
+
+double FormulaInterval::width()const
+{
+	return empty() ? 0.0 : upper - lower;
+}
+
+FormulaInterval FormulaInterval::none()
+{
+	return Interval(numeric_limits<double>::quiet_NaN(), numeric_limits<double>::quiet_NaN());
+}
+
+FormulaInterval FormulaInterval::entire()
+{
+	return Interval(-INF, INF);
+}
+
+// Bounds moved outward by ulps; a NaN bound, as from inf - inf, becomes
+// infinite.
+static Interval outward(double lower, double upper, int ulps = 1)
+{
+	if(lower != lower)
+	{
+		lower = -INF;
+	}
+	if(upper != upper)
+	{
+		upper = INF;
+	}
+	for(int i = 0; i < ulps; i++)
+	{
+		lower = nextafter(lower, -INF);
+		upper = nextafter(upper, INF);
+	}
+	return Interval(lower, upper);
+}
+
+static Interval hull(const Interval& x, const Interval& y)
+{
+	if(x.empty())
+	{
+		return y;
+	}
+	if(y.empty())
+	{
+		return x;
+	}
+	return Interval(min(x.lower, y.lower), max(x.upper, y.upper));
+}
+
+static Interval meet(const Interval& x, double lower, double upper)
+{
+	return Interval(max(x.lower, lower), min(x.upper, upper));
+}
+
+// Smallest interval holding the values, any of them NaN standing for
+// every value.
+static Interval bounds(const double* values, size_t n, int ulps)
+{
+	double lower = INF;
+	double upper = -INF;
+	for(size_t i = 0; i < n; i++)
+	{
+		lower = values[i] == values[i] ? min(lower, values[i]) : -INF;
+		upper = values[i] == values[i] ? max(upper, values[i]) : INF;
+	}
+	return outward(lower, upper, ulps);
+}
+
+// The part of x where a value is not within ZERO of 0, in two pieces.
+static Interval negativePart(const Interval& x)
+{
+	return meet(x, -INF, -ZERO);
+}
+
+static Interval positivePart(const Interval& x)
+{
+	return meet(x, ZERO, INF);
+}
+
+static Interval add(const Interval& x, const Interval& y)
+{
+	return outward(x.lower + y.lower, x.upper + y.upper);
+}
+
+static Interval subtract(const Interval& x, const Interval& y)
+{
+	return outward(x.lower - y.upper, x.upper - y.lower);
+}
+
+// 0 * inf is taken as 0: the infinite bound is only approached.
+static double times(double x, double y)
+{
+	return x == 0 || y == 0 ? 0.0 : x * y;
+}
+
+static Interval multiply(const Interval& x, const Interval& y)
+{
+	double products[] = {times(x.lower, y.lower), times(x.lower, y.upper), times(x.upper, y.lower), times(x.upper, y.upper)};
+	return bounds(products, 4, 1);
+}
+
+// A divisor within ZERO of 0 fails, so x / y is taken over the two pieces
+// of y away from it, where it is monotone in both operands.
+static Interval divide(const Interval& x, const Interval& y)
+{
+	Interval result = Interval::none();
+	for(const Interval& piece : {negativePart(y), positivePart(y)})
+	{
+		if(!piece.empty())
+		{
+			double quotients[] = {x.lower / piece.lower, x.lower / piece.upper, x.upper / piece.lower, x.upper / piece.upper};
+			result = hull(result, bounds(quotients, 4, 1));
+		}
+	}
+	return result;
+}
+
+// x^n for an integer n: monotone on each side of 0, and a negative n fails
+// near 0. The bounds are widened by the ulps of the way eval computes it.
+static Interval integerPower(const Interval& x, double n, int ulps)
+{
+	if(n == 0)
+	{
+		return Interval(1.0);
+	}
+	if(n < 0)
+	{
+		Interval result = Interval::none();
+		for(const Interval& piece : {negativePart(x), positivePart(x)})
+		{
+			if(!piece.empty())
+			{
+				double powers[] = {pow(piece.lower, n), pow(piece.upper, n)};
+				result = hull(result, bounds(powers, 2, ulps));
+			}
+		}
+		return result;
+	}
+
+	double powers[] = {pow(x.lower, n), pow(x.upper, n)};
+	Interval result = bounds(powers, 2, ulps);
+	if(fmod(n, 2) == 0 && x.lower < 0 && x.upper > 0)
+	{
+		result.lower = 0.0;
+	}
+	return result;
+}
+
+// x^y for x >= 0 is monotone in each operand, so its bounds are at the
+// corners; a negative y fails for x near 0.
+static Interval nonNegativePower(const Interval& x, const Interval& y)
+{
+	Interval result = Interval::none();
+	Interval pieces[][2] =
+	{
+		{meet(x, ZERO, INF), meet(y, -INF, -numeric_limits<double>::denorm_min())},
+		{x, meet(y, 0.0, INF)}
+	};
+	for(const auto& piece : pieces)
+	{
+		if(!piece[0].empty() && !piece[1].empty())
+		{
+			double powers[] =
+			{
+				pow(piece[0].lower, piece[1].lower), pow(piece[0].lower, piece[1].upper),
+				pow(piece[0].upper, piece[1].lower), pow(piece[0].upper, piece[1].upper)
+			};
+			result = hull(result, bounds(powers, 4, FUNCTION_ULPS));
+		}
+	}
+	return result;
+}
+
+// A negative base only has a power for integer exponents; as for those
+// the magnitude is that of |x|^y, the sign is left open.
+static Interval power(const Interval& x, const Interval& y, int ulps)
+{
+	if(y.lower == y.upper && y.lower == floor(y.lower))
+	{
+		return integerPower(x, y.lower, ulps);
+	}
+
+	Interval result = nonNegativePower(meet(x, 0.0, INF), y);
+	Interval integers(ceil(y.lower), floor(y.upper));
+	if(x.lower < 0 && !integers.empty())
+	{
+		Interval magnitude(max(0.0, -x.upper), -x.lower);
+		double upper = nonNegativePower(magnitude, integers).upper;
+		result = hull(result, Interval(-upper, upper));
+	}
+	return result;
+}
+
+// Image of x under f, increasing or decreasing on [lower, upper], outside
+// of which it fails.
+static Interval increasing(const Interval& x, double lower, double upper, double (*f)(double))
+{
+	Interval m = meet(x, lower, upper);
+	return m.empty() ? m : outward(f(m.lower), f(m.upper), FUNCTION_ULPS);
+}
+
+static Interval decreasing(const Interval& x, double lower, double upper, double (*f)(double))
+{
+	Interval m = meet(x, lower, upper);
+	return m.empty() ? m : outward(f(m.upper), f(m.lower), FUNCTION_ULPS);
+}
+
+// The same on each side of 0, away from it by at least ZERO.
+static Interval decreasingApart(const Interval& x, double (*f)(double))
+{
+	return hull(decreasing(x, -INF, -ZERO, f), decreasing(x, ZERO, INF, f));
+}
+
+// Image of x under an even f, increasing or decreasing with |x|.
+static Interval evenIncreasing(const Interval& x, double (*f)(double))
+{
+	double near = x.lower <= 0 && x.upper >= 0 ? 0.0 : min(fabs(x.lower), fabs(x.upper));
+	return outward(f(near), f(max(fabs(x.lower), fabs(x.upper))), FUNCTION_ULPS);
+}
+
+static Interval evenDecreasing(const Interval& x, double (*f)(double))
+{
+	double near = x.lower <= 0 && x.upper >= 0 ? 0.0 : min(fabs(x.lower), fabs(x.upper));
+	return outward(f(max(fabs(x.lower), fabs(x.upper))), f(near), FUNCTION_ULPS);
+}
+
+// Whether x holds offset + k * period for some integer k. The margin
+// covers the rounding of k * period, so a point just outside counts.
+static bool reaches(const Interval& x, double offset, double period)
+{
+	if(!(x.upper - x.lower < period))
+	{
+		return true;
+	}
+	double margin = 1E-12 * max(1.0, max(fabs(x.lower), fabs(x.upper)));
+	double k = floor((x.lower - offset) / period);
+	for(int j = -1; j <= 2; j++)
+	{
+		double point = offset + (k + j) * period;
+		if(point >= x.lower - margin && point <= x.upper + margin)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// sin and cos, with maxima at peak + 2k pi and minima half a period away.
+static Interval periodic(const Interval& x, double (*f)(double), double peak)
+{
+	if(!(x.upper - x.lower < 2 * PI))
+	{
+		return Interval(-1.0, 1.0);
+	}
+	double values[] = {f(x.lower), f(x.upper)};
+	Interval result = bounds(values, 2, FUNCTION_ULPS);
+	if(reaches(x, peak, 2 * PI))
+	{
+		result.upper = 1.0;
+	}
+	if(reaches(x, peak + PI, 2 * PI))
+	{
+		result.lower = -1.0;
+	}
+	return meet(result, -1.0, 1.0);
+}
+
+// 1 / y where y is within ZERO of 0 fails.
+static Interval reciprocal(const Interval& y)
+{
+	return divide(Interval(1.0), y);
+}
+
+static double sine(double x)
+{
+	return sin(x);
+}
+
+static double cosine(double x)
+{
+	return cos(x);
+}
+
+static Interval sinInterval(const Interval& x)
+{
+	return periodic(x, sine, PI / 2);
+}
+
+static Interval cosInterval(const Interval& x)
+{
+	return periodic(x, cosine, 0.0);
+}
+
+// Near a pole the interpreters fail, so tan and cot stay within
+// POLE_BOUND; between poles they are monotone.
+static Interval tanInterval(const Interval& x)
+{
+	if(reaches(x, PI / 2, PI))
+	{
+		return Interval(-POLE_BOUND, POLE_BOUND);
+	}
+	return outward(tan(x.lower), tan(x.upper), FUNCTION_ULPS);
+}
+
+static Interval cotInterval(const Interval& x)
+{
+	if(reaches(x, 0.0, PI))
+	{
+		return Interval(-POLE_BOUND, POLE_BOUND);
+	}
+	return outward(cos(x.upper) / sin(x.upper), cos(x.lower) / sin(x.lower), FUNCTION_ULPS);
+}
+
+static Interval signInterval(const Interval& x)
+{
+	auto sign = [](double v) { return v > 0 ? 1.0 : v < 0 ? -1.0 : 0.0; };
+	return Interval(sign(x.lower), sign(x.upper));
+}
+
+// Bounds moved outward by an absolute error.
+static Interval widen(const Interval& x, double error)
+{
+	return x.empty() ? x : outward(x.lower - error, x.upper + error);
+}
+
+static Interval widenRelative(const Interval& x, double error)
+{
+	return x.empty() ? x : outward(x.lower - fabs(x.lower) * error, x.upper + fabs(x.upper) * error);
+}
+
+// The built-in gives +inf at 0 and tends to -inf from below it. There it
+// computes log((1 - sqrt(1 + x^2)) / x), where the subtraction cancels: its
+// results are off by up to about 5 eps / x^2, and are -inf once the square
+// root of 1 + x^2 rounds to 1.
+static Interval acschInterval(const Interval& x)
+{
+	Interval m = meet(x, -1.0, 1.0);
+	auto f = [](double v) { return asinh(1 / v); };
+	if(m.empty() || m.lower > 0)
+	{
+		return decreasing(m, 0.0, 1.0, f);
+	}
+	if(m.upper >= 0)
+	{
+		return Interval(m.lower < 0 ? -INF : nextafter(f(m.upper), -INF), INF);
+	}
+
+	Interval result = widen(decreasing(m, -1.0, 0.0, f), 8 * DBL_EPSILON / (m.upper * m.upper));
+	if(m.upper * m.upper < 4 * DBL_EPSILON)
+	{
+		result.lower = -INF;
+	}
+	return result;
+}
+
+// The built-in computes 0.5 * log((x + 1) / (x - 1)), where the quotient is
+// near 1 for a large x: its results are off by up to about 2 eps.
+static Interval acothInterval(const Interval& x)
+{
+	Interval result = hull(decreasing(x, -INF, -1.0, [](double v) { return -0.5 * log1p(2 / (-v - 1)); }),
+		decreasing(x, 1.0, INF, [](double v) { return 0.5 * log1p(2 / (v - 1)); }));
+	return widen(result, 8 * DBL_EPSILON);
+}
+
+struct Inclusion
+{
+	string_view name;
+	Interval (*f)(const Interval& x);
+};
+
+#define INCREASING(name, lower, upper, expression) {name, [](const Interval& x) { return increasing(x, lower, upper, [](double v) -> double { return expression; }); }}
+#define DECREASING(name, lower, upper, expression) {name, [](const Interval& x) { return decreasing(x, lower, upper, [](double v) -> double { return expression; }); }}
+#define DECREASING_APART(name, expression) {name, [](const Interval& x) { return decreasingApart(x, [](double v) -> double { return expression; }); }}
+
+// One per built-in function, for its exact definition in built_in.cpp. The
+// inverse functions of reciprocals are written in forms that stay accurate
+// near the ends of their domains.
+static const Inclusion s_inclusions[] =
+	{
+		{"sin", sinInterval},
+		{"cos", cosInterval},
+		{"tan", tanInterval},
+		{"csc", [](const Interval& x) { return reciprocal(sinInterval(x)); }},
+		{"sec", [](const Interval& x) { return reciprocal(cosInterval(x)); }},
+		{"cot", cotInterval},
+
+		INCREASING("asin", -1.0, 1.0, asin(v)),
+		DECREASING("acos", -1.0, 1.0, acos(v)),
+		INCREASING("atan", -INF, INF, atan(v)),
+		{"acsc", [](const Interval& x) { return hull(decreasing(x, -INF, -1.0, [](double v) { return asin(1 / v); }),
+			decreasing(x, 1.0, INF, [](double v) { return asin(1 / v); })); }},
+		{"asec", [](const Interval& x) { return hull(increasing(x, -INF, -1.0, [](double v) { return acos(1 / v); }),
+			increasing(x, 1.0, INF, [](double v) { return acos(1 / v); })); }},
+		DECREASING("acot", -INF, INF, v > 0 ? atan(1 / v) : v < 0 ? PI + atan(1 / v) : PI / 2),
+
+		{"sinh", [](const Interval& x) { return increasing(x, -INF, INF, [](double v) { return sinh(v); }); }},
+		{"cosh", [](const Interval& x) { return evenIncreasing(x, [](double v) { return cosh(v); }); }},
+		INCREASING("tanh", -INF, INF, tanh(v)),
+		DECREASING_APART("csch", 1 / sinh(v)),
+		{"sech", [](const Interval& x) { return evenDecreasing(x, [](double v) { return 1 / cosh(v); }); }},
+		DECREASING_APART("coth", 1 / tanh(v)),
+
+		INCREASING("asinh", -INF, INF, asinh(v)),
+		INCREASING("acosh", 1.0, INF, acosh(v)),
+		INCREASING("atanh", -1.0, 1.0, atanh(v)),
+		{"acsch", acschInterval},
+		DECREASING("asech", 0.0, 1.0, log1p(((1 - v) + sqrt((1 - v) * (1 + v))) / v)),
+		{"acoth", acothInterval},
+
+		INCREASING("exp", -INF, INF, exp(v)),
+		INCREASING("log", 0.0, INF, log(v)),
+		INCREASING("ln", 0.0, INF, log(v)),
+		INCREASING("lg", 0.0, INF, log10(v)),
+		INCREASING("log10", 0.0, INF, log10(v)),
+		INCREASING("log2", 0.0, INF, log2(v)),
+
+		INCREASING("sqrt", 0.0, INF, sqrt(v)),
+		{"abs", [](const Interval& x) { return evenIncreasing(x, [](double v) { return fabs(v); }); }},
+		{"fabs", [](const Interval& x) { return evenIncreasing(x, [](double v) { return fabs(v); }); }},
+		{"sign", signInterval},
+		{"sgn", signInterval},
+	};
+#undef INCREASING
+#undef DECREASING
+#undef DECREASING_APART
+
+// The Formula::Fast forms of the functions of fast_math.hpp: the bounds of
+// the exact ones, widened by the error of the approximation.
+static Interval fastExpInterval(const Interval& x)
+{
+	Interval result = widenRelative(increasing(x, -INF, INF, [](double v) { return exp(v); }), FAST_EXP_ERROR);
+	if(!result.empty() && x.lower < FAST_EXP_FLUSH)
+	{
+		result.lower = 0.0;
+	}
+	return result;
+}
+
+#define FAST_LOG(name, expression) {name, [](const Interval& x) { return widenRelative(increasing(x, 0.0, INF, [](double v) -> double { return expression; }), FAST_LOG_ERROR); }}
+
+static const Inclusion s_fast_inclusions[] =
+	{
+		{"sin", [](const Interval& x) { return widen(sinInterval(x), FAST_TRIG_ERROR); }},
+		{"cos", [](const Interval& x) { return widen(cosInterval(x), FAST_TRIG_ERROR); }},
+		{"tan", [](const Interval& x) { return widenRelative(tanInterval(x), FAST_TAN_ERROR); }},
+		{"exp", fastExpInterval},
+		FAST_LOG("log", log(v)),
+		FAST_LOG("ln", log(v)),
+		FAST_LOG("lg", log10(v)),
+		FAST_LOG("log10", log10(v)),
+		FAST_LOG("log2", log2(v)),
+	};
+#undef FAST_LOG
+
+// The names starting with "arc" are aliases: arcsin is asin and so on.
+static Interval (*inclusion(string_view name, bool fast))(const Interval&)
+{
+	for(const Inclusion& inclusion : s_fast_inclusions)
+	{
+		if(fast && inclusion.name == name)
+		{
+			return inclusion.f;
+		}
+	}
+
+	bool alias = name.size() > 3 && name.substr(0, 3) == "arc";
+	if(alias)
+	{
+		name.remove_prefix(3);
+	}
+	for(const Inclusion& inclusion : s_inclusions)
+	{
+		string_view found = inclusion.name;
+		if(alias ? found[0] == 'a' && found.substr(1) == name : found == name)
+		{
+			return inclusion.f;
+		}
+	}
+	throw FormulaException(FormulaException::INTERNAL_ERROR);
+}
+
+// Runs the code as written, before the Horner rewrite: a power of a
+// variable bounds better than the products Horner form makes of it.
+FormulaInterval Formula::evalInterval(const vector<FormulaInterval>& variables)const
+{
+	compiled();
+
+	Epoch::Guard guard;
+	const Binding::State* state = m_binding ? &m_binding->current() : nullptr;
+	const Program& program = state ? *state->program : tiered();
+	const Definitions* context = state ? state->context.get() : nullptr;
+
+	SmallBuffer<double, 16> values(program.n_variables);
+	SmallBuffer<int, 16> argument(program.n_variables);
+	bindArguments(program, variables.size(), values.data(), argument.data());
+
+	SmallBuffer<BoundFunction, 8> functions(program.n_functions);
+	SmallBuffer<bool, 8> user(program.n_functions);
+	bindFunctions(program, context, functions.data(), user.data());
+	SmallBuffer<Interval (*)(const Interval&), 8> inclusions(program.n_functions);
+	for(unsigned i = 0; i < program.n_functions; i++)
+	{
+		if(user[i])
+		{
+			throw FormulaException(FormulaException::NOT_BUILT_IN_FUNCTION, string(program.functions[i]));
+		}
+		inclusions[i] = inclusion(program.functions[i], m_precision == Fast);
+	}
+
+	SmallBuffer<Interval, 32> stack(program.max_stack);
+	unsigned top = 0;
+	for(unsigned i = 0; i < program.size; i++)
+	{
+		const Program::Instruction& instruction = program.code[i];
+		if(instruction.op == Program::Const)
+		{
+			stack[top++] = Interval(instruction.value);
+			continue;
+		}
+
+		if(instruction.op == Program::Load)
+		{
+			int k = argument[instruction.arg];
+			stack[top++] = k >= 0 ? variables[k] : Interval(values[instruction.arg]);
+			continue;
+		}
+
+		if(instruction.op == Program::Call)
+		{
+			Interval& x = stack[top - 1];
+			x = x.empty() ? Interval::none() : inclusions[instruction.arg](x);
+			continue;
+		}
+
+		top--;
+		Interval& x = stack[top - 1];
+		const Interval& y = stack[top];
+		if(x.empty() || y.empty())
+		{
+			x = Interval::none();
+			continue;
+		}
+		switch(instruction.op)
+		{
+			case Program::Add: x = add(x, y); break;
+			case Program::Sub: x = subtract(x, y); break;
+			case Program::Mul: x = multiply(x, y); break;
+			case Program::Div: x = divide(x, y); break;
+			default: // case Program::Pow:
+			{
+				bool products = y.lower == y.upper && Program::integerExponent(y.lower);
+				x = power(x, y, products ? FUNCTION_ULPS + PRODUCT_ULPS : FUNCTION_ULPS);
+				break;
+			}
+		}
+	}
+
+	// Results within 1E-6 of 0 are rounded to it, which keeps the order.
+	Interval result = stack[0];
+	if(result.empty())
+	{
+		return Interval::none();
+	}
+	auto round = [](double r) { return fabs(r) <= 1E-6 ? 0 : r; };
+	return Interval(round(result.lower), round(result.upper));
+}
@@ -0,0 +1,257 @@
+#include "../include/formula_loader.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <fstream>
+#include <mutex>
+#include <string_view>
+#include <thread>
+
+using namespace std;
+
+struct FormulaLoader::Line
+{
+	size_t number;
+	string name;
+	string expression;
+};
+
+static bool isBlank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static string trim(const string& str)
+{
+	size_t begin = 0;
+	size_t end = str.size();
+	while(begin < end && isBlank(str[begin]))
+	{
+		begin++;
+	}
+	while(end > begin && isBlank(str[end - 1]))
+	{
+		end--;
+	}
+	return str.substr(begin, end - begin);
+}
+
+static FormulaLoader::Error error(size_t line, const string& name, const FormulaException& exception)
+{
+	FormulaLoader::Error error;
+	error.line = line;
+	error.name = name;
+	error.type = exception.type();
+	error.message = exception.message();
+	return error;
+}
+
+FormulaLoader::FormulaLoader(unsigned threads):
+m_threads(threads)
+{}
+
+void FormulaLoader::setContext(const FormulaContext& context)
+{
+	m_context = make_shared<FormulaContext>(context);
+}
+
+void FormulaLoader::setArena(FormulaArena& arena)
+{
+	m_arena = make_shared<FormulaArena>(arena);
+}
+
+void FormulaLoader::setTiering(const FormulaTiering& tiering)
+{
+	m_tiering = make_shared<FormulaTiering>(tiering);
+}
+
+FormulaLoader::Result FormulaLoader::load(const string& path)const
+{
+	ifstream in(path);
+	if(!in)
+	{
+		throw FormulaException(FormulaException::CANNOT_OPEN_FILE, path);
+	}
+	return load(in);
+}
+
+FormulaLoader::Result FormulaLoader::load(istream& in)const
+{
+	Result result;
+	vector<Line> lines;
+
+	string str;
+	for(size_t number = 1; getline(in, str); number++)
+	{
+		str = trim(str);
+		if(str.empty() || str[0] == '#')
+		{
+			continue;
+		}
+		result.lines++;
+
+		size_t equal = str.find('=');
+		string name = equal == string::npos ? string() : trim(str.substr(0, equal));
+		if(name.empty() || find_if(name.begin(), name.end(), isBlank) != name.end())
+		{
+			result.errors.push_back(error(number, name, FormulaException(FormulaException::WRONG_FORMAT)));
+			continue;
+		}
+		lines.push_back(Line{number, name, str.substr(equal + 1)});
+	}
+
+	compile(lines, result);
+	return result;
+}
+
+FormulaLoader::Result FormulaLoader::compile(const vector<pair<string, string> >& rules)const
+{
+	Result result;
+	result.lines = rules.size();
+
+	vector<Line> lines;
+	lines.reserve(rules.size());
+	for(size_t i = 0; i < rules.size(); i++)
+	{
+		lines.push_back(Line{i + 1, rules[i].first, rules[i].second});
+	}
+
+	compile(lines, result);
+	return result;
+}
+
+void FormulaLoader::compile(const vector<Line>& lines, Result& result)const
+{
+	static const size_t NONE = (size_t)-1;
+
+	// Expressions are told apart without their blanks, which compile drops.
+	unordered_map<string_view, size_t> defined;
+	unordered_map<string, size_t> distinct;
+	vector<const string*> expressions;
+	vector<size_t> expression_of(lines.size(), NONE);
+	defined.reserve(lines.size());
+	distinct.reserve(lines.size());
+	for(size_t i = 0; i < lines.size(); i++)
+	{
+		const Line& line = lines[i];
+		auto first = defined.emplace(line.name, line.number);
+		if(!first.second)
+		{
+			result.errors.push_back(error(line.number, line.name, FormulaException(FormulaException::ALREADY_DEFINED,
+				line.name + " at line " + to_string(first.first->second))));
+			continue;
+		}
+
+		string key;
+		key.reserve(line.expression.size());
+		for(char c : line.expression)
+		{
+			if(!isBlank(c))
+			{
+				key.push_back(c);
+			}
+		}
+		if(key.empty())
+		{
+			result.errors.push_back(error(line.number, line.name, FormulaException(FormulaException::EMPTY_STRING)));
+			continue;
+		}
+
+		auto found = distinct.emplace(std::move(key), expressions.size());
+		if(found.second)
+		{
+			expressions.push_back(&line.expression);
+		}
+		expression_of[i] = found.first->second;
+	}
+
+	// Workers, the calling thread among them, take the expressions one at
+	// a time; errors other than those of a formula are raised once all
+	// have stopped.
+	vector<Formula> formulas(expressions.size());
+	vector<FormulaException> failures(expressions.size());
+	vector<char> failed(expressions.size(), false);
+	atomic<size_t> next{0};
+	exception_ptr fatal;
+	mutex fatal_mutex;
+
+	auto work = [&]()
+	{
+		try
+		{
+			for(size_t i = next++; i < expressions.size(); i = next++)
+			{
+				try
+				{
+					formulas[i] = compile(*expressions[i]);
+				}
+				catch(const FormulaException& exception)
+				{
+					failures[i] = exception;
+					failed[i] = true;
+				}
+			}
+		}
+		catch(...)
+		{
+			lock_guard<mutex> lock(fatal_mutex);
+			fatal = current_exception();
+			next = expressions.size();
+		}
+	};
+
+	unsigned n_threads = m_threads ? m_threads : max(1u, thread::hardware_concurrency());
+	n_threads = (unsigned)min<size_t>(n_threads, expressions.size());
+	vector<thread> workers;
+	for(unsigned k = 1; k < n_threads; k++)
+	{
+		workers.emplace_back(work);
+	}
+	work();
+	for(thread& worker : workers)
+	{
+		worker.join();
+	}
+	if(fatal)
+	{
+		rethrow_exception(fatal);
+	}
+	result.compiled = expressions.size();
+	result.formulas.reserve(lines.size());
+
+	for(size_t i = 0; i < lines.size(); i++)
+	{
+		size_t k = expression_of[i];
+		if(k == NONE)
+		{
+			continue;
+		}
+		if(failed[k])
+		{
+			result.errors.push_back(error(lines[i].number, lines[i].name, failures[k]));
+			continue;
+		}
+		result.names.push_back(lines[i].name);
+		result.name_lines.push_back(lines[i].number);
+		result.formulas.emplace(lines[i].name, formulas[k]);
+	}
+
+	stable_sort(result.errors.begin(), result.errors.end(), [](const Error& a, const Error& b)
+	{
+		return a.line < b.line;
+	});
+}
+
+Formula FormulaLoader::compile(const string& expression)const
+{
+	Formula formula;
+	formula.compile(expression, m_arena ? m_arena->m_impl : nullptr, m_tiering.get());
+	if(m_context)
+	{
+		formula.bind(m_context->m_impl);
+	}
+
+	formula.check();
+	return formula;
+}
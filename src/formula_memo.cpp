@@ -0,0 +1,145 @@
+#include "../include/formula_memo.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+using namespace std;
+
+// Counters are spread over a few cache lines picked by thread, so that
+// threads hitting the same memo do not all write to one line.
+static const size_t COUNTER_SHARDS = 16;
+
+// Each slot is guarded by its own sequence number: 0 while empty, odd while
+// being written. Readers never wait: an entry being written, torn or for
+// another argument is a miss.
+struct FormulaMemo::Impl
+{
+	struct Slot
+	{
+		atomic<uint64_t> sequence{0};
+		atomic<uint64_t> key{0};
+		atomic<uint64_t> value{0};
+	};
+
+	struct alignas(64) Counter
+	{
+		atomic<unsigned long long> hits{0};
+		atomic<unsigned long long> misses{0};
+	};
+
+	Impl(const std::function<double(double)>& _f, size_t capacity);
+
+	Counter& counter();
+
+	std::function<double(double)> f;
+	size_t mask;
+	unique_ptr<Slot[]> slots;
+	Counter counters[COUNTER_SHARDS];
+};
+
+static inline uint64_t bits(double x)
+{
+	uint64_t u;
+	memcpy(&u, &x, sizeof(u));
+	return u;
+}
+
+static inline double fromBits(uint64_t u)
+{
+	double x;
+	memcpy(&x, &u, sizeof(x));
+	return x;
+}
+
+static inline uint64_t mix(uint64_t u)
+{
+	u ^= u >> 33;
+	u *= 0xff51afd7ed558ccdULL;
+	u ^= u >> 33;
+	u *= 0xc4ceb9fe1a85ec53ULL;
+	u ^= u >> 33;
+	return u;
+}
+
+FormulaMemo::Impl::Impl(const std::function<double(double)>& _f, size_t capacity):
+f(_f)
+{
+	size_t size = 1;
+	while(size < capacity)
+	{
+		size <<= 1;
+	}
+	mask = size - 1;
+	slots.reset(new Slot[size]);
+}
+
+FormulaMemo::Impl::Counter& FormulaMemo::Impl::counter()
+{
+	static thread_local size_t shard = hash<thread::id>()(this_thread::get_id()) % COUNTER_SHARDS;
+	return counters[shard];
+}
+
+FormulaMemo::FormulaMemo(const std::function<double(double)>& f, size_t capacity):
+m_impl(make_shared<Impl>(f, capacity))
+{}
+
+double FormulaMemo::operator ()(double x)const
+{
+	uint64_t key = bits(x);
+	Impl::Slot& slot = m_impl->slots[mix(key) & m_impl->mask];
+
+	uint64_t before = slot.sequence.load(memory_order_acquire);
+	if(before != 0 && (before & 1) == 0)
+	{
+		uint64_t stored_key = slot.key.load(memory_order_relaxed);
+		uint64_t stored_value = slot.value.load(memory_order_relaxed);
+		atomic_thread_fence(memory_order_acquire);
+		if(stored_key == key && slot.sequence.load(memory_order_relaxed) == before)
+		{
+			m_impl->counter().hits.fetch_add(1, memory_order_relaxed);
+			return fromBits(stored_value);
+		}
+	}
+
+	m_impl->counter().misses.fetch_add(1, memory_order_relaxed);
+	double y = m_impl->f(x);
+
+	// The entry is replaced only if no other thread is writing the slot.
+	if((before & 1) == 0 && slot.sequence.compare_exchange_strong(before, before + 1, memory_order_acquire))
+	{
+		atomic_thread_fence(memory_order_release);
+		slot.key.store(key, memory_order_relaxed);
+		slot.value.store(bits(y), memory_order_relaxed);
+		slot.sequence.store(before + 2, memory_order_release);
+	}
+	return y;
+}
+
+FormulaMemo::Stats FormulaMemo::stats()const
+{
+	Stats stats;
+	stats.capacity = m_impl->mask + 1;
+	for(const Impl::Counter& counter : m_impl->counters)
+	{
+		stats.hits += counter.hits.load(memory_order_relaxed);
+		stats.misses += counter.misses.load(memory_order_relaxed);
+	}
+	return stats;
+}
+
+void FormulaMemo::resetStats()
+{
+	for(Impl::Counter& counter : m_impl->counters)
+	{
+		counter.hits.store(0, memory_order_relaxed);
+		counter.misses.store(0, memory_order_relaxed);
+	}
+}
+
+double FormulaMemo::Stats::hitRate()const
+{
+	unsigned long long calls = hits + misses;
+	return calls ? (double)hits / calls : 0.0;
+}
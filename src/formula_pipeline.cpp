@@ -0,0 +1,277 @@
+#include "../include/formula_pipeline.hpp"
+#include "../include/formula_exeption.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+// Rows wait in a ring of capacity requests guarded by one mutex; a worker
+// takes a whole batch under a single lock.
+struct FormulaPipeline::Impl
+{
+	struct Request
+	{
+		vector<double> row;
+		Callback done;
+	};
+
+	Impl(const Formula& _formula, size_t _capacity, size_t _max_batch);
+
+	void push(Request&& request, bool wait, bool& pushed);
+	// Buffers of one worker, reused from batch to batch.
+	struct Scratch
+	{
+		vector<Request> batch;
+		vector<vector<double> > columns;
+		vector<const double*> pointers;
+		vector<double> results;
+		vector<exception_ptr> errors;
+	};
+
+	void work();
+	size_t evaluate(Scratch& scratch);
+
+	Formula formula;
+	size_t max_batch;
+
+	mutable mutex mtx;
+	condition_variable not_empty;
+	condition_variable not_full;
+	condition_variable idle;
+	vector<Request> ring;
+	size_t head = 0;
+	size_t size = 0;
+	size_t in_flight = 0;
+	unsigned idle_workers = 0;
+	bool closing = false;
+	Stats stats;
+
+	vector<thread> workers;
+};
+
+FormulaPipeline::Impl::Impl(const Formula& _formula, size_t _capacity, size_t _max_batch):
+formula(_formula),
+max_batch(max<size_t>(1, _max_batch)),
+ring(max<size_t>(1, _capacity))
+{}
+
+void FormulaPipeline::Impl::push(Request&& request, bool wait, bool& pushed)
+{
+	unique_lock<mutex> lock(mtx);
+	if(size == ring.size())
+	{
+		if(!wait)
+		{
+			pushed = false;
+			return;
+		}
+		stats.blocked++;
+		not_full.wait(lock, [&]() { return size < ring.size(); });
+	}
+
+	ring[(head + size) % ring.size()] = std::move(request);
+	size++;
+	pushed = true;
+
+	// Busy workers look at the queue again before waiting.
+	bool wake = idle_workers != 0;
+	lock.unlock();
+	if(wake)
+	{
+		not_empty.notify_one();
+	}
+}
+
+// A worker takes every queued row with as many arguments as the first, up
+// to a batch; rows left behind wake another worker.
+void FormulaPipeline::Impl::work()
+{
+	Scratch scratch;
+	vector<Request>& batch = scratch.batch;
+	while(true)
+	{
+		bool more = false;
+		{
+			unique_lock<mutex> lock(mtx);
+			idle_workers++;
+			not_empty.wait(lock, [&]() { return size != 0 || closing; });
+			idle_workers--;
+			if(size == 0)
+			{
+				return;
+			}
+
+			size_t n_arguments = ring[head].row.size();
+			while(size != 0 && batch.size() < max_batch && ring[head].row.size() == n_arguments)
+			{
+				batch.push_back(std::move(ring[head]));
+				head = (head + 1) % ring.size();
+				size--;
+			}
+			in_flight += batch.size();
+			more = size != 0;
+		}
+		not_full.notify_all();
+		if(more)
+		{
+			not_empty.notify_one();
+		}
+
+		size_t failed = evaluate(scratch);
+		for(size_t i = 0; i < batch.size(); i++)
+		{
+			batch[i].done(scratch.results[i], scratch.errors[i]);
+		}
+
+		{
+			lock_guard<mutex> lock(mtx);
+			in_flight -= batch.size();
+			stats.rows += batch.size();
+			stats.batches++;
+			stats.failed += failed;
+			if(size == 0 && in_flight == 0)
+			{
+				idle.notify_all();
+			}
+		}
+		batch.clear();
+	}
+}
+
+// Every row goes through evalBatch, so a row gives the same bits whatever
+// batch it lands in. evalBatch stops at the first row that fails, so a
+// failing batch is run again one row at a time to tell which rows failed.
+// Any exception does, user functions may throw others than
+// FormulaException. As that would call them twice for some rows, the rows
+// of a formula calling user functions are run one at a time from the start.
+size_t FormulaPipeline::Impl::evaluate(Scratch& scratch)
+{
+	vector<Request>& batch = scratch.batch;
+	vector<double>& results = scratch.results;
+	vector<exception_ptr>& errors = scratch.errors;
+
+	size_t n = batch.size();
+	size_t n_arguments = batch[0].row.size();
+	results.assign(n, 0.0);
+	errors.assign(n, nullptr);
+	scratch.pointers.resize(n_arguments);
+
+	if(n > 1 && !formula.callsUserFunctions())
+	{
+		scratch.columns.resize(n_arguments);
+		for(size_t k = 0; k < n_arguments; k++)
+		{
+			scratch.columns[k].resize(n);
+			for(size_t i = 0; i < n; i++)
+			{
+				scratch.columns[k][i] = batch[i].row[k];
+			}
+			scratch.pointers[k] = scratch.columns[k].data();
+		}
+
+		try
+		{
+			formula.evalBatch(scratch.pointers, n, results.data());
+			return 0;
+		}
+		catch(...)
+		{
+		}
+	}
+
+	size_t failed = 0;
+	for(size_t i = 0; i < n; i++)
+	{
+		for(size_t k = 0; k < n_arguments; k++)
+		{
+			scratch.pointers[k] = &batch[i].row[k];
+		}
+
+		try
+		{
+			formula.evalBatch(scratch.pointers, 1, &results[i]);
+		}
+		catch(...)
+		{
+			errors[i] = current_exception();
+			failed++;
+		}
+	}
+	return failed;
+}
+
+FormulaPipeline::FormulaPipeline(const Formula& formula, unsigned threads, size_t capacity, size_t max_batch):
+m_impl(new Impl(formula, capacity, max_batch))
+{
+	unsigned n_threads = threads ? threads : max(1u, thread::hardware_concurrency());
+	for(unsigned k = 0; k < n_threads; k++)
+	{
+		m_impl->workers.emplace_back(&Impl::work, m_impl.get());
+	}
+}
+
+FormulaPipeline::~FormulaPipeline()
+{
+	{
+		lock_guard<mutex> lock(m_impl->mtx);
+		m_impl->closing = true;
+	}
+	m_impl->not_empty.notify_all();
+	for(thread& worker : m_impl->workers)
+	{
+		worker.join();
+	}
+}
+
+void FormulaPipeline::push(vector<double> row, Callback done)
+{
+	bool pushed;
+	m_impl->push(Impl::Request{std::move(row), std::move(done)}, true, pushed);
+}
+
+future<double> FormulaPipeline::push(vector<double> row)
+{
+	shared_ptr<promise<double> > result = make_shared<promise<double> >();
+	future<double> value = result->get_future();
+	push(std::move(row), [result](double y, exception_ptr error)
+	{
+		if(error)
+		{
+			result->set_exception(error);
+		}
+		else
+		{
+			result->set_value(y);
+		}
+	});
+	return value;
+}
+
+bool FormulaPipeline::tryPush(vector<double> row, Callback done)
+{
+	bool pushed;
+	m_impl->push(Impl::Request{std::move(row), std::move(done)}, false, pushed);
+	return pushed;
+}
+
+void FormulaPipeline::drain()
+{
+	unique_lock<mutex> lock(m_impl->mtx);
+	m_impl->idle.wait(lock, [&]() { return m_impl->size == 0 && m_impl->in_flight == 0; });
+}
+
+FormulaPipeline::Stats FormulaPipeline::stats()const
+{
+	lock_guard<mutex> lock(m_impl->mtx);
+	Stats stats = m_impl->stats;
+	stats.queued = m_impl->size;
+	return stats;
+}
+
+double FormulaPipeline::Stats::meanBatch()const
+{
+	return batches ? (double)rows / batches : 0.0;
+}
@@ -0,0 +1,365 @@
+#include "formula_program.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <map>
+#include <utility>
+
+using namespace std;
+
+// Beyond these a sub-expression is left as written: exponents of a variable
+// up to what PowInt handles, and few enough terms that products and sums of
+// polynomials stay cheap to build.
+static const unsigned MAX_DEGREE = 32;
+static const size_t MAX_TERMS = 64;
+
+// Pairs of variable index and exponent, sorted by variable; empty for the
+// constant term.
+typedef vector<pair<unsigned, unsigned> > Monomial;
+typedef map<Monomial, double> Polynomial;
+
+static unsigned degree(const Monomial& monomial, unsigned variable)
+{
+	for(const auto& factor : monomial)
+	{
+		if(factor.first == variable)
+		{
+			return factor.second;
+		}
+	}
+	return 0;
+}
+
+static bool add(Polynomial& p, const Polynomial& q, double sign)
+{
+	for(const auto& term : q)
+	{
+		p[term.first] += sign * term.second;
+	}
+	return p.size() <= MAX_TERMS;
+}
+
+// Only a single term is multiplied out, so (x + 1)*(x - 1) stays a product
+// of two polynomials instead of growing.
+static bool multiply(const Polynomial& p, const Polynomial& q, Polynomial& product)
+{
+	if(p.size() != 1 && q.size() != 1)
+	{
+		return false;
+	}
+
+	for(const auto& a : p)
+	{
+		for(const auto& b : q)
+		{
+			Monomial monomial;
+			auto i = a.first.begin();
+			auto j = b.first.begin();
+			while(i != a.first.end() || j != b.first.end())
+			{
+				if(j == b.first.end() || (i != a.first.end() && i->first < j->first))
+				{
+					monomial.push_back(*i++);
+				}
+				else if(i == a.first.end() || j->first < i->first)
+				{
+					monomial.push_back(*j++);
+				}
+				else
+				{
+					monomial.emplace_back(i->first, i->second + j->second);
+					i++;
+					j++;
+				}
+				if(monomial.back().second > MAX_DEGREE)
+				{
+					return false;
+				}
+			}
+			product[monomial] += a.second * b.second;
+		}
+	}
+	return product.size() <= MAX_TERMS;
+}
+
+// Only a monomial without coefficient is raised, so no new constant has to
+// be computed.
+static bool power(const Polynomial& p, double exponent, Polynomial& result)
+{
+	if(p.size() != 1 || p.begin()->second != 1.0 ||
+	   exponent != floor(exponent) || exponent < 1 || exponent > MAX_DEGREE)
+	{
+		return false;
+	}
+
+	Monomial monomial = p.begin()->first;
+	for(auto& factor : monomial)
+	{
+		factor.second *= (unsigned)exponent;
+		if(factor.second > MAX_DEGREE)
+		{
+			return false;
+		}
+	}
+	result[monomial] = 1.0;
+	return true;
+}
+
+bool Formula::Program::rewritePolynomials(const vector<Instruction>& code, vector<Instruction>& horner,
+	vector<unsigned>& origin)
+{
+	size_t n = code.size();
+
+	// Subtrees of the postfix code: the first instruction of each, its
+	// operands and the operator using its value.
+	vector<unsigned> start(n);
+	vector<unsigned> lhs(n, 0);
+	vector<unsigned> rhs(n, 0);
+	vector<int> parent(n, -1);
+	vector<unsigned> roots;
+	for(unsigned i = 0; i < n; i++)
+	{
+		switch(code[i].op)
+		{
+			case Const:
+			case Load:
+			{
+				start[i] = i;
+				break;
+			}
+			case Call:
+			{
+				lhs[i] = roots.back();
+				roots.pop_back();
+				parent[lhs[i]] = i;
+				start[i] = start[lhs[i]];
+				break;
+			}
+			default:
+			{
+				rhs[i] = roots.back();
+				roots.pop_back();
+				lhs[i] = roots.back();
+				roots.pop_back();
+				parent[lhs[i]] = i;
+				parent[rhs[i]] = i;
+				start[i] = start[lhs[i]];
+				break;
+			}
+		}
+		roots.push_back(i);
+	}
+
+	vector<Polynomial> polynomials(n);
+	vector<bool> polynomial(n, false);
+	for(unsigned i = 0; i < n; i++)
+	{
+		const Instruction& instruction = code[i];
+		Polynomial& p = polynomials[i];
+		switch(instruction.op)
+		{
+			case Const:
+			{
+				p[Monomial()] = instruction.value;
+				polynomial[i] = true;
+				break;
+			}
+			case Load:
+			{
+				p[Monomial{{instruction.arg, 1}}] = 1.0;
+				polynomial[i] = true;
+				break;
+			}
+			case Add:
+			case Sub:
+			{
+				if(polynomial[lhs[i]] && polynomial[rhs[i]])
+				{
+					p = polynomials[lhs[i]];
+					polynomial[i] = add(p, polynomials[rhs[i]], instruction.op == Add ? 1.0 : -1.0);
+				}
+				break;
+			}
+			case Mul:
+			{
+				if(polynomial[lhs[i]] && polynomial[rhs[i]])
+				{
+					polynomial[i] = multiply(polynomials[lhs[i]], polynomials[rhs[i]], p);
+				}
+				break;
+			}
+			case Pow:
+			{
+				if(polynomial[lhs[i]] && code[rhs[i]].op == Const)
+				{
+					polynomial[i] = power(polynomials[lhs[i]], code[rhs[i]].value, p);
+				}
+				break;
+			}
+			default:
+			{
+				break;
+			}
+		}
+		if(!polynomial[i])
+		{
+			p.clear();
+		}
+	}
+
+	// Horner form in the variable of highest degree, whose coefficients are
+	// polynomials in the others written the same way:
+	//   c3*x^3 + c1*x + c0  ->  (c3*x^2 + c1)*x + c0
+	// Each "* x +" step is lowered to one multiply-add.
+	vector<Instruction> out;
+	auto push = [&](OpCode op, unsigned arg, double value)
+	{
+		out.push_back(Instruction{op, arg, value});
+	};
+	auto raise = [&](unsigned variable, unsigned exponent)
+	{
+		push(Load, variable, 0.0);
+		if(exponent > 1)
+		{
+			push(Const, 0, exponent);
+			push(Pow, 0, 0.0);
+		}
+	};
+	std::function<void(const Polynomial&)> emit = [&](const Polynomial& p)
+	{
+		unsigned variable = 0;
+		unsigned highest = 0;
+		for(const auto& term : p)
+		{
+			for(const auto& factor : term.first)
+			{
+				if(factor.second > highest || (factor.second == highest && factor.first < variable))
+				{
+					variable = factor.first;
+					highest = factor.second;
+				}
+			}
+		}
+		if(highest == 0)
+		{
+			push(Const, 0, p.begin()->second);
+			return;
+		}
+
+		map<unsigned, Polynomial, greater<unsigned> > coefficients;
+		for(const auto& term : p)
+		{
+			Monomial rest;
+			for(const auto& factor : term.first)
+			{
+				if(factor.first != variable)
+				{
+					rest.push_back(factor);
+				}
+			}
+			coefficients[degree(term.first, variable)][rest] += term.second;
+		}
+
+		// A leading coefficient of one is not multiplied.
+		const Polynomial& leading = coefficients.begin()->second;
+		bool one = leading.size() == 1 && leading.begin()->first.empty() && leading.begin()->second == 1.0;
+		if(!one)
+		{
+			emit(leading);
+		}
+
+		unsigned previous = coefficients.begin()->first;
+		for(auto c = next(coefficients.begin()); c != coefficients.end(); ++c)
+		{
+			raise(variable, previous - c->first);
+			if(!one)
+			{
+				push(Mul, 0, 0.0);
+			}
+			one = false;
+			emit(c->second);
+			push(Add, 0, 0.0);
+			previous = c->first;
+		}
+		if(previous > 0)
+		{
+			raise(variable, previous);
+			if(!one)
+			{
+				push(Mul, 0, 0.0);
+			}
+		}
+	};
+
+	auto operators = [&](const Instruction* begin, const Instruction* end, unsigned& powers) -> unsigned
+	{
+		unsigned count = 0;
+		powers = 0;
+		for(const Instruction* instruction = begin; instruction != end; instruction++)
+		{
+			count += instruction->op != Const && instruction->op != Load;
+			powers += instruction->op == Pow;
+		}
+		return count;
+	};
+
+	// Only whole polynomials of degree two or more are rewritten, and only
+	// where that takes fewer operators, or as many with fewer powers.
+	bool rewritten = false;
+	vector<int> rewrite(n, -1);
+	for(unsigned i = 0; i < n; i++)
+	{
+		if(!polynomial[i] || (parent[i] >= 0 && polynomial[parent[i]]))
+		{
+			continue;
+		}
+
+		unsigned highest = 0;
+		for(const auto& term : polynomials[i])
+		{
+			for(const auto& factor : term.first)
+			{
+				highest = max(highest, factor.second);
+			}
+		}
+		if(highest < 2 || polynomials[i].size() < 2)
+		{
+			continue;
+		}
+
+		out.clear();
+		emit(polynomials[i]);
+		unsigned old_powers = 0;
+		unsigned new_powers = 0;
+		unsigned old_operators = operators(&code[start[i]], &code[i] + 1, old_powers);
+		unsigned new_operators = operators(out.data(), out.data() + out.size(), new_powers);
+		if(new_operators < old_operators || (new_operators == old_operators && new_powers < old_powers))
+		{
+			rewrite[start[i]] = i;
+			rewritten = true;
+		}
+	}
+	if(!rewritten)
+	{
+		return false;
+	}
+
+	for(unsigned i = 0; i < n; i++)
+	{
+		if(rewrite[i] < 0)
+		{
+			horner.push_back(code[i]);
+			origin.push_back(i);
+			continue;
+		}
+
+		unsigned root = rewrite[i];
+		out.clear();
+		emit(polynomials[root]);
+		horner.insert(horner.end(), out.begin(), out.end());
+		origin.insert(origin.end(), out.size(), root);
+		i = root;
+	}
+	return true;
+}
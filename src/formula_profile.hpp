@@ -0,0 +1,87 @@
+#ifndef FORMULA_PROFILE_H
+#define FORMULA_PROFILE_H
+
+#include "../include/formula.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define FORMULA_PROFILE_RDTSC
+#elif (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define FORMULA_PROFILE_RDTSC
+#endif
+
+// Counters of one compiled program. They are atomic so formulas evaluated
+// from several threads still add up; relaxed ordering is enough for totals.
+struct Formula::Profile
+{
+	struct Counter
+	{
+		std::atomic<unsigned long long> count{0};
+		std::atomic<unsigned long long> cycles{0};
+	};
+
+	static const int LATENCY_BUCKETS = 64;
+
+	explicit Profile(size_t n_instructions):
+	instructions(n_instructions) {}
+
+	static unsigned long long clock()
+	{
+#ifdef FORMULA_PROFILE_RDTSC
+		return __rdtsc();
+#else
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+	}
+
+	void instruction(size_t i, unsigned long long cycles)
+	{
+		instructions[i].count.fetch_add(1, std::memory_order_relaxed);
+		instructions[i].cycles.fetch_add(cycles, std::memory_order_relaxed);
+	}
+
+	void eval(unsigned long long cycles)
+	{
+		int bucket = 0;
+		while(bucket + 1 < LATENCY_BUCKETS && (cycles >> (bucket + 1)) != 0)
+		{
+			bucket++;
+		}
+
+		evals.fetch_add(1, std::memory_order_relaxed);
+		total_cycles.fetch_add(cycles, std::memory_order_relaxed);
+		latency[bucket].fetch_add(1, std::memory_order_relaxed);
+	}
+
+	void reset()
+	{
+		for(Counter& counter : instructions)
+		{
+			counter.count = 0;
+			counter.cycles = 0;
+		}
+		for(auto& bucket : latency)
+		{
+			bucket = 0;
+		}
+		evals = 0;
+		total_cycles = 0;
+		built_in_calls = 0;
+		user_calls = 0;
+	}
+
+	std::vector<Counter> instructions;
+	std::atomic<unsigned long long> evals{0};
+	std::atomic<unsigned long long> total_cycles{0};
+	std::atomic<unsigned long long> built_in_calls{0};
+	std::atomic<unsigned long long> user_calls{0};
+	std::atomic<unsigned long long> latency[LATENCY_BUCKETS] = {};
+};
+
+#endif // FORMULA_PROFILE_H
@@ -0,0 +1,897 @@
+#include "formula_program.hpp"
+#include "built_in.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <set>
+#include <sstream>
+
+using namespace std;
+
+static size_t alignUp(size_t n, size_t alignment)
+{
+	return (n + alignment - 1) / alignment * alignment;
+}
+
+shared_ptr<const Formula::Program> Formula::Program::compile(const string& source, const vector<Token>& postfix,
+	const shared_ptr<FormulaArena::Impl>& arena, bool lower)
+{
+	set<string> variables;
+	vector<string> functions;
+
+	bool valid = true;
+	FormulaException::Type error = FormulaException::UNKNOWN;
+	string error_name;
+
+	size_t depth = 0;
+	size_t max_depth = 0;
+	for(const Token& token : postfix)
+	{
+		switch(token.type)
+		{
+			case Token::Error:
+			{
+				valid = false;
+				error = FormulaException::NOT_SUPPORTED_TOKEN;
+				break;
+			}
+			case Token::Number:
+			case Token::Variable:
+			{
+				depth++;
+				break;
+			}
+			case Token::Operator:
+			{
+				if(token.name != "+" &&
+				   token.name != "-" &&
+				   token.name != "*" &&
+				   token.name != "/" &&
+				   token.name != "^")
+				{
+					valid = false;
+					error = FormulaException::WRONG_FORMAT;
+				}
+				else if(depth < 2)
+				{
+					valid = false;
+					error = FormulaException::NOT_ENOUGH_OPERANDS;
+				}
+				depth--;
+				break;
+			}
+			case Token::Function:
+			{
+				if(depth == 0)
+				{
+					valid = false;
+					error = FormulaException::NOT_ENOUGH_OPERANDS;
+				}
+				break;
+			}
+		}
+
+		if(!valid)
+		{
+			error_name = token.name;
+			break;
+		}
+
+		max_depth = max(max_depth, depth);
+		if(token.type == Token::Variable)
+		{
+			variables.insert(token.name);
+		}
+		else if(token.type == Token::Function && find(functions.begin(), functions.end(), token.name) == functions.end())
+		{
+			functions.push_back(token.name);
+		}
+	}
+
+	if(valid && !postfix.empty() && depth != 1)
+	{
+		valid = false;
+		error = FormulaException::WRONG_FORMAT;
+	}
+
+	size_t n = valid ? postfix.size() : 0;
+
+	vector<Instruction> code(n);
+	vector<Span> spans(n);
+	vector<unsigned> origins(n);
+	for(size_t i = 0; i < n; i++)
+	{
+		const Token& token = postfix[i];
+
+		code[i].arg = 0;
+		code[i].value = 0.0;
+		switch(token.type)
+		{
+			case Token::Number:
+			{
+				code[i].op = Const;
+				code[i].value = token.data;
+				break;
+			}
+			case Token::Variable:
+			{
+				code[i].op = Load;
+				code[i].arg = distance(variables.begin(), variables.find(token.name));
+				break;
+			}
+			case Token::Function:
+			{
+				code[i].op = Call;
+				code[i].arg = find(functions.begin(), functions.end(), token.name) - functions.begin();
+				break;
+			}
+			default:
+			{
+				switch(token.name[0])
+				{
+					case '+': code[i].op = Add; break;
+					case '-': code[i].op = Sub; break;
+					case '*': code[i].op = Mul; break;
+					case '/': code[i].op = Div; break;
+					default: code[i].op = Pow; break;
+				}
+			}
+		}
+		spans[i].pos = postfix[i].pos;
+		spans[i].length = postfix[i].length;
+		origins[i] = i;
+	}
+
+	vector<string_view> variable_names(variables.begin(), variables.end());
+	vector<string_view> function_names(functions.begin(), functions.end());
+	return assemble(source, code, spans, origins, variable_names, function_names, max_depth, valid, error, error_name, arena, true, lower);
+}
+
+shared_ptr<const Formula::Program> Formula::Program::assemble(string_view source, const vector<Instruction>& code,
+	const vector<Span>& code_spans, const vector<unsigned>& code_origins, const vector<string_view>& variables, const vector<string_view>& functions,
+	unsigned max_stack, bool valid, FormulaException::Type error, string_view error_name,
+	const shared_ptr<FormulaArena::Impl>& arena, bool copy_names, bool lower)
+{
+	size_t n = code.size();
+
+	vector<Instruction> horner;
+	vector<unsigned> origin;
+	bool rewritten = lower && n > 0 && rewritePolynomials(code, horner, origin);
+	if(!rewritten)
+	{
+		origin.resize(n);
+		for(unsigned i = 0; i < n; i++)
+		{
+			origin[i] = i;
+		}
+	}
+	const vector<Instruction>& lowered = rewritten ? horner : code;
+
+	unsigned horner_stack = max_stack;
+	if(rewritten)
+	{
+		unsigned depth = 0;
+		horner_stack = 0;
+		for(const Instruction& instruction : horner)
+		{
+			if(instruction.op == Const || instruction.op == Load)
+			{
+				horner_stack = max(horner_stack, ++depth);
+			}
+			else if(instruction.op != Call)
+			{
+				depth--;
+			}
+		}
+	}
+
+	vector<Operation> operations;
+	vector<double> constants;
+	unsigned n_registers = 0;
+	unsigned result = 0;
+	if(lower && n > 0)
+	{
+		allocateRegisters(lowered, origin, variables.size(), operations, constants, n_registers, result);
+	}
+
+	// The source is copied even into an arena block: interned, every
+	// expression a formula was ever assigned would stay in the arena.
+	size_t chars = 0;
+	if(copy_names)
+	{
+		chars = source.size() + error_name.size();
+	}
+	if(!arena && copy_names)
+	{
+		for(string_view name : variables) chars += name.size();
+		for(string_view name : functions) chars += name.size();
+	}
+
+	size_t code_offset = alignUp(sizeof(Program), alignof(Instruction));
+	size_t spans_offset = alignUp(code_offset + n * sizeof(Instruction), alignof(Span));
+	size_t origins_offset = alignUp(spans_offset + n * sizeof(Span), alignof(unsigned));
+	size_t horner_offset = alignUp(origins_offset + n * sizeof(unsigned), alignof(Instruction));
+	size_t operations_offset = alignUp(horner_offset + horner.size() * sizeof(Instruction), alignof(Operation));
+	size_t constants_offset = alignUp(operations_offset + operations.size() * sizeof(Operation), alignof(double));
+	size_t variables_offset = alignUp(constants_offset + constants.size() * sizeof(double), alignof(string_view));
+	size_t functions_offset = variables_offset + variables.size() * sizeof(string_view);
+	size_t chars_offset = functions_offset + functions.size() * sizeof(string_view);
+	size_t bytes = chars_offset + chars;
+
+	char* block = (char*)(arena ? arena->allocateBlock(bytes, alignof(Program)) : ::operator new(bytes));
+	char* text = block + chars_offset;
+
+	// Copies a string into the block, or keeps the view of one owned by
+	// another program.
+	auto copyText = [&](string_view str) -> string_view
+	{
+		if(!copy_names)
+		{
+			return str;
+		}
+		memcpy(text, str.data(), str.size());
+		text += str.size();
+		return string_view(text - str.size(), str.size());
+	};
+
+	// Names are interned in the arena instead.
+	auto place = [&](string_view str) -> string_view
+	{
+		return arena ? arena->intern(str) : copyText(str);
+	};
+
+	Program* program = new (block) Program;
+	program->source = copyText(source);
+	program->size = n;
+	program->max_stack = max_stack;
+	program->valid = valid;
+	program->error = error;
+	program->error_name = copyText(error_name);
+	program->bytes = bytes;
+	program->chars = chars;
+	program->arena = arena.get();
+
+	string_view* variable_names = (string_view*)(block + variables_offset);
+	program->variables = variable_names;
+	program->n_variables = variables.size();
+	for(string_view name : variables)
+	{
+		*variable_names++ = place(name);
+	}
+
+	string_view* function_names = (string_view*)(block + functions_offset);
+	program->functions = function_names;
+	program->n_functions = functions.size();
+	for(string_view name : functions)
+	{
+		*function_names++ = place(name);
+	}
+
+	Instruction* program_code = (Instruction*)(block + code_offset);
+	Span* spans = (Span*)(block + spans_offset);
+	program->code = program_code;
+	program->spans = spans;
+	copy(code.begin(), code.end(), program_code);
+	copy(code_spans.begin(), code_spans.end(), spans);
+
+	unsigned* origins = (unsigned*)(block + origins_offset);
+	program->origins = origins;
+	copy(code_origins.begin(), code_origins.end(), origins);
+
+	Instruction* program_horner = (Instruction*)(block + horner_offset);
+	copy(horner.begin(), horner.end(), program_horner);
+	program->horner_code = rewritten ? program_horner : program_code;
+	program->horner_size = lowered.size();
+	program->horner_stack = horner_stack;
+
+	program->lowered = lower;
+	Operation* program_operations = (Operation*)(block + operations_offset);
+	copy(operations.begin(), operations.end(), program_operations);
+	program->operations = program_operations;
+	program->n_operations = operations.size();
+
+	double* program_constants = (double*)(block + constants_offset);
+	copy(constants.begin(), constants.end(), program_constants);
+	program->constants = program_constants;
+	program->n_constants = constants.size();
+	program->n_registers = n_registers;
+	program->result = result;
+
+	if(arena)
+	{
+		lock_guard<mutex> lock(arena->mtx);
+		arena->programs++;
+		arena->program_bytes += bytes;
+		shared_ptr<FormulaArena::Impl> owner = arena->shared_from_this();
+		return shared_ptr<const Program>(program, [owner](const Program* p)
+		{
+			size_t block_bytes = p->bytes;
+			p->~Program();
+			owner->releaseBlock((void*)p, block_bytes);
+		});
+	}
+
+	return shared_ptr<const Program>(program, [](const Program* p)
+	{
+		p->~Program();
+		::operator delete((void*)p);
+	});
+}
+
+// Mirrors the checks of the interpreters: an operation that would throw is
+// not folded.
+bool Formula::Program::foldOperation(OpCode op, double x, double y, double& result)
+{
+	switch(op)
+	{
+		case Add: result = x + y; return true;
+		case Sub: result = x - y; return true;
+		case Mul: result = x * y; return true;
+		case Div:
+		{
+			if(BuiltIn::isZero(y))
+			{
+				return false;
+			}
+			result = x / y;
+			return true;
+		}
+		default: // case Pow:
+		{
+			if(BuiltIn::isZero(x) && y < 0)
+			{
+				return false;
+			}
+			result = pow(x, y);
+			return true;
+		}
+	}
+}
+
+static bool foldCall(BuiltIn::Function f, double x, double& result)
+{
+	try
+	{
+		result = f(x);
+		return true;
+	}
+	catch(const FormulaException&)
+	{
+		return false;
+	}
+}
+
+shared_ptr<const Formula::Program> Formula::Program::fold(const Program& program,
+	const std::function<bool(string_view, double&)>& constant,
+	const std::function<BuiltIn::Function(string_view)>& pure)
+{
+	vector<double> values(program.n_variables);
+	vector<bool> known(program.n_variables);
+	vector<unsigned> renumbered(program.n_variables);
+	vector<string_view> variables;
+	for(unsigned i = 0; i < program.n_variables; i++)
+	{
+		known[i] = constant(program.variables[i], values[i]);
+		if(!known[i])
+		{
+			renumbered[i] = variables.size();
+			variables.push_back(program.variables[i]);
+		}
+	}
+	vector<string_view> functions(program.functions, program.functions + program.n_functions);
+
+	// A stack value is produced by the instructions from begin on.
+	struct Value
+	{
+		size_t begin;
+		bool constant;
+		double value;
+	};
+	vector<Value> stack;
+	vector<Instruction> code;
+	vector<Span> spans;
+	vector<unsigned> origins;
+	size_t max_stack = 0;
+
+	// Replaces the instructions from begin on and the one of span by a
+	// constant spanning all of their tokens.
+	auto replace = [&](size_t begin, double value, Span span, unsigned origin)
+	{
+		unsigned from = span.pos;
+		unsigned to = span.pos + span.length;
+		for(size_t i = begin; i < spans.size(); i++)
+		{
+			from = min(from, spans[i].pos);
+			to = max(to, spans[i].pos + spans[i].length);
+		}
+		code.resize(begin);
+		spans.resize(begin);
+		origins.resize(begin);
+		code.push_back(Instruction{Const, 0, value});
+		spans.push_back(Span{from, to - from});
+		origins.push_back(origin);
+	};
+
+	for(unsigned i = 0; i < program.size; i++)
+	{
+		Instruction instruction = program.code[i];
+		Span span = program.spans[i];
+		unsigned origin = program.origins[i];
+		switch(instruction.op)
+		{
+			case Const:
+			{
+				stack.push_back(Value{code.size(), true, instruction.value});
+				break;
+			}
+			case Load:
+			{
+				if(known[instruction.arg])
+				{
+					stack.push_back(Value{code.size(), true, values[instruction.arg]});
+					instruction = Instruction{Const, 0, values[instruction.arg]};
+				}
+				else
+				{
+					stack.push_back(Value{code.size(), false, 0.0});
+					instruction.arg = renumbered[instruction.arg];
+				}
+				break;
+			}
+			case Call:
+			{
+				Value& x = stack.back();
+				BuiltIn::Function f = x.constant ? pure(program.functions[instruction.arg]) : nullptr;
+				double result;
+				if(f && foldCall(f, x.value, result))
+				{
+					replace(x.begin, result, span, origin);
+					x.value = result;
+					continue;
+				}
+				x.constant = false;
+				break;
+			}
+			default:
+			{
+				Value y = stack.back();
+				stack.pop_back();
+				Value& x = stack.back();
+				double result;
+				if(x.constant && y.constant && foldOperation(instruction.op, x.value, y.value, result))
+				{
+					replace(x.begin, result, span, origin);
+					x.value = result;
+					continue;
+				}
+				x.constant = false;
+				break;
+			}
+		}
+		code.push_back(instruction);
+		spans.push_back(span);
+		origins.push_back(origin);
+		max_stack = max(max_stack, stack.size());
+	}
+
+	return assemble(program.source, code, spans, origins, variables, functions, max_stack, true,
+		FormulaException::UNKNOWN, string_view(), nullptr, false);
+}
+
+void Formula::Program::allocateRegisters(const vector<Instruction>& code, const vector<unsigned>& origin,
+	unsigned n_variables, vector<Operation>& operations, vector<double>& constants,
+	unsigned& n_registers, unsigned& result)
+{
+	// Constants are told apart by their bits, so 0 and -0 stay distinct.
+	unordered_map<uint64_t, unsigned> constant_index;
+	auto constantIndex = [&](double value) -> unsigned
+	{
+		uint64_t bits;
+		memcpy(&bits, &value, sizeof(double));
+		return constant_index.find(bits)->second;
+	};
+
+	// Constants are deduplicated first, so temporaries can follow them.
+	for(const Instruction& instruction : code)
+	{
+		if(instruction.op == Const)
+		{
+			uint64_t bits;
+			memcpy(&bits, &instruction.value, sizeof(double));
+			if(constant_index.emplace(bits, (unsigned)constants.size()).second)
+			{
+				constants.push_back(instruction.value);
+			}
+		}
+	}
+
+	unsigned first_temporary = n_variables + constants.size();
+	unsigned n_temporaries = 0;
+	vector<unsigned> free_temporaries;
+
+	// Each stack value is read once, so its temporary dies at that read and
+	// can hold the result being computed.
+	auto release = [&](unsigned r)
+	{
+		if(r >= first_temporary)
+		{
+			free_temporaries.push_back(r);
+		}
+	};
+	auto allocate = [&]() -> unsigned
+	{
+		if(free_temporaries.empty())
+		{
+			return first_temporary + n_temporaries++;
+		}
+		auto lowest = min_element(free_temporaries.begin(), free_temporaries.end());
+		unsigned r = *lowest;
+		free_temporaries.erase(lowest);
+		return r;
+	};
+
+	// A product is not emitted until its reader is known: an addition or
+	// subtraction takes it as a fused operation, anything else gets a Mul.
+	// Multiplication cannot fail, so emitting it late changes no result.
+	struct Value
+	{
+		unsigned reg;
+		bool product;
+		unsigned lhs;
+		unsigned rhs;
+		unsigned source;
+	};
+	vector<Value> stack;
+
+	auto emit = [&](OpCode op, unsigned lhs, unsigned rhs, unsigned acc, unsigned source) -> Value
+	{
+		Operation operation;
+		operation.op = op;
+		operation.lhs = lhs;
+		operation.rhs = rhs;
+		operation.acc = acc;
+		operation.source = source;
+		operation.dst = allocate();
+		operations.push_back(operation);
+		return Value{operation.dst, false, 0, 0, 0};
+	};
+	auto materialize = [&](Value& value)
+	{
+		if(value.product)
+		{
+			release(value.lhs);
+			release(value.rhs);
+			value = emit(Mul, value.lhs, value.rhs, 0, value.source);
+		}
+	};
+	auto pop = [&]() -> Value
+	{
+		Value value = stack.back();
+		stack.pop_back();
+		return value;
+	};
+
+	for(unsigned i = 0; i < code.size(); i++)
+	{
+		const Instruction& instruction = code[i];
+		switch(instruction.op)
+		{
+			case Const:
+			{
+				stack.push_back(Value{(unsigned)(n_variables + constantIndex(instruction.value)), false, 0, 0, 0});
+				break;
+			}
+			case Load:
+			{
+				stack.push_back(Value{instruction.arg, false, 0, 0, 0});
+				break;
+			}
+			case Call:
+			{
+				Value x = pop();
+				materialize(x);
+				release(x.reg);
+				stack.push_back(emit(Call, x.reg, instruction.arg, 0, origin[i]));
+				break;
+			}
+			case Mul:
+			{
+				Value y = pop();
+				Value x = pop();
+				materialize(x);
+				materialize(y);
+				stack.push_back(Value{0, true, x.reg, y.reg, origin[i]});
+				break;
+			}
+			case Add:
+			case Sub:
+			{
+				Value y = pop();
+				Value x = pop();
+				if(y.product)
+				{
+					materialize(x);
+					release(y.lhs);
+					release(y.rhs);
+					release(x.reg);
+					stack.push_back(emit(instruction.op == Add ? MulAdd : NegMulAdd, y.lhs, y.rhs, x.reg, origin[i]));
+				}
+				else if(x.product)
+				{
+					release(x.lhs);
+					release(x.rhs);
+					release(y.reg);
+					stack.push_back(emit(instruction.op == Add ? MulAdd : MulSub, x.lhs, x.rhs, y.reg, origin[i]));
+				}
+				else
+				{
+					release(x.reg);
+					release(y.reg);
+					stack.push_back(emit(instruction.op, x.reg, y.reg, 0, origin[i]));
+				}
+				break;
+			}
+			case Pow:
+			{
+				Value y = pop();
+				Value x = pop();
+				materialize(x);
+				materialize(y);
+				release(x.reg);
+				release(y.reg);
+
+				// Small integer and one-half exponents avoid pow().
+				bool constant = y.reg >= n_variables && y.reg < first_temporary;
+				double exponent = constant ? constants[y.reg - n_variables] : 0.0;
+				if(constant && integerExponent(exponent))
+				{
+					stack.push_back(emit(exponent > 0 ? PowInt : PowNegInt, x.reg, y.reg, (unsigned)fabs(exponent), origin[i]));
+				}
+				else if(constant && exponent == 0.5)
+				{
+					stack.push_back(emit(Sqrt, x.reg, y.reg, 0, origin[i]));
+				}
+				else
+				{
+					stack.push_back(emit(Pow, x.reg, y.reg, 0, origin[i]));
+				}
+				break;
+			}
+			default:
+			{
+				Value y = pop();
+				Value x = pop();
+				materialize(x);
+				materialize(y);
+				release(x.reg);
+				release(y.reg);
+				stack.push_back(emit(instruction.op, x.reg, y.reg, 0, origin[i]));
+				break;
+			}
+		}
+	}
+
+	materialize(stack.back());
+	result = stack.back().reg;
+	n_registers = first_temporary + n_temporaries;
+}
+
+unsigned Formula::Program::variableIndex(string_view name)const
+{
+	return lower_bound(variables, variables + n_variables, name) - variables;
+}
+
+void Formula::Program::undefinedVariable(const bool* undefined)const
+{
+	for(unsigned i = 0; i < size; i++)
+	{
+		if(code[i].op == Load && undefined[code[i].arg])
+		{
+			throw FormulaException(FormulaException::NOT_DEFINED_VARIABLE, string(variables[code[i].arg]));
+		}
+	}
+	throw FormulaException(FormulaException::NOT_DEFINED_VARIABLE);
+}
+
+FormulaArena::Impl::Impl(size_t _chunk_size):
+chunk_size(_chunk_size < 256 ? 256 : _chunk_size),
+current(nullptr),
+left(0),
+reserved(0),
+used(0),
+programs(0),
+program_bytes(0),
+free_bytes(0),
+interned_bytes(0) {}
+
+void* FormulaArena::Impl::allocate(size_t bytes, size_t alignment)
+{
+	lock_guard<mutex> lock(mtx);
+
+	size_t padding = (alignment - (size_t)current % alignment) % alignment;
+	if(current == nullptr || padding + bytes > left)
+	{
+		size_t size = max(chunk_size, bytes);
+		chunks.emplace_back(new char[size]);
+		current = chunks.back().get();
+		left = size;
+		padding = 0;
+		reserved += size;
+	}
+
+	char* p = current + padding;
+	current += padding + bytes;
+	left -= padding + bytes;
+	used += padding + bytes;
+	return p;
+}
+
+void* FormulaArena::Impl::allocateBlock(size_t bytes, size_t alignment)
+{
+	size_t size = alignUp(bytes, BLOCK_GRANULE);
+	{
+		lock_guard<mutex> lock(mtx);
+		auto freed = free_blocks.find(size);
+		if(freed != free_blocks.end() && !freed->second.empty())
+		{
+			void* block = freed->second.back();
+			freed->second.pop_back();
+			free_bytes -= size;
+			return block;
+		}
+	}
+	return allocate(size, alignment);
+}
+
+void FormulaArena::Impl::releaseBlock(void* block, size_t bytes)
+{
+	size_t size = alignUp(bytes, BLOCK_GRANULE);
+	lock_guard<mutex> lock(mtx);
+	free_blocks[size].push_back(block);
+	free_bytes += size;
+	programs--;
+	program_bytes -= bytes;
+}
+
+string_view FormulaArena::Impl::intern(string_view name)
+{
+	{
+		lock_guard<mutex> lock(mtx);
+		auto it = names.find(name);
+		if(it != names.end())
+		{
+			return *it;
+		}
+	}
+
+	char* p = (char*)allocate(name.size(), 1);
+	memcpy(p, name.data(), name.size());
+
+	lock_guard<mutex> lock(mtx);
+	auto inserted = names.insert(string_view(p, name.size()));
+	if(inserted.second)
+	{
+		interned_bytes += name.size();
+	}
+	return *inserted.first;
+}
+
+FormulaArena::FormulaArena(size_t chunk_size):
+m_impl(make_shared<Impl>(chunk_size)) {}
+
+FormulaArena::Usage FormulaArena::usage()const
+{
+	lock_guard<mutex> lock(m_impl->mtx);
+
+	Usage usage;
+	usage.chunks = m_impl->chunks.size();
+	usage.reserved = m_impl->reserved;
+	usage.used = m_impl->used;
+	usage.programs = m_impl->programs;
+	usage.program_bytes = m_impl->program_bytes;
+	usage.free_bytes = m_impl->free_bytes;
+	usage.interned_names = m_impl->names.size();
+	usage.interned_bytes = m_impl->interned_bytes;
+	return usage;
+}
+
+string FormulaArena::report()const
+{
+	Usage u = usage();
+
+	ostringstream out;
+	out << "chunks: " << u.chunks << ", reserved: " << u.reserved << " bytes, used: " << u.used << " bytes";
+	if(u.reserved)
+	{
+		out << " (" << 100 * u.used / u.reserved << "%)";
+	}
+	out << "\n";
+	out << "programs: " << u.programs << ", " << u.program_bytes << " bytes";
+	if(u.programs)
+	{
+		out << " (" << u.program_bytes / u.programs << " per program)";
+	}
+	out << ", " << u.free_bytes << " bytes free for reuse\n";
+	out << "interned names: " << u.interned_names << ", " << u.interned_bytes << " bytes\n";
+	return out.str();
+}
+
+// Rough size of an unordered_map: bucket array plus one node per entry.
+template<typename Map>
+static size_t mapBytes(const Map& map, size_t& blocks)
+{
+	size_t bytes = 0;
+	if(map.bucket_count() > 1)
+	{
+		bytes += map.bucket_count() * sizeof(void*);
+		blocks++;
+	}
+
+	for(const auto& entry : map)
+	{
+		bytes += sizeof(entry) + 2 * sizeof(void*);
+		blocks++;
+		if(entry.first.capacity() > 15)
+		{
+			bytes += entry.first.capacity() + 1;
+			blocks++;
+		}
+	}
+	return bytes;
+}
+
+FormulaMemoryUsage Formula::memoryUsage()const
+{
+	FormulaMemoryUsage usage;
+	usage.object = sizeof(Formula);
+
+	if(m_program)
+	{
+		usage.arena = m_program->arena != nullptr;
+		usage.program = m_program->bytes - m_program->chars;
+		usage.names = m_program->chars;
+		if(!usage.arena)
+		{
+			usage.heap_blocks += 2;
+		}
+	}
+
+	// The folded program of a bound formula views the names of m_program.
+	if(m_binding)
+	{
+		shared_ptr<const Program> folded = m_binding->folded();
+		usage.program += sizeof(Binding) + sizeof(Binding::State);
+		usage.heap_blocks += 2;
+		if(folded != m_program)
+		{
+			usage.program += folded->bytes;
+			usage.heap_blocks++;
+		}
+	}
+
+	// So does the optimized program of a formula with tiering.
+	if(m_tiering)
+	{
+		shared_ptr<const Program> optimized = m_tiering->current();
+		usage.program += sizeof(Tiering);
+		usage.heap_blocks++;
+		if(optimized)
+		{
+			usage.program += optimized->bytes;
+			usage.heap_blocks++;
+		}
+	}
+
+	if(m_definitions)
+	{
+		usage.definitions = sizeof(Definitions)
+			+ mapBytes(m_definitions->variables, usage.heap_blocks)
+			+ mapBytes(m_definitions->functions, usage.heap_blocks)
+			+ mapBytes(m_definitions->kernels, usage.heap_blocks);
+		usage.heap_blocks++;
+	}
+	return usage;
+}
@@ -0,0 +1,410 @@
+#ifndef FORMULA_PROGRAM_H
+#define FORMULA_PROGRAM_H
+
+#include "../include/formula.hpp"
+#include "../include/formula_exeption.hpp"
+#include "built_in.hpp"
+
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Postfix program over a flat instruction array. Operands live on a stack of
+// at most max_stack values; Load and Call refer to the variables and
+// functions tables by index. Everything, including the tables and the
+// preprocessed source, is placed in one block right after this header.
+struct Formula::Program
+{
+	enum OpCode : unsigned char
+	{
+		Const,
+		Load,
+		Add,
+		Sub,
+		Mul,
+		Div,
+		Pow,
+		Call,
+
+		// Superinstructions of the register form only: lhs*rhs + acc,
+		// lhs*rhs - acc, acc - lhs*rhs, lhs^acc and lhs^-acc for a small
+		// integer acc, and lhs^0.5.
+		MulAdd,
+		MulSub,
+		NegMulAdd,
+		PowInt,
+		PowNegInt,
+		Sqrt
+	};
+
+	struct Instruction
+	{
+		OpCode op;
+		unsigned arg;
+		double value;
+	};
+
+	// Position of the token an instruction comes from in source.
+	struct Span
+	{
+		unsigned pos;
+		unsigned length;
+	};
+
+	// Three-address form of the same program. Registers hold the variables,
+	// then the distinct constants, then the temporaries; a temporary is freed
+	// by its only reader, so one register serves many sub-expressions. Call
+	// keeps the function index in rhs, and source is the instruction an
+	// operation comes from in code.
+	struct Operation
+	{
+		OpCode op;
+		unsigned dst;
+		unsigned lhs;
+		unsigned rhs;
+		unsigned acc;
+		unsigned source;
+	};
+
+	std::string_view source;
+
+	const Instruction* code;
+	const Span* spans;
+	unsigned size;
+	unsigned max_stack;
+
+	// Instruction of the compiled program each one comes from; a folded
+	// constant comes from the operator or call it replaces. The profile
+	// counts by it, so it survives folding.
+	const unsigned* origins;
+
+	// The same code with its polynomial sub-expressions in Horner form, run
+	// by evalBatch and lowered to operations; code itself when it has none.
+	const Instruction* horner_code;
+	unsigned horner_size;
+	unsigned horner_stack;
+
+	// Cleared for a program compiled for tiering: it has no operations and
+	// its horner_code is code.
+	bool lowered;
+
+	const Operation* operations;
+	unsigned n_operations;
+	const double* constants;
+	unsigned n_constants;
+	unsigned n_registers;
+	unsigned result;
+
+	// Sorted, so positional arguments follow the dictionary order.
+	const std::string_view* variables;
+	unsigned n_variables;
+
+	const std::string_view* functions;
+	unsigned n_functions;
+
+	// Cleared when the postfix sequence is malformed; such a program has no
+	// code and reports the error from eval() and check().
+	bool valid;
+	FormulaException::Type error;
+	std::string_view error_name;
+
+	// Size of the block, and how much of it holds characters. Names of a
+	// program placed in an arena are interned there instead.
+	size_t bytes;
+	size_t chars;
+	FormulaArena::Impl* arena;
+
+	static std::shared_ptr<const Program> compile(const std::string& source, const std::vector<Token>& postfix,
+		const std::shared_ptr<FormulaArena::Impl>& arena, bool lower = true);
+
+	// Places code and tables in one block. Names are copied into it, or
+	// interned in the arena, or with copy_names cleared only viewed, in
+	// which case their owner must outlive the program. With lower cleared
+	// the register form and the Horner rewrite are skipped.
+	static std::shared_ptr<const Program> assemble(std::string_view source, const std::vector<Instruction>& code,
+		const std::vector<Span>& spans, const std::vector<unsigned>& origins, const std::vector<std::string_view>& variables,
+		const std::vector<std::string_view>& functions, unsigned max_stack, bool valid,
+		FormulaException::Type error, std::string_view error_name,
+		const std::shared_ptr<FormulaArena::Impl>& arena, bool copy_names, bool lower = true);
+
+	// Copy of a valid program with the variables for which constant() gives
+	// a value replaced by it, and every operator or call of pure() functions
+	// whose operands are all constants evaluated, unless that fails: such
+	// an error is left to be raised by eval. Names are viewed in program.
+	static std::shared_ptr<const Program> fold(const Program& program,
+		const std::function<bool(std::string_view, double&)>& constant,
+		const std::function<BuiltIn::Function(std::string_view)>& pure);
+	static bool foldOperation(OpCode op, double x, double y, double& result);
+
+	// Constant exponents of x^n run as PowInt or PowNegInt, by
+	// square-and-multiply. Each squaring rounds, so the error grows with
+	// n: it is kept to exponents where it stays within 2 ulp of pow().
+	static const unsigned MAX_INTEGER_POWER = 4;
+	static bool integerExponent(double exponent)
+	{
+		return exponent == std::floor(exponent) && std::fabs(exponent) <= MAX_INTEGER_POWER &&
+			exponent != 0 && exponent != 1;
+	}
+	static double integerPower(double x, unsigned n)
+	{
+		double result = 1.0;
+		while(n)
+		{
+			if(n & 1)
+			{
+				result *= x;
+			}
+			x *= x;
+			n >>= 1;
+		}
+		return result;
+	}
+
+	unsigned variableIndex(std::string_view name)const;
+
+	// Lowers stack code to operations over registers, reusing a temporary
+	// register as soon as the value it holds has been read. Products feeding
+	// an addition or subtraction and powers with a constant exponent are
+	// fused into superinstructions on the way.
+	// origin gives the instruction of the original code each one comes from.
+	static void allocateRegisters(const std::vector<Instruction>& code, const std::vector<unsigned>& origin,
+		unsigned n_variables, std::vector<Operation>& operations, std::vector<double>& constants,
+		unsigned& n_registers, unsigned& result);
+
+	// Rewrites every sub-expression made of variables, constants, +, -, * and
+	// constant integer powers into Horner form, nesting the variables of
+	// higher degree outside, where that takes fewer operators. Returns false
+	// and leaves horner empty when nothing is rewritten.
+	static bool rewritePolynomials(const std::vector<Instruction>& code, std::vector<Instruction>& horner,
+		std::vector<unsigned>& origin);
+
+	// Reports the undefined variable the postfix sequence reaches first, as
+	// evaluating token by token would.
+	[[noreturn]] void undefinedVariable(const bool* undefined)const;
+};
+
+struct Formula::Definitions
+{
+	std::unordered_map<std::string, double> variables;
+	std::unordered_map<std::string, std::function<double(double)> > functions;
+	// Array forms of some of the functions, used by evalBatch.
+	std::unordered_map<std::string, std::function<void(const double*, double*, size_t)> > kernels;
+};
+
+struct FormulaArena::Impl : public std::enable_shared_from_this<FormulaArena::Impl>
+{
+	explicit Impl(size_t _chunk_size);
+
+	void* allocate(size_t bytes, size_t alignment);
+	std::string_view intern(std::string_view name);
+
+	// Program blocks are rounded up to a multiple of BLOCK_GRANULE. A block
+	// released by its program is kept for the next program of that size.
+	static const size_t BLOCK_GRANULE = 64;
+	void* allocateBlock(size_t bytes, size_t alignment);
+	void releaseBlock(void* block, size_t bytes);
+
+	size_t chunk_size;
+
+	mutable std::mutex mtx;
+	std::vector<std::unique_ptr<char[]> > chunks;
+	char* current;
+	size_t left;
+
+	std::unordered_set<std::string_view> names;
+	std::unordered_map<size_t, std::vector<void*> > free_blocks;
+
+	size_t reserved;
+	size_t used;
+	size_t programs;
+	size_t program_bytes;
+	size_t free_bytes;
+	size_t interned_bytes;
+};
+
+// A formula constructed with a context: the program it was compiled to and
+// the same program folded against the context, refolded whenever a context
+// name it uses changes. Copies of the formula share the binding as long as
+// they share their definitions.
+struct Formula::Binding
+{
+	struct State
+	{
+		std::shared_ptr<const Program> program;
+		std::shared_ptr<const Definitions> context;
+	};
+
+	// The state eval runs, valid while an Epoch::Guard is held.
+	const State& current()const
+	{
+		return *state.load(std::memory_order_acquire);
+	}
+
+	// Folds source against context; needs no lock.
+	std::shared_ptr<const State> fold(const std::shared_ptr<const Definitions>& context)const;
+
+	// Publishes next and retires the state it replaces. Called with the
+	// context mutex held.
+	void publish(const std::shared_ptr<const State>& next);
+
+	void refold(const std::shared_ptr<const Definitions>& context)
+	{
+		publish(fold(context));
+	}
+
+	// The folded program, kept alive without a guard.
+	std::shared_ptr<const Program> folded()const;
+
+	std::shared_ptr<FormulaContext::Impl> context;
+	std::shared_ptr<const Program> source;
+	std::shared_ptr<const Definitions> definitions;
+	Precision precision = Exact;
+
+	std::atomic<const State*> state{nullptr};
+	std::shared_ptr<const State> owner;
+};
+
+// Call counter of a formula constructed with tiering, shared by its copies
+// like its program. The optimized program is published once, before which
+// eval runs source; both live as long as the tiering.
+struct Formula::Tiering : public std::enable_shared_from_this<Formula::Tiering>
+{
+	Tiering(const std::shared_ptr<const Program>& _source, const FormulaTiering& _options):
+	source(_source),
+	options(_options) {}
+
+	// The program to run, counting the call while it is source.
+	const Program& program()
+	{
+		const Program* program = optimized.load(std::memory_order_acquire);
+		if(program)
+		{
+			return *program;
+		}
+		if(calls.fetch_add(1, std::memory_order_relaxed) + 1 == options.threshold)
+		{
+			promote();
+		}
+		return *source;
+	}
+
+	// Optimizes source now or queues it for the background thread.
+	void promote();
+	void optimize();
+
+	// The optimized program once published, else null.
+	std::shared_ptr<const Program> current()const;
+
+	std::shared_ptr<const Program> source;
+	FormulaTiering options;
+
+	std::atomic<unsigned long long> calls{0};
+	std::atomic<const Program*> optimized{nullptr};
+	std::shared_ptr<const Program> owner;
+};
+
+struct FormulaContext::Impl
+{
+	std::shared_ptr<const Formula::Definitions> snapshot()const;
+
+	// Registers a binding under every name its program uses and folds it,
+	// outside of the lock so formulas can be bound from several threads.
+	void bind(const std::shared_ptr<Formula::Binding>& binding);
+
+	// Applies change to a copy of the definitions, publishes it and
+	// refolds the bindings using any of names.
+	void update(const std::vector<std::string>& names, const std::function<void(Formula::Definitions&)>& change);
+
+	mutable std::mutex mtx;
+	std::shared_ptr<const Formula::Definitions> definitions;
+
+	// Bindings by the names they use; expired ones are swept when the
+	// number of entries has doubled since the last sweep.
+	std::unordered_map<std::string, std::vector<std::weak_ptr<Formula::Binding> > > dependents;
+	size_t n_dependents = 0;
+	size_t sweep_at = 1024;
+
+	unsigned long long updates = 0;
+	unsigned long long refolds = 0;
+};
+
+// Fixed buffer on the stack for the common small case, heap otherwise.
+template<typename T, size_t N>
+class SmallBuffer
+{
+public:
+	explicit SmallBuffer(size_t n):
+	m_data(n <= N ? m_local : new T[n]) {}
+
+	~SmallBuffer()
+	{
+		if(m_data != m_local)
+		{
+			delete[] m_data;
+		}
+	}
+
+	SmallBuffer(const SmallBuffer&) = delete;
+	SmallBuffer& operator =(const SmallBuffer&) = delete;
+
+	T* data()
+	{
+		return m_data;
+	}
+
+	T& operator [](size_t i)
+	{
+		return m_data[i];
+	}
+
+private:
+	T m_local[N];
+	T* m_data;
+};
+
+// Rows evaluated per pass over the program. Each stack level owns a buffer of
+// this many values, plus one spare, so a whole block stays in the L1 cache.
+static const size_t BATCH_BLOCK = 256;
+
+// Instead of running the program once per row, every instruction is applied
+// to a block of rows at a time: the dispatch cost is shared by the block and
+// the inner loops over plain arrays are left to the compiler to vectorize.
+// Stack entries are pointers, so loads of a column read it in place. A batch
+// is used by one thread at a time.
+struct Formula::Batch
+{
+	Batch(const Formula& formula, const Program& program, const Definitions* context, const std::vector<const double*>& columns);
+
+	// Variables named in records take the columns, in the order of the
+	// program's variables; their pointers are left to the caller.
+	Batch(const Formula& formula, const Program& program, const Definitions* context, const FormulaRecords& records);
+
+	// Results of rows [row, row + m), m <= BATCH_BLOCK, before small values
+	// are rounded to 0.
+	const double* run(size_t row, size_t m);
+
+	const Program& program;
+	std::vector<const double*> columns;
+	SmallBuffer<double, 16> values;
+	SmallBuffer<int, 16> argument;
+	SmallBuffer<BoundFunction, 8> functions;
+	SmallBuffer<BoundKernel, 8> kernels;
+	std::vector<double> constants;
+	SmallBuffer<const double*, 16> variables;
+	std::vector<double> buffers;
+	SmallBuffer<double*, 32> levels;
+	double* spare;
+	SmallBuffer<const double*, 32> stack;
+
+private:
+	explicit Batch(const Program& program);
+	void bindConstants();
+};
+
+#endif // FORMULA_PROGRAM_H
@@ -0,0 +1,209 @@
+#include "../include/formula.hpp"
+#include "formula_profile.hpp"
+#include "formula_program.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+using namespace std;
+
+const char* FormulaStats::opcodeName(FormulaStats::OpCode opcode)
+{
+	switch(opcode)
+	{
+		case NUMBER: return "number";
+		case VARIABLE: return "variable";
+		case ADD: return "+";
+		case SUB: return "-";
+		case MUL: return "*";
+		case DIV: return "/";
+		case POW: return "^";
+		case FUNCTION: return "function";
+		default: return "unknown";
+	}
+}
+
+FormulaStats Formula::stats()const
+{
+	FormulaStats stats;
+
+	// A formula bound to a context reports the folded program it runs, one
+	// with tiering its optimized program once made. Its counters are those
+	// of the compiled instructions it comes from.
+	shared_ptr<const Program> program = m_binding ? m_binding->folded() : m_program;
+	if(!m_binding && m_tiering && m_tiering->current())
+	{
+		program = m_tiering->current();
+	}
+	if(program)
+	{
+		stats.stack_dispatches = program->size;
+		for(unsigned i = 0; i < program->size; i++)
+		{
+			if(program->code[i].op != Program::Const && program->code[i].op != Program::Load)
+			{
+				stats.register_dispatches++;
+			}
+		}
+		stats.fused_dispatches = program->n_operations;
+	}
+
+#ifdef FORMULA_PROFILING
+	stats.enabled = true;
+	if(!m_profile)
+	{
+		return stats;
+	}
+
+	stats.evals = m_profile->evals.load(memory_order_relaxed);
+	stats.cycles = m_profile->total_cycles.load(memory_order_relaxed);
+	stats.built_in_calls = m_profile->built_in_calls.load(memory_order_relaxed);
+	stats.user_calls = m_profile->user_calls.load(memory_order_relaxed);
+
+	for(unsigned i = 0; i < program->size; i++)
+	{
+		FormulaStats::Instruction instruction;
+		switch(program->code[i].op)
+		{
+			case Program::Const: instruction.opcode = FormulaStats::NUMBER; break;
+			case Program::Load: instruction.opcode = FormulaStats::VARIABLE; break;
+			case Program::Add: instruction.opcode = FormulaStats::ADD; break;
+			case Program::Sub: instruction.opcode = FormulaStats::SUB; break;
+			case Program::Mul: instruction.opcode = FormulaStats::MUL; break;
+			case Program::Div: instruction.opcode = FormulaStats::DIV; break;
+			case Program::Pow: instruction.opcode = FormulaStats::POW; break;
+			case Program::Call: instruction.opcode = FormulaStats::FUNCTION; break;
+			default: break;
+		}
+		instruction.position = program->spans[i].pos;
+		instruction.length = program->spans[i].length;
+		instruction.text = string(program->source.substr(instruction.position, instruction.length));
+		const Profile::Counter& counter = m_profile->instructions[program->origins[i]];
+		instruction.counter.count = counter.count.load(memory_order_relaxed);
+		instruction.counter.cycles = counter.cycles.load(memory_order_relaxed);
+
+		stats.opcodes[instruction.opcode].count += instruction.counter.count;
+		stats.opcodes[instruction.opcode].cycles += instruction.counter.cycles;
+		stats.instructions.push_back(instruction);
+	}
+
+	for(const auto& bucket : m_profile->latency)
+	{
+		stats.latency.push_back(bucket.load(memory_order_relaxed));
+	}
+#endif
+
+	return stats;
+}
+
+void Formula::resetStats()
+{
+#ifdef FORMULA_PROFILING
+	if(m_profile)
+	{
+		m_profile->reset();
+	}
+#endif
+}
+
+string Formula::dumpStats()const
+{
+	FormulaStats s = stats();
+	if(!s.enabled)
+	{
+		return "Profiling is disabled, build the library with FORMULA_OPT_PROFILING=ON\n";
+	}
+
+	if(s.instructions.empty())
+	{
+		return "Empty formula\n";
+	}
+
+	ostringstream out;
+
+	// Heat line under the expression: 9 marks the costliest token.
+	string expression(m_program->source);
+	if(!expression.empty() && expression.back() == '#')
+	{
+		expression.pop_back();
+	}
+
+	unsigned long long hottest = 1;
+	for(const FormulaStats::Instruction& instruction : s.instructions)
+	{
+		hottest = max(hottest, instruction.counter.cycles);
+	}
+
+	string heat(expression.size(), ' ');
+	for(const FormulaStats::Instruction& instruction : s.instructions)
+	{
+		char mark = '0' + (char)((9 * instruction.counter.cycles + hottest / 2) / hottest);
+		for(size_t i = instruction.position; i < instruction.position + instruction.length && i < heat.size(); i++)
+		{
+			heat[i] = mark;
+		}
+	}
+
+	out << "formula: " << expression << "\n";
+	out << "heat:    " << heat << "\n\n";
+
+	out << "evals: " << s.evals
+		<< ", cycles: " << s.cycles
+		<< ", cycles/eval: " << (s.evals ? s.cycles / s.evals : 0)
+		<< ", built-in calls: " << s.built_in_calls
+		<< ", user calls: " << s.user_calls << "\n";
+	out << "dispatches: " << s.stack_dispatches << " stack, " << s.register_dispatches << " register, "
+		<< s.fused_dispatches << " fused\n\n";
+
+	out << left << setw(12) << "opcode" << right << setw(16) << "count" << setw(16) << "cycles" << setw(9) << "share" << "\n";
+	unsigned long long total = 0;
+	for(const FormulaStats::Counter& counter : s.opcodes)
+	{
+		total += counter.cycles;
+	}
+	for(int op = 0; op < FormulaStats::OPCODE_COUNT; op++)
+	{
+		const FormulaStats::Counter& counter = s.opcodes[op];
+		if(counter.count == 0)
+		{
+			continue;
+		}
+		out << left << setw(12) << FormulaStats::opcodeName((FormulaStats::OpCode)op)
+			<< right << setw(16) << counter.count << setw(16) << counter.cycles
+			<< setw(8) << fixed << setprecision(1) << (total ? 100.0 * counter.cycles / total : 0.0) << "%\n";
+	}
+
+	vector<const FormulaStats::Instruction*> hot;
+	for(const FormulaStats::Instruction& instruction : s.instructions)
+	{
+		if(instruction.counter.count > 0)
+		{
+			hot.push_back(&instruction);
+		}
+	}
+	stable_sort(hot.begin(), hot.end(), [](const FormulaStats::Instruction* a, const FormulaStats::Instruction* b)
+	{
+		return a->counter.cycles > b->counter.cycles;
+	});
+
+	out << "\nhot spots:\n";
+	for(size_t i = 0; i < hot.size() && i < 10; i++)
+	{
+		out << "  " << left << setw(16) << ("'" + hot[i]->text + "'")
+			<< " at " << setw(6) << hot[i]->position
+			<< right << setw(16) << hot[i]->counter.cycles << " cycles"
+			<< setw(8) << fixed << setprecision(1) << (total ? 100.0 * hot[i]->counter.cycles / total : 0.0) << "%\n";
+	}
+
+	out << "\nlatency (cycles per eval):\n";
+	for(size_t i = 0; i < s.latency.size(); i++)
+	{
+		if(s.latency[i] != 0)
+		{
+			out << "  [2^" << setw(2) << i << ", 2^" << setw(2) << i + 1 << ")" << setw(16) << s.latency[i] << "\n";
+		}
+	}
+
+	return out.str();
+}
@@ -0,0 +1,138 @@
+#include "formula_program.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+	// Runs queued jobs in order on one thread, started with the first job
+	// and joined at exit; jobs still queued then are dropped.
+	class Optimizer
+	{
+	public:
+		~Optimizer()
+		{
+			{
+				lock_guard<mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_wake.notify_one();
+			if(m_thread.joinable())
+			{
+				m_thread.join();
+			}
+		}
+
+		void push(function<void()> job)
+		{
+			{
+				lock_guard<mutex> lock(m_mutex);
+				if(!m_thread.joinable())
+				{
+					m_thread = thread(&Optimizer::run, this);
+				}
+				m_jobs.push_back(std::move(job));
+			}
+			m_wake.notify_one();
+		}
+
+	private:
+		void run()
+		{
+			for(;;)
+			{
+				function<void()> job;
+				{
+					unique_lock<mutex> lock(m_mutex);
+					m_wake.wait(lock, [this]() { return m_stop || !m_jobs.empty(); });
+					if(m_stop)
+					{
+						return;
+					}
+					job = std::move(m_jobs.front());
+					m_jobs.pop_front();
+				}
+
+				// A formula whose program cannot be optimized stays
+				// interpreted.
+				try
+				{
+					job();
+				}
+				catch(...)
+				{
+				}
+			}
+		}
+
+		mutex m_mutex;
+		condition_variable m_wake;
+		deque<function<void()> > m_jobs;
+		bool m_stop = false;
+		thread m_thread;
+	};
+
+	Optimizer& optimizer()
+	{
+		static Optimizer s_optimizer;
+		return s_optimizer;
+	}
+}
+
+// Only the call reaching the threshold gets here. The job holds the tiering
+// weakly, so a formula destroyed meanwhile is not optimized.
+void Formula::Tiering::promote()
+{
+	if(!options.background)
+	{
+		optimize();
+		return;
+	}
+
+	weak_ptr<Tiering> tiering = shared_from_this();
+	optimizer().push([tiering]()
+	{
+		shared_ptr<Tiering> alive = tiering.lock();
+		if(alive)
+		{
+			alive->optimize();
+		}
+	});
+}
+
+// Constants are folded without looking up any name, as define() may still
+// change what the variables and functions stand for. owner is written
+// before the pointer is published and never again.
+void Formula::Tiering::optimize()
+{
+	if(!source->valid || source->size == 0)
+	{
+		return;
+	}
+
+	shared_ptr<const Program> program = Program::fold(*source,
+		[](string_view, double&)
+		{
+			return false;
+		},
+		[](string_view) -> BuiltIn::Function
+		{
+			return nullptr;
+		});
+	owner = program;
+	optimized.store(program.get(), memory_order_release);
+}
+
+shared_ptr<const Formula::Program> Formula::Tiering::current()const
+{
+	return optimized.load(memory_order_acquire) ? owner : nullptr;
+}
+
+Formula::Tier Formula::tier()const
+{
+	return (m_tiering && !m_binding && !m_tiering->current()) ? Interpreted : Optimized;
+}